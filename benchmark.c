@@ -13,456 +13,5036 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
-
-#ifdef USE_PERF
-#include <linux/perf_event.h>
-#include <sys/ioctl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <unistd.h>
-#include <sys/syscall.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
 #endif
 
+#include "harness.h"
+
 // ============================================================================
 // CONFIGURATION
 // ============================================================================
-#define MATRIX_ROWS 11008
-#define MATRIX_COLS 4096
-#define ITERATIONS 100
-#define SPARSITY 0.5f  // 50% zeros
+// Defaults; override with --rows/--cols/--shapes, --iterations, --sparsity
+#define DEFAULT_ROWS 11008
+#define DEFAULT_COLS 4096
+#define DEFAULT_ITERATIONS 100
+#define DEFAULT_SPARSITY 0.5f  // 50% zeros
+#define MAX_SHAPES 16
+#define DEFAULT_GROUP_SIZE 128  // columns per scale for --epilogue
+#define DEFAULT_PLAN_PATH "ternary_plan.json"  // --autotune output, read at startup
+#define DEFAULT_VALIDATE_SEED 1                // --validate shapes
 
 // ============================================================================
-// PERFORMANCE COUNTER SETUP
+// MULTI-THREADED ENGINE
 // ============================================================================
-#ifdef USE_PERF
-static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
-                           int cpu, int group_fd, unsigned long flags) {
-    return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
+// Rows are split into one contiguous slice per thread. Each thread pins
+// itself to a CPU and then copies its own slice of the weights into a fresh,
+// untouched mapping, so first-touch places those pages on the thread's NUMA
+// node. All threads then run the same matvec iterations in lock-step with a
+// barrier after each one, as a layer would in a real forward pass.
+// Mutex/condvar barrier: pthread_barrier_t is not available on macOS
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+    int waiting;
+    unsigned generation;
+} thread_barrier_t;
+
+static void barrier_init(thread_barrier_t *b, int count) {
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->count = count;
+    b->waiting = 0;
+    b->generation = 0;
+}
+
+static void barrier_destroy(thread_barrier_t *b) {
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->cond);
+}
+
+static void barrier_wait(thread_barrier_t *b) {
+    pthread_mutex_lock(&b->lock);
+    unsigned gen = b->generation;
+    if (++b->waiting == b->count) {
+        b->waiting = 0;
+        b->generation++;
+        pthread_cond_broadcast(&b->cond);
+    } else {
+        while (gen == b->generation) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
 }
 
+typedef struct thread_engine thread_engine_t;
+
 typedef struct {
-    int fd_cycles;
-    int fd_instructions;
-    int fd_cache_refs;
-    int fd_cache_misses;
-    int fd_l1d_read_miss;
-    int fd_llc_read_miss;
-} perf_counters_t;
-
-void setup_perf_counters(perf_counters_t *counters) {
-    struct perf_event_attr pe;
-    
-    // CPU cycles
-    memset(&pe, 0, sizeof(struct perf_event_attr));
-    pe.type = PERF_TYPE_HARDWARE;
-    pe.size = sizeof(struct perf_event_attr);
-    pe.config = PERF_COUNT_HW_CPU_CYCLES;
-    pe.disabled = 1;
-    pe.exclude_kernel = 1;
-    pe.exclude_hv = 1;
-    counters->fd_cycles = perf_event_open(&pe, 0, -1, -1, 0);
-    
-    // Instructions
-    pe.config = PERF_COUNT_HW_INSTRUCTIONS;
-    counters->fd_instructions = perf_event_open(&pe, 0, -1, -1, 0);
-    
-    // Cache references
-    pe.config = PERF_COUNT_HW_CACHE_REFERENCES;
-    counters->fd_cache_refs = perf_event_open(&pe, 0, -1, -1, 0);
-    
-    // Cache misses
-    pe.config = PERF_COUNT_HW_CACHE_MISSES;
-    counters->fd_cache_misses = perf_event_open(&pe, 0, -1, -1, 0);
-    
-    // L1D read misses
-    pe.type = PERF_TYPE_HW_CACHE;
-    pe.config = (PERF_COUNT_HW_CACHE_L1D) | 
-                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
-                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
-    counters->fd_l1d_read_miss = perf_event_open(&pe, 0, -1, -1, 0);
-    
-    // LLC (Last Level Cache) read misses
-    pe.config = (PERF_COUNT_HW_CACHE_LL) |
-                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
-                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
-    counters->fd_llc_read_miss = perf_event_open(&pe, 0, -1, -1, 0);
-}
-
-void start_perf_counters(perf_counters_t *counters) {
-    ioctl(counters->fd_cycles, PERF_EVENT_IOC_RESET, 0);
-    ioctl(counters->fd_instructions, PERF_EVENT_IOC_RESET, 0);
-    ioctl(counters->fd_cache_refs, PERF_EVENT_IOC_RESET, 0);
-    ioctl(counters->fd_cache_misses, PERF_EVENT_IOC_RESET, 0);
-    ioctl(counters->fd_l1d_read_miss, PERF_EVENT_IOC_RESET, 0);
-    ioctl(counters->fd_llc_read_miss, PERF_EVENT_IOC_RESET, 0);
-    
-    ioctl(counters->fd_cycles, PERF_EVENT_IOC_ENABLE, 0);
-    ioctl(counters->fd_instructions, PERF_EVENT_IOC_ENABLE, 0);
-    ioctl(counters->fd_cache_refs, PERF_EVENT_IOC_ENABLE, 0);
-    ioctl(counters->fd_cache_misses, PERF_EVENT_IOC_ENABLE, 0);
-    ioctl(counters->fd_l1d_read_miss, PERF_EVENT_IOC_ENABLE, 0);
-    ioctl(counters->fd_llc_read_miss, PERF_EVENT_IOC_ENABLE, 0);
-}
-
-void stop_perf_counters(perf_counters_t *counters, long long *cycles,
-                       long long *instructions, long long *cache_refs,
-                       long long *cache_misses, long long *l1d_miss,
-                       long long *llc_miss) {
-    ioctl(counters->fd_cycles, PERF_EVENT_IOC_DISABLE, 0);
-    ioctl(counters->fd_instructions, PERF_EVENT_IOC_DISABLE, 0);
-    ioctl(counters->fd_cache_refs, PERF_EVENT_IOC_DISABLE, 0);
-    ioctl(counters->fd_cache_misses, PERF_EVENT_IOC_DISABLE, 0);
-    ioctl(counters->fd_l1d_read_miss, PERF_EVENT_IOC_DISABLE, 0);
-    ioctl(counters->fd_llc_read_miss, PERF_EVENT_IOC_DISABLE, 0);
-    
-    read(counters->fd_cycles, cycles, sizeof(long long));
-    read(counters->fd_instructions, instructions, sizeof(long long));
-    read(counters->fd_cache_refs, cache_refs, sizeof(long long));
-    read(counters->fd_cache_misses, cache_misses, sizeof(long long));
-    read(counters->fd_l1d_read_miss, l1d_miss, sizeof(long long));
-    read(counters->fd_llc_read_miss, llc_miss, sizeof(long long));
-}
-
-void close_perf_counters(perf_counters_t *counters) {
-    close(counters->fd_cycles);
-    close(counters->fd_instructions);
-    close(counters->fd_cache_refs);
-    close(counters->fd_cache_misses);
-    close(counters->fd_l1d_read_miss);
-    close(counters->fd_llc_read_miss);
+    thread_engine_t *engine;
+    pthread_t thread;
+    int index;
+    int row_begin;
+    int row_end;
+    int pinned;
+} engine_thread_t;
+
+struct thread_engine {
+    weight_format_t format;
+    const uint8_t *source;      // weights as generated/packed by main
+    uint8_t *matrix;            // per-run copy placed by first touch
+    size_t matrix_bytes;
+    const float *input;
+    float *output;
+    int rows;
+    int cols;
+    int iterations;
+    int num_threads;
+    int pin;
+    thread_barrier_t barrier;
+    struct timespec start;
+    struct timespec end;
+};
+
+static void *engine_worker(void *arg) {
+    engine_thread_t *self = (engine_thread_t*)arg;
+    thread_engine_t *e = self->engine;
+    size_t row_bytes = ternary_format_row_bytes(e->format, e->cols);
+    size_t offset = (size_t)self->row_begin * row_bytes;
+    size_t length = (size_t)(self->row_end - self->row_begin) * row_bytes;
+
+    if (e->pin) {
+        self->pinned = ternary_pin_current_thread(self->index % ternary_online_cpus()) == 0;
+    }
+
+    // First touch: the pages of this slice are faulted in by this thread
+    memcpy(e->matrix + offset, e->source + offset, length);
+
+    // Warmup pass over the slice, then start together
+    ternary_matvec_rows(e->format, e->matrix, e->input, e->output,
+                        self->row_begin, self->row_end, e->cols);
+    barrier_wait(&e->barrier);
+    if (self->index == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &e->start);
+    }
+
+    for (int i = 0; i < e->iterations; i++) {
+        ternary_matvec_rows(e->format, e->matrix, e->input, e->output,
+                            self->row_begin, self->row_end, e->cols);
+        TRACE_BEGIN(trace_t0);
+        barrier_wait(&e->barrier);
+        TRACE_END(trace_t0, "barrier", i);
+    }
+
+    if (self->index == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &e->end);
+    }
+    return NULL;
+}
+
+// Runs `iterations` threaded matvecs and returns the wall time in ms,
+// or a negative value if the engine could not be set up.
+// *pinned receives the number of threads that were successfully pinned.
+double run_threaded_matvec(weight_format_t format, const uint8_t *matrix,
+                           const float *input, float *output,
+                           int rows, int cols, int iterations,
+                           int num_threads, int pin, int *pinned) {
+    thread_engine_t e;
+    memset(&e, 0, sizeof(e));
+    e.format = format;
+    e.source = matrix;
+    e.matrix_bytes = (size_t)rows * ternary_format_row_bytes(format, cols);
+    e.input = input;
+    e.output = output;
+    e.rows = rows;
+    e.cols = cols;
+    e.iterations = iterations;
+    e.num_threads = num_threads;
+    e.pin = pin;
+
+    // Fresh anonymous mapping: no page is touched until a worker copies in
+    e.matrix = (uint8_t*)mmap(NULL, e.matrix_bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e.matrix == MAP_FAILED) {
+        return -1.0;
+    }
+
+    engine_thread_t *threads = (engine_thread_t*)calloc(num_threads,
+                                                        sizeof(engine_thread_t));
+    if (!threads) {
+        munmap(e.matrix, e.matrix_bytes);
+        return -1.0;
+    }
+
+    barrier_init(&e.barrier, num_threads);
+    int started = 0;
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].engine = &e;
+        threads[t].index = t;
+        threads[t].row_begin = (int)((long long)rows * t / num_threads);
+        threads[t].row_end = (int)((long long)rows * (t + 1) / num_threads);
+        if (pthread_create(&threads[t].thread, NULL, engine_worker,
+                           &threads[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    if (started != num_threads) {
+        // The barrier can never complete; this is unrecoverable
+        fprintf(stderr, "Failed to start thread %d of %d\n", started, num_threads);
+        exit(1);
+    }
+
+    *pinned = 0;
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+        *pinned += threads[t].pinned;
+    }
+
+    barrier_destroy(&e.barrier);
+    free(threads);
+    munmap(e.matrix, e.matrix_bytes);
+
+    return (e.end.tv_sec - e.start.tv_sec) * 1000.0 +
+           (e.end.tv_nsec - e.start.tv_nsec) / 1000000.0;
+}
+
+// Thread-scaling study: 1..max_threads, aggregate weight bandwidth per format
+void run_thread_sweep(const int8_t *matrix_8bit, const uint8_t *matrix_2bit,
+                      const float *input, float *output, int rows, int cols,
+                      int iterations, int max_threads, int pin) {
+    double bytes_8bit = (double)rows * ternary_format_row_bytes(FORMAT_8BIT, cols);
+    double bytes_2bit = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+
+    printf("Thread Scaling (%d online CPUs, %s, first-touch weight placement)\n\n",
+           ternary_online_cpus(), pin ? "pinned" : "unpinned");
+    printf("%-7s | %12s | %10s | %12s | %10s | %8s | %6s\n",
+           "Threads", "8-bit ms/it", "8-bit GB/s", "2-bit ms/it", "2-bit GB/s",
+           "2b vs 8b", "Pinned");
+    printf("------------------------------------------------------------------------------------\n");
+
+    for (int t = 1; t <= max_threads; t++) {
+        int pinned_8bit = 0, pinned_2bit = 0;
+        double ms_8bit = run_threaded_matvec(FORMAT_8BIT, (const uint8_t*)matrix_8bit,
+                                             input, output, rows, cols,
+                                             iterations, t, pin, &pinned_8bit);
+        double ms_2bit = run_threaded_matvec(FORMAT_2BIT, matrix_2bit,
+                                             input, output, rows, cols,
+                                             iterations, t, pin, &pinned_2bit);
+        if (ms_8bit < 0.0 || ms_2bit < 0.0) {
+            fprintf(stderr, "Threaded engine setup failed at %d threads\n", t);
+            return;
+        }
+
+        double it_8bit = ms_8bit / iterations;
+        double it_2bit = ms_2bit / iterations;
+        printf("%-7d | %12.3f | %10.2f | %12.3f | %10.2f | %7.2fx | %3d/%-2d\n",
+               t, it_8bit, bytes_8bit / (it_8bit * 1e6),
+               it_2bit, bytes_2bit / (it_2bit * 1e6),
+               it_8bit / it_2bit,
+               pinned_2bit < pinned_8bit ? pinned_2bit : pinned_8bit, t);
+    }
+    printf("\nGB/s counts packed weight bytes streamed per matvec.\n");
+}
+
+// ============================================================================
+// BATCH SWEEP
+// ============================================================================
+// Runs the batched kernels for B = 1, 2, 4, ... max_batch. While weight
+// streaming dominates, time per call barely grows with B; once decode and
+// accumulate dominate, it grows linearly. Iterations are divided by B so
+// each point processes roughly the same number of input vectors.
+static double time_matmul(weight_format_t format, const uint8_t *matrix,
+                          const float *input, float *output,
+                          int rows, int cols, int batch, int iterations) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        if (format == FORMAT_8BIT) {
+            ternary_matmul_8bit_impl((const int8_t*)matrix, input, output, rows, cols, batch);
+        } else {
+            ternary_matmul_2bit_impl(matrix, input, output, rows, cols, batch);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) * 1000.0 +
+           (end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+// Bandwidth-bound while doubling B costs well under double the time
+static const char *batch_regime(double ms, double prev_ms, int batch, int prev_batch) {
+    if (prev_batch == 0) {
+        return "-";
+    }
+    double growth = (ms / prev_ms) / ((double)batch / prev_batch);
+    return growth < 0.6 ? "bandwidth" : "compute";
+}
+
+void run_batch_sweep(const int8_t *matrix_8bit, const uint8_t *matrix_2bit,
+                     int rows, int cols, int iterations, int max_batch) {
+    float *input = (float*)ternary_alloc((size_t)max_batch * cols * sizeof(float));
+    float *output = (float*)ternary_alloc((size_t)max_batch * rows * sizeof(float));
+    if (!input || !output) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(input);
+        ternary_free(output);
+        return;
+    }
+    generate_input_vector(input, max_batch * cols);
+
+    double weights = (double)rows * cols;
+    double bytes_8bit = (double)rows * ternary_format_row_bytes(FORMAT_8BIT, cols);
+    double bytes_2bit = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+
+    printf("Batch Sweep (kernels: 8-bit %s, 2-bit %s)\n\n",
+           ternary_matmul_8bit_impl_name, ternary_matmul_2bit_impl_name);
+    printf("%-5s | %11s | %8s | %10s | %11s | %8s | %10s | %8s\n",
+           "Batch", "8-bit ms", "GMAC/s", "8b regime", "2-bit ms", "GMAC/s",
+           "2b regime", "2b vs 8b");
+    printf("--------------------------------------------------------------------------------------------\n");
+
+    double prev_8bit = 0.0, prev_2bit = 0.0;
+    int prev_batch = 0;
+    for (int batch = 1; ; batch *= 2) {
+        if (batch > max_batch) {
+            batch = max_batch;
+        }
+        int iters = iterations / batch > 0 ? iterations / batch : 1;
+
+        // One untimed call to fault in outputs and warm the row buffers
+        ternary_matmul_8bit_impl(matrix_8bit, input, output, rows, cols, batch);
+        ternary_matmul_2bit_impl(matrix_2bit, input, output, rows, cols, batch);
+
+        double ms_8bit = time_matmul(FORMAT_8BIT, (const uint8_t*)matrix_8bit,
+                                     input, output, rows, cols, batch, iters) / iters;
+        double ms_2bit = time_matmul(FORMAT_2BIT, matrix_2bit,
+                                     input, output, rows, cols, batch, iters) / iters;
+
+        printf("%-5d | %11.3f | %8.2f | %10s | %11.3f | %8.2f | %10s | %7.2fx\n",
+               batch,
+               ms_8bit, weights * batch / (ms_8bit * 1e6),
+               batch_regime(ms_8bit, prev_8bit, batch, prev_batch),
+               ms_2bit, weights * batch / (ms_2bit * 1e6),
+               batch_regime(ms_2bit, prev_2bit, batch, prev_batch),
+               ms_8bit / ms_2bit);
+
+        prev_8bit = ms_8bit;
+        prev_2bit = ms_2bit;
+        prev_batch = batch;
+        if (batch == max_batch) {
+            break;
+        }
+    }
+
+    printf("\nms is per batched call. Weight bytes per call: 8-bit %.0f KB, 2-bit %.0f KB.\n",
+           bytes_8bit / 1024, bytes_2bit / 1024);
+    printf("Regime compares each step with the previous one: \"bandwidth\" when\n");
+    printf("doubling B costs under 1.2x the time, \"compute\" otherwise.\n");
+
+    ternary_free(input);
+    ternary_free(output);
+}
+
+// ============================================================================
+// INT8 ACTIVATION COMPARISON
+// ============================================================================
+// 2-bit weights with float activations vs int8 activations. The int8 time
+// includes quantizing the input on every call; the kernel-only time shows
+// what is left when one quantized input feeds several matrices.
+void run_int8_comparison(const uint8_t *matrix_2bit, const float *input,
+                         int rows, int cols, int iterations) {
+    float *out_float = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    float *out_q8 = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    quant_input_t q;
+    q.q = (int8_t*)ternary_alloc((size_t)cols);
+    if (!out_float || !out_q8 || !q.q) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(out_float);
+        ternary_free(out_q8);
+        ternary_free(q.q);
+        return;
+    }
+
+    struct timespec start, end;
+    int block = ternary_matvec_2bit_q8_block;
+
+    // Warmup both paths
+    for (int i = 0; i < 10; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, out_float, rows, cols);
+        ternary_quantize_input_int8(input, cols, block, &q);
+        ternary_matvec_2bit_q8_impl(matrix_2bit, &q, out_q8, rows, cols);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, out_float, rows, cols);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms_float = elapsed_ms(&start, &end) / iterations;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_quantize_input_int8(input, cols, block, &q);
+        ternary_matvec_2bit_q8_impl(matrix_2bit, &q, out_q8, rows, cols);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms_q8 = elapsed_ms(&start, &end) / iterations;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_matvec_2bit_q8_impl(matrix_2bit, &q, out_q8, rows, cols);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms_q8_kernel = elapsed_ms(&start, &end) / iterations;
+
+    // Quantization error relative to the float result
+    double max_err = 0.0, sum_sq = 0.0;
+    for (int r = 0; r < rows; r++) {
+        double err = out_q8[r] - out_float[r];
+        if (err < 0.0) err = -err;
+        if (err > max_err) max_err = err;
+        sum_sq += (double)out_float[r] * out_float[r];
+    }
+    double rms = rows > 0 ? sqrt_nolibm(sum_sq / rows) : 0.0;
+
+    double weight_kb = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols) / 1024;
+    printf("Int8 Activations (2-bit weights, int8 kernel: %s)\n\n",
+           ternary_matvec_2bit_q8_impl_name);
+    printf("%-26s | %10s | %14s | %9s\n",
+           "Path", "ms/iter", "Activation KB", "vs float");
+    printf("-----------------------------------------------------------------------\n");
+    printf("%-26s | %10.3f | %14.1f | %8.2fx\n", "float activations",
+           ms_float, cols * sizeof(float) / 1024.0, 1.0);
+    printf("%-26s | %10.3f | %14.1f | %8.2fx\n", "int8 (incl. quantize)",
+           ms_q8, cols / 1024.0, ms_float / ms_q8);
+    printf("%-26s | %10.3f | %14.1f | %8.2fx\n", "int8 (kernel only)",
+           ms_q8_kernel, cols / 1024.0, ms_float / ms_q8_kernel);
+    printf("\nWeights per call: %.0f KB. Quantization error vs float: max %.4g "
+           "(%.3f%% of output RMS %.4g)\n",
+           weight_kb, max_err, rms > 0.0 ? 100.0 * max_err / rms : 0.0, rms);
+
+    ternary_free(out_float);
+    ternary_free(out_q8);
+    ternary_free(q.q);
+}
+
+// ============================================================================
+// TILE SWEEP
+// ============================================================================
+// Times the tiled 2-bit kernel across row-tile x column-tile shapes and
+// reports the fastest one against the untiled kernel. A row_tile or
+// col_tile > 0 pins that dimension instead of sweeping it.
+static const int tile_sweep_rows[] = { 1, 2, 4, 8 };
+static const int tile_sweep_cols[] = { 256, 512, 1024, 2048, 4096 };
+#define TILE_SWEEP_NROWS (int)(sizeof(tile_sweep_rows) / sizeof(tile_sweep_rows[0]))
+#define TILE_SWEEP_NCOLS (int)(sizeof(tile_sweep_cols) / sizeof(tile_sweep_cols[0]))
+
+static double time_tiled(const uint8_t *matrix_2bit, const float *input,
+                         float *output, int rows, int cols,
+                         int row_tile, int col_tile, int iterations) {
+    struct timespec start, end;
+    ternary_matvec_2bit_tiled_impl(matrix_2bit, input, output, rows, cols,
+                                   row_tile, col_tile);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_matvec_2bit_tiled_impl(matrix_2bit, input, output, rows, cols,
+                                       row_tile, col_tile);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ms(&start, &end) / iterations;
+}
+
+void run_tile_sweep(const uint8_t *matrix_2bit, const float *input,
+                    float *output, int rows, int cols, int iterations,
+                    int row_tile, int col_tile) {
+    int row_tiles[TILE_SWEEP_NROWS], col_tiles[TILE_SWEEP_NCOLS];
+    int nrows = 0, ncols = 0;
+
+    if (row_tile > 0) {
+        row_tiles[nrows++] = row_tile;
+    } else {
+        for (int i = 0; i < TILE_SWEEP_NROWS; i++) {
+            row_tiles[nrows++] = tile_sweep_rows[i];
+        }
+    }
+    if (col_tile > 0) {
+        col_tiles[ncols++] = ternary_tile_round_cols(col_tile);
+    } else {
+        // Column tiles at or past the row length all reduce to one block
+        for (int i = 0; i < TILE_SWEEP_NCOLS; i++) {
+            col_tiles[ncols++] = tile_sweep_cols[i];
+            if (tile_sweep_cols[i] >= cols) {
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < 10; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, output, rows, cols);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, output, rows, cols);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms_untiled = elapsed_ms(&start, &end) / iterations;
+
+    double bytes = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+    printf("Tile Sweep (2-bit, tiled kernel: %s, untiled: %s %.3f ms)\n\n",
+           ternary_matvec_2bit_tiled_impl_name, ternary_matvec_2bit_impl_name, ms_untiled);
+    printf("%-8s | %8s | %9s | %10s | %8s | %10s\n",
+           "Row tile", "Col tile", "Input KB", "ms/iter", "GB/s", "vs untiled");
+    printf("-----------------------------------------------------------------------\n");
+
+    double best_ms = 0.0;
+    int best_r = 0, best_c = 0;
+    for (int i = 0; i < nrows; i++) {
+        for (int j = 0; j < ncols; j++) {
+            double ms = time_tiled(matrix_2bit, input, output, rows, cols,
+                                   row_tiles[i], col_tiles[j], iterations);
+            int block = col_tiles[j] < cols ? col_tiles[j] : cols;
+            printf("%-8d | %8d | %9.1f | %10.3f | %8.2f | %9.2fx\n",
+                   row_tiles[i], col_tiles[j], block * sizeof(float) / 1024.0,
+                   ms, bytes / (ms * 1e6), ms_untiled / ms);
+            if (best_r == 0 || ms < best_ms) {
+                best_ms = ms;
+                best_r = row_tiles[i];
+                best_c = col_tiles[j];
+            }
+        }
+    }
+
+    printf("\nBest tile: %d rows x %d cols, %.3f ms/iter (%.2fx vs untiled)\n",
+           best_r, best_c, best_ms, ms_untiled / best_ms);
+    printf("Input KB is the slice of the input vector reused across each row panel.\n");
+}
+
+// ============================================================================
+// PREFETCH SWEEP
+// ============================================================================
+// Times the hinted 2-bit kernel over prefetch distances, with temporal and
+// non-temporal hints, against the plain kernel. What prefetching wins back
+// was time the plain kernel spent waiting on latency, not on DRAM bandwidth.
+static const int prefetch_sweep_distances[] = { 0, 256, 512, 1024, 2048, 4096, 8192 };
+#define PREFETCH_SWEEP_COUNT \
+    (int)(sizeof(prefetch_sweep_distances) / sizeof(prefetch_sweep_distances[0]))
+
+static double time_hinted(const uint8_t *matrix_2bit, const float *input,
+                          float *output, int rows, int cols,
+                          const load_hints_t *hints, int iterations) {
+    struct timespec start, end;
+    ternary_matvec_2bit_hinted_impl(matrix_2bit, input, output, rows, cols, hints);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_matvec_2bit_hinted_impl(matrix_2bit, input, output, rows, cols, hints);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ms(&start, &end) / iterations;
+}
+
+// distance >= 0 compares just that distance against no prefetch
+void run_prefetch_sweep(const uint8_t *matrix_2bit, const float *input,
+                        float *output, int rows, int cols, int iterations,
+                        int distance) {
+    int distances[PREFETCH_SWEEP_COUNT];
+    int count = 0;
+    if (distance >= 0) {
+        distances[count++] = 0;
+        if (distance > 0) {
+            distances[count++] = distance;
+        }
+    } else {
+        for (int i = 0; i < PREFETCH_SWEEP_COUNT; i++) {
+            distances[count++] = prefetch_sweep_distances[i];
+        }
+    }
+
+    for (int i = 0; i < 10; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, output, rows, cols);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, output, rows, cols);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms_plain = elapsed_ms(&start, &end) / iterations;
+
+    double bytes = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+    const char *nt_loads = ternary_matvec_2bit_hinted_streams ? "stream" : "normal";
+    printf("Prefetch Sweep (2-bit, hinted kernel: %s, plain: %s %.3f ms)\n\n",
+           ternary_matvec_2bit_hinted_impl_name, ternary_matvec_2bit_impl_name, ms_plain);
+    printf("%-8s | %6s | %10s | %10s | %8s | %8s\n",
+           "Loads", "Hint", "Distance B", "ms/iter", "GB/s", "vs plain");
+    printf("-----------------------------------------------------------------\n");
+
+    double best_ms = 0.0, ms_unhinted = 0.0;
+    load_hints_t best = { 0, 0 };
+    for (int nt = 0; nt <= 1; nt++) {
+        for (int i = 0; i < count; i++) {
+            load_hints_t hints = { distances[i], nt };
+            double ms = time_hinted(matrix_2bit, input, output, rows, cols,
+                                    &hints, iterations);
+            printf("%-8s | %6s | %10d | %10.3f | %8.2f | %7.2fx\n",
+                   nt ? nt_loads : "normal",
+                   distances[i] == 0 ? "-" : nt ? "nta" : "t0",
+                   distances[i], ms, bytes / (ms * 1e6), ms_plain / ms);
+            if (nt == 0 && distances[i] == 0) {
+                ms_unhinted = ms;
+            }
+            if (best_ms == 0.0 || ms < best_ms) {
+                best_ms = ms;
+                best = hints;
+            }
+        }
+    }
+
+    // Measured against the same kernel without hints, so the line-at-a-time
+    // restructuring is not counted as latency
+    double recovered = ms_unhinted > best_ms ?
+                       100.0 * (ms_unhinted - best_ms) / ms_unhinted : 0.0;
+    printf("\nBest: %s loads, distance %d B, %.3f ms/iter (%.2fx vs plain)\n",
+           best.nontemporal ? nt_loads : "normal", best.prefetch_distance,
+           best_ms, ms_plain / best_ms);
+    printf("Hints recover %.1f%% of the unhinted kernel's time; that share was spent\n",
+           recovered);
+    printf("on load latency, the rest is bandwidth or compute.\n");
+}
+
+// ============================================================================
+// EPILOGUE SWEEP
+// ============================================================================
+// The layer as it runs: scale, bias and activation fused into the 2-bit
+// kernel, against the plain kernel followed by a separate pass over the
+// stored sums. Per-group scales cannot be applied after the fact (they need
+// each group's partial dot), so those rows compare with the plain kernel
+// only. Every fused result is checked against the scalar fused kernel.
+#define EPILOGUE_SWEEP_ROUNDS 5
+
+// ms per layer; ep NULL times the plain kernel, fused 0 adds the pass
+static double time_epilogue(const uint8_t *matrix_2bit, const float *input,
+                            float *output, int rows, int cols,
+                            const epilogue_t *ep, int fused, int iterations) {
+    struct timespec start, end;
+    double best = 0.0;
+    for (int round = 0; round < EPILOGUE_SWEEP_ROUNDS; round++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++) {
+            if (ep && fused) {
+                ternary_matvec_2bit_fused_impl(matrix_2bit, input, output, rows, cols, ep);
+            } else {
+                ternary_matvec_2bit_impl(matrix_2bit, input, output, rows, cols);
+                if (ep) {
+                    ternary_epilogue_pass(output, rows, ep);
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = elapsed_ms(&start, &end) / iterations;
+        if (round == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Largest |a - b| relative to max(1, |b|)
+static double max_rel_error(const float *a, const float *b, int n) {
+    double worst = 0.0;
+    for (int i = 0; i < n; i++) {
+        double ref = b[i] < 0.0f ? -b[i] : b[i];
+        double diff = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        double rel = diff / (ref > 1.0 ? ref : 1.0);
+        if (rel > worst) {
+            worst = rel;
+        }
+    }
+    return worst;
+}
+
+void run_epilogue_sweep(const uint8_t *matrix_2bit, const float *input,
+                        float *output, int rows, int cols, int iterations,
+                        int group_size) {
+    int groups = (cols + group_size - 1) / group_size;
+    int per_sweep = iterations / EPILOGUE_SWEEP_ROUNDS > 0 ?
+                    iterations / EPILOGUE_SWEEP_ROUNDS : 1;
+    float *scales = (float*)ternary_alloc((size_t)rows * groups * sizeof(float));
+    float *bias = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    float *reference = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    if (!scales || !bias || !reference) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(scales);
+        ternary_free(bias);
+        ternary_free(reference);
+        return;
+    }
+    // Scales near 1 / sqrt(cols) keep post-activation values in a sane range
+    srand(11);
+    for (size_t i = 0; i < (size_t)rows * groups; i++) {
+        scales[i] = (0.5f + (float)rand() / RAND_MAX) / 64.0f;
+    }
+    for (int r = 0; r < rows; r++) {
+        bias[r] = (float)rand() / RAND_MAX - 0.5f;
+    }
+
+    double ms_plain = time_epilogue(matrix_2bit, input, output, rows, cols,
+                                    NULL, 0, per_sweep);
+    printf("Fused Epilogue (2-bit, fused kernel: %s, plain: %s %.3f ms)\n\n",
+           ternary_matvec_2bit_fused_impl_name, ternary_matvec_2bit_impl_name, ms_plain);
+    printf("%-10s | %-6s | %12s | %9s | %12s | %9s | %s\n",
+           "Scales", "Act", "Plain + pass", "Fused", "vs separate", "vs plain", "Check");
+    printf("--------------------------------------------------------------------------------\n");
+
+    for (int grouped = 0; grouped <= 1; grouped++) {
+        for (int a = 0; a < EPILOGUE_ACT_COUNT; a++) {
+            epilogue_t ep = { scales, bias, grouped ? group_size : 0, (epilogue_act_t)a };
+            double ms_fused = time_epilogue(matrix_2bit, input, output, rows, cols,
+                                            &ep, 1, per_sweep);
+            ternary_matvec_2bit_fused(matrix_2bit, input, reference, rows, cols, &ep);
+            ternary_matvec_2bit_fused_impl(matrix_2bit, input, output, rows, cols, &ep);
+            int ok = max_rel_error(output, reference, rows) < 1e-4;
+
+            char label[32], separate[32], speedup[32];
+            if (grouped) {
+                snprintf(label, sizeof(label), "group %d", group_size);
+                snprintf(separate, sizeof(separate), "-");
+                snprintf(speedup, sizeof(speedup), "-");
+            } else {
+                double ms_separate = time_epilogue(matrix_2bit, input, output, rows, cols,
+                                                   &ep, 0, per_sweep);
+                snprintf(label, sizeof(label), "per row");
+                snprintf(separate, sizeof(separate), "%.3f", ms_separate);
+                snprintf(speedup, sizeof(speedup), "%.2fx", ms_separate / ms_fused);
+            }
+            printf("%-10s | %-6s | %12s | %9.3f | %12s | %8.2fx | %s\n",
+                   label, ternary_epilogue_act_names[a], separate, ms_fused, speedup,
+                   ms_plain / ms_fused, ok ? "ok" : "MISMATCH");
+        }
+    }
+    printf("\nTimes are ms per layer, best of %d rounds. \"vs plain\" below 1.00x is what\n",
+           EPILOGUE_SWEEP_ROUNDS);
+    printf("the epilogue costs once fused; the separate pass rereads %d stored sums.\n",
+           rows);
+
+    ternary_free(scales);
+    ternary_free(bias);
+    ternary_free(reference);
+}
+
+// ============================================================================
+// MULTI-PROJECTION BENCHMARK
+// ============================================================================
+// gate+up (two projections) and QKV (three) as one fused call against
+// separate ternary_matvec_2bit calls, all at the shape under test. The GQA row
+// gives K and V a quarter of the rows (at least one), as grouped-query
+// attention does.
+// Every fused output must match its separate call.
+#define MULTI_BENCH_ROUNDS 5
+
+typedef struct {
+    const char *name;
+    int count;
+    int kv_divisor;     // rows of the projections after the first / this
+} multi_case_t;
+
+static const multi_case_t multi_cases[] = {
+    { "gate+up",   2, 1 },
+    { "QKV",       3, 1 },
+    { "QKV (GQA)", 3, 4 },
+};
+#define MULTI_CASE_COUNT (int)(sizeof(multi_cases) / sizeof(multi_cases[0]))
+
+// Best of MULTI_BENCH_ROUNDS, ms per set of projections
+static double time_projections(const projection_t *proj, int count,
+                               const float *input, int cols, int fused,
+                               int iterations) {
+    double best = 0.0;
+    for (int round = 0; round < MULTI_BENCH_ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++) {
+            if (fused) {
+                ternary_matvec_2bit_multi_impl(proj, count, input, cols);
+            } else {
+                for (int p = 0; p < count; p++) {
+                    ternary_matvec_2bit_impl(proj[p].matrix, input, proj[p].output,
+                                             proj[p].rows, cols);
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = elapsed_ms(&start, &end) / iterations;
+        if (round == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+void run_multi_proj(const uint8_t *matrix_2bit, const float *input, int rows,
+                    int cols, int iterations, float sparsity) {
+    size_t packed = (size_t)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+    int per_round = iterations / MULTI_BENCH_ROUNDS > 0 ?
+                    iterations / MULTI_BENCH_ROUNDS : 1;
+    uint8_t *matrices[MAX_PROJECTIONS] = { (uint8_t*)matrix_2bit };
+    float *separate[MAX_PROJECTIONS] = { NULL }, *fused[MAX_PROJECTIONS] = { NULL };
+    int8_t *matrix_8bit = (int8_t*)ternary_alloc((size_t)rows * cols);
+    int ok = matrix_8bit != NULL;
+    for (int p = 0; p < 3; p++) {
+        if (p > 0) {
+            matrices[p] = (uint8_t*)ternary_alloc(packed);
+        }
+        separate[p] = (float*)ternary_alloc((size_t)rows * sizeof(float));
+        fused[p] = (float*)ternary_alloc((size_t)rows * sizeof(float));
+        ok = ok && matrices[p] && separate[p] && fused[p];
+    }
+    if (ok) {
+        for (int p = 1; p < 3; p++) {
+            srand(42 + p);
+            generate_ternary_matrix_8bit(matrix_8bit, rows, cols, sparsity);
+            ternary_pack_matrix(FORMAT_2BIT, matrix_8bit, matrices[p], rows, cols,
+                                ternary_online_cpus());
+        }
+
+        printf("Multi-Projection (2-bit, %d × %d each, fused kernel: %s, separate: %s)\n\n",
+               rows, cols, ternary_matvec_2bit_multi_impl_name, ternary_matvec_2bit_impl_name);
+        printf("%-10s | %17s | %11s | %9s | %8s | %8s | %s\n",
+               "Layer", "Rows", "Separate ms", "Fused ms", "Speedup", "GB/s", "Check");
+        printf("-------------------------------------------------------------------------------------\n");
+
+        for (int i = 0; i < MULTI_CASE_COUNT; i++) {
+            const multi_case_t *mc = &multi_cases[i];
+            projection_t sep[MAX_PROJECTIONS], fus[MAX_PROJECTIONS];
+            char shape[32];
+            int len = 0;
+            double bytes = 0.0;
+            for (int p = 0; p < mc->count; p++) {
+                int prows = p == 0 ? rows : rows / mc->kv_divisor;
+                prows = prows > 0 ? prows : 1;
+                sep[p] = (projection_t){ matrices[p], separate[p], prows };
+                fus[p] = (projection_t){ matrices[p], fused[p], prows };
+                bytes += (double)prows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+                len += snprintf(shape + len, sizeof(shape) - (size_t)len, "%s%d",
+                                p ? "+" : "", prows);
+            }
+
+            double ms_separate = time_projections(sep, mc->count, input, cols, 0,
+                                                  per_round);
+            double ms_fused = time_projections(fus, mc->count, input, cols, 1, per_round);
+            int match = 1;
+            for (int p = 0; p < mc->count; p++) {
+                match = match && max_rel_error(fused[p], separate[p], fus[p].rows) < 1e-5;
+            }
+            printf("%-10s | %17s | %11.3f | %9.3f | %7.2fx | %8.2f | %s\n",
+                   mc->name, shape, ms_separate, ms_fused, ms_separate / ms_fused,
+                   bytes / (ms_fused * 1e6), match ? "ok" : "MISMATCH");
+        }
+        printf("\nTimes are ms per layer, best of %d rounds. The fused kernel loads each\n",
+               MULTI_BENCH_ROUNDS);
+        printf("input vector once per row of all projections instead of once per matrix.\n");
+    } else {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+
+    ternary_free(matrix_8bit);
+    for (int p = 0; p < 3; p++) {
+        if (p > 0) {
+            ternary_free(matrices[p]);
+        }
+        ternary_free(separate[p]);
+        ternary_free(fused[p]);
+    }
 }
-#endif
 
 // ============================================================================
-// DATA GENERATION
+// SPARSE BREAK-EVEN
 // ============================================================================
-void generate_ternary_matrix_8bit(int8_t *matrix, int rows, int cols) {
-    for (int i = 0; i < rows * cols; i++) {
-        float r = (float)rand() / RAND_MAX;
-        if (r < SPARSITY) {
-            matrix[i] = 0;
-        } else if (r < SPARSITY + (1.0f - SPARSITY) / 2.0f) {
-            matrix[i] = 1;
+// Finds the sparsity above which the sparse layout (ternary_sparse_matrix_build())
+// beats dense 2-bit on this machine. The sweep regenerates the shape under
+// test at each sparsity and times both kernels. The break-even point is
+// interpolated where the speedup crosses 1.0 and saved to the plan, where
+// ternary_prefer_sparse() picks the sparse kernel for layers with at
+// least that many zeros.
+#define SPARSE_BENCH_ROUNDS 3
+
+static const float sparse_sweep_levels[] = {
+    0.50f, 0.60f, 0.70f, 0.80f, 0.85f, 0.90f, 0.95f, 0.98f, 0.99f
+};
+#define SPARSE_SWEEP_COUNT \
+    (int)(sizeof(sparse_sweep_levels) / sizeof(sparse_sweep_levels[0]))
+
+// Best of SPARSE_BENCH_ROUNDS, ms per matvec; sm NULL times dense 2-bit
+static double time_sparse(const sparse_matrix_t *sm, const uint8_t *matrix_2bit,
+                          const float *input, float *output, int rows, int cols,
+                          int iterations) {
+    double best = 0.0;
+    for (int round = 0; round < SPARSE_BENCH_ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++) {
+            if (sm) {
+                ternary_matvec_sparse_impl(sm, input, output);
+            } else {
+                ternary_matvec_2bit_impl(matrix_2bit, input, output, rows, cols);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = elapsed_ms(&start, &end) / iterations;
+        if (round == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Sparsity where y crosses 1.0 between two sweep points, by linear
+// interpolation; -1 if no point reaches 1.0
+static double sparse_crossing(const double *y, int count) {
+    for (int i = 0; i < count; i++) {
+        if (y[i] >= 1.0) {
+            if (i == 0) {
+                return sparse_sweep_levels[0];
+            }
+            double t = (1.0 - y[i - 1]) / (y[i] - y[i - 1]);
+            return sparse_sweep_levels[i - 1] +
+                   t * (sparse_sweep_levels[i] - sparse_sweep_levels[i - 1]);
+        }
+    }
+    return -1.0;
+}
+
+// Stores the measured break-even sparsity, -1 if dense always wins; returns
+// 0 on success
+int run_sparse_sweep(int rows, int cols, int iterations, double *break_even_out) {
+    size_t packed = (size_t)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+    int per_round = iterations / SPARSE_BENCH_ROUNDS > 0 ?
+                    iterations / SPARSE_BENCH_ROUNDS : 1;
+    int8_t *matrix_8bit = (int8_t*)ternary_alloc((size_t)rows * cols);
+    uint8_t *matrix_2bit = (uint8_t*)ternary_alloc(packed);
+    float *input = (float*)ternary_alloc((size_t)cols * sizeof(float));
+    float *dense = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    float *sparse = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    double speedup[SPARSE_SWEEP_COUNT], size_ratio[SPARSE_SWEEP_COUNT];
+    double break_even = -1.0;
+    int done = 0;
+
+    if (matrix_8bit && matrix_2bit && input && dense && sparse) {
+        generate_input_vector(input, cols);
+        printf("Sparse vs Dense 2-bit (%d × %d, sparse kernel: %s, dense: %s)\n\n",
+               rows, cols, ternary_matvec_sparse_impl_name, ternary_matvec_2bit_impl_name);
+        printf("%-8s | %10s | %10s | %9s | %9s | %8s | %s\n",
+               "Zeros", "2-bit KB", "Sparse KB", "2-bit ms", "Sparse ms", "Speedup", "Check");
+        printf("---------------------------------------------------------------------------\n");
+
+        for (; done < SPARSE_SWEEP_COUNT; done++) {
+            sparse_matrix_t sm;
+            srand(42);
+            generate_ternary_matrix_8bit(matrix_8bit, rows, cols, sparse_sweep_levels[done]);
+            ternary_pack_matrix(FORMAT_2BIT, matrix_8bit, matrix_2bit, rows, cols,
+                                ternary_online_cpus());
+            if (ternary_sparse_matrix_build(&sm, matrix_8bit, rows, cols) != 0) {
+                break;
+            }
+
+            double ms_dense = time_sparse(NULL, matrix_2bit, input, dense, rows, cols,
+                                          per_round);
+            double ms_sparse = time_sparse(&sm, NULL, input, sparse, rows, cols, per_round);
+            speedup[done] = ms_dense / ms_sparse;
+            size_ratio[done] = (double)packed / sm.bytes;
+            int ok = max_rel_error(sparse, dense, rows) < 1e-4;
+
+            printf("%7.0f%% | %10zu | %10zu | %9.3f | %9.3f | %7.2fx | %s\n",
+                   100.0 * ternary_sparsity(matrix_8bit, (size_t)rows * cols),
+                   packed / 1024, sm.bytes / 1024, ms_dense, ms_sparse, speedup[done],
+                   ok ? "ok" : "MISMATCH");
+            ternary_sparse_matrix_free(&sm);
+        }
+    }
+
+    if (done < SPARSE_SWEEP_COUNT) {
+        fprintf(stderr, "Memory allocation failed\n");
+    } else {
+        break_even = sparse_crossing(speedup, SPARSE_SWEEP_COUNT);
+        double size_even = sparse_crossing(size_ratio, SPARSE_SWEEP_COUNT);
+        printf("\n");
+        if (break_even > 0.0) {
+            printf("Break-even: sparse is faster from %.1f%% zeros; store layers at or\n",
+                   100.0 * break_even);
+            printf("above that sparsity sparse, the rest as dense 2-bit.\n");
+        } else {
+            printf("Break-even: dense 2-bit is faster at every sparsity tested.\n");
+        }
+        if (size_even > 0.0) {
+            printf("The sparse layout is smaller from %.1f%% zeros.\n", 100.0 * size_even);
+        }
+    }
+
+    ternary_free(matrix_8bit);
+    ternary_free(matrix_2bit);
+    ternary_free(input);
+    ternary_free(dense);
+    ternary_free(sparse);
+    *break_even_out = break_even;
+    return done < SPARSE_SWEEP_COUNT ? -1 : 0;
+}
+
+// ============================================================================
+// THREAD POOL SWEEP
+// ============================================================================
+// Static row slices balance dense 2-bit, where every row costs the same,
+// but not the sparse layout once nonzeros cluster: one slow slice then
+// sets the latency. The sweep times the persistent pool with stealing off
+// (static chunks) and on, for dense 2-bit and for a sparse matrix whose
+// nonzeros ramp from dense in the first rows to none in the last, and
+// reports per-thread busy time and steals. Dense also runs on threads
+// spawned per call, and a tiny matvec isolates the dispatch cost.
+#define POOL_SWEEP_ROUNDS 3
+#define POOL_DISPATCH_CALLS 1000
+
+// Row r keeps a 2 * (1 - sparsity) * (1 - r / rows) share of nonzeros
+// (capped at all of them), so the mean matches `sparsity` when it is at
+// least 0.5
+static void generate_skewed_matrix(int8_t *matrix, int rows, int cols, float sparsity) {
+    for (int r = 0; r < rows; r++) {
+        double nonzero = 2.0 * (1.0 - sparsity) * (1.0 - (r + 0.5) / rows);
+        generate_ternary_matrix_8bit(matrix + (size_t)r * cols, 1, cols,
+                                     nonzero >= 1.0 ? 0.0f : (float)(1.0 - nonzero));
+    }
+}
+
+typedef struct {
+    thread_pool_t *pool;        // NULL: threads spawned per call
+    const uint8_t *matrix_2bit;
+    const sparse_matrix_t *sparse;
+    const float *input;
+    float *output;
+    int rows;
+    int cols;
+    int threads;
+    int chunk;
+    int steal;
+} pool_case_t;
+
+static void pool_case_call(const pool_case_t *c) {
+    if (!c->pool) {
+        ternary_matvec_rows_parallel(FORMAT_2BIT, c->matrix_2bit, c->input, c->output,
+                                     c->rows, c->cols, c->threads);
+    } else if (c->sparse) {
+        ternary_pool_matvec_sparse(c->pool, c->sparse, c->input, c->output, c->chunk, c->steal);
+    } else {
+        ternary_pool_matvec_rows(c->pool, FORMAT_2BIT, c->matrix_2bit, c->input, c->output,
+                                 c->rows, c->cols, c->chunk, c->steal);
+    }
+}
+
+// Best of POOL_SWEEP_ROUNDS, ms per call. The pool's counters cover every
+// call of the best round, so they divide by `iterations`.
+static double time_pool_case(const pool_case_t *c, int iterations,
+                             thread_pool_stats_t *stats) {
+    double best = 0.0;
+    pool_case_call(c);
+    for (int round = 0; round < POOL_SWEEP_ROUNDS; round++) {
+        struct timespec start, end;
+        if (c->pool) {
+            ternary_pool_reset_stats(c->pool);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++) {
+            pool_case_call(c);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = elapsed_ms(&start, &end) / iterations;
+        if (round == 0 || ms < best) {
+            best = ms;
+            if (c->pool && stats) {
+                ternary_pool_stats(c->pool, stats);
+            }
+        }
+    }
+    return best;
+}
+
+// Slowest thread's busy time over the mean: 1.0 is perfect balance
+static double pool_imbalance(const thread_pool_stats_t *stats, int threads) {
+    double max = 0.0, sum = 0.0;
+    for (int t = 0; t < threads; t++) {
+        sum += stats[t].busy_ms;
+        max = stats[t].busy_ms > max ? stats[t].busy_ms : max;
+    }
+    return sum > 0.0 ? max * threads / sum : 1.0;
+}
+
+static long long pool_steals(const thread_pool_stats_t *stats, int threads) {
+    long long steals = 0;
+    for (int t = 0; t < threads; t++) {
+        steals += stats[t].steals;
+    }
+    return steals;
+}
+
+void run_pool_sweep(const uint8_t *matrix_2bit, int rows, int cols, float sparsity,
+                    int iterations, int max_threads, int pin) {
+    int8_t *skewed = (int8_t*)ternary_alloc((size_t)rows * cols);
+    float *input = (float*)ternary_alloc((size_t)cols * sizeof(float));
+    float *reference = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    float *output = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    thread_pool_stats_t static_stats[MAX_MATVEC_THREADS];
+    thread_pool_stats_t steal_stats[MAX_MATVEC_THREADS];
+    sparse_matrix_t sm;
+    int have_sparse = 0;
+
+    if (max_threads > MAX_MATVEC_THREADS) {
+        max_threads = MAX_MATVEC_THREADS;
+    }
+    if (skewed && input && reference && output) {
+        generate_input_vector(input, cols);
+        generate_skewed_matrix(skewed, rows, cols, sparsity);
+        have_sparse = ternary_sparse_matrix_build(&sm, skewed, rows, cols) == 0;
+    }
+    if (!have_sparse) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(skewed);
+        ternary_free(input);
+        ternary_free(reference);
+        ternary_free(output);
+        return;
+    }
+
+    printf("Thread Pool (%d online CPUs, %s, %d-row chunks, 2-bit %s, sparse %s)\n",
+           ternary_online_cpus(), pin ? "pinned" : "unpinned", POOL_DEFAULT_CHUNK,
+           ternary_matvec_2bit_impl_name, ternary_matvec_sparse_impl_name);
+    printf("Sparse rows ramp from %.0f%% nonzeros to none (%.0f%% zeros overall)\n\n",
+           (2.0 * (1.0 - sparsity) > 1.0 ? 1.0 : 2.0 * (1.0 - sparsity)) * 100.0,
+           100.0 * ternary_sparsity(skewed, (size_t)rows * cols));
+    printf("%-7s | %-6s | %9s | %9s | %9s | %8s | %8s | %8s | %9s | %s\n",
+           "Threads", "Rows", "spawn ms", "static ms", "steal ms", "vs static",
+           "Imbal st", "Imbal ws", "Steals/it", "Check");
+    printf("-----------------------------------------------------------------------------------------------------------\n");
+
+    int last_threads = 0;
+    for (int t = 1; t <= max_threads; t = t * 2 > max_threads && t < max_threads ?
+                                            max_threads : t * 2) {
+        thread_pool_t *pool = ternary_pool_create(t, pin);
+        if (!pool) {
+            fprintf(stderr, "Thread pool setup failed at %d threads\n", t);
+            break;
+        }
+        for (int w = 0; w < 2; w++) {
+            pool_case_t c = { pool, matrix_2bit, w ? &sm : NULL, input, output,
+                              rows, cols, t, POOL_DEFAULT_CHUNK, 0 };
+            if (w) {
+                ternary_matvec_sparse_impl(&sm, input, reference);
+            } else {
+                ternary_matvec_2bit_impl(matrix_2bit, input, reference, rows, cols);
+            }
+
+            double ms_static = time_pool_case(&c, iterations, static_stats);
+            c.steal = 1;
+            double ms_steal = time_pool_case(&c, iterations, steal_stats);
+            int ok = max_rel_error(output, reference, rows) < 1e-4;
+            char spawn[16] = "-";
+            if (!w) {
+                pool_case_t s = c;
+                s.pool = NULL;
+                snprintf(spawn, sizeof(spawn), "%.3f", time_pool_case(&s, iterations, NULL));
+                ok = ok && max_rel_error(output, reference, rows) < 1e-4;
+            }
+            printf("%-7d | %-6s | %9s | %9.3f | %9.3f | %7.2fx | %8.2f | %8.2f | %9.1f | %s\n",
+                   t, w ? "sparse" : "dense", spawn, ms_static, ms_steal,
+                   ms_static / ms_steal, pool_imbalance(static_stats, t),
+                   pool_imbalance(steal_stats, t),
+                   (double)pool_steals(steal_stats, t) / iterations, ok ? "ok" : "MISMATCH");
+        }
+        last_threads = t;
+        ternary_pool_destroy(pool);
+    }
+
+    if (last_threads > 1) {
+        // The skewed sparse case again at the widest point, per thread
+        thread_pool_t *pool = ternary_pool_create(last_threads, pin);
+        if (pool) {
+            pool_case_t c = { pool, matrix_2bit, &sm, input, output, rows, cols,
+                              last_threads, POOL_DEFAULT_CHUNK, 0 };
+            time_pool_case(&c, iterations, static_stats);
+            c.steal = 1;
+            time_pool_case(&c, iterations, steal_stats);
+
+            printf("\nSparse, %d threads, per call:\n\n", last_threads);
+            printf("%-6s | %11s | %9s | %11s | %9s | %9s | %9s\n", "Thread",
+                   "static ms", "chunks", "steal ms", "chunks", "steals", "parks");
+            printf("---------------------------------------------------------------------------\n");
+            for (int t = 0; t < last_threads; t++) {
+                printf("%-6d | %11.3f | %9.1f | %11.3f | %9.1f | %9.1f | %9.1f\n", t,
+                       static_stats[t].busy_ms / iterations,
+                       (double)static_stats[t].chunks / iterations,
+                       steal_stats[t].busy_ms / iterations,
+                       (double)steal_stats[t].chunks / iterations,
+                       (double)steal_stats[t].steals / iterations,
+                       (double)steal_stats[t].parks / iterations);
+            }
+
+            // Dispatch alone: one row per thread
+            pool_case_t tiny = { pool, matrix_2bit, NULL, input, output,
+                                 last_threads, cols, last_threads, 1, 1 };
+            double us_pool = time_pool_case(&tiny, POOL_DISPATCH_CALLS, NULL) * 1000.0;
+            tiny.pool = NULL;
+            double us_spawn = time_pool_case(&tiny, POOL_DISPATCH_CALLS, NULL) * 1000.0;
+            printf("\nDispatch (%d-row matvec): pool %.1f us, spawn per call %.1f us\n",
+                   last_threads, us_pool, us_spawn);
+            ternary_pool_destroy(pool);
+        }
+    }
+    printf("\nImbal is the slowest thread's busy time over the mean (1.00 = balanced).\n");
+    printf("Thread 0 is the calling thread. Busy time includes looking for work.\n");
+
+    ternary_sparse_matrix_free(&sm);
+    ternary_free(skewed);
+    ternary_free(input);
+    ternary_free(reference);
+    ternary_free(output);
+}
+
+// ============================================================================
+// SHAPE-SPECIALIZED KERNEL SWEEP
+// ============================================================================
+// Times each row tile of the kernels specialized on this shape's column
+// count against the generic dispatched kernel, and checks their output
+// against it. TERNARY_ISA=scalar compares the scalar pair instead.
+static double time_fixed(matvec_2bit_fn fn, const uint8_t *matrix_2bit,
+                         const float *input, float *output, int rows, int cols,
+                         int iterations) {
+    struct timespec start, end;
+    fn(matrix_2bit, input, output, rows, cols);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        fn(matrix_2bit, input, output, rows, cols);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ms(&start, &end) / iterations;
+}
+
+void run_fixed_sweep(const uint8_t *matrix_2bit, const float *input,
+                     float *output, int rows, int cols, int iterations) {
+    printf("Shape-Specialized Kernels (2-bit, %d columns, fixed: %s, generic: %s)\n\n",
+           cols, ternary_matvec_2bit_fixed_impl_name, ternary_matvec_2bit_impl_name);
+    if (!ternary_matvec_2bit_fixed(cols, FIXED_DEFAULT_TILE)) {
+        printf("No specialized kernel for %d columns on this build; "
+               "ternary_matvec_2bit_shaped() uses the generic one.\nSpecialized:",
+               cols);
+        for (int i = 0; i < FIXED_COL_COUNT; i++) {
+            printf(" %d", ternary_matvec_2bit_fixed_cols[i]);
+        }
+        printf("\n");
+        return;
+    }
+
+    float *reference = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    if (!reference) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+    for (int i = 0; i < 10; i++) {
+        ternary_matvec_2bit_impl(matrix_2bit, input, reference, rows, cols);
+    }
+    double ms_generic = time_fixed(ternary_matvec_2bit_impl, matrix_2bit, input, reference,
+                                   rows, cols, iterations);
+
+    double bytes = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+    printf("%-16s | %10s | %8s | %10s | %11s\n",
+           "Kernel", "ms/iter", "GB/s", "vs generic", "Max rel err");
+    printf("------------------------------------------------------------------\n");
+    printf("%-16s | %10.3f | %8.2f | %9.2fx | %11s\n", "generic",
+           ms_generic, bytes / (ms_generic * 1e6), 1.0, "-");
+
+    double best_ms = 0.0;
+    int best_tile = 0;
+    for (int i = 0; i < FIXED_TILE_COUNT; i++) {
+        int tile = ternary_matvec_2bit_fixed_tiles[i];
+        matvec_2bit_fn fn = ternary_matvec_2bit_fixed(cols, tile);
+        double ms = time_fixed(fn, matrix_2bit, input, output, rows, cols, iterations);
+        char label[32];
+        snprintf(label, sizeof(label), "fixed %dx%d", cols, tile);
+        printf("%-16s | %10.3f | %8.2f | %9.2fx | %11.2e\n", label, ms,
+               bytes / (ms * 1e6), ms_generic / ms,
+               max_rel_error(output, reference, rows));
+        if (best_tile == 0 || ms < best_ms) {
+            best_ms = ms;
+            best_tile = tile;
+        }
+    }
+
+    printf("\nBest: %d-row tile, %.3f ms/iter (%.2fx vs generic); "
+           "ternary_matvec_2bit_shaped() uses %d rows.\n",
+           best_tile, best_ms, ms_generic / best_ms, FIXED_DEFAULT_TILE);
+    ternary_free(reference);
+}
+
+// ============================================================================
+// GPU BACKEND
+// ============================================================================
+// The 8-bit, 2-bit and bitplane weights of this shape run through the GPU
+// kernels byte for byte as packed here, so the 2-bit vs 8-bit bandwidth
+// ratio can be read off device memory as well. Each output is checked
+// against the dispatched CPU kernel on the same weights.
+#ifdef TERNARY_GPU
+static const weight_format_t gpu_formats[] = { FORMAT_8BIT, FORMAT_2BIT, FORMAT_BITPLANE };
+#define GPU_FORMAT_COUNT (int)(sizeof(gpu_formats) / sizeof(gpu_formats[0]))
+
+int run_gpu_bench(const weight_set_t *ws, int iterations) {
+    char device[160];
+    double peak_gbps = 0.0;
+    if (ternary_gpu_device_info(device, sizeof(device), &peak_gbps) != 0) {
+        return -1;
+    }
+
+    int rows = ws->rows, cols = ws->cols;
+    float *reference = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    float *gpu_output = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    if (!reference || !gpu_output) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(reference);
+        ternary_free(gpu_output);
+        return -1;
+    }
+
+    printf("GPU Backend (%s", device);
+    if (peak_gbps > 0.0) {
+        printf(", peak %.0f GB/s", peak_gbps);
+    }
+    printf(")\n\n");
+    printf("%-16s | %8s | %9s | %11s | %9s | %9s | %8s | %6s | %8s | %9s\n",
+           "Format", "MB", "Upload ms", "Upload GB/s", "p50 us", "p99 us",
+           "GB/s", "% peak", "vs 8-bit", "Max err");
+    printf("----------------------------------------------------------------------"
+           "----------------------------------------------\n");
+
+    gpu_result_t res[GPU_FORMAT_COUNT];
+    int failed = 0;
+    for (int i = 0; i < GPU_FORMAT_COUNT && !failed; i++) {
+        weight_format_t f = gpu_formats[i];
+        const uint8_t *matrix = weight_set_matrix(ws, f);
+        if (ternary_gpu_matvec_bench(f, matrix, ws->input, gpu_output, rows, cols,
+                                     iterations, &res[i]) != 0) {
+            failed = 1;
+            continue;
+        }
+        ternary_matvec_rows(f, matrix, ws->input, reference, 0, rows, cols);
+        double err = max_rel_error(gpu_output, reference, rows);
+        double mb = (double)rows * ternary_format_row_bytes(f, cols) / (1024.0 * 1024.0);
+        printf("%-16s | %8.2f | %9.3f | %11.2f | %9.2f | %9.2f | %8.1f | %5.1f%% | "
+               "%7.2fx | %9.2e%s\n",
+               ternary_format_name(f), mb, res[i].upload_ms, res[i].upload_gbps,
+               res[i].kernel.median_ms * 1e3, res[i].kernel.p99_ms * 1e3,
+               res[i].hbm_gbps, peak_gbps > 0.0 ? 100.0 * res[i].hbm_gbps / peak_gbps : 0.0,
+               res[0].kernel.median_ms / res[i].kernel.median_ms, err,
+               err < 1e-4 ? "" : "  MISMATCH");
+        failed = err >= 1e-4;
+    }
+
+    if (!failed) {
+        printf("\nGB/s is weight + activation bytes over the median kernel time. Per call,\n"
+               "the input up and output back add %.1f us (%.0f%% of the 2-bit kernel).\n",
+               res[1].io_us, 100.0 * res[1].io_us / (res[1].kernel.median_ms * 1e3));
+    }
+    ternary_free(reference);
+    ternary_free(gpu_output);
+    return failed ? -1 : 0;
+}
+#endif
+
+// ============================================================================
+// LAYER PROFILE
+// ============================================================================
+// Times every projection of one transformer layer in every format. Shapes
+// are rows x cols = output features x input features, so q/k/v/o and
+// gate/up/down cover the dense matvecs of a decoder layer; GQA models
+// have narrower k/v.
+typedef struct {
+    const char *name;
+    int hidden;         // model width
+    int kv_dim;         // k/v projection width (== hidden without GQA)
+    int ffn;            // MLP intermediate width
+    int layers;         // decoder layers, for --decode
+} model_shape_t;
+
+static const model_shape_t model_shapes[] = {
+    { "bitnet-2b", 2560,  640,  6912, 30 },
+    { "llama-7b",  4096, 4096, 11008, 32 },
+    { "llama-13b", 5120, 5120, 13824, 40 },
+    { "llama3-8b", 4096, 1024, 14336, 32 },
+    { "llama-70b", 8192, 1024, 28672, 80 },
+};
+#define MODEL_SHAPE_COUNT (int)(sizeof(model_shapes) / sizeof(model_shapes[0]))
+#define LAYER_PROJECTIONS 7
+#define LAYER_BUDGET_MS 1000.0
+
+static const model_shape_t *find_model_shape(const char *name) {
+    for (int i = 0; i < MODEL_SHAPE_COUNT; i++) {
+        if (strcmp(model_shapes[i].name, name) == 0) {
+            return &model_shapes[i];
+        }
+    }
+    return NULL;
+}
+
+static void layer_projections(const model_shape_t *m, const char *names[],
+                              int rows[], int cols[]) {
+    static const char *proj_names[LAYER_PROJECTIONS] = {
+        "q", "k", "v", "o", "gate", "up", "down"
+    };
+    int proj_rows[LAYER_PROJECTIONS] = {
+        m->hidden, m->kv_dim, m->kv_dim, m->hidden, m->ffn, m->ffn, m->hidden
+    };
+    int proj_cols[LAYER_PROJECTIONS] = {
+        m->hidden, m->hidden, m->hidden, m->hidden, m->hidden, m->hidden, m->ffn
+    };
+    for (int i = 0; i < LAYER_PROJECTIONS; i++) {
+        names[i] = proj_names[i];
+        rows[i] = proj_rows[i];
+        cols[i] = proj_cols[i];
+    }
+}
+
+// Size in bytes of the data or unified cache at `level` (1-3) on CPU 0,
+// or 0 if unknown
+static long cache_size_bytes(int level) {
+#ifdef __linux__
+    for (int i = 0; i < 8; i++) {
+        char path[128], buf[64];
+        int lv = 0;
+        FILE *f;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        if (!(f = fopen(path, "r"))) {
+            break;
+        }
+        if (fscanf(f, "%d", &lv) != 1) {
+            lv = 0;
+        }
+        fclose(f);
+        if (lv != level) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        if (!(f = fopen(path, "r"))) {
+            continue;
+        }
+        int usable = fgets(buf, sizeof(buf), f) && strncmp(buf, "Instruction", 11) != 0;
+        fclose(f);
+        if (!usable) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        if (!(f = fopen(path, "r"))) {
+            continue;
+        }
+        long size = 0;
+        char unit = 'K';
+        if (fscanf(f, "%ld%c", &size, &unit) < 1) {
+            size = 0;
+        }
+        fclose(f);
+        return unit == 'M' ? size << 20 : unit == 'K' ? size << 10 : size;
+    }
+    return 0;
+#elif defined(__APPLE__)
+    static const char *names[] = { NULL, "hw.l1dcachesize", "hw.l2cachesize",
+                                   "hw.l3cachesize" };
+    int64_t size = 0;
+    size_t len = sizeof(size);
+    if (level < 1 || level > 3 || sysctlbyname(names[level], &size, &len, NULL, 0) != 0) {
+        return 0;
+    }
+    return (long)size;
+#else
+    (void)level;
+    return 0;
+#endif
+}
+
+// Smallest cache level that holds `bytes`, for the residency column
+static const char *residency(size_t bytes) {
+    static const char *names[] = { "L1", "L2", "LLC" };
+    int known = 0;
+    for (int level = 1; level <= 3; level++) {
+        long size = cache_size_bytes(level);
+        if (size > 0) {
+            known = 1;
+            if (bytes <= (size_t)size) {
+                return names[level - 1];
+            }
+        }
+    }
+    return known ? "DRAM" : "?";
+}
+
+void run_layer_profile(const model_shape_t *model, float sparsity, int iterations) {
+    const char *names[LAYER_PROJECTIONS];
+    int rows[LAYER_PROJECTIONS], cols[LAYER_PROJECTIONS];
+    double total_ms[WEIGHT_FORMAT_COUNT] = { 0.0 };
+    double total_bytes[WEIGHT_FORMAT_COUNT] = { 0.0 };
+    double total_p99_2bit = 0.0;
+    layer_projections(model, names, rows, cols);
+
+    printf("Layer Profile: %s (hidden %d, kv %d, ffn %d)\n\n",
+           model->name, model->hidden, model->kv_dim, model->ffn);
+    printf("%-5s | %-12s | %-9s | %9s | %9s | %9s | %9s | %9s | %8s | %8s\n",
+           "Proj", "Shape", "8b / 2b", "8-bit ms", "2-bit ms", "2b p99",
+           "bitpl ms", "base3 ms", "2b GB/s", "2b vs 8b");
+    printf("------------------------------------------------------------------------------------------------------------\n");
+
+    for (int p = 0; p < LAYER_PROJECTIONS; p++) {
+        weight_set_t ws;
+        if (weight_set_alloc(&ws, rows[p], cols[p], sparsity) != 0) {
+            fprintf(stderr, "Memory allocation failed for %s (%d x %d)\n",
+                    names[p], rows[p], cols[p]);
+            return;
+        }
+
+        double ms[WEIGHT_FORMAT_COUNT];
+        timing_stats_t stats_2bit;
+        for (int f = 0; f < WEIGHT_FORMAT_COUNT; f++) {
+            ms[f] = time_format_budget(ternary_all_formats[f], weight_set_matrix(&ws, ternary_all_formats[f]),
+                                       ws.input, ws.output, rows[p], cols[p],
+                                       3, iterations, LAYER_BUDGET_MS,
+                                       ternary_all_formats[f] == FORMAT_2BIT ? &stats_2bit : NULL);
+            total_ms[f] += ms[f];
+            total_bytes[f] += (double)rows[p] *
+                              ternary_format_row_bytes(ternary_all_formats[f], cols[p]);
+        }
+
+        char shape[32], fit[16];
+        size_t bytes_2bit = (size_t)rows[p] * ternary_format_row_bytes(FORMAT_2BIT, cols[p]);
+        snprintf(shape, sizeof(shape), "%dx%d", rows[p], cols[p]);
+        snprintf(fit, sizeof(fit), "%s/%s",
+                 residency((size_t)rows[p] * ternary_format_row_bytes(FORMAT_8BIT, cols[p])),
+                 residency(bytes_2bit));
+        total_p99_2bit += stats_2bit.p99_ms;
+        printf("%-5s | %-12s | %-9s | %9.3f | %9.3f | %9.3f | %9.3f | %9.3f | %8.2f | %7.2fx\n",
+               names[p], shape, fit, ms[0], ms[1], stats_2bit.p99_ms, ms[2], ms[3],
+               bytes_2bit / (ms[1] * 1e6), ms[0] / ms[1]);
+        weight_set_free(&ws);
+    }
+
+    printf("------------------------------------------------------------------------------------------------------------\n");
+    printf("%-5s | %-12s | %-9s | %9.3f | %9.3f | %9.3f | %9.3f | %9.3f | %8.2f | %7.2fx\n",
+           "layer", "", "", total_ms[0], total_ms[1], total_p99_2bit, total_ms[2],
+           total_ms[3], total_bytes[1] / (total_ms[1] * 1e6), total_ms[0] / total_ms[1]);
+    printf("\n8b / 2b is the smallest cache level holding each footprint. Each cell\n");
+    printf("runs up to %d iterations or about %.0f ms, whichever comes first.\n",
+           iterations, LAYER_BUDGET_MS);
+    printf("The layer p99 sums the projection p99s, an upper bound on the layer's.\n");
+}
+
+// ============================================================================
+// TOKEN DECODE
+// ============================================================================
+// Streams one activation through every layer of a model per token, the
+// access pattern of autoregressive decoding. Each layer's projections are
+// separate buffers, so every weight is read exactly once per token and a
+// stack larger than the LLC cannot stay hot between tokens the way one
+// repeated matrix does. Attention itself is skipped: o reads the q output
+// and down reads gate * up.
+//
+// The pipelined loop adds a helper thread that reads one byte per cache
+// line of the next `lookahead` layers while the compute threads work on
+// the current one, pulling them into the LLC (and, on an SMT sibling, the
+// shared L2). It never runs further ahead than that, so it cannot evict
+// the layer being computed if lookahead layers fit in the cache.
+#define DECODE_DEFAULT_TOKENS 16
+#define DECODE_WARMUP_TOKENS 1
+#define DECODE_MAX_RAM_FRACTION 0.8   // of physical memory, for the weights
+#define DECODE_DEFAULT_LOOKAHEAD 1
+#define DECODE_LINE_BYTES 64
+
+typedef struct decode_prefetcher decode_prefetcher_t;
+
+typedef struct {
+    weight_format_t format;
+    int layers;
+    int hidden;
+    int threads;
+    const char *names[LAYER_PROJECTIONS];
+    int rows[LAYER_PROJECTIONS];
+    int cols[LAYER_PROJECTIONS];
+    uint8_t **weights;      // layers x LAYER_PROJECTIONS matrices
+    float *embedding;       // each token's input
+    float *x;               // residual stream
+    float *h;               // normalised layer input
+    float *out[LAYER_PROJECTIONS];
+    thread_pool_t *pool;    // built once per run, used when threads > 1
+    decode_prefetcher_t *prefetch;  // NULL: the serial loop
+} decode_model_t;
+
+struct decode_prefetcher {
+    const decode_model_t *d;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long step;              // tokens * layers + layer the compute is on
+    int lookahead;          // layers warmed ahead of step
+    int stop;
+    int cpu;                // CPU the helper is pinned to, -1 if unpinned
+    long long warmed;       // layers warmed
+    long long on_time;      // ... finished before the compute reached them
+    double busy_ms;
+};
+
+static volatile uint8_t decode_warm_sink;
+
+// Loads one byte per cache line of layer `l`
+static void decode_warm_layer(const decode_model_t *d, int l) {
+    uint8_t sum = 0;
+    for (int p = 0; p < LAYER_PROJECTIONS; p++) {
+        const uint8_t *w = d->weights[(size_t)l * LAYER_PROJECTIONS + p];
+        size_t bytes = (size_t)d->rows[p] * ternary_format_row_bytes(d->format, d->cols[p]);
+        for (size_t i = 0; i < bytes; i += DECODE_LINE_BYTES) {
+            sum += w[i];
+        }
+    }
+    decode_warm_sink += sum;
+}
+
+static void *decode_prefetch_worker(void *arg) {
+    decode_prefetcher_t *pf = (decode_prefetcher_t*)arg;
+    long next = 0;
+
+    if (pf->cpu >= 0 && ternary_pin_current_thread(pf->cpu) != 0) {
+        pf->cpu = -1;
+    }
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->stop) {
+        if (next <= pf->step) {
+            next = pf->step + 1;    // fell behind: skip to what is still ahead
+        }
+        if (next > pf->step + pf->lookahead) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        long target = next;
+        pthread_mutex_unlock(&pf->lock);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        TRACE_BEGIN(trace_t0);
+        decode_warm_layer(pf->d, (int)(target % pf->d->layers));
+        TRACE_END(trace_t0, "warm layer", target % pf->d->layers);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        pthread_mutex_lock(&pf->lock);
+        pf->busy_ms += elapsed_ms(&t0, &t1);
+        pf->warmed++;
+        pf->on_time += pf->step < target;
+        next = target + 1;
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+// CPU sharing a core with `cpu`, or -1 without SMT or off Linux
+static int smt_sibling(int cpu) {
+#ifdef __linux__
+    char path[96];
+    int first = -1, second = -1;
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    int n = fscanf(f, "%d%*[,-]%d", &first, &second);
+    fclose(f);
+    if (n < 2) {
+        return -1;
+    }
+    return first == cpu ? second : first;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+// Starts the helper; it is pinned to the SMT sibling of pin_cpu when the
+// benchmark thread is pinned and has one
+static int decode_prefetch_start(decode_prefetcher_t *pf, decode_model_t *d,
+                                 int lookahead, int pin_cpu) {
+    memset(pf, 0, sizeof(*pf));
+    pf->d = d;
+    pf->step = -1;
+    pf->lookahead = lookahead;
+    pf->cpu = pin_cpu >= 0 ? smt_sibling(pin_cpu) : -1;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, decode_prefetch_worker, pf) != 0) {
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->cond);
+        return -1;
+    }
+    d->prefetch = pf;
+    return 0;
+}
+
+static void decode_prefetch_stop(decode_prefetcher_t *pf, decode_model_t *d) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    d->prefetch = NULL;
+}
+
+// Tells the helper the compute has moved on to the next layer
+static void decode_layer_begin(const decode_model_t *d) {
+    decode_prefetcher_t *pf = d->prefetch;
+    if (pf) {
+        pthread_mutex_lock(&pf->lock);
+        pf->step++;
+        pthread_cond_signal(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+    }
+}
+
+static size_t physical_memory_bytes(void) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page_size > 0 ? (size_t)pages * (size_t)page_size : 0;
+}
+
+// out = x / rms(x), keeping activations bounded across the stack
+static void rms_norm(const float *x, float *out, int n) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += (double)x[i] * x[i];
+    }
+    float scale = (float)(1.0 / sqrt_nolibm(sum / n + 1e-6));
+    for (int i = 0; i < n; i++) {
+        out[i] = x[i] * scale;
+    }
+}
+
+static void decode_project(const decode_model_t *d, uint8_t *const *w, int p,
+                           const float *input) {
+    TRACE_BEGIN(trace_t0);
+    if (d->threads > 1) {
+        ternary_pool_matvec_rows(d->pool, d->format, w[p], input, d->out[p], d->rows[p],
+                                 d->cols[p], POOL_DEFAULT_CHUNK, 1);
+    } else {
+        ternary_matvec_rows(d->format, w[p], input, d->out[p], 0, d->rows[p], d->cols[p]);
+    }
+    TRACE_END(trace_t0, d->names[p], d->rows[p]);
+}
+
+// One token through every layer
+static void decode_token(const void *ctx) {
+    const decode_model_t *d = (const decode_model_t*)ctx;
+    memcpy(d->x, d->embedding, (size_t)d->hidden * sizeof(float));
+    for (int l = 0; l < d->layers; l++) {
+        uint8_t *const *w = d->weights + (size_t)l * LAYER_PROJECTIONS;
+        TRACE_BEGIN(trace_t0);
+
+        decode_layer_begin(d);
+        rms_norm(d->x, d->h, d->hidden);
+        for (int p = 0; p < 3; p++) {
+            decode_project(d, w, p, d->h);
+        }
+        decode_project(d, w, 3, d->out[0]);
+        for (int i = 0; i < d->hidden; i++) {
+            d->x[i] += d->out[3][i];
+        }
+
+        rms_norm(d->x, d->h, d->hidden);
+        decode_project(d, w, 4, d->h);
+        decode_project(d, w, 5, d->h);
+        for (int i = 0; i < d->rows[4]; i++) {
+            d->out[4][i] *= d->out[5][i];
+        }
+        decode_project(d, w, 6, d->out[4]);
+        for (int i = 0; i < d->hidden; i++) {
+            d->x[i] += d->out[6][i];
+        }
+        TRACE_END(trace_t0, "layer", l);
+    }
+}
+
+static void decode_model_free(decode_model_t *d) {
+    ternary_pool_destroy(d->pool);
+    if (d->weights) {
+        for (size_t i = 0; i < (size_t)d->layers * LAYER_PROJECTIONS; i++) {
+            ternary_free(d->weights[i]);
+        }
+        free(d->weights);
+    }
+    ternary_free(d->embedding);
+    ternary_free(d->x);
+    ternary_free(d->h);
+    for (int p = 0; p < LAYER_PROJECTIONS; p++) {
+        ternary_free(d->out[p]);
+    }
+}
+
+// Generates layer 0 and copies it into every other layer's own buffers:
+// the access pattern, not the values, is what the run measures. With more
+// than one CPU the pool for the threaded runs is started here too, so
+// thread start-up stays out of the timed tokens.
+static int decode_model_alloc(decode_model_t *d, const model_shape_t *model,
+                              weight_format_t format, int layers, float sparsity,
+                              int pin) {
+    memset(d, 0, sizeof(*d));
+    d->format = format;
+    d->layers = layers;
+    d->hidden = model->hidden;
+    d->threads = 1;
+    layer_projections(model, d->names, d->rows, d->cols);
+
+    d->weights = (uint8_t**)calloc((size_t)layers * LAYER_PROJECTIONS, sizeof(uint8_t*));
+    d->embedding = (float*)ternary_alloc((size_t)d->hidden * sizeof(float));
+    d->x = (float*)ternary_alloc((size_t)d->hidden * sizeof(float));
+    d->h = (float*)ternary_alloc((size_t)d->hidden * sizeof(float));
+    if (ternary_online_cpus() > 1) {
+        d->pool = ternary_pool_create(ternary_online_cpus(), pin);
+    }
+    int ok = d->weights && d->embedding && d->x && d->h && (d->pool || ternary_online_cpus() == 1);
+    for (int p = 0; p < LAYER_PROJECTIONS && ok; p++) {
+        d->out[p] = (float*)ternary_alloc((size_t)d->rows[p] * sizeof(float));
+        ok = d->out[p] != NULL;
+    }
+    for (int p = 0; p < LAYER_PROJECTIONS && ok; p++) {
+        size_t bytes = (size_t)d->rows[p] * ternary_format_row_bytes(format, d->cols[p]);
+        int8_t *matrix_8bit = (int8_t*)malloc((size_t)d->rows[p] * d->cols[p]);
+        for (int l = 0; l < layers && ok && matrix_8bit; l++) {
+            uint8_t *w = (uint8_t*)ternary_alloc(bytes);
+            d->weights[(size_t)l * LAYER_PROJECTIONS + p] = w;
+            if (!w) {
+                ok = 0;
+            } else if (l == 0) {
+                generate_ternary_matrix_8bit(matrix_8bit, d->rows[p], d->cols[p], sparsity);
+                ternary_pack_matrix(format, matrix_8bit, w, d->rows[p], d->cols[p],
+                                    ternary_online_cpus());
+            } else {
+                memcpy(w, d->weights[p], bytes);
+            }
+        }
+        ok = ok && matrix_8bit;
+        free(matrix_8bit);
+    }
+    if (!ok) {
+        decode_model_free(d);
+        return -1;
+    }
+    generate_input_vector(d->embedding, d->hidden);
+    return 0;
+}
+
+int run_decode(const model_shape_t *model, weight_format_t format, int layers,
+               int tokens, int lookahead, int pin_cpu, float sparsity) {
+    const char *names[LAYER_PROJECTIONS];
+    int rows[LAYER_PROJECTIONS], cols[LAYER_PROJECTIONS];
+    size_t layer_bytes = 0;
+    long long layer_weights = 0;
+    layer_projections(model, names, rows, cols);
+    for (int p = 0; p < LAYER_PROJECTIONS; p++) {
+        layer_bytes += (size_t)rows[p] * ternary_format_row_bytes(format, cols[p]);
+        layer_weights += (long long)rows[p] * cols[p];
+    }
+    size_t token_bytes = layer_bytes * (size_t)layers;
+    size_t ram = physical_memory_bytes();
+    long llc = cache_size_bytes(3);
+
+    printf("Token Decode: %s, %d of %d layers, %s (hidden %d, kv %d, ffn %d)\n",
+           model->name, layers, model->layers, ternary_format_name(format),
+           model->hidden, model->kv_dim, model->ffn);
+    printf("  Weights:    %.2f GB in %d matrices, %.2f G weights per token\n",
+           token_bytes / 1e9, layers * LAYER_PROJECTIONS, layer_weights * layers / 1e9);
+    if (llc > 0) {
+        printf("  LLC:        %ld MB, %.1fx smaller than the weights\n",
+               llc >> 20, (double)token_bytes / llc);
+    }
+    if (ram > 0 && token_bytes > ram * DECODE_MAX_RAM_FRACTION) {
+        fprintf(stderr, "%.2f GB of weights exceeds %.0f%% of the %.2f GB of RAM; "
+                "lower --decode-layers or use a smaller --layout\n",
+                token_bytes / 1e9, DECODE_MAX_RAM_FRACTION * 100.0, ram / 1e9);
+        return -1;
+    }
+
+    decode_model_t d;
+    if (decode_model_alloc(&d, model, format, layers, sparsity, pin_cpu >= 0) != 0) {
+        fprintf(stderr, "Memory allocation failed for %.2f GB of weights\n",
+                token_bytes / 1e9);
+        return -1;
+    }
+
+    int thread_counts[2] = { 1, d.pool ? ternary_pool_threads(d.pool) : 1 };
+    int runs = thread_counts[1] > 1 ? 2 : 1;
+    int loops = lookahead > 0 ? 2 : 1;
+    benchmark_result_t results[2][2];
+    decode_prefetcher_t helpers[2];
+    printf("\n%-7s | %-8s | %9s | %9s | %9s | %9s | %9s | %15s\n",
+           "Threads", "Loop", "ms/token", "p50 ms", "p99 ms", "Tokens/s", "GB/s",
+           "Hidden");
+    printf("------------------------------------------------------------------------------------------------\n");
+    for (int r = 0; r < runs; r++) {
+        d.threads = thread_counts[r];
+        for (int loop = 0; loop < loops; loop++) {
+            benchmark_result_t *res = &results[r][loop];
+            char name[16], hidden[32] = "-";
+            if (loop == 1 && decode_prefetch_start(&helpers[r], &d, lookahead, pin_cpu) != 0) {
+                fprintf(stderr, "Failed to start the prefetch thread\n");
+                loops = 1;
+                break;
+            }
+            for (int t = 0; t < DECODE_WARMUP_TOKENS; t++) {
+                decode_token(&d);
+            }
+            benchmark_call(decode_token, &d, tokens, res);
+            if (loop == 1) {
+                decode_prefetch_stop(&helpers[r], &d);
+                double saved = results[r][0].stats.mean_ms - res->stats.mean_ms;
+                snprintf(hidden, sizeof(hidden), "%.2f ms (%.0f%%)", saved,
+                         100.0 * saved / results[r][0].stats.mean_ms);
+                snprintf(name, sizeof(name), "ahead %d", lookahead);
+            } else {
+                snprintf(name, sizeof(name), "serial");
+            }
+            printf("%-7d | %-8s | %9.2f | %9.2f | %9.2f | %9.2f | %9.2f | %15s\n",
+                   d.threads, name, res->stats.mean_ms, res->stats.median_ms,
+                   res->stats.p99_ms, 1000.0 / res->stats.mean_ms,
+                   token_bytes / (res->stats.mean_ms * 1e6), hidden);
+        }
+    }
+
+    int printed = 0;
+    for (int r = 0; r < runs; r++) {
+        for (int loop = 0; loop < loops; loop++) {
+            const benchmark_result_t *res = &results[r][loop];
+            if (res->dram_read_bytes < 0) {
+                continue;
+            }
+            double dram = (double)res->dram_read_bytes / res->iterations;
+            printf("%s%d thread%s, %s: %.2f GB of DRAM reads per token (%.0f%% of the weights)\n",
+                   printed++ ? "" : "\n", thread_counts[r], thread_counts[r] == 1 ? "" : "s",
+                   loop ? "pipelined" : "serial", dram / 1e9, 100.0 * dram / token_bytes);
+        }
+    }
+    for (int r = 0; r < runs && loops > 1; r++) {
+        const decode_prefetcher_t *pf = &helpers[r];
+        double run_ms = results[r][1].stats.mean_ms *
+                        (results[r][1].iterations + DECODE_WARMUP_TOKENS);
+        char where[32];
+        if (pf->cpu >= 0) {
+            snprintf(where, sizeof(where), "CPU %d", pf->cpu);
+        } else {
+            snprintf(where, sizeof(where), "unpinned");
+        }
+        printf("%sHelper with %d thread%s (%s): warmed %lld layers, %.0f%% before the\n"
+               "  compute reached them, busy %.0f%% of the run\n",
+               r ? "" : "\n", thread_counts[r], thread_counts[r] == 1 ? "" : "s", where,
+               pf->warmed, pf->warmed ? 100.0 * pf->on_time / pf->warmed : 0.0,
+               run_ms > 0.0 ? 100.0 * pf->busy_ms / run_ms : 0.0);
+    }
+    printf("\nGB/s counts each weight byte once per token (%d timed after %d warm-up).\n",
+           results[0][0].iterations, DECODE_WARMUP_TOKENS);
+    if (runs > 1) {
+        printf("Each projection splits %d-row chunks over a persistent thread pool.\n",
+               POOL_DEFAULT_CHUNK);
+    }
+    if (loops > 1) {
+        printf("Hidden is the serial ms/token the layer-ahead helper saved.\n");
+        if (thread_counts[1] == 1) {
+            printf("With one CPU the helper time-shares the core with the compute.\n");
+        }
+    }
+    decode_model_free(&d);
+    return 0;
+}
+
+// ============================================================================
+// WORKING-SET SWEEP
+// ============================================================================
+// Grows the matrix from a few KB to max_bytes (8-bit footprint), doubling
+// the weight count each step, and times every format at each size. Small
+// sets stay cache-resident across iterations; the GB/s cliffs show where
+// each representation falls out of L1, L2, LLC and into DRAM.
+#define WSS_COLS 1024
+#define WSS_MIN_WEIGHTS 4096
+#define WSS_BUDGET_MS 100.0
+
+void run_working_set_sweep(float sparsity, size_t max_bytes, const char *csv_path) {
+    FILE *csv = NULL;
+    if (csv_path) {
+        csv = fopen(csv_path, "w");
+        if (!csv) {
+            fprintf(stderr, "Cannot open %s for writing\n", csv_path);
+            return;
+        }
+        fprintf(csv, "weights,rows,cols,format,kernel,bytes,level,ms,gb_per_s,ns_per_weight\n");
+    }
+
+    long caches[3];
+    for (int level = 1; level <= 3; level++) {
+        caches[level - 1] = cache_size_bytes(level);
+    }
+    printf("Working-Set Sweep (cols %d; L1 %ld KB, L2 %ld KB, LLC %ld KB)\n\n",
+           WSS_COLS, caches[0] >> 10, caches[1] >> 10, caches[2] >> 10);
+    printf("%-10s | %10s |", "Weights", "8-bit KB");
+    for (int f = 0; f < WEIGHT_FORMAT_COUNT; f++) {
+        printf(" %-16.16s |", ternary_format_name(ternary_all_formats[f]));
+    }
+    printf("\n%-10s | %10s |", "", "");
+    for (int f = 0; f < WEIGHT_FORMAT_COUNT; f++) {
+        printf(" %4s %6s %4s |", "lvl", "GB/s", "ns/w");
+    }
+    printf("\n------------------------------------------------------------------------------------------------\n");
+
+    for (size_t weights = WSS_MIN_WEIGHTS; weights <= max_bytes; weights *= 2) {
+        int rows = (int)(weights / WSS_COLS);
+        weight_set_t ws;
+        if (weight_set_alloc(&ws, rows, WSS_COLS, sparsity) != 0) {
+            printf("(stopped: could not allocate %zu weights)\n", weights);
+            break;
+        }
+
+        printf("%-10zu | %10zu |", weights, weights / 1024);
+        for (int f = 0; f < WEIGHT_FORMAT_COUNT; f++) {
+            weight_format_t format = ternary_all_formats[f];
+            size_t bytes = (size_t)rows * ternary_format_row_bytes(format, WSS_COLS);
+            double ms = time_format_budget(format, weight_set_matrix(&ws, format),
+                                           ws.input, ws.output, rows, WSS_COLS,
+                                           1, 1 << 30, WSS_BUDGET_MS, NULL);
+            double gbps = bytes / (ms * 1e6);
+            double ns_per_weight = ms * 1e6 / weights;
+            const char *level = residency(bytes);
+
+            printf(" %4s %6.2f %4.2f |", level, gbps, ns_per_weight);
+            if (csv) {
+                fprintf(csv, "%zu,%d,%d,%s,%s,%zu,%s,%.6f,%.4f,%.4f\n",
+                        weights, rows, WSS_COLS, ternary_format_name(format),
+                        ternary_format_kernel_name(format), bytes, level, ms, gbps,
+                        ns_per_weight);
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+        weight_set_free(&ws);
+    }
+
+    // Where each footprint stops fitting, from the cache sizes alone
+    printf("\nLargest weight count that fits each level:\n");
+    printf("%-16s | %12s | %12s | %12s\n", "Format", "L1", "L2", "LLC");
+    printf("------------------------------------------------------------\n");
+    for (int f = 0; f < WEIGHT_FORMAT_COUNT; f++) {
+        double bytes_per_weight = (double)ternary_format_row_bytes(ternary_all_formats[f], WSS_COLS) / WSS_COLS;
+        printf("%-16s |", ternary_format_name(ternary_all_formats[f]));
+        for (int level = 0; level < 3; level++) {
+            if (caches[level] > 0) {
+                printf(" %12.0f |", caches[level] / bytes_per_weight);
+            } else {
+                printf(" %12s |", "?");
+            }
+        }
+        printf("\n");
+    }
+    printf("\nlvl is the smallest cache level holding the footprint; ns/w is time per weight.\n");
+
+    if (csv) {
+        fclose(csv);
+        printf("CSV written to %s\n", csv_path);
+    }
+}
+
+// ============================================================================
+// WEIGHT FILES (MEMORY-MAPPED)
+// ============================================================================
+// One packed ternary tensor per file, laid out so the kernels can run on the
+// mapping directly:
+//   [0, 64)                 weight_file_header_t
+//   [scales_offset, +4*rows) float per-row scales (generated weights use 1.0)
+//   [data_offset, +rows*row_bytes) rows in the layout's packed format
+// Both sections start on a WEIGHT_FILE_ALIGN boundary of the file; mmap
+// returns a page-aligned base, so they are 64-byte aligned in memory too.
+// All fields are in host byte order; byte_order catches a file written on
+// a host of the other endianness. Loading is an mmap plus page faults on
+// first use instead of generating and repacking every matrix.
+#define WEIGHT_FILE_MAGIC "TRNPACK"
+#define WEIGHT_FILE_VERSION 1
+#define WEIGHT_FILE_ALIGN 64
+#define WEIGHT_FILE_BYTE_ORDER 0x01020304u
+
+#define WEIGHT_MAP_POPULATE 1   // prefault every page at map time
+#define WEIGHT_MAP_HUGEPAGE 2   // ask for transparent huge pages
+
+// On-disk layout ids; fixed, unlike weight_format_t's order
+enum {
+    WEIGHT_LAYOUT_8BIT = 1,
+    WEIGHT_LAYOUT_2BIT = 2,
+    WEIGHT_LAYOUT_BITPLANE = 3,
+    WEIGHT_LAYOUT_BASE3 = 4
+};
+
+typedef struct {
+    char magic[8];          // WEIGHT_FILE_MAGIC, NUL-terminated
+    uint32_t version;
+    uint32_t byte_order;    // WEIGHT_FILE_BYTE_ORDER as written
+    uint32_t layout;        // WEIGHT_LAYOUT_*
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t flags;         // reserved, 0
+    uint64_t row_bytes;
+    uint64_t scales_offset;
+    uint64_t data_offset;
+    uint64_t file_bytes;
+} weight_file_header_t;
+
+_Static_assert(sizeof(weight_file_header_t) == WEIGHT_FILE_ALIGN,
+               "weight file header must fill one aligned block");
+
+typedef struct {
+    void *base;             // the whole mapping
+    size_t bytes;
+    weight_format_t format;
+    int rows;
+    int cols;
+    const float *scales;
+    const uint8_t *data;
+    int hugepage;           // MADV_HUGEPAGE was accepted
+} weight_file_t;
+
+static uint32_t format_layout(weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return WEIGHT_LAYOUT_8BIT;
+    case FORMAT_2BIT:     return WEIGHT_LAYOUT_2BIT;
+    case FORMAT_BITPLANE: return WEIGHT_LAYOUT_BITPLANE;
+    case FORMAT_BASE3:    return WEIGHT_LAYOUT_BASE3;
+    }
+    return 0;
+}
+
+// Returns 0 and sets *format for a known layout id
+static int layout_format(uint32_t layout, weight_format_t *format) {
+    switch (layout) {
+    case WEIGHT_LAYOUT_8BIT:     *format = FORMAT_8BIT;     return 0;
+    case WEIGHT_LAYOUT_2BIT:     *format = FORMAT_2BIT;     return 0;
+    case WEIGHT_LAYOUT_BITPLANE: *format = FORMAT_BITPLANE; return 0;
+    case WEIGHT_LAYOUT_BASE3:    *format = FORMAT_BASE3;    return 0;
+    }
+    return -1;
+}
+
+// --layout names
+static int parse_layout(const char *name, weight_format_t *format) {
+    static const struct { const char *name; weight_format_t format; } names[] = {
+        { "8bit", FORMAT_8BIT }, { "2bit", FORMAT_2BIT },
+        { "bitplane", FORMAT_BITPLANE }, { "base3", FORMAT_BASE3 }
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i].name) == 0) {
+            *format = names[i].format;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t weight_file_align(uint64_t offset) {
+    return (offset + WEIGHT_FILE_ALIGN - 1) & ~(uint64_t)(WEIGHT_FILE_ALIGN - 1);
+}
+
+static void weight_file_layout(weight_file_header_t *h, weight_format_t format,
+                               int rows, int cols) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, WEIGHT_FILE_MAGIC, sizeof(WEIGHT_FILE_MAGIC));
+    h->version = WEIGHT_FILE_VERSION;
+    h->byte_order = WEIGHT_FILE_BYTE_ORDER;
+    h->layout = format_layout(format);
+    h->rows = (uint32_t)rows;
+    h->cols = (uint32_t)cols;
+    h->row_bytes = ternary_format_row_bytes(format, cols);
+    h->scales_offset = weight_file_align(sizeof(*h));
+    h->data_offset = weight_file_align(h->scales_offset + (uint64_t)rows * sizeof(float));
+    h->file_bytes = h->data_offset + (uint64_t)rows * h->row_bytes;
+}
+
+// Zero bytes up to `offset`; returns 0 on success
+static int weight_file_pad(FILE *f, uint64_t offset) {
+    static const uint8_t zeros[WEIGHT_FILE_ALIGN];
+    long at = ftell(f);
+    if (at < 0 || (uint64_t)at > offset) {
+        return -1;
+    }
+    size_t pad = (size_t)(offset - (uint64_t)at);
+    return fwrite(zeros, 1, pad, f) == pad ? 0 : -1;
+}
+
+// Writes `data` (rows in `format`) and per-row scales (NULL: all 1.0).
+// Returns 0 on success
+int weight_file_write(const char *path, weight_format_t format, const uint8_t *data,
+                      const float *scales, int rows, int cols) {
+    weight_file_header_t h;
+    weight_file_layout(&h, format, rows, cols);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return -1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 && weight_file_pad(f, h.scales_offset) == 0;
+    for (int r = 0; ok && r < rows; r++) {
+        float scale = scales ? scales[r] : 1.0f;
+        ok = fwrite(&scale, sizeof(scale), 1, f) == 1;
+    }
+    ok = ok && weight_file_pad(f, h.data_offset) == 0 &&
+         fwrite(data, h.row_bytes, rows, f) == (size_t)rows;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Maps a weight file read-only; returns 0 on success. With
+// WEIGHT_MAP_POPULATE every page is faulted in here (MAP_POPULATE on Linux,
+// MADV_WILLNEED elsewhere). WEIGHT_MAP_HUGEPAGE is advisory: file-backed THP
+// needs kernel support and is reported in wf->hugepage.
+int weight_file_map(weight_file_t *wf, const char *path, int flags) {
+    memset(wf, 0, sizeof(*wf));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(weight_file_header_t)) {
+        fprintf(stderr, "%s is not a weight file (too short)\n", path);
+        close(fd);
+        return -1;
+    }
+
+    int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (flags & WEIGHT_MAP_POPULATE) {
+        map_flags |= MAP_POPULATE;
+    }
+#endif
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, map_flags, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return -1;
+    }
+    wf->base = base;
+    wf->bytes = (size_t)st.st_size;
+
+    const weight_file_header_t *h = (const weight_file_header_t*)base;
+    const char *error = NULL;
+    if (memcmp(h->magic, WEIGHT_FILE_MAGIC, sizeof(WEIGHT_FILE_MAGIC)) != 0) {
+        error = "bad magic";
+    } else if (h->byte_order != WEIGHT_FILE_BYTE_ORDER) {
+        error = "written on a host of the other byte order";
+    } else if (h->version != WEIGHT_FILE_VERSION) {
+        error = "unsupported version";
+    } else if (layout_format(h->layout, &wf->format) != 0) {
+        error = "unknown layout";
+    } else if (h->rows < 1 || h->cols < 1 || h->rows > INT32_MAX || h->cols > INT32_MAX ||
+               h->row_bytes != ternary_format_row_bytes(wf->format, (int)h->cols)) {
+        error = "bad shape";
+    } else {
+        weight_file_header_t expect;
+        weight_file_layout(&expect, wf->format, (int)h->rows, (int)h->cols);
+        if (h->scales_offset != expect.scales_offset ||
+            h->data_offset != expect.data_offset || h->file_bytes != expect.file_bytes) {
+            error = "bad section offsets";
+        } else if (h->file_bytes > wf->bytes) {
+            error = "truncated";
+        }
+    }
+    if (error) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        munmap(base, wf->bytes);
+        memset(wf, 0, sizeof(*wf));
+        return -1;
+    }
+
+    wf->rows = (int)h->rows;
+    wf->cols = (int)h->cols;
+    wf->scales = (const float*)((const uint8_t*)base + h->scales_offset);
+    wf->data = (const uint8_t*)base + h->data_offset;
+
+#ifndef MAP_POPULATE
+    if (flags & WEIGHT_MAP_POPULATE) {
+        madvise(base, wf->bytes, MADV_WILLNEED);
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (flags & WEIGHT_MAP_HUGEPAGE) {
+        wf->hugepage = madvise(base, wf->bytes, MADV_HUGEPAGE) == 0;
+    }
+#endif
+    return 0;
+}
+
+void weight_file_unmap(weight_file_t *wf) {
+    if (wf->base) {
+        munmap(wf->base, wf->bytes);
+    }
+    memset(wf, 0, sizeof(*wf));
+}
+
+// --write-weights: generates the usual seeded matrix and stores it
+int write_weight_file(const char *path, weight_format_t format, int rows, int cols,
+                      float sparsity) {
+    size_t bytes = (size_t)rows * ternary_format_row_bytes(format, cols);
+    int8_t *matrix_8bit = (int8_t*)malloc((size_t)rows * cols);
+    uint8_t *packed = (uint8_t*)malloc(bytes);
+    if (!matrix_8bit || !packed) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(matrix_8bit);
+        free(packed);
+        return 1;
+    }
+    srand(42);
+    generate_ternary_matrix_8bit(matrix_8bit, rows, cols, sparsity);
+    ternary_pack_matrix(format, matrix_8bit, packed, rows, cols, ternary_online_cpus());
+    int status = weight_file_write(path, format, packed, NULL, rows, cols);
+    if (status == 0) {
+        printf("Wrote %s: %s, %d × %d, %zu KB\n", path, ternary_format_name(format),
+               rows, cols, bytes / 1024);
+    }
+    free(matrix_8bit);
+    free(packed);
+    return status == 0 ? 0 : 1;
+}
+
+static long page_faults(long *major) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    *major = ru.ru_majflt;
+    return ru.ru_minflt;
+}
+
+// --weights: cold-start cost of a mapped file against generate + repack
+int run_weight_file(const char *path, int flags, float sparsity, int iterations) {
+    struct timespec t0, t1;
+    long major0, major1;
+    long minor0 = page_faults(&major0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    weight_file_t wf;
+    if (weight_file_map(&wf, path, flags) != 0) {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double map_ms = elapsed_ms(&t0, &t1);
+    long map_minor = page_faults(&major1) - minor0, map_major = major1 - major0;
+
+    int rows = wf.rows, cols = wf.cols;
+    size_t bytes = (size_t)rows * ternary_format_row_bytes(wf.format, cols);
+    float *input = (float*)ternary_alloc((size_t)cols * sizeof(float));
+    float *output = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    int8_t *matrix_8bit = (int8_t*)ternary_alloc((size_t)rows * cols);
+    uint8_t *packed = (uint8_t*)ternary_alloc(bytes);
+    if (!input || !output || !matrix_8bit || !packed) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(input);
+        ternary_free(output);
+        ternary_free(matrix_8bit);
+        ternary_free(packed);
+        weight_file_unmap(&wf);
+        return 1;
+    }
+    srand(7);
+    generate_input_vector(input, cols);
+
+    // First matvec: every untouched page faults in from the page cache
+    minor0 = page_faults(&major0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ternary_matvec_rows(wf.format, wf.data, input, output, 0, rows, cols);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double first_ms = elapsed_ms(&t0, &t1);
+    long first_minor = page_faults(&major1) - minor0, first_major = major1 - major0;
+
+    benchmark_result_t mapped;
+    benchmark_format(wf.format, wf.data, input, output, rows, cols, iterations, &mapped);
+
+    // What startup costs without the file
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    srand(42);
+    generate_ternary_matrix_8bit(matrix_8bit, rows, cols, sparsity);
+    ternary_pack_matrix(wf.format, matrix_8bit, packed, rows, cols, ternary_online_cpus());
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double repack_ms = elapsed_ms(&t0, &t1);
+
+    printf("Weight File: %s\n", path);
+    printf("  Layout:        %s (%s kernel), %d × %d, %zu KB\n",
+           ternary_format_name(wf.format), ternary_format_kernel_name(wf.format), rows, cols,
+           bytes / 1024);
+    printf("  Populate:      %s\n", flags & WEIGHT_MAP_POPULATE ? "yes" : "no");
+    if (flags & WEIGHT_MAP_HUGEPAGE) {
+        printf("  Huge Pages:    %s\n", wf.hugepage ? "advised (MADV_HUGEPAGE)" :
+                                                      "not supported for this mapping");
+    }
+    printf("\n%-26s | %10s | %12s | %12s\n", "Step", "Time", "Minor Faults", "Major Faults");
+    printf("------------------------------------------------------------------------\n");
+    printf("%-26s | %7.3f ms | %12ld | %12ld\n", "mmap + validate", map_ms,
+           map_minor, map_major);
+    printf("%-26s | %7.3f ms | %12ld | %12ld\n", "First matvec (cold)", first_ms,
+           first_minor, first_major);
+    printf("%-26s | %7.3f ms | %12s | %12s\n", "Steady matvec (mean)",
+           mapped.stats.mean_ms, "-", "-");
+    printf("%-26s | %7.1f ms | %12s | %12s\n", "Generate + pack (no file)",
+           repack_ms, "-", "-");
+    printf("\nCold start from the file: %.2f ms vs %.1f ms to regenerate and repack (%.0fx).\n",
+           map_ms + first_ms, repack_ms, repack_ms / (map_ms + first_ms));
+    if (first_major == 0 && map_major == 0) {
+        printf("No major faults: the file was already in the page cache.\n");
+    }
+
+    ternary_free(input);
+    ternary_free(output);
+    ternary_free(matrix_8bit);
+    ternary_free(packed);
+    weight_file_unmap(&wf);
+    return 0;
+}
+
+// ============================================================================
+// PACK BENCHMARK
+// ============================================================================
+// Conversion throughput in GB/s of int8 weights (the unpacked side), so
+// every layout is measured against the same amount of model. Each row
+// times the reference packer, the fast packer on one thread and on every
+// online CPU, and the fast unpacker. The check column compares the fast
+// output with the reference byte for byte, and the unpacked matrix with
+// the original.
+#define PACK_BENCH_RUNS 3
+
+static void pack_reference(weight_format_t format, const int8_t *matrix_8bit,
+                           uint8_t *packed, int rows, int cols) {
+    switch (format) {
+    case FORMAT_8BIT:
+        memcpy(packed, matrix_8bit, (size_t)rows * cols);
+        break;
+    case FORMAT_2BIT:
+        ternary_pack_2bit(matrix_8bit, packed, rows, cols);
+        break;
+    case FORMAT_BITPLANE:
+        ternary_pack_bitplane(matrix_8bit, (uint64_t*)packed, rows, cols);
+        break;
+    case FORMAT_BASE3:
+        ternary_pack_base3(matrix_8bit, packed, rows, cols);
+        break;
+    }
+}
+
+// Best of PACK_BENCH_RUNS in ms; num_threads 0 runs the reference packer,
+// a non-NULL unpacked times the unpacker instead
+static double time_pack(weight_format_t format, const int8_t *matrix_8bit,
+                        uint8_t *packed, int8_t *unpacked, int rows, int cols,
+                        int num_threads) {
+    double best = 0.0;
+    for (int i = 0; i < PACK_BENCH_RUNS; i++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (unpacked) {
+            ternary_unpack_matrix(format, packed, unpacked, rows, cols, num_threads);
+        } else if (num_threads == 0) {
+            pack_reference(format, matrix_8bit, packed, rows, cols);
+        } else {
+            ternary_pack_matrix(format, matrix_8bit, packed, rows, cols, num_threads);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ms = elapsed_ms(&t0, &t1);
+        if (i == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+void run_pack_bench(const int8_t *matrix_8bit, int rows, int cols) {
+    static const weight_format_t formats[] = { FORMAT_2BIT, FORMAT_BITPLANE, FORMAT_BASE3 };
+    int threads = ternary_online_cpus();
+    double gb = (double)rows * cols / 1e9;
+
+    printf("Conversion throughput, GB/s of int8 weights (%d × %d, %d threads):\n\n",
+           rows, cols, threads);
+    printf("%-16s | %-6s | %9s | %9s | %9s | %7s | %9s | %9s | %s\n",
+           "Format", "Packer", "Reference", "Fast 1T", "Fast NT", "Speedup",
+           "Unpack 1T", "Unpack NT", "Check");
+    printf("---------------------------------------------------------------------------------------------------------\n");
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        weight_format_t format = formats[f];
+        size_t bytes = (size_t)rows * ternary_format_row_bytes(format, cols);
+        uint8_t *reference = (uint8_t*)malloc(bytes);
+        uint8_t *packed = (uint8_t*)malloc(bytes);
+        int8_t *unpacked = (int8_t*)malloc((size_t)rows * cols);
+        if (!reference || !packed || !unpacked) {
+            fprintf(stderr, "Memory allocation failed\n");
+            free(reference);
+            free(packed);
+            free(unpacked);
+            return;
+        }
+
+        double ref_ms = time_pack(format, matrix_8bit, reference, NULL, rows, cols, 0);
+        double fast_ms = time_pack(format, matrix_8bit, packed, NULL, rows, cols, 1);
+        double fast_nt_ms = time_pack(format, matrix_8bit, packed, NULL, rows, cols, threads);
+        double unpack_ms = time_pack(format, matrix_8bit, packed, unpacked, rows, cols, 1);
+        double unpack_nt_ms = time_pack(format, matrix_8bit, packed, unpacked, rows, cols, threads);
+        int ok = memcmp(reference, packed, bytes) == 0 &&
+                 memcmp(unpacked, matrix_8bit, (size_t)rows * cols) == 0;
+
+        printf("%-16s | %-6s | %9.2f | %9.2f | %9.2f | %6.1fx | %9.2f | %9.2f | %s\n",
+               ternary_format_name(format), ternary_format_packer_name(format),
+               gb / (ref_ms / 1e3), gb / (fast_ms / 1e3), gb / (fast_nt_ms / 1e3), ref_ms / fast_nt_ms,
+               gb / (unpack_ms / 1e3), gb / (unpack_nt_ms / 1e3), ok ? "ok" : "MISMATCH");
+
+        free(reference);
+        free(packed);
+        free(unpacked);
+    }
+}
+
+// ============================================================================
+// ALLOCATOR SWEEP
+// ============================================================================
+// Rebuilds the weight set under every --alloc policy and times the 8-bit
+// and 2-bit kernels on each, with dTLB load misses per matvec and the share
+// of both matrices actually backed by huge pages. What the huge-page rows
+// win over "aligned" is the TLB share of the bandwidth story; the
+// 64-byte rows against "malloc" show what split cache lines cost.
+static void format_per_iteration(char *buf, size_t size, long long value, int iterations) {
+    if (value < 0 || iterations < 1) {
+        snprintf(buf, size, "n/a");
+    } else {
+        snprintf(buf, size, "%.0f", (double)value / iterations);
+    }
+}
+
+void run_alloc_sweep(int rows, int cols, float sparsity, int iterations) {
+    alloc_policy_t saved = ternary_alloc_policy;
+    double bytes_8bit = (double)rows * ternary_format_row_bytes(FORMAT_8BIT, cols);
+    double bytes_2bit = (double)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+    double ms_8bit[ALLOC_POLICY_COUNT] = { 0 }, ms_2bit[ALLOC_POLICY_COUNT] = { 0 };
+
+    printf("Allocator Sweep (%d × %d, THP mode: %s)\n\n", rows, cols, ternary_thp_mode());
+    printf("%-8s | %9s | %7s | %10s | %9s | %7s | %10s | %10s\n",
+           "Policy", "8-bit ms", "GB/s", "dTLB/iter", "2-bit ms", "GB/s",
+           "dTLB/iter", "Huge pages");
+    printf("-------------------------------------------------------------------------------------------\n");
+
+    for (int p = 0; p < ALLOC_POLICY_COUNT; p++) {
+        weight_set_t ws;
+        int fallbacks = ternary_alloc_hugetlb_fallbacks;
+        ternary_alloc_policy = (alloc_policy_t)p;
+        if (weight_set_alloc(&ws, rows, cols, sparsity) != 0) {
+            printf("%-8s | allocation failed\n", ternary_alloc_policy_names[p]);
+            continue;
+        }
+        for (int i = 0; i < 3; i++) {
+            ternary_matvec_8bit_impl(ws.matrix_8bit, ws.input, ws.output, rows, cols);
+            ternary_matvec_2bit_impl(ws.matrix_2bit, ws.input, ws.output, rows, cols);
+        }
+        benchmark_result_t r8, r2;
+        benchmark_8bit(ws.matrix_8bit, ws.input, ws.output, rows, cols, iterations, &r8);
+        benchmark_2bit(ws.matrix_2bit, ws.input, ws.output, rows, cols, iterations, &r2);
+        ms_8bit[p] = r8.stats.mean_ms;
+        ms_2bit[p] = r2.stats.mean_ms;
+
+        long huge_8bit = ternary_huge_page_bytes(ws.matrix_8bit, (size_t)bytes_8bit);
+        long huge_2bit = ternary_huge_page_bytes(ws.matrix_2bit, (size_t)bytes_2bit);
+        char tlb_8bit[32], tlb_2bit[32], huge[32];
+        format_per_iteration(tlb_8bit, sizeof(tlb_8bit), r8.dtlb_misses, r8.iterations);
+        format_per_iteration(tlb_2bit, sizeof(tlb_2bit), r2.dtlb_misses, r2.iterations);
+        if (huge_8bit < 0 || huge_2bit < 0) {
+            snprintf(huge, sizeof(huge), "n/a");
+        } else {
+            snprintf(huge, sizeof(huge), "%.0f%%",
+                     100.0 * (huge_8bit + huge_2bit) / (bytes_8bit + bytes_2bit));
+        }
+        printf("%-8s | %9.3f | %7.2f | %10s | %9.3f | %7.2f | %10s | %10s%s\n",
+               ternary_alloc_policy_names[p], ms_8bit[p], bytes_8bit / (ms_8bit[p] * 1e6),
+               tlb_8bit, ms_2bit[p], bytes_2bit / (ms_2bit[p] * 1e6), tlb_2bit, huge,
+               ternary_alloc_hugetlb_fallbacks != fallbacks ? " (thp fallback)" : "");
+        weight_set_free(&ws);
+    }
+    ternary_alloc_policy = saved;
+
+    if (ms_8bit[ALLOC_ALIGNED] > 0.0 && ms_8bit[ALLOC_THP] > 0.0) {
+        printf("\nthp vs aligned: 8-bit %.2fx, 2-bit %.2fx",
+               ms_8bit[ALLOC_ALIGNED] / ms_8bit[ALLOC_THP],
+               ms_2bit[ALLOC_ALIGNED] / ms_2bit[ALLOC_THP]);
+        if (ms_8bit[ALLOC_MALLOC] > 0.0) {
+            printf("; aligned vs malloc: 8-bit %.2fx, 2-bit %.2fx",
+                   ms_8bit[ALLOC_MALLOC] / ms_8bit[ALLOC_ALIGNED],
+                   ms_2bit[ALLOC_MALLOC] / ms_2bit[ALLOC_ALIGNED]);
+        }
+        printf("\n");
+    }
+    printf("Huge pages is the share of both matrices on 2 MB pages (AnonHugePages\n");
+    printf("or hugetlb in /proc/self/smaps); hugetlb needs vm.nr_hugepages reserved.\n");
+}
+
+// ============================================================================
+// ROOFLINE CALIBRATION
+// ============================================================================
+// STREAM-style limits of this host, measured once per run: peak read
+// bandwidth over a buffer well beyond the LLC, and peak float-add throughput
+// from independent in-register vector chains, each on one core and on every
+// online CPU. A kernel's bytes moved (weights + input + output) and adds per
+// matvec then place it on the roofline:
+//   roof time = max(bytes / read bandwidth, adds / add peak)
+// A kernel running near its roof is bandwidth- (or add-) bound; one far
+// below it while in the bandwidth regime is limited by its decode work.
+// The add chains use the widest vectors the build targets (-march), which
+// is what the dispatched kernels run on with the default Makefile.
+#define ROOFLINE_MIN_BYTES ((size_t)64 << 20)
+#define ROOFLINE_MAX_BYTES ((size_t)1024 << 20)
+#define ROOFLINE_PASSES 5
+#define ROOFLINE_ADD_MS 20.0
+#define ROOFLINE_BOUND_FRACTION 0.7   // of the roof, to call a kernel bound
+
+#if defined(__AVX512F__)
+#define ROOFLINE_VEC_BYTES 64
+#elif defined(__AVX__)
+#define ROOFLINE_VEC_BYTES 32
+#else
+#define ROOFLINE_VEC_BYTES 16
+#endif
+#define ROOFLINE_ADD_CHAINS 8         // covers 4-cycle latency on 2 ports
+#define ROOFLINE_ADDS_PER_REP (ROOFLINE_ADD_CHAINS * ROOFLINE_VEC_BYTES / 4)
+
+typedef float roofline_vec_t __attribute__((vector_size(ROOFLINE_VEC_BYTES)));
+
+typedef struct {
+    int valid;
+    int threads;            // CPUs used for the "all" figures
+    size_t buffer_bytes;
+    double read_gbps;       // one core
+    double read_gbps_all;
+    double add_gops;        // 1e9 float adds / s, one core
+    double add_gops_all;
+} roofline_t;
+
+typedef enum { ROOF_TOUCH, ROOF_READ, ROOF_ADD } roofline_mode_t;
+
+// Written after every pass so the reads and adds stay live
+static volatile double roofline_checksum;
+
+typedef struct roofline_job roofline_job_t;
+
+typedef struct {
+    roofline_job_t *job;
+    pthread_t thread;
+    int index;
+    double checksum;        // keeps the passes from being optimised away
+} roofline_thread_t;
+
+struct roofline_job {
+    roofline_mode_t mode;
+    uint64_t *buffer;
+    size_t words;
+    long add_reps;
+    int num_threads;
+    thread_barrier_t barrier;
+    struct timespec start;
+    struct timespec end;
+};
+
+static uint64_t roofline_read(const uint64_t *p, size_t n) {
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += p[i];
+        s1 += p[i + 1];
+        s2 += p[i + 2];
+        s3 += p[i + 3];
+    }
+    for (; i < n; i++) {
+        s0 += p[i];
+    }
+    return s0 + s1 + s2 + s3;
+}
+
+// ROOFLINE_ADDS_PER_REP float adds per rep. The seeds are volatile so the
+// compiler cannot merge the chains or fold the repeated additions
+static volatile float roofline_seed[ROOFLINE_ADD_CHAINS + 1] = {
+    0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 1e-7f
+};
+
+static float roofline_add(long reps) {
+    roofline_vec_t zero = { 0 };
+    roofline_vec_t step = zero + roofline_seed[ROOFLINE_ADD_CHAINS];
+    roofline_vec_t a0 = zero + roofline_seed[0], a1 = zero + roofline_seed[1],
+                   a2 = zero + roofline_seed[2], a3 = zero + roofline_seed[3],
+                   a4 = zero + roofline_seed[4], a5 = zero + roofline_seed[5],
+                   a6 = zero + roofline_seed[6], a7 = zero + roofline_seed[7];
+    for (long r = 0; r < reps; r++) {
+        a0 += step;
+        a1 += step;
+        a2 += step;
+        a3 += step;
+        a4 += step;
+        a5 += step;
+        a6 += step;
+        a7 += step;
+    }
+    roofline_vec_t sum = ((a0 + a1) + (a2 + a3)) + ((a4 + a5) + (a6 + a7));
+    float total = 0.0f;
+    for (int i = 0; i < ROOFLINE_VEC_BYTES / 4; i++) {
+        total += sum[i];
+    }
+    return total;
+}
+
+static void *roofline_worker(void *arg) {
+    roofline_thread_t *self = (roofline_thread_t*)arg;
+    roofline_job_t *job = self->job;
+    size_t begin = job->words * self->index / job->num_threads;
+    size_t end = job->words * (self->index + 1) / job->num_threads;
+
+    ternary_pin_current_thread(self->index % ternary_online_cpus());
+    barrier_wait(&job->barrier);
+    if (self->index == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+    }
+
+    switch (job->mode) {
+    case ROOF_TOUCH:
+        // First touch from the thread that will read the slice
+        memset(job->buffer + begin, 1, (end - begin) * sizeof(uint64_t));
+        break;
+    case ROOF_READ:
+        self->checksum = (double)roofline_read(job->buffer + begin, end - begin);
+        break;
+    case ROOF_ADD:
+        self->checksum = roofline_add(job->add_reps);
+        break;
+    }
+
+    barrier_wait(&job->barrier);
+    if (self->index == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+    }
+    return NULL;
+}
+
+// One pass on num_threads pinned threads; returns the wall time in ms
+static double roofline_pass(roofline_job_t *job, roofline_mode_t mode, int num_threads) {
+    roofline_thread_t *threads = (roofline_thread_t*)calloc(num_threads,
+                                                            sizeof(roofline_thread_t));
+    if (!threads) {
+        return -1.0;
+    }
+    job->mode = mode;
+    job->num_threads = num_threads;
+    barrier_init(&job->barrier, num_threads);
+
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].job = job;
+        threads[t].index = t;
+        threads[t].checksum = 0.0;
+        if (pthread_create(&threads[t].thread, NULL, roofline_worker, &threads[t]) != 0) {
+            // The barrier can never complete; this is unrecoverable
+            fprintf(stderr, "Failed to start thread %d of %d\n", t, num_threads);
+            exit(1);
+        }
+    }
+    double checksum = 0.0;
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+        checksum += threads[t].checksum;
+    }
+    barrier_destroy(&job->barrier);
+    free(threads);
+
+    roofline_checksum = checksum;
+    return elapsed_ms(&job->start, &job->end);
+}
+
+// Best pass of ROOFLINE_PASSES, in ms
+static double roofline_best(roofline_job_t *job, roofline_mode_t mode, int num_threads) {
+    double best = 0.0;
+    for (int i = 0; i < ROOFLINE_PASSES; i++) {
+        double ms = roofline_pass(job, mode, num_threads);
+        if (ms < 0.0) {
+            return -1.0;
+        }
+        if (i == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Returns 0 on success; on failure roof->valid is 0
+int measure_roofline(roofline_t *roof) {
+    roofline_job_t job;
+    memset(roof, 0, sizeof(*roof));
+    memset(&job, 0, sizeof(job));
+    roof->threads = ternary_online_cpus();
+
+    // Twice the LLC so no pass is served from cache
+    size_t bytes = (size_t)cache_size_bytes(3) * 2;
+    bytes = bytes < ROOFLINE_MIN_BYTES ? ROOFLINE_MIN_BYTES :
+            bytes > ROOFLINE_MAX_BYTES ? ROOFLINE_MAX_BYTES : bytes;
+    void *buffer = MAP_FAILED;
+    for (; bytes >= ROOFLINE_MIN_BYTES; bytes /= 2) {
+        buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer != MAP_FAILED) {
+            break;
+        }
+    }
+    if (buffer == MAP_FAILED) {
+        return -1;
+    }
+    job.buffer = (uint64_t*)buffer;
+    job.words = bytes / sizeof(uint64_t);
+    roof->buffer_bytes = bytes;
+
+    double read_ms = -1.0, read_all_ms = -1.0;
+    if (roofline_pass(&job, ROOF_TOUCH, roof->threads) >= 0.0) {
+        read_ms = roofline_best(&job, ROOF_READ, 1);
+        read_all_ms = roofline_best(&job, ROOF_READ, roof->threads);
+    }
+    munmap(buffer, bytes);
+
+    // Grow the add pass until one run takes ROOFLINE_ADD_MS
+    double add_ms;
+    job.add_reps = 1L << 16;
+    while ((add_ms = roofline_pass(&job, ROOF_ADD, 1)) >= 0.0 &&
+           add_ms < ROOFLINE_ADD_MS && job.add_reps < 1L << 40) {
+        job.add_reps *= 2;
+    }
+    double adds = (double)job.add_reps * ROOFLINE_ADDS_PER_REP;
+    double add_1_ms = roofline_best(&job, ROOF_ADD, 1);
+    double add_all_ms = roofline_best(&job, ROOF_ADD, roof->threads);
+    if (read_ms <= 0.0 || read_all_ms <= 0.0 || add_1_ms <= 0.0 || add_all_ms <= 0.0) {
+        return -1;
+    }
+
+    roof->read_gbps = bytes / (read_ms * 1e6);
+    roof->read_gbps_all = bytes / (read_all_ms * 1e6);
+    roof->add_gops = adds / (add_1_ms * 1e6);
+    roof->add_gops_all = adds * roof->threads / (add_all_ms * 1e6);
+    roof->valid = 1;
+    return 0;
+}
+
+void print_roofline(const roofline_t *roof) {
+    printf("Roofline Calibration:\n");
+    if (!roof->valid) {
+        printf("  Unavailable (no %zu MB buffer or threads)\n\n",
+               ROOFLINE_MIN_BYTES >> 20);
+        return;
+    }
+    printf("  Read Bandwidth: %.2f GB/s (1 core), %.2f GB/s (%d CPUs), %zu MB buffer\n",
+           roof->read_gbps, roof->read_gbps_all, roof->threads, roof->buffer_bytes >> 20);
+    printf("  Float Add Peak: %.2f Gadd/s (1 core), %.2f Gadd/s (%d CPUs), %d-bit vectors\n",
+           roof->add_gops, roof->add_gops_all, roof->threads, ROOFLINE_VEC_BYTES * 8);
+    printf("  Ridge Point:    %.2f adds/byte (1 core)\n\n",
+           roof->add_gops / roof->read_gbps);
+}
+
+// Bytes one matvec moves: the weights plus the float input and output
+static double roofline_bytes(size_t weight_bytes, int rows, int cols) {
+    return (double)weight_bytes + (double)cols * sizeof(float) +
+           (double)rows * sizeof(float);
+}
+
+// Fraction of the single-core roof one matvec reaches, and its regime
+static double roofline_fraction(const roofline_t *roof, double bytes, double adds,
+                                double ms, const char **regime) {
+    double memory_ms = bytes / (roof->read_gbps * 1e6);
+    double add_ms = adds / (roof->add_gops * 1e6);
+    *regime = memory_ms >= add_ms ? "bandwidth" : "add";
+    return (memory_ms >= add_ms ? memory_ms : add_ms) / ms;
+}
+
+static const char *roofline_bound(double fraction, const char *regime) {
+    return fraction >= ROOFLINE_BOUND_FRACTION ? regime : "decode";
+}
+
+// One row per format: achieved fraction of read bandwidth, add peak and roof
+void print_roofline_table(const weight_format_t *formats,
+                          const benchmark_result_t *results, int count,
+                          int rows, int cols, const roofline_t *roof) {
+    double adds = (double)rows * cols;
+    long llc = cache_size_bytes(3);
+    int cached = 0;
+
+    printf("%-16s | %11s | %8s | %7s | %8s | %7s | %7s | %s\n",
+           "Format", "Bytes Moved", "GB/s", "% Read", "Gadd/s", "% Add", "% Roof",
+           "Bound");
+    printf("------------------------------------------------------------------------------------------\n");
+    for (int i = 0; i < count; i++) {
+        double ms = results[i].stats.mean_ms;
+        double bytes = roofline_bytes(results[i].memory_bytes, rows, cols);
+        double gbps = bytes / (ms * 1e6);
+        double gops = adds / (ms * 1e6);
+        const char *regime;
+        double fraction = roofline_fraction(roof, bytes, adds, ms, &regime);
+        int fits = llc > 0 && results[i].memory_bytes <= (size_t)llc;
+        cached |= fits;
+        printf("%-16s | %8.1f MB | %8.2f | %6.1f%% | %8.2f | %6.1f%% | %6.1f%% | %s%s\n",
+               ternary_format_name(formats[i]), bytes / (1 << 20), gbps,
+               100.0 * gbps / roof->read_gbps, gops, 100.0 * gops / roof->add_gops,
+               100.0 * fraction, roofline_bound(fraction, regime), fits ? " *" : "");
+    }
+    if (cached) {
+        printf("\n* Weights fit in the LLC, so they can be read faster than the DRAM\n");
+        printf("  roof and fractions above 100%% are possible.\n");
+    }
+}
+
+// ============================================================================
+// RESULT FILES (JSON / CSV) AND COMPARE MODE
+// ============================================================================
+// --json and --csv record every metric of the default comparison together
+// with the config, host, build flags and kernel variants, so runs can be
+// tracked across hosts and builds without parsing the text report.
+// In the JSON, each result object is written on one line; --compare reads
+// those lines back and flags throughput regressions beyond a threshold.
+#ifndef BUILD_FLAGS
+#define BUILD_FLAGS "unknown"
+#endif
+
+#define RESULT_SCHEMA_VERSION 1
+
+typedef struct {
+    FILE *json;
+    FILE *csv;
+    int json_results;       // result objects written so far
+    float sparsity;
+    const roofline_t *roof; // NULL when the calibration did not run
+    char cpu_model[128];
+} result_sink_t;
+
+static void read_cpu_model(char *buf, size_t size) {
+    snprintf(buf, size, "unknown");
+#if defined(__APPLE__)
+    size_t len = size;
+    if (sysctlbyname("machdep.cpu.brand_string", buf, &len, NULL, 0) == 0) {
+        return;
+    }
+#elif defined(__linux__)
+    // x86 reports "model name"; AArch64 only implementer / part numbers
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    char line[256];
+    unsigned implementer = 0, part = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        if (!colon) {
+            continue;
+        }
+        char *value = colon + 1 + strspn(colon + 1, " \t");
+        value[strcspn(value, "\n")] = '\0';
+        if (strncmp(line, "model name", 10) == 0) {
+            snprintf(buf, size, "%s", value);
+            fclose(f);
+            return;
+        }
+        if (strncmp(line, "CPU implementer", 15) == 0 && !implementer) {
+            implementer = (unsigned)strtoul(value, NULL, 0);
+        } else if (strncmp(line, "CPU part", 8) == 0 && !part) {
+            part = (unsigned)strtoul(value, NULL, 0);
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (implementer) {
+        snprintf(buf, size, "implementer 0x%02x part 0x%03x", implementer, part);
+        return;
+    }
+#endif
+    struct utsname u;
+    if (uname(&u) == 0) {
+        snprintf(buf, size, "%s", u.machine);
+    }
+}
+
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Counters that were not measured are null / empty
+static void json_counter(FILE *f, const char *key, long long value) {
+    if (value < 0) {
+        fprintf(f, ", \"%s\": null", key);
+    } else {
+        fprintf(f, ", \"%s\": %lld", key, value);
+    }
+}
+
+static void csv_counter(FILE *f, long long value) {
+    if (value >= 0) {
+        fprintf(f, "%lld", value);
+    }
+    fputc(',', f);
+}
+
+static const char *const csv_columns =
+    "shape,rows,cols,format,kernel,bytes,iterations,mean_ms,min_ms,median_ms,"
+    "p90_ms,p99_ms,stddev_ms,ci95_ms,gb_per_s,ns_per_weight,cycles,instructions,"
+    "cache_refs,cache_misses,l1d_misses,llc_misses,dtlb_misses,stalled_frontend,"
+    "stalled_backend,node_reads,dram_read_bytes,bytes_moved,read_bw_fraction,"
+    "roof_fraction,sparsity,cpu_model,build_flags\n";
+
+// Opens the requested files and writes the run-level header; returns 0 on
+// success
+static int result_sink_open(result_sink_t *sink, const char *json_path,
+                            const char *csv_path, float sparsity, int iterations,
+                            double target_ci, int pin_cpu, const roofline_t *roof) {
+    memset(sink, 0, sizeof(*sink));
+    sink->sparsity = sparsity;
+    sink->roof = roof && roof->valid ? roof : NULL;
+    read_cpu_model(sink->cpu_model, sizeof(sink->cpu_model));
+
+    if (csv_path) {
+        if (!(sink->csv = fopen(csv_path, "w"))) {
+            fprintf(stderr, "Cannot open %s for writing\n", csv_path);
+            return -1;
+        }
+        fputs(csv_columns, sink->csv);
+    }
+    if (!json_path) {
+        return 0;
+    }
+    if (!(sink->json = fopen(json_path, "w"))) {
+        fprintf(stderr, "Cannot open %s for writing\n", json_path);
+        return -1;
+    }
+
+    char stamp[32] = "";
+    time_t now = time(NULL);
+    struct tm tm_utc;
+    if (gmtime_r(&now, &tm_utc)) {
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm_utc);
+    }
+    struct utsname u;
+    if (uname(&u) != 0) {
+        memset(&u, 0, sizeof(u));
+    }
+
+    FILE *f = sink->json;
+    fprintf(f, "{\n  \"schema\": %d,\n  \"timestamp\": \"%s\",\n",
+            RESULT_SCHEMA_VERSION, stamp);
+    fprintf(f, "  \"system\": { \"cpu_model\": ");
+    json_string(f, sink->cpu_model);
+    fprintf(f, ", \"os\": ");
+    json_string(f, u.sysname);
+    fprintf(f, ", \"os_release\": ");
+    json_string(f, u.release);
+    fprintf(f, ", \"arch\": ");
+    json_string(f, u.machine);
+    fprintf(f, ", \"online_cpus\": %d, \"l1d_bytes\": %ld, \"l2_bytes\": %ld, "
+               "\"llc_bytes\": %ld },\n", ternary_online_cpus(), cache_size_bytes(1),
+            cache_size_bytes(2), cache_size_bytes(3));
+    fprintf(f, "  \"build\": { \"compiler\": ");
+    json_string(f, __VERSION__);
+    fprintf(f, ", \"flags\": ");
+    json_string(f, BUILD_FLAGS);
+#ifdef USE_PERF
+    fprintf(f, ", \"perf_counters\": true },\n");
+#else
+    fprintf(f, ", \"perf_counters\": false },\n");
+#endif
+    fprintf(f, "  \"config\": { \"sparsity\": %.4f, \"iterations\": %d, "
+               "\"target_ci\": %.4f, \"pin_cpu\": %d },\n",
+            sparsity, iterations, target_ci, pin_cpu);
+    if (sink->roof) {
+        fprintf(f, "  \"roofline\": { \"read_gb_per_s\": %.4f, \"read_gb_per_s_all\": %.4f, "
+                   "\"add_g_per_s\": %.4f, \"add_g_per_s_all\": %.4f, \"threads\": %d, "
+                   "\"buffer_bytes\": %zu, \"vector_bits\": %d },\n",
+                roof->read_gbps, roof->read_gbps_all, roof->add_gops, roof->add_gops_all,
+                roof->threads, roof->buffer_bytes, ROOFLINE_VEC_BYTES * 8);
+    } else {
+        fprintf(f, "  \"roofline\": null,\n");
+    }
+    fprintf(f, "  \"kernels\": { \"8bit\": \"%s\", \"2bit\": \"%s\", "
+               "\"bitplane\": \"%s\", \"base3\": \"%s\", \"2bit_tiled\": \"%s\", "
+               "\"2bit_hinted\": \"%s\", \"2bit_fused\": \"%s\", \"2bit_multi\": \"%s\", "
+               "\"2bit_q8\": \"%s\", \"matmul_8bit\": \"%s\", \"matmul_2bit\": \"%s\" },\n",
+            ternary_matvec_8bit_impl_name, ternary_matvec_2bit_impl_name,
+            ternary_matvec_bitplane_impl_name, ternary_matvec_base3_impl_name,
+            ternary_matvec_2bit_tiled_impl_name,
+            ternary_matvec_2bit_hinted_impl_name, ternary_matvec_2bit_fused_impl_name,
+            ternary_matvec_2bit_multi_impl_name, ternary_matvec_2bit_q8_impl_name,
+            ternary_matmul_8bit_impl_name, ternary_matmul_2bit_impl_name);
+    fprintf(f, "  \"results\": [\n");
+    return 0;
+}
+
+// One result line; format and kernel are the layout and the kernel that ran
+static void result_sink_add(result_sink_t *sink, int rows, int cols, const char *format,
+                            const char *kernel, const benchmark_result_t *r) {
+    const timing_stats_t *t = &r->stats;
+    double gbps = r->memory_bytes / (t->mean_ms * 1e6);
+    double ns_per_weight = t->mean_ms * 1e6 / ((double)rows * cols);
+    double bytes_moved = roofline_bytes(r->memory_bytes, rows, cols);
+    double read_fraction = -1.0, roof_fraction = -1.0;
+    if (sink->roof) {
+        const char *regime;
+        read_fraction = bytes_moved / (t->mean_ms * 1e6) / sink->roof->read_gbps;
+        roof_fraction = roofline_fraction(sink->roof, bytes_moved, (double)rows * cols,
+                                          t->mean_ms, &regime);
+    }
+
+    if (sink->json) {
+        FILE *f = sink->json;
+        fprintf(f, "%s    { \"shape\": \"%dx%d\", \"rows\": %d, \"cols\": %d, \"format\": ",
+                sink->json_results++ ? ",\n" : "", rows, cols, rows, cols);
+        json_string(f, format);
+        fprintf(f, ", \"kernel\": ");
+        json_string(f, kernel);
+        fprintf(f, ", \"bytes\": %zu, \"iterations\": %d, \"mean_ms\": %.6f, "
+                   "\"min_ms\": %.6f, \"median_ms\": %.6f, \"p90_ms\": %.6f, "
+                   "\"p99_ms\": %.6f, \"stddev_ms\": %.6f, \"ci95_ms\": %.6f, "
+                   "\"gb_per_s\": %.4f, \"ns_per_weight\": %.5f",
+                r->memory_bytes, r->iterations, t->mean_ms, t->min_ms,
+                t->median_ms, t->p90_ms, t->p99_ms, t->stddev_ms, t->ci95_ms,
+                gbps, ns_per_weight);
+        json_counter(f, "cycles", r->cycles);
+        json_counter(f, "instructions", r->instructions);
+        json_counter(f, "cache_refs", r->cache_refs);
+        json_counter(f, "cache_misses", r->cache_misses);
+        json_counter(f, "l1d_misses", r->l1d_misses);
+        json_counter(f, "llc_misses", r->llc_misses);
+        json_counter(f, "dtlb_misses", r->dtlb_misses);
+        json_counter(f, "stalled_frontend", r->stalled_frontend);
+        json_counter(f, "stalled_backend", r->stalled_backend);
+        json_counter(f, "node_reads", r->node_reads);
+        json_counter(f, "dram_read_bytes", r->dram_read_bytes);
+        fprintf(f, ", \"bytes_moved\": %.0f", bytes_moved);
+        if (sink->roof) {
+            fprintf(f, ", \"read_bw_fraction\": %.4f, \"roof_fraction\": %.4f }",
+                    read_fraction, roof_fraction);
+        } else {
+            fprintf(f, ", \"read_bw_fraction\": null, \"roof_fraction\": null }");
+        }
+    }
+
+    if (sink->csv) {
+        FILE *f = sink->csv;
+        fprintf(f, "%dx%d,%d,%d,%s,%s,%zu,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,"
+                   "%.4f,%.5f,",
+                rows, cols, rows, cols, format, kernel, r->memory_bytes, r->iterations, t->mean_ms, t->min_ms, t->median_ms,
+                t->p90_ms, t->p99_ms, t->stddev_ms, t->ci95_ms, gbps, ns_per_weight);
+        csv_counter(f, r->cycles);
+        csv_counter(f, r->instructions);
+        csv_counter(f, r->cache_refs);
+        csv_counter(f, r->cache_misses);
+        csv_counter(f, r->l1d_misses);
+        csv_counter(f, r->llc_misses);
+        csv_counter(f, r->dtlb_misses);
+        csv_counter(f, r->stalled_frontend);
+        csv_counter(f, r->stalled_backend);
+        csv_counter(f, r->node_reads);
+        csv_counter(f, r->dram_read_bytes);
+        fprintf(f, "%.0f,", bytes_moved);
+        if (sink->roof) {
+            fprintf(f, "%.4f,%.4f,", read_fraction, roof_fraction);
+        } else {
+            fputs(",,", f);
+        }
+        // Quote the free-text columns; double any embedded quotes
+        fprintf(f, "%.4f,\"", sink->sparsity);
+        for (const char *c = sink->cpu_model; *c; c++) {
+            if (*c == '"') fputc('"', f);
+            fputc(*c, f);
+        }
+        fprintf(f, "\",\"%s\"\n", BUILD_FLAGS);
+    }
+}
+
+static void result_sink_close(result_sink_t *sink) {
+    if (sink->json) {
+        fprintf(sink->json, "\n  ]\n}\n");
+        fclose(sink->json);
+    }
+    if (sink->csv) {
+        fclose(sink->csv);
+    }
+}
+
+#define COMPARE_MAX_RESULTS 512
+#define DEFAULT_COMPARE_THRESHOLD 5.0
+
+typedef struct {
+    char shape[32];
+    char format[32];
+    char kernel[32];
+    double gb_per_s;
+    double p99_ms;
+} compare_entry_t;
+
+// Value of "key": in one JSON line, or NULL
+static const char *json_field(const char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    if (!p) {
+        return NULL;
+    }
+    p += strlen(pattern);
+    return p + strspn(p, " \t");
+}
+
+static int json_field_string(const char *line, const char *key, char *out, size_t size) {
+    const char *p = json_field(line, key);
+    if (!p || *p != '"') {
+        return -1;
+    }
+    size_t n = 0;
+    for (p++; *p && *p != '"' && n + 1 < size; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static int json_field_number(const char *line, const char *key, double *out) {
+    const char *p = json_field(line, key);
+    char *end;
+    if (!p) {
+        return -1;
+    }
+    *out = strtod(p, &end);
+    return end == p ? -1 : 0;
+}
+
+// Loads the result lines of a --json file; returns the count or -1
+static int load_result_file(const char *path, compare_entry_t *entries, int max,
+                            char *cpu_model, size_t cpu_size) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    snprintf(cpu_model, cpu_size, "unknown");
+
+    char line[4096];
+    int count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (json_field(line, "cpu_model")) {
+            json_field_string(line, "cpu_model", cpu_model, cpu_size);
+        }
+        compare_entry_t *e = &entries[count];
+        if (count < max &&
+            json_field_string(line, "shape", e->shape, sizeof(e->shape)) == 0 &&
+            json_field_string(line, "format", e->format, sizeof(e->format)) == 0 &&
+            json_field_number(line, "gb_per_s", &e->gb_per_s) == 0) {
+            if (json_field_string(line, "kernel", e->kernel, sizeof(e->kernel)) != 0) {
+                snprintf(e->kernel, sizeof(e->kernel), "?");
+            }
+            if (json_field_number(line, "p99_ms", &e->p99_ms) != 0) {
+                e->p99_ms = 0.0;
+            }
+            count++;
+        }
+    }
+    fclose(f);
+    if (count == 0) {
+        fprintf(stderr, "%s has no results (expected a --json file)\n", path);
+        return -1;
+    }
+    return count;
+}
+
+// Returns 0 when nothing regressed, 1 on a regression, 2 on a bad file
+int run_compare(const char *baseline_path, const char *candidate_path,
+                double threshold_pct) {
+    static compare_entry_t baseline[COMPARE_MAX_RESULTS], candidate[COMPARE_MAX_RESULTS];
+    char baseline_cpu[128], candidate_cpu[128];
+    int nb = load_result_file(baseline_path, baseline, COMPARE_MAX_RESULTS,
+                              baseline_cpu, sizeof(baseline_cpu));
+    int nc = load_result_file(candidate_path, candidate, COMPARE_MAX_RESULTS,
+                              candidate_cpu, sizeof(candidate_cpu));
+    if (nb < 0 || nc < 0) {
+        return 2;
+    }
+
+    printf("Compare (threshold %.1f%%)\n", threshold_pct);
+    printf("  Baseline:  %s (%s)\n", baseline_path, baseline_cpu);
+    printf("  Candidate: %s (%s)\n\n", candidate_path, candidate_cpu);
+    printf("%-12s | %-16s | %-17s | %9s | %9s | %8s | %8s | %s\n",
+           "Shape", "Format", "Kernel", "Base GB/s", "New GB/s", "GB/s", "p99", "Status");
+    printf("------------------------------------------------------------------------------------------------------------\n");
+
+    int regressions = 0;
+    for (int i = 0; i < nb; i++) {
+        const compare_entry_t *b = &baseline[i], *c = NULL;
+        for (int j = 0; j < nc && !c; j++) {
+            if (strcmp(candidate[j].shape, b->shape) == 0 &&
+                strcmp(candidate[j].format, b->format) == 0) {
+                c = &candidate[j];
+            }
+        }
+        if (!c) {
+            printf("%-12s | %-16s | %-17s | %9.2f | %9s | %8s | %8s | missing\n",
+                   b->shape, b->format, b->kernel, b->gb_per_s, "-", "-", "-");
+            continue;
+        }
+
+        char kernel[40];
+        if (strcmp(b->kernel, c->kernel) == 0) {
+            snprintf(kernel, sizeof(kernel), "%s", b->kernel);
+        } else {
+            snprintf(kernel, sizeof(kernel), "%s>%s", b->kernel, c->kernel);
+        }
+        double change = b->gb_per_s > 0.0 ? 100.0 * (c->gb_per_s / b->gb_per_s - 1.0) : 0.0;
+        double p99_change = b->p99_ms > 0.0 ? 100.0 * (c->p99_ms / b->p99_ms - 1.0) : 0.0;
+        const char *status = "ok";
+        if (change < -threshold_pct) {
+            status = "REGRESSION";
+            regressions++;
+        } else if (change > threshold_pct) {
+            status = "faster";
+        }
+        printf("%-12s | %-16s | %-17s | %9.2f | %9.2f | %+7.1f%% | %+7.1f%% | %s\n",
+               b->shape, b->format, kernel, b->gb_per_s, c->gb_per_s,
+               change, p99_change, status);
+    }
+
+    printf("\n%d regression%s beyond %.1f%% throughput loss.\n",
+           regressions, regressions == 1 ? "" : "s", threshold_pct);
+    return regressions > 0 ? 1 : 0;
+}
+
+// ============================================================================
+// AUTOTUNE AND PLAN CACHE
+// ============================================================================
+// --autotune times every available registry kernel on a shape, checks its
+// output against the scalar 2-bit kernel, and records the fastest one in a
+// plan file. Each line of the file is one JSON object keyed by CPU model,
+// shape and sparsity; lines for other CPUs are kept when it is rewritten,
+// so one file can travel between machines. --sparse adds a line per CPU
+// and shape with its measured sparse break-even; a sparsity without an
+// autotuned entry then runs sparse or dense 2-bit by ternary_prefer_sparse().
+#define PLAN_MAX_ENTRIES 256
+#define AUTOTUNE_ROUNDS 5
+#define AUTOTUNE_BUDGET_MS 1000.0   // per kernel; slow kernels run fewer calls
+
+typedef struct {
+    char cpu[128];
+    int rows;
+    int cols;
+    double sparsity;
+    char kernel[32];
+    double ms;                  // autotuned time per call
+} plan_entry_t;
+
+typedef struct {
+    char cpu[128];
+    int rows;
+    int cols;
+    double break_even;          // from run_sparse_sweep(), -1: dense always wins
+} plan_break_even_t;
+
+static plan_entry_t plan_entries[PLAN_MAX_ENTRIES];
+static int plan_count = 0;
+static plan_break_even_t plan_break_evens[PLAN_MAX_ENTRIES];
+static int plan_break_even_count = 0;
+static char plan_cpu[128] = "unknown";
+
+static int plan_matches(const plan_entry_t *e, int rows, int cols, double sparsity) {
+    double diff = e->sparsity - sparsity;
+    return e->rows == rows && e->cols == cols && diff < 0.005 && diff > -0.005 &&
+           strcmp(e->cpu, plan_cpu) == 0;
+}
+
+// Loads a plan file; returns the entries for this CPU, or -1 if it cannot
+// be read. Lines that do not parse are skipped.
+static int plan_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[1024];
+    int mine = 0;
+    plan_count = 0;
+    plan_break_even_count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        plan_entry_t *e = &plan_entries[plan_count];
+        plan_break_even_t *b = &plan_break_evens[plan_break_even_count];
+        double rows, cols;
+        if (json_field(line, "sparse_break_even")) {
+            if (plan_break_even_count < PLAN_MAX_ENTRIES &&
+                json_field_string(line, "cpu", b->cpu, sizeof(b->cpu)) == 0 &&
+                json_field_number(line, "rows", &rows) == 0 &&
+                json_field_number(line, "cols", &cols) == 0 &&
+                json_field_number(line, "sparse_break_even", &b->break_even) == 0) {
+                b->rows = (int)rows;
+                b->cols = (int)cols;
+                mine += strcmp(b->cpu, plan_cpu) == 0;
+                plan_break_even_count++;
+            }
+        } else if (plan_count < PLAN_MAX_ENTRIES &&
+                   json_field_string(line, "cpu", e->cpu, sizeof(e->cpu)) == 0 &&
+                   json_field_number(line, "rows", &rows) == 0 &&
+                   json_field_number(line, "cols", &cols) == 0 &&
+                   json_field_number(line, "sparsity", &e->sparsity) == 0 &&
+                   json_field_string(line, "kernel", e->kernel, sizeof(e->kernel)) == 0) {
+            if (json_field_number(line, "ms", &e->ms) != 0) {
+                e->ms = 0.0;
+            }
+            e->rows = (int)rows;
+            e->cols = (int)cols;
+            mine += strcmp(e->cpu, plan_cpu) == 0;
+            plan_count++;
+        }
+    }
+    fclose(f);
+    return mine;
+}
+
+static int plan_find(int rows, int cols, double sparsity) {
+    for (int i = 0; i < plan_count; i++) {
+        if (plan_matches(&plan_entries[i], rows, cols, sparsity)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static const plan_entry_t *plan_lookup(int rows, int cols, double sparsity) {
+    int i = plan_find(rows, cols, sparsity);
+    return i >= 0 ? &plan_entries[i] : NULL;
+}
+
+static plan_break_even_t *plan_break_even(int rows, int cols) {
+    for (int i = 0; i < plan_break_even_count; i++) {
+        plan_break_even_t *b = &plan_break_evens[i];
+        if (b->rows == rows && b->cols == cols && strcmp(b->cpu, plan_cpu) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Adds or replaces this CPU's break-even for the shape; returns 0 on success
+static int plan_store_break_even(int rows, int cols, double break_even) {
+    plan_break_even_t *b = plan_break_even(rows, cols);
+    if (!b) {
+        if (plan_break_even_count == PLAN_MAX_ENTRIES) {
+            return -1;
+        }
+        b = &plan_break_evens[plan_break_even_count++];
+        snprintf(b->cpu, sizeof(b->cpu), "%s", plan_cpu);
+        b->rows = rows;
+        b->cols = cols;
+    }
+    b->break_even = break_even;
+    return 0;
+}
+
+// Adds or replaces this CPU's entry for the shape; returns 0 on success
+static int plan_store(int rows, int cols, double sparsity, const char *kernel, double ms) {
+    int i = plan_find(rows, cols, sparsity);
+    plan_entry_t *e = i >= 0 ? &plan_entries[i] : NULL;
+    if (!e) {
+        if (plan_count == PLAN_MAX_ENTRIES) {
+            return -1;
+        }
+        e = &plan_entries[plan_count++];
+        snprintf(e->cpu, sizeof(e->cpu), "%s", plan_cpu);
+        e->rows = rows;
+        e->cols = cols;
+        e->sparsity = sparsity;
+    }
+    snprintf(e->kernel, sizeof(e->kernel), "%s", kernel);
+    e->ms = ms;
+    return 0;
+}
+
+static int plan_save(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return -1;
+    }
+    for (int i = 0; i < plan_count; i++) {
+        const plan_entry_t *e = &plan_entries[i];
+        fprintf(f, "{ \"cpu\": ");
+        json_string(f, e->cpu);
+        fprintf(f, ", \"rows\": %d, \"cols\": %d, \"sparsity\": %.4f, \"kernel\": ",
+                e->rows, e->cols, e->sparsity);
+        json_string(f, e->kernel);
+        fprintf(f, ", \"ms\": %.6f }\n", e->ms);
+    }
+    for (int i = 0; i < plan_break_even_count; i++) {
+        const plan_break_even_t *b = &plan_break_evens[i];
+        fprintf(f, "{ \"cpu\": ");
+        json_string(f, b->cpu);
+        fprintf(f, ", \"rows\": %d, \"cols\": %d, \"sparse_break_even\": %.4f }\n",
+                b->rows, b->cols, b->break_even);
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Best-of-rounds ms per call. The first call is a warmup that also sizes
+// the rounds, so each kernel stays near AUTOTUNE_BUDGET_MS.
+static double autotune_time(const kernel_entry_t *k, const kernel_args_t *a,
+                            int iterations) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    k->run(a);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double first = elapsed_ms(&start, &end);
+
+    int per_round = iterations / AUTOTUNE_ROUNDS > 0 ? iterations / AUTOTUNE_ROUNDS : 1;
+    if (first > 0.0 && per_round * AUTOTUNE_ROUNDS * first > AUTOTUNE_BUDGET_MS) {
+        per_round = (int)(AUTOTUNE_BUDGET_MS / (AUTOTUNE_ROUNDS * first));
+        per_round = per_round > 0 ? per_round : 1;
+    }
+    double best = -1.0;
+    for (int r = 0; r < AUTOTUNE_ROUNDS; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < per_round; i++) {
+            k->run(a);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = elapsed_ms(&start, &end) / per_round;
+        if (best < 0.0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Times every available kernel on the weight set and stores the fastest
+// correct one in the plan; returns it, or NULL if none could run
+static const kernel_entry_t *run_autotune(const weight_set_t *ws, double sparsity,
+                                          int iterations) {
+    int rows = ws->rows, cols = ws->cols;
+    float *reference = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    if (!reference) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    ternary_matvec_2bit(ws->matrix_2bit, ws->input, reference, rows, cols);
+
+    kernel_args_t args;
+    ternary_kernel_args_init(&args, ws);
+    double ms[KERNEL_COUNT], ms_2bit = -1.0;
+    int ok[KERNEL_COUNT], best = -1;
+
+    printf("Autotune (%d × %d, %.0f%% zeros, %s)\n\n", rows, cols, 100.0 * sparsity,
+           plan_cpu);
+    printf("%-13s | %-14s | %-7s | %10s | %9s | %8s | %7s | %s\n",
+           "Kernel", "Layout", "ISA", "Weight KB", "ms/it", "GB/s", "vs 2bit", "Check");
+    printf("-----------------------------------------------------------------------------------------------\n");
+
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        const kernel_entry_t *k = &ternary_kernel_registry[i];
+        ms[i] = -1.0;
+        ok[i] = 0;
+        if (!ternary_kernel_available(k)) {
+            continue;
+        }
+        if (ternary_kernel_prepare(k, &args) != 0) {
+            if (!k->shaped) {
+                fprintf(stderr, "Cannot build the %s layout\n", k->layout);
+            }
+            continue;
+        }
+        ms[i] = autotune_time(k, &args, iterations);
+        ok[i] = max_rel_error(ws->output, reference, rows) < 1e-4;
+        if (strcmp(k->name, KERNEL_DEFAULT) == 0) {
+            ms_2bit = ms[i];
+        }
+        if (ok[i] && (best < 0 || ms[i] < ms[best])) {
+            best = i;
+        }
+    }
+
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        const kernel_entry_t *k = &ternary_kernel_registry[i];
+        if (ms[i] < 0.0) {
+            continue;
+        }
+        size_t bytes = ternary_kernel_bytes(k, &args);
+        printf("%-13s | %-14s | %-7s | %10zu | %9.3f | %8.2f | %6.2fx | %s%s\n",
+               k->name, k->layout, *k->impl, bytes / 1024, ms[i],
+               bytes / (ms[i] * 1e6), ms_2bit > 0.0 ? ms_2bit / ms[i] : 0.0,
+               ok[i] ? "ok" : "MISMATCH", i == best ? "  <- plan" : "");
+    }
+
+    ternary_kernel_args_free(&args);
+    ternary_free(reference);
+    if (best < 0) {
+        fprintf(stderr, "No kernel produced a correct result\n");
+        return NULL;
+    }
+    if (plan_store(rows, cols, sparsity, ternary_kernel_registry[best].name, ms[best]) != 0) {
+        fprintf(stderr, "Plan is full (%d entries); not stored\n", PLAN_MAX_ENTRIES);
+    }
+    return &ternary_kernel_registry[best];
+}
+
+// ============================================================================
+// VALIDATION
+// ============================================================================
+// --validate runs every registry kernel, and the kernels outside the
+// registry (batched, tiled, prefetching, fused, multi-projection, int8,
+// shape-specialized), on randomized shapes against a double-precision
+// reference computed from the int8 weights. Shapes include tiny rows, every
+// cols % 4 tail and the specialized widths, at sparsities from dense to
+// 99% zeros. Each ISA the CPU supports is validated in turn unless
+// TERNARY_ISA picks one.
+//
+// The relative error is |out - ref| / sum_c |w_c * x_c| for the row, so a
+// row whose terms cancel does not turn rounding into a large ratio. A check
+// fails past VALIDATE_TOLERANCE; the int8 kernel is held to the same bound
+// against a reference built from its quantized input.
+#define VALIDATE_SHAPES 24          // random shapes, plus the edge and fixed ones
+#define VALIDATE_MAX_ROWS 300
+#define VALIDATE_MAX_COLS 4100
+#define VALIDATE_FIXED_ROWS 37      // rows for the specialized widths
+#define VALIDATE_THREADS 3          // odd, so row slices are uneven
+#define VALIDATE_BATCH 11           // one full MATMUL_BLOCK and a remainder
+#define VALIDATE_TOLERANCE 1e-5
+#define VALIDATE_MAX_CHECKS 64
+
+typedef struct {
+    char name[40];
+    const char *isa;
+    int shapes;
+    double max_abs;
+    double max_rel;
+    double tolerance;
+    int failures;
+    int fail_rows;          // first failing shape
+    int fail_cols;
+    int last_shape;
+    int shape_failed;
+} validate_check_t;
+
+typedef struct {
+    const weight_set_t *ws;
+    int shape;              // index of the shape being run
+    double *ref;            // rows x VALIDATE_BATCH, input b at ref + b * rows
+    double *mag;            // sum |w x| per row and input
+    float *inputs;          // VALIDATE_BATCH inputs of cols, the first is ws->input
+    float *out;             // rows x VALIDATE_BATCH
+    validate_check_t *checks;
+    int *count;
+} validate_ctx_t;
+
+static const int validate_edge_shapes[][2] = {
+    { 1, 1 }, { 1, 3 }, { 2, 4 }, { 3, 5 }, { 5, 17 }, { 7, 63 }, { 9, 65 },
+    { 13, 127 }, { 1, 4099 }, { 64, 16 }
+};
+#define VALIDATE_EDGE_COUNT (int)(sizeof(validate_edge_shapes) / sizeof(validate_edge_shapes[0]))
+static const double validate_sparsities[] = { 0.0, 0.33, 0.5, 0.9, 0.99 };
+
+// xorshift32: shapes stay the same for a seed whatever rand() is doing
+static uint32_t validate_next(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static validate_check_t *validate_check(validate_ctx_t *v, const char *name,
+                                        const char *isa, double tolerance) {
+    for (int i = 0; i < *v->count; i++) {
+        if (strcmp(v->checks[i].name, name) == 0) {
+            return &v->checks[i];
+        }
+    }
+    if (*v->count == VALIDATE_MAX_CHECKS) {
+        return NULL;
+    }
+    validate_check_t *c = &v->checks[(*v->count)++];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->isa = isa;
+    c->tolerance = tolerance;
+    c->last_shape = -1;
+    return c;
+}
+
+// Compares n outputs against ref / mag and folds them into the named check
+static void validate_record(validate_ctx_t *v, const char *name, const char *isa,
+                            double tolerance, const float *out, const double *ref,
+                            const double *mag, int n) {
+    validate_check_t *c = validate_check(v, name, isa, tolerance);
+    if (!c) {
+        return;
+    }
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        double diff = out[i] > ref[i] ? out[i] - ref[i] : ref[i] - out[i];
+        double rel = mag[i] > 0.0 ? diff / mag[i] : diff > 0.0 ? 1.0 : 0.0;
+        // NaN compares false everywhere; count it as a failure
+        if (diff != diff) {
+            rel = 1.0;
+        }
+        if (diff > c->max_abs) {
+            c->max_abs = diff;
+        }
+        if (rel > c->max_rel) {
+            c->max_rel = rel;
+        }
+        failed |= !(rel <= tolerance);
+    }
+    // A check may record several outputs per shape; count the shape once
+    if (c->last_shape != v->shape) {
+        c->last_shape = v->shape;
+        c->shape_failed = 0;
+        c->shapes++;
+    }
+    if (failed && !c->shape_failed) {
+        c->shape_failed = 1;
+        if (c->failures++ == 0) {
+            c->fail_rows = v->ws->rows;
+            c->fail_cols = v->ws->cols;
+        }
+    }
+}
+
+static void validate_reference(validate_ctx_t *v) {
+    const weight_set_t *ws = v->ws;
+    for (int b = 0; b < VALIDATE_BATCH; b++) {
+        const float *x = v->inputs + (size_t)b * ws->cols;
+        for (int r = 0; r < ws->rows; r++) {
+            const int8_t *w = ws->matrix_8bit + (size_t)r * ws->cols;
+            double sum = 0.0, mag = 0.0;
+            for (int c = 0; c < ws->cols; c++) {
+                double t = w[c] * (double)x[c];
+                sum += t;
+                mag += t < 0.0 ? -t : t;
+            }
+            v->ref[(size_t)b * ws->rows + r] = sum;
+            v->mag[(size_t)b * ws->rows + r] = mag;
+        }
+    }
+}
+
+static void validate_registry(validate_ctx_t *v) {
+    const weight_set_t *ws = v->ws;
+    kernel_args_t args;
+    ternary_kernel_args_init(&args, ws);
+    if (args.threads < VALIDATE_THREADS) {
+        args.threads = VALIDATE_THREADS;
+    }
+    // Threaded kernels too: on one CPU they are slow, not wrong
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        const kernel_entry_t *k = &ternary_kernel_registry[i];
+        if (ternary_kernel_prepare(k, &args) != 0) {
+            if (!k->shaped) {
+                fprintf(stderr, "Cannot build the %s layout\n", k->layout);
+            }
+            continue;
+        }
+        memset(ws->output, 0xff, (size_t)ws->rows * sizeof(float));
+        k->run(&args);
+        validate_record(v, k->name, *k->impl, VALIDATE_TOLERANCE, ws->output,
+                        v->ref, v->mag, ws->rows);
+    }
+    ternary_kernel_args_free(&args);
+}
+
+// Fused epilogues: random scales and bias, the activation cycling with the
+// shape; silu is left out, its reference would need libm's exp
+static void validate_fused(validate_ctx_t *v, int variant) {
+    const weight_set_t *ws = v->ws;
+    int rows = ws->rows, cols = ws->cols;
+    static const epilogue_act_t acts[] = { EPILOGUE_NONE, EPILOGUE_RELU, EPILOGUE_RELU2 };
+    int group_size = variant % 2 ? 64 : 0;
+    int groups = group_size ? (cols + group_size - 1) / group_size : 1;
+    float *scales = (float*)ternary_alloc((size_t)rows * groups * sizeof(float));
+    float *bias = (float*)ternary_alloc((size_t)rows * sizeof(float));
+    double *ref = (double*)ternary_alloc((size_t)rows * sizeof(double));
+    double *mag = (double*)ternary_alloc((size_t)rows * sizeof(double));
+    if (!scales || !bias || !ref || !mag) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ternary_free(scales);
+        ternary_free(bias);
+        ternary_free(ref);
+        ternary_free(mag);
+        return;
+    }
+    for (size_t i = 0; i < (size_t)rows * groups; i++) {
+        scales[i] = 0.5f + (float)rand() / RAND_MAX;
+    }
+    for (int r = 0; r < rows; r++) {
+        bias[r] = (float)rand() / RAND_MAX - 0.5f;
+    }
+    epilogue_t ep = { scales, bias, group_size, acts[variant % 3] };
+
+    int span = group_size ? group_size : cols;
+    for (int r = 0; r < rows; r++) {
+        const int8_t *w = ws->matrix_8bit + (size_t)r * cols;
+        double sum = 0.0, m = 0.0;
+        for (int g = 0; g * span < cols; g++) {
+            double s = scales[group_size ? (size_t)r * groups + g : (size_t)r];
+            double part = 0.0, part_mag = 0.0;
+            for (int c = g * span; c < cols && c < (g + 1) * span; c++) {
+                double t = w[c] * (double)ws->input[c];
+                part += t;
+                part_mag += t < 0.0 ? -t : t;
+            }
+            sum += s * part;
+            m += s * part_mag;
+        }
+        sum += bias[r];
+        m += bias[r] < 0.0f ? -bias[r] : bias[r];
+        if (ep.act == EPILOGUE_RELU) {
+            sum = sum > 0.0 ? sum : 0.0;
+        } else if (ep.act == EPILOGUE_RELU2) {
+            // d(s^2) = 2s ds + ds^2, with |ds| up to the tolerance times m
+            double pre = sum < 0.0 ? -sum : sum;
+            sum = sum > 0.0 ? sum * sum : 0.0;
+            m = 2.0 * pre * m + VALIDATE_TOLERANCE * m * m;
+        }
+        ref[r] = sum;
+        mag[r] = m;
+    }
+
+    ternary_matvec_2bit_fused_impl(ws->matrix_2bit, ws->input, v->out, rows, cols, &ep);
+    validate_record(v, "2bit-fused", ternary_matvec_2bit_fused_impl_name, VALIDATE_TOLERANCE,
+                    v->out, ref, mag, rows);
+    ternary_free(scales);
+    ternary_free(bias);
+    ternary_free(ref);
+    ternary_free(mag);
+}
+
+// The int8 kernel is checked against the activations it was actually given,
+// scale * sum_c w_c * q_c with q read back through the block interleave,
+// so quantization error is not mistaken for a kernel error.
+static void validate_q8(validate_ctx_t *v) {
+    const weight_set_t *ws = v->ws;
+    int rows = ws->rows, cols = ws->cols;
+    quant_input_t q;
+    q.q = (int8_t*)ternary_alloc((size_t)cols);
+    double *ref = (double*)ternary_alloc((size_t)rows * 2 * sizeof(double));
+    if (!q.q || !ref) {
+        ternary_free(q.q);
+        ternary_free(ref);
+        return;
+    }
+    int block = ternary_matvec_2bit_q8_block;
+    int group = block / 4;
+    int full = cols / block * block;
+    ternary_quantize_input_int8(ws->input, cols, block, &q);
+    for (int r = 0; r < rows; r++) {
+        const int8_t *w = ws->matrix_8bit + (size_t)r * cols;
+        int64_t sum = 0, mag = 0;
+        for (int c = 0; c < cols; c++) {
+            int col = c % block;
+            int src = c < full ? c - col + (col % 4) * group + col / 4 : c;
+            int t = w[c] * q.q[src];
+            sum += t;
+            mag += t < 0 ? -t : t;
+        }
+        ref[r] = (double)q.scale * (double)sum;
+        ref[rows + r] = (double)q.scale * (double)mag;
+    }
+    ternary_matvec_2bit_q8_impl(ws->matrix_2bit, &q, v->out, rows, cols);
+    validate_record(v, "2bit-q8", ternary_matvec_2bit_q8_impl_name, VALIDATE_TOLERANCE,
+                    v->out, ref, ref + rows, rows);
+    ternary_free(q.q);
+    ternary_free(ref);
+}
+
+static void validate_kernels(validate_ctx_t *v, int variant) {
+    const weight_set_t *ws = v->ws;
+    int rows = ws->rows, cols = ws->cols;
+    char name[40];
+
+    ternary_matmul_8bit_impl(ws->matrix_8bit, v->inputs, v->out, rows, cols, VALIDATE_BATCH);
+    validate_record(v, "8bit-batch", ternary_matmul_8bit_impl_name, VALIDATE_TOLERANCE,
+                    v->out, v->ref, v->mag, rows * VALIDATE_BATCH);
+    ternary_matmul_2bit_impl(ws->matrix_2bit, v->inputs, v->out, rows, cols, VALIDATE_BATCH);
+    validate_record(v, "2bit-batch", ternary_matmul_2bit_impl_name, VALIDATE_TOLERANCE,
+                    v->out, v->ref, v->mag, rows * VALIDATE_BATCH);
+
+    // 0 and TILE_MAX_ROWS + 1 are out of range and must be clamped
+    static const int row_tiles[] = { 1, 2, 3, 4, 8, 0, TILE_MAX_ROWS + 1 };
+    static const int col_tiles[] = { 64, 4096 };
+    for (int i = 0; i < (int)(sizeof(row_tiles) / sizeof(row_tiles[0])); i++) {
+        for (int j = 0; j < 2; j++) {
+            snprintf(name, sizeof(name), "2bit-tiled %dx%d", row_tiles[i], col_tiles[j]);
+            ternary_matvec_2bit_tiled_impl(ws->matrix_2bit, ws->input, v->out, rows, cols,
+                                           row_tiles[i], col_tiles[j]);
+            validate_record(v, name, ternary_matvec_2bit_tiled_impl_name, VALIDATE_TOLERANCE,
+                            v->out, v->ref, v->mag, rows);
+        }
+    }
+
+    load_hints_t hints = { 512, 1 };
+    ternary_matvec_2bit_hinted_impl(ws->matrix_2bit, ws->input, v->out, rows, cols, &hints);
+    validate_record(v, "2bit-prefetch nt", ternary_matvec_2bit_hinted_impl_name,
+                    VALIDATE_TOLERANCE, v->out, v->ref, v->mag, rows);
+
+    // Row prefixes of the same weights, so every projection has its own
+    // height; more than MAX_PROJECTIONS runs in groups
+    static const int proj_counts[] = { 3, MAX_PROJECTIONS + 2 };
+    for (int i = 0; i < 2; i++) {
+        projection_t proj[MAX_PROJECTIONS + 2];
+        int count = proj_counts[i];
+        float *o = v->out;
+        for (int p = 0; p < count; p++) {
+            proj[p].matrix = ws->matrix_2bit;
+            proj[p].output = o;
+            proj[p].rows = p == count - 1 ? 1 : rows - (int)((long long)rows * p / count);
+            o += proj[p].rows;
+        }
+        ternary_matvec_2bit_multi_impl(proj, count, ws->input, cols);
+        snprintf(name, sizeof(name), "2bit-multi x%d", count);
+        for (int p = 0; p < count; p++) {
+            validate_record(v, name, ternary_matvec_2bit_multi_impl_name, VALIDATE_TOLERANCE,
+                            proj[p].output, v->ref, v->mag, proj[p].rows);
+        }
+    }
+
+    validate_q8(v);
+
+    for (int i = 0; i < FIXED_TILE_COUNT; i++) {
+        matvec_2bit_fn fn = ternary_matvec_2bit_fixed(cols, ternary_matvec_2bit_fixed_tiles[i]);
+        if (fn) {
+            snprintf(name, sizeof(name), "2bit-fixed x%d", ternary_matvec_2bit_fixed_tiles[i]);
+            fn(ws->matrix_2bit, ws->input, v->out, rows, cols);
+            validate_record(v, name, ternary_matvec_2bit_fixed_impl_name, VALIDATE_TOLERANCE,
+                            v->out, v->ref, v->mag, rows);
+        }
+    }
+
+    validate_fused(v, variant);
+}
+
+static int validate_shape(validate_ctx_t *v, int rows, int cols, double sparsity,
+                          int variant) {
+    weight_set_t ws;
+    if (weight_set_alloc(&ws, rows, cols, (float)sparsity) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    size_t n = (size_t)rows * VALIDATE_BATCH;
+    v->ws = &ws;
+    v->shape = variant;
+    v->ref = (double*)ternary_alloc(n * sizeof(double));
+    v->mag = (double*)ternary_alloc(n * sizeof(double));
+    v->inputs = (float*)ternary_alloc((size_t)cols * VALIDATE_BATCH * sizeof(float));
+    v->out = (float*)ternary_alloc(n * 2 * sizeof(float));
+    int status = -1;
+    if (v->ref && v->mag && v->inputs && v->out) {
+        memcpy(v->inputs, ws.input, (size_t)cols * sizeof(float));
+        generate_input_vector(v->inputs + cols, cols * (VALIDATE_BATCH - 1));
+        validate_reference(v);
+        validate_registry(v);
+        validate_kernels(v, variant);
+        status = 0;
+    } else {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+    ternary_free(v->ref);
+    ternary_free(v->mag);
+    ternary_free(v->inputs);
+    ternary_free(v->out);
+    weight_set_free(&ws);
+    return status;
+}
+
+static int validate_isa_supported(const char *isa) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (strcmp(isa, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(isa, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f");
+    }
+#elif defined(__aarch64__) && !defined(__ARM_FEATURE_SVE)
+    if (strcmp(isa, "sve") == 0) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+// All shapes on the current dispatch; returns the number of failed checks
+static int validate_isa(uint32_t seed, int *shapes_run) {
+    validate_check_t checks[VALIDATE_MAX_CHECKS];
+    int count = 0, shapes = 0;
+    validate_ctx_t v;
+    memset(&v, 0, sizeof(v));
+    v.checks = checks;
+    v.count = &count;
+
+    uint32_t state = seed ? seed : 1;
+    int total = VALIDATE_EDGE_COUNT + VALIDATE_SHAPES + FIXED_COL_COUNT;
+    for (int i = 0; i < total; i++) {
+        int rows, cols;
+        if (i < VALIDATE_EDGE_COUNT) {
+            rows = validate_edge_shapes[i][0];
+            cols = validate_edge_shapes[i][1];
+        } else if (i < VALIDATE_EDGE_COUNT + VALIDATE_SHAPES) {
+            // Every cols % 4 in turn, 0 meaning a whole number of 16-column words
+            int tail = i % 4;
+            rows = 1 + (int)(validate_next(&state) % VALIDATE_MAX_ROWS);
+            cols = 1 + (int)(validate_next(&state) % VALIDATE_MAX_COLS);
+            cols = tail ? (cols & ~3) + tail : (cols + 15) / 16 * 16;
         } else {
-            matrix[i] = -1;
+            rows = VALIDATE_FIXED_ROWS;
+            cols = ternary_matvec_2bit_fixed_cols[i - VALIDATE_EDGE_COUNT - VALIDATE_SHAPES];
         }
+        int s = (int)(validate_next(&state) % (sizeof(validate_sparsities) /
+                                               sizeof(validate_sparsities[0])));
+        if (validate_shape(&v, rows, cols, validate_sparsities[s], i) != 0) {
+            return -1;
+        }
+        shapes++;
     }
-}
 
-void pack_ternary_2bit(const int8_t *matrix_8bit, uint8_t *matrix_2bit,
-                       int rows, int cols) {
-    int packed_cols = (cols + 3) / 4;
-    memset(matrix_2bit, 0, rows * packed_cols);
-    
-    for (int r = 0; r < rows; r++) {
-        for (int c = 0; c < cols; c++) {
-            int8_t val = matrix_8bit[r * cols + c];
-            int packed_idx = r * packed_cols + c / 4;
-            int trit_idx = c % 4;
-            
-            uint8_t bits;
-            if (val == 0) bits = 0;       // 00
-            else if (val == 1) bits = 1;  // 01
-            else bits = 2;                // 10 for -1
-            
-            matrix_2bit[packed_idx] |= (bits << (trit_idx * 2));
+    int failed = 0;
+    printf("%-18s | %-10s | %6s | %10s | %10s | %9s | %s\n",
+           "Kernel", "ISA", "Shapes", "Max abs", "Max rel", "Tolerance", "Check");
+    printf("-----------------------------------------------------------------------------------------\n");
+    for (int i = 0; i < count; i++) {
+        const validate_check_t *c = &checks[i];
+        printf("%-18s | %-10s | %6d | %10.2e | %10.2e | %9.0e | ", c->name, c->isa,
+               c->shapes, c->max_abs, c->max_rel, c->tolerance);
+        if (c->failures) {
+            printf("FAIL on %d shape%s, first %d × %d\n", c->failures,
+                   c->failures == 1 ? "" : "s", c->fail_rows, c->fail_cols);
+            failed++;
+        } else {
+            printf("ok\n");
         }
     }
+    *shapes_run = shapes;
+    return failed;
 }
 
-void generate_input_vector(float *vec, int size) {
-    for (int i = 0; i < size; i++) {
-        vec[i] = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-    }
-}
+// Returns 0 when every check on every ISA passed
+int run_validate(uint32_t seed) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const char *const isas[] = { "scalar", "avx2", "avx512" };
+#elif defined(__aarch64__)
+    static const char *const isas[] = { "scalar", "neon", "sve" };
+#else
+    static const char *const isas[] = { "scalar" };
+#endif
+    const int isa_count = (int)(sizeof(isas) / sizeof(isas[0]));
+    const char *forced = getenv("TERNARY_ISA");
+    int failed = 0, passes = 0, shapes = 0;
 
-// ============================================================================
-// VERSION A: 8-BIT REPRESENTATION (THEIRS)
-// ============================================================================
-void matvec_8bit(const int8_t *matrix, const float *input, float *output,
-                 int rows, int cols) {
-    for (int r = 0; r < rows; r++) {
-        float sum = 0.0f;
-        const int8_t *row_ptr = matrix + r * cols;
-        
-        for (int c = 0; c < cols; c++) {
-            int8_t w = row_ptr[c];
-            if (w != 0) {
-                sum += (float)w * input[c];
+    for (int i = 0; i < isa_count && failed >= 0; i++) {
+        if (forced) {
+            if (i > 0) {
+                break;
             }
+        } else if (!validate_isa_supported(isas[i])) {
+            continue;
+        } else {
+            setenv("TERNARY_ISA", isas[i], 1);
+            ternary_init_kernel_dispatch();
+        }
+        if (passes++) {
+            printf("\n");
         }
-        
-        output[r] = sum;
+        printf("Validation (%s dispatch, seed %u)\n\n", ternary_matvec_2bit_impl_name, seed);
+        int f = validate_isa(seed, &shapes);
+        failed = f < 0 ? -1 : failed + f;
     }
+    if (!forced) {
+        unsetenv("TERNARY_ISA");
+        ternary_init_kernel_dispatch();
+    }
+
+    if (failed < 0) {
+        return -1;
+    }
+    printf("\n%d shapes per ISA, %d ISA%s: %s\n", shapes, passes, passes == 1 ? "" : "s",
+           failed ? "MISMATCH" : "all kernels match the double-precision reference");
+    return failed ? 1 : 0;
 }
 
 // ============================================================================
-// VERSION B: 2-BIT PACKED REPRESENTATION (OURS)
+// MAIN
 // ============================================================================
-static inline int8_t unpack_trit(uint8_t packed, int index) {
-    uint8_t bits = (packed >> (index * 2)) & 0x3;
-    return (bits == 2) ? -1 : (bits == 1) ? 1 : 0;
-}
+typedef struct {
+    int shape_rows[MAX_SHAPES];
+    int shape_cols[MAX_SHAPES];
+    int nshapes;        // shapes run one after another
+    int iterations;
+    float sparsity;     // fraction of zero weights
+    const char *layers; // model name or "all": run the layer profile instead
+    const char *decode; // model name: stream tokens through its full stack instead
+    int decode_layers;  // > 0: layers in the stack instead of the model's count
+    int tokens;         // timed tokens per thread count
+    int lookahead;      // layers the --decode helper warms ahead, 0 for none
+    int working_set;    // run the working-set sweep instead
+    size_t wss_max_bytes;   // largest 8-bit footprint in the sweep
+    const char *csv_path;   // results CSV (sweep CSV with --working-set)
+    const char *json_path;  // results JSON, NULL for none
+    const char *compare_baseline;   // --compare: compare two JSON files instead
+    const char *compare_candidate;
+    double compare_threshold;       // throughput loss in % flagged as a regression
+    int roofline;       // calibrate the roofline before the default comparison
+    const char *write_weights;  // write a weight file of the first shape and exit
+    weight_format_t layout;     // its layout
+    const char *weights_path;   // time cold start from this weight file instead
+    int map_flags;              // WEIGHT_MAP_* for weights_path
+    double target_ci;   // > 0: auto-calibrate iterations to this CI / mean
+    int max_iterations; // cap for auto-calibration
+    int pin_cpu;        // >= 0: pin the benchmark thread to this CPU
+    int threads;        // > 0: run the thread-scaling sweep up to this count
+    int batch;          // > 0: run the batch sweep up to this batch size
+    int int8;           // run the int8-activation comparison
+    int pin;            // pin engine threads to CPUs
+    int tiles;          // run the tile-shape sweep
+    int row_tile;       // > 0: fixed row tile for the sweep
+    int col_tile;       // > 0: fixed column tile for the sweep
+    int prefetch;       // run the prefetch / streaming-load sweep
+    int prefetch_distance;  // >= 0: compare only this distance
+    int pack_bench;     // time int8 <-> packed conversion for every layout
+    alloc_policy_t alloc;   // allocator for weight and activation buffers
+    int numa_node;      // >= 0: bind buffers to this NUMA node
+    int alloc_sweep;    // compare every allocator policy
+    int epilogue;       // run the fused scale / bias / activation sweep
+    int group_size;     // columns per scale in its grouped rows
+    int multi_proj;     // fused gate+up / QKV against separate calls
+    int sparse;         // sparse-format break-even sweep
+    int pool;           // > 0: work-stealing pool sweep up to this many threads
+    int fixed;          // shape-specialized kernels against the generic one
+    int gpu;            // GPU backend against the same packed weights
+    int validate;       // every kernel against a double-precision reference
+    uint32_t validate_seed;
+    int autotune;       // time every registry kernel and update the plan
+    const char *plan_path;  // plan cache, NULL to ignore it
+    const char *trace_path; // Chrome trace of the run (tracing builds only)
+} bench_options_t;
 
-void matvec_2bit(const uint8_t *matrix_packed, const float *input,
-                 float *output, int rows, int cols) {
-    int packed_cols = (cols + 3) / 4;
-    
-    for (int r = 0; r < rows; r++) {
-        float sum = 0.0f;
-        const uint8_t *row_ptr = matrix_packed + r * packed_cols;
-        
-        for (int packed_idx = 0; packed_idx < packed_cols; packed_idx++) {
-            uint8_t packed = row_ptr[packed_idx];
-            
-            for (int trit_idx = 0; trit_idx < 4; trit_idx++) {
-                int c = packed_idx * 4 + trit_idx;
-                if (c < cols) {
-                    int8_t w = unpack_trit(packed, trit_idx);
-                    if (w != 0) {
-                        sum += (float)w * input[c];
-                    }
-                }
-            }
-        }
-        
-        output[r] = sum;
+static void print_usage(const char *prog) {
+    printf("Usage: %s [options]\n\n", prog);
+    printf("With no options, runs the 8-bit vs 2-bit single-thread comparison.\n\n");
+    printf("  --rows N      Matrix rows (default %d)\n", DEFAULT_ROWS);
+    printf("  --cols N      Matrix columns (default %d)\n", DEFAULT_COLS);
+    printf("  --shapes LIST Comma-separated RxC shapes, run one after another\n");
+    printf("  --iterations N\n");
+    printf("                Timed iterations per measurement (default %d)\n",
+           DEFAULT_ITERATIONS);
+    printf("  --sparsity F  Fraction of zero weights, 0..1 (default %.2f)\n",
+           DEFAULT_SPARSITY);
+    printf("  --target-ci PCT\n");
+    printf("                Add iterations until the 95%% CI is within PCT%% of the mean\n");
+    printf("  --max-iterations N\n");
+    printf("                Cap for --target-ci (default 10000)\n");
+    printf("  --pin-cpu N   Pin the benchmark thread to CPU N\n");
+    printf("  --no-roofline Skip the read-bandwidth / add-peak calibration\n");
+    printf("  --layers MODEL\n");
+    printf("                Time every projection of one layer of MODEL:\n");
+    printf("               ");
+    for (int i = 0; i < MODEL_SHAPE_COUNT; i++) {
+        printf(" %s", model_shapes[i].name);
     }
+    printf(" all\n");
+    printf("  --decode MODEL\n");
+    printf("                Stream tokens through every layer of MODEL in --layout\n");
+    printf("  --decode-layers N\n");
+    printf("                Layers in the --decode stack (default: the model's)\n");
+    printf("  --tokens N    Timed tokens per --decode run (default %d)\n",
+           DECODE_DEFAULT_TOKENS);
+    printf("  --lookahead N Layers a --decode helper thread warms ahead of the\n");
+    printf("                compute (default %d, 0 for the serial loop only)\n",
+           DECODE_DEFAULT_LOOKAHEAD);
+    printf("  --working-set Sweep matrix size from KB to --wss-max-mb, all formats\n");
+    printf("  --wss-max-mb N\n");
+    printf("                Largest 8-bit footprint in the sweep (default 1024)\n");
+    printf("  --json FILE   Write every metric, the config, host and build as JSON\n");
+    printf("  --csv FILE    Write results as CSV (the sweep with --working-set)\n");
+    printf("  --write-weights FILE\n");
+    printf("                Write the generated --rows x --cols matrix as a weight file\n");
+    printf("  --layout L    Its layout, and --decode's: 8bit, 2bit (default), bitplane\n");
+    printf("                or base3\n");
+    printf("  --weights FILE\n");
+    printf("                Time cold start and matvec from an mmap'ed weight file\n");
+    printf("  --populate    Prefault the whole file at map time (MAP_POPULATE)\n");
+    printf("  --hugepages   Advise transparent huge pages for the mapping\n");
+    printf("  --compare OLD.json,NEW.json\n");
+    printf("                Compare two --json files; exit 1 on a regression\n");
+    printf("  --threshold PCT\n");
+    printf("                Throughput loss flagged by --compare (default %.0f%%)\n",
+           DEFAULT_COMPARE_THRESHOLD);
+    printf("  --threads N   Thread-scaling sweep from 1 to N threads\n");
+    printf("  --no-pin      Do not pin engine threads to CPUs\n");
+    printf("  --batch N     Batched matmul sweep for B = 1, 2, 4, ... N\n");
+    printf("  --int8        2-bit matvec with int8-quantized activations\n");
+    printf("  --tiles       Sweep tiled 2-bit kernel shapes and report the best\n");
+    printf("  --row-tile N  Fix the sweep's row tile (1, 2, 4 or 8)\n");
+    printf("  --col-tile N  Fix the sweep's column tile (rounded up to 64)\n");
+    printf("  --prefetch    Sweep software prefetch distances and streaming loads\n");
+    printf("  --prefetch-distance N\n");
+    printf("                Compare only prefetching N bytes ahead\n");
+    printf("  --pack-bench  Time packing / unpacking every layout (GB/s)\n");
+    printf("  --alloc P     Buffer allocator: malloc, aligned (default), thp or hugetlb\n");
+    printf("  --numa-node N Bind weight and activation buffers to NUMA node N\n");
+    printf("  --alloc-sweep Time 8-bit and 2-bit under every allocator, with dTLB misses\n");
+    printf("  --epilogue    2-bit with fused scale, bias and activation vs a separate pass\n");
+    printf("  --group-size N\n");
+    printf("                Columns per scale in the grouped rows (default %d)\n",
+           DEFAULT_GROUP_SIZE);
+    printf("  --multi-proj  Fused gate+up and QKV kernels vs separate 2-bit calls\n");
+    printf("  --sparse      Sparse index-list format vs dense 2-bit, 50-99%% zeros\n");
+    printf("  --pool N      Work-stealing pool vs static rows, 1 to N threads, on dense\n");
+    printf("                2-bit and skewed sparse rows\n");
+    printf("  --fixed       Kernels specialized on the column count vs the generic 2-bit\n");
+    printf("  --gpu         8-bit, 2-bit and bitplane on the GPU: upload, kernel, device\n");
+    printf("                GB/s (needs make cuda or make hip)\n");
+    printf("  --validate    Check every kernel and format against a double-precision\n");
+    printf("                reference on random shapes; exit status 1 on a mismatch\n");
+    printf("  --validate-seed N\n");
+    printf("                Seed for the --validate shapes (default %d)\n",
+           DEFAULT_VALIDATE_SEED);
+    printf("  --autotune    Time every kernel per shape and save the fastest to the plan\n");
+    printf("  --plan FILE   Plan cache read at startup (default %s, 'none' to ignore)\n",
+           DEFAULT_PLAN_PATH);
+    printf("  --trace FILE  Write kernel, chunk, layer and barrier spans as Chrome trace\n");
+    printf("                JSON (needs make trace)\n");
+    printf("  --help        Show this message\n");
 }
 
-// ============================================================================
-// BENCHMARK HARNESS
-// ============================================================================
-typedef struct {
-    double time_ms;
-    long long cycles;
-    long long instructions;
-    long long cache_refs;
-    long long cache_misses;
-    long long l1d_misses;
-    long long llc_misses;
-    double cache_miss_rate;
-    double ipc;
-    size_t memory_bytes;
-} benchmark_result_t;
-
-void benchmark_8bit(const int8_t *matrix, const float *input, float *output,
-                   int rows, int cols, int iterations,
-                   benchmark_result_t *result) {
-    struct timespec start, end;
-    
-#ifdef USE_PERF
-    perf_counters_t counters;
-    setup_perf_counters(&counters);
-    start_perf_counters(&counters);
-#endif
-    
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    
-    for (int i = 0; i < iterations; i++) {
-        matvec_8bit(matrix, input, output, rows, cols);
+// Parses "RxC[,RxC...]"; returns the number of shapes or -1
+static int parse_shapes(const char *arg, int *rows, int *cols) {
+    int count = 0;
+    const char *p = arg;
+    while (*p) {
+        char *end;
+        long r = strtol(p, &end, 10);
+        if (end == p || (*end != 'x' && *end != 'X')) {
+            return -1;
+        }
+        p = end + 1;
+        long c = strtol(p, &end, 10);
+        if (end == p || r < 1 || c < 1 || r > 1L << 20 || c > 1L << 20 ||
+            count == MAX_SHAPES) {
+            return -1;
+        }
+        rows[count] = (int)r;
+        cols[count] = (int)c;
+        count++;
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
     }
-    
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    
-#ifdef USE_PERF
-    stop_perf_counters(&counters, &result->cycles, &result->instructions,
-                      &result->cache_refs, &result->cache_misses,
-                      &result->l1d_misses, &result->llc_misses);
-    close_perf_counters(&counters);
-    
-    result->cache_miss_rate = (double)result->cache_misses / result->cache_refs * 100.0;
-    result->ipc = (double)result->instructions / result->cycles;
-#else
-    result->cycles = 0;
-    result->instructions = 0;
-    result->cache_refs = 0;
-    result->cache_misses = 0;
-    result->l1d_misses = 0;
-    result->llc_misses = 0;
-    result->cache_miss_rate = 0.0;
-    result->ipc = 0.0;
-#endif
-    
-    result->time_ms = (end.tv_sec - start.tv_sec) * 1000.0 +
-                      (end.tv_nsec - start.tv_nsec) / 1000000.0;
-    result->memory_bytes = rows * cols * sizeof(int8_t);
+    return count;
 }
 
-void benchmark_2bit(const uint8_t *matrix_packed, const float *input,
-                   float *output, int rows, int cols, int iterations,
-                   benchmark_result_t *result) {
-    struct timespec start, end;
-    
-#ifdef USE_PERF
-    perf_counters_t counters;
-    setup_perf_counters(&counters);
-    start_perf_counters(&counters);
+// Returns 0 to continue, 1 to exit successfully, -1 on a usage error
+static int parse_options(int argc, char **argv, bench_options_t *opts) {
+    static const struct option long_opts[] = {
+        { "rows",       required_argument, NULL, 'r' },
+        { "cols",       required_argument, NULL, 'c' },
+        { "shapes",     required_argument, NULL, 'S' },
+        { "iterations", required_argument, NULL, 'n' },
+        { "sparsity",   required_argument, NULL, 's' },
+        { "layers",     required_argument, NULL, 'L' },
+        { "decode",     required_argument, NULL, 'd' },
+        { "decode-layers", required_argument, NULL, 'J' },
+        { "tokens",     required_argument, NULL, 'u' },
+        { "lookahead",  required_argument, NULL, 'e' },
+        { "target-ci",  required_argument, NULL, 'I' },
+        { "max-iterations", required_argument, NULL, 'X' },
+        { "pin-cpu",    required_argument, NULL, 'p' },
+        { "no-roofline", no_argument,      NULL, 'Y' },
+        { "write-weights", required_argument, NULL, 'w' },
+        { "layout",     required_argument, NULL, 'l' },
+        { "weights",    required_argument, NULL, 'g' },
+        { "populate",   no_argument,       NULL, 'U' },
+        { "hugepages",  no_argument,       NULL, 'G' },
+        { "working-set", no_argument,      NULL, 'W' },
+        { "wss-max-mb", required_argument, NULL, 'M' },
+        { "csv",        required_argument, NULL, 'o' },
+        { "json",       required_argument, NULL, 'j' },
+        { "compare",    required_argument, NULL, 'K' },
+        { "threshold",  required_argument, NULL, 'H' },
+        { "threads", required_argument, NULL, 't' },
+        { "no-pin",  no_argument,       NULL, 'P' },
+        { "batch",   required_argument, NULL, 'b' },
+        { "int8",    no_argument,       NULL, 'q' },
+        { "tiles",    no_argument,       NULL, 'T' },
+        { "row-tile", required_argument, NULL, 'R' },
+        { "col-tile", required_argument, NULL, 'C' },
+        { "prefetch", no_argument,       NULL, 'F' },
+        { "prefetch-distance", required_argument, NULL, 'D' },
+        { "pack-bench", no_argument,     NULL, 'A' },
+        { "alloc",      required_argument, NULL, 'a' },
+        { "numa-node",  required_argument, NULL, 'N' },
+        { "alloc-sweep", no_argument,      NULL, 'Z' },
+        { "epilogue",   no_argument,       NULL, 'E' },
+        { "group-size", required_argument, NULL, 'O' },
+        { "multi-proj", no_argument,       NULL, 'Q' },
+        { "sparse",     no_argument,       NULL, 'B' },
+        { "pool",       required_argument, NULL, 'f' },
+        { "fixed",      no_argument,       NULL, 'i' },
+        { "gpu",        no_argument,       NULL, 'm' },
+        { "validate",   no_argument,       NULL, 'v' },
+        { "validate-seed", required_argument, NULL, 'y' },
+        { "autotune",   no_argument,       NULL, 'V' },
+        { "plan",       required_argument, NULL, 'k' },
+        { "trace",      required_argument, NULL, 'x' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    opts->shape_rows[0] = DEFAULT_ROWS;
+    opts->shape_cols[0] = DEFAULT_COLS;
+    opts->nshapes = 1;
+    opts->iterations = DEFAULT_ITERATIONS;
+    opts->sparsity = DEFAULT_SPARSITY;
+    opts->layers = NULL;
+    opts->decode = NULL;
+    opts->decode_layers = 0;
+    opts->tokens = DECODE_DEFAULT_TOKENS;
+    opts->lookahead = DECODE_DEFAULT_LOOKAHEAD;
+    opts->target_ci = 0.0;
+    opts->max_iterations = 10000;
+    opts->pin_cpu = -1;
+    opts->working_set = 0;
+    opts->wss_max_bytes = (size_t)1024 << 20;
+    opts->csv_path = NULL;
+    opts->json_path = NULL;
+    opts->compare_baseline = NULL;
+    opts->compare_candidate = NULL;
+    opts->compare_threshold = DEFAULT_COMPARE_THRESHOLD;
+    opts->roofline = 1;
+    opts->write_weights = NULL;
+    opts->layout = FORMAT_2BIT;
+    opts->weights_path = NULL;
+    opts->map_flags = 0;
+    opts->threads = 0;
+    opts->batch = 0;
+    opts->int8 = 0;
+    opts->pin = 1;
+    opts->tiles = 0;
+    opts->row_tile = 0;
+    opts->col_tile = 0;
+    opts->prefetch = 0;
+    opts->prefetch_distance = -1;
+    opts->pack_bench = 0;
+    opts->alloc = ALLOC_ALIGNED;
+    opts->numa_node = -1;
+    opts->alloc_sweep = 0;
+    opts->epilogue = 0;
+    opts->group_size = DEFAULT_GROUP_SIZE;
+    opts->multi_proj = 0;
+    opts->sparse = 0;
+    opts->pool = 0;
+    opts->fixed = 0;
+    opts->gpu = 0;
+    opts->validate = 0;
+    opts->validate_seed = DEFAULT_VALIDATE_SEED;
+    opts->autotune = 0;
+    opts->plan_path = DEFAULT_PLAN_PATH;
+    opts->trace_path = NULL;
+
+    int opt, have_shapes = 0, have_dims = 0;
+    while ((opt = getopt_long(argc, argv, "t:b:n:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+        case 'c': {
+            int value = atoi(optarg);
+            if (value < 1) {
+                fprintf(stderr, "--%s must be at least 1\n", opt == 'r' ? "rows" : "cols");
+                return -1;
+            }
+            if (opt == 'r') {
+                opts->shape_rows[0] = value;
+            } else {
+                opts->shape_cols[0] = value;
+            }
+            have_dims = 1;
+            break;
+        }
+        case 'S':
+            opts->nshapes = parse_shapes(optarg, opts->shape_rows, opts->shape_cols);
+            if (opts->nshapes < 1) {
+                fprintf(stderr, "--shapes expects up to %d comma-separated RxC shapes\n",
+                        MAX_SHAPES);
+                return -1;
+            }
+            have_shapes = 1;
+            break;
+        case 'n':
+            opts->iterations = atoi(optarg);
+            if (opts->iterations < 1) {
+                fprintf(stderr, "--iterations must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 's': {
+            char *end;
+            opts->sparsity = strtof(optarg, &end);
+            if (end == optarg || *end || opts->sparsity < 0.0f || opts->sparsity > 1.0f) {
+                fprintf(stderr, "--sparsity must be between 0 and 1\n");
+                return -1;
+            }
+            break;
+        }
+        case 'L':
+            if (strcmp(optarg, "all") != 0 && !find_model_shape(optarg)) {
+                fprintf(stderr, "Unknown model '%s' for --layers\n", optarg);
+                return -1;
+            }
+            opts->layers = optarg;
+            break;
+        case 'd':
+            if (!find_model_shape(optarg)) {
+                fprintf(stderr, "Unknown model '%s' for --decode\n", optarg);
+                return -1;
+            }
+            opts->decode = optarg;
+            break;
+        case 'J':
+            opts->decode_layers = atoi(optarg);
+            if (opts->decode_layers < 1) {
+                fprintf(stderr, "--decode-layers must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 'u':
+            opts->tokens = atoi(optarg);
+            if (opts->tokens < 1) {
+                fprintf(stderr, "--tokens must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 'e': {
+            char *end;
+            long value = strtol(optarg, &end, 10);
+            if (end == optarg || *end || value < 0 || value > 64) {
+                fprintf(stderr, "--lookahead must be between 0 and 64\n");
+                return -1;
+            }
+            opts->lookahead = (int)value;
+            break;
+        }
+        case 'I': {
+            char *end;
+            opts->target_ci = strtod(optarg, &end) / 100.0;
+            if (end == optarg || *end || opts->target_ci <= 0.0) {
+                fprintf(stderr, "--target-ci must be a positive percentage\n");
+                return -1;
+            }
+            break;
+        }
+        case 'X':
+            opts->max_iterations = atoi(optarg);
+            if (opts->max_iterations < 1) {
+                fprintf(stderr, "--max-iterations must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 'p':
+            opts->pin_cpu = atoi(optarg);
+            if (opts->pin_cpu < 0 || opts->pin_cpu >= ternary_online_cpus()) {
+                fprintf(stderr, "--pin-cpu must be between 0 and %d\n", ternary_online_cpus() - 1);
+                return -1;
+            }
+            break;
+        case 'Y':
+            opts->roofline = 0;
+            break;
+        case 'w':
+            opts->write_weights = optarg;
+            break;
+        case 'l':
+            if (parse_layout(optarg, &opts->layout) != 0) {
+                fprintf(stderr, "--layout must be 8bit, 2bit, bitplane or base3\n");
+                return -1;
+            }
+            break;
+        case 'g':
+            opts->weights_path = optarg;
+            break;
+        case 'U':
+            opts->map_flags |= WEIGHT_MAP_POPULATE;
+            break;
+        case 'G':
+            opts->map_flags |= WEIGHT_MAP_HUGEPAGE;
+            break;
+        case 'W':
+            opts->working_set = 1;
+            break;
+        case 'M': {
+            long mb = atol(optarg);
+            if (mb < 1) {
+                fprintf(stderr, "--wss-max-mb must be at least 1\n");
+                return -1;
+            }
+            opts->wss_max_bytes = (size_t)mb << 20;
+            opts->working_set = 1;
+            break;
+        }
+        case 'o':
+            opts->csv_path = optarg;
+            break;
+        case 'j':
+            opts->json_path = optarg;
+            break;
+        case 'K': {
+            char *comma = strchr(optarg, ',');
+            if (!comma || comma == optarg || !comma[1]) {
+                fprintf(stderr, "--compare takes OLD.json,NEW.json\n");
+                return -1;
+            }
+            *comma = '\0';
+            opts->compare_baseline = optarg;
+            opts->compare_candidate = comma + 1;
+            break;
+        }
+        case 'H': {
+            char *end;
+            opts->compare_threshold = strtod(optarg, &end);
+            if (end == optarg || *end || opts->compare_threshold < 0.0) {
+                fprintf(stderr, "--threshold must be a non-negative percentage\n");
+                return -1;
+            }
+            break;
+        }
+        case 't':
+            opts->threads = atoi(optarg);
+            if (opts->threads < 1) {
+                fprintf(stderr, "--threads must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 'P':
+            opts->pin = 0;
+            break;
+        case 'b':
+            opts->batch = atoi(optarg);
+            if (opts->batch < 1) {
+                fprintf(stderr, "--batch must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 'q':
+            opts->int8 = 1;
+            break;
+        case 'T':
+            opts->tiles = 1;
+            break;
+        case 'R':
+            opts->row_tile = atoi(optarg);
+            if (opts->row_tile != 1 && opts->row_tile != 2 &&
+                opts->row_tile != 4 && opts->row_tile != TILE_MAX_ROWS) {
+                fprintf(stderr, "--row-tile must be 1, 2, 4 or %d\n", TILE_MAX_ROWS);
+                return -1;
+            }
+            opts->tiles = 1;
+            break;
+        case 'C':
+            opts->col_tile = atoi(optarg);
+            if (opts->col_tile < 1) {
+                fprintf(stderr, "--col-tile must be at least 1\n");
+                return -1;
+            }
+            opts->tiles = 1;
+            break;
+        case 'F':
+            opts->prefetch = 1;
+            break;
+        case 'D':
+            opts->prefetch_distance = atoi(optarg);
+            if (opts->prefetch_distance < 0) {
+                fprintf(stderr, "--prefetch-distance must be at least 0\n");
+                return -1;
+            }
+            opts->prefetch = 1;
+            break;
+        case 'A':
+            opts->pack_bench = 1;
+            break;
+        case 'a':
+            if (parse_alloc_policy(optarg, &opts->alloc) != 0) {
+                fprintf(stderr, "--alloc must be malloc, aligned, thp or hugetlb\n");
+                return -1;
+            }
+            break;
+        case 'N':
+            opts->numa_node = atoi(optarg);
+            if (opts->numa_node < 0 || opts->numa_node >= 1024) {
+                fprintf(stderr, "--numa-node must be between 0 and 1023\n");
+                return -1;
+            }
+            break;
+        case 'Z':
+            opts->alloc_sweep = 1;
+            break;
+        case 'E':
+            opts->epilogue = 1;
+            break;
+        case 'O':
+            opts->group_size = atoi(optarg);
+            if (opts->group_size < 16 || opts->group_size % 16) {
+                fprintf(stderr, "--group-size must be a positive multiple of 16\n");
+                return -1;
+            }
+            opts->epilogue = 1;
+            break;
+        case 'Q':
+            opts->multi_proj = 1;
+            break;
+        case 'B':
+            opts->sparse = 1;
+            break;
+        case 'f':
+            opts->pool = atoi(optarg);
+            if (opts->pool < 1 || opts->pool > MAX_MATVEC_THREADS) {
+                fprintf(stderr, "--pool must be between 1 and %d\n", MAX_MATVEC_THREADS);
+                return -1;
+            }
+            break;
+        case 'i':
+            opts->fixed = 1;
+            break;
+        case 'm':
+#ifndef TERNARY_GPU
+            fprintf(stderr, "--gpu needs a GPU build (make cuda or make hip)\n");
+            return -1;
 #endif
-    
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    
-    for (int i = 0; i < iterations; i++) {
-        matvec_2bit(matrix_packed, input, output, rows, cols);
+            opts->gpu = 1;
+            break;
+        case 'v':
+            opts->validate = 1;
+            break;
+        case 'y':
+            opts->validate_seed = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'V':
+            opts->autotune = 1;
+            break;
+        case 'k':
+            opts->plan_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'x':
+            if (!ternary_trace_compiled_in()) {
+                fprintf(stderr, "--trace needs a tracing build (make trace)\n");
+                return -1;
+            }
+            opts->trace_path = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 1;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
     }
-    
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    
-#ifdef USE_PERF
-    stop_perf_counters(&counters, &result->cycles, &result->instructions,
-                      &result->cache_refs, &result->cache_misses,
-                      &result->l1d_misses, &result->llc_misses);
-    close_perf_counters(&counters);
-    
-    result->cache_miss_rate = (double)result->cache_misses / result->cache_refs * 100.0;
-    result->ipc = (double)result->instructions / result->cycles;
-#else
-    result->cycles = 0;
-    result->instructions = 0;
-    result->cache_refs = 0;
-    result->cache_misses = 0;
-    result->l1d_misses = 0;
-    result->llc_misses = 0;
-    result->cache_miss_rate = 0.0;
-    result->ipc = 0.0;
-#endif
-    
-    result->time_ms = (end.tv_sec - start.tv_sec) * 1000.0 +
-                      (end.tv_nsec - start.tv_nsec) / 1000000.0;
-    
-    int packed_cols = (cols + 3) / 4;
-    result->memory_bytes = rows * packed_cols * sizeof(uint8_t);
+    if (have_shapes && have_dims) {
+        fprintf(stderr, "--shapes cannot be combined with --rows/--cols\n");
+        return -1;
+    }
+    if (opts->autotune && !opts->plan_path) {
+        fprintf(stderr, "--autotune needs a --plan file\n");
+        return -1;
+    }
+    return 0;
 }
 
-// ============================================================================
-// MAIN
-// ============================================================================
-int main() {
-    printf("========================================================================\n");
-    printf("2-Bit Ternary Encoding Memory Bandwidth Micro-Benchmark\n");
-    printf("HyperFold Technologies UK Ltd.\n");
-    printf("========================================================================\n\n");
-    
-    printf("Configuration:\n");
-    printf("  Matrix Size:  %d × %d\n", MATRIX_ROWS, MATRIX_COLS);
-    printf("  Total Weights: %d\n", MATRIX_ROWS * MATRIX_COLS);
-    printf("  Sparsity:     %.0f%%\n", SPARSITY * 100.0f);
-    printf("  Iterations:   %d\n", ITERATIONS);
-#ifdef USE_PERF
-    printf("  Profiling:    Hardware Performance Counters (perf)\n");
-#else
-    printf("  Profiling:    Time only (compile with -DUSE_PERF for counters)\n");
-#endif
-    printf("\n");
-    
-    // Allocate memory
-    size_t matrix_8bit_size = MATRIX_ROWS * MATRIX_COLS * sizeof(int8_t);
-    int packed_cols = (MATRIX_COLS + 3) / 4;
-    size_t matrix_2bit_size = MATRIX_ROWS * packed_cols * sizeof(uint8_t);
-    
-    int8_t *matrix_8bit = (int8_t*)malloc(matrix_8bit_size);
-    uint8_t *matrix_2bit = (uint8_t*)malloc(matrix_2bit_size);
-    float *input = (float*)malloc(MATRIX_COLS * sizeof(float));
-    float *output = (float*)malloc(MATRIX_ROWS * sizeof(float));
-    
-    if (!matrix_8bit || !matrix_2bit || !input || !output) {
+// Runs the selected modes (or the default comparison) on one shape
+static int run_shape(const bench_options_t *opts, result_sink_t *sink,
+                     const roofline_t *roof, int rows, int cols) {
+    weight_set_t ws;
+    if (weight_set_alloc(&ws, rows, cols, opts->sparsity) != 0) {
         fprintf(stderr, "Memory allocation failed\n");
         return 1;
     }
-    
-    // Generate test data
-    srand(42);
-    generate_ternary_matrix_8bit(matrix_8bit, MATRIX_ROWS, MATRIX_COLS);
-    pack_ternary_2bit(matrix_8bit, matrix_2bit, MATRIX_ROWS, MATRIX_COLS);
-    generate_input_vector(input, MATRIX_COLS);
-    
+    int8_t *matrix_8bit = ws.matrix_8bit;
+    uint8_t *matrix_2bit = ws.matrix_2bit;
+    uint64_t *matrix_bitplane = ws.matrix_bitplane;
+    uint8_t *matrix_base3 = ws.matrix_base3;
+    float *input = ws.input;
+    float *output = ws.output;
+    size_t matrix_8bit_size = (size_t)rows * ternary_format_row_bytes(FORMAT_8BIT, cols);
+    size_t matrix_2bit_size = (size_t)rows * ternary_format_row_bytes(FORMAT_2BIT, cols);
+
     printf("Memory Footprint:\n");
     printf("  8-bit representation: %zu KB\n", matrix_8bit_size / 1024);
     printf("  2-bit representation: %zu KB\n", matrix_2bit_size / 1024);
-    printf("  Reduction:            %.1f%%\n\n",
+    printf("  Reduction:            %.1f%%\n",
            100.0 * (1.0 - (double)matrix_2bit_size / matrix_8bit_size));
+    if (ternary_alloc_policy == ALLOC_THP || ternary_alloc_policy == ALLOC_HUGETLB) {
+        long huge_8bit = ternary_huge_page_bytes(matrix_8bit, matrix_8bit_size);
+        long huge_2bit = ternary_huge_page_bytes(matrix_2bit, matrix_2bit_size);
+        if (huge_8bit >= 0 && huge_2bit >= 0) {
+            printf("  On huge pages:        %.0f%%%s\n",
+                   100.0 * (huge_8bit + huge_2bit) / (matrix_8bit_size + matrix_2bit_size),
+                   ternary_alloc_hugetlb_fallbacks ? " (hugetlb pool empty, used thp)" : "");
+        }
+    }
+    printf("\n");
     
+    if (opts->threads > 0 || opts->batch > 0 || opts->int8 || opts->tiles ||
+        opts->prefetch || opts->pack_bench || opts->alloc_sweep || opts->epilogue ||
+        opts->multi_proj || opts->sparse || opts->pool > 0 || opts->fixed ||
+        opts->gpu || opts->autotune) {
+        int sections = 0;
+        if (opts->threads > 0) {
+            run_thread_sweep(matrix_8bit, matrix_2bit, input, output,
+                             rows, cols, opts->iterations,
+                             opts->threads, opts->pin);
+            sections++;
+        }
+        if (opts->batch > 0) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_batch_sweep(matrix_8bit, matrix_2bit, rows, cols,
+                            opts->iterations, opts->batch);
+        }
+        if (opts->int8) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_int8_comparison(matrix_2bit, input, rows, cols,
+                                opts->iterations);
+        }
+        if (opts->tiles) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_tile_sweep(matrix_2bit, input, output, rows, cols,
+                           opts->iterations, opts->row_tile, opts->col_tile);
+        }
+        if (opts->prefetch) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_prefetch_sweep(matrix_2bit, input, output, rows,
+                               cols, opts->iterations, opts->prefetch_distance);
+        }
+        if (opts->pack_bench) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_pack_bench(matrix_8bit, rows, cols);
+        }
+        if (opts->alloc_sweep) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_alloc_sweep(rows, cols, opts->sparsity, opts->iterations);
+        }
+        if (opts->epilogue) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_epilogue_sweep(matrix_2bit, input, output, rows, cols,
+                               opts->iterations, opts->group_size);
+        }
+        if (opts->multi_proj) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_multi_proj(matrix_2bit, input, rows, cols, opts->iterations,
+                           opts->sparsity);
+        }
+        if (opts->sparse) {
+            if (sections++) {
+                printf("\n");
+            }
+            double break_even;
+            if (run_sparse_sweep(rows, cols, opts->iterations, &break_even) != 0) {
+                weight_set_free(&ws);
+                return 1;
+            }
+            if (opts->plan_path) {
+                if (plan_store_break_even(rows, cols, break_even) != 0) {
+                    fprintf(stderr, "Plan is full (%d entries); not stored\n", PLAN_MAX_ENTRIES);
+                } else if (plan_save(opts->plan_path) == 0) {
+                    printf("Saved to %s for %d × %d on this CPU.\n", opts->plan_path, rows, cols);
+                }
+            }
+        }
+        if (opts->pool > 0) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_pool_sweep(matrix_2bit, rows, cols, opts->sparsity, opts->iterations,
+                           opts->pool, opts->pin);
+        }
+        if (opts->fixed) {
+            if (sections++) {
+                printf("\n");
+            }
+            run_fixed_sweep(matrix_2bit, input, output, rows, cols, opts->iterations);
+        }
+#ifdef TERNARY_GPU
+        if (opts->gpu) {
+            if (sections++) {
+                printf("\n");
+            }
+            if (run_gpu_bench(&ws, opts->iterations) != 0) {
+                weight_set_free(&ws);
+                return 1;
+            }
+        }
+#endif
+        if (opts->autotune) {
+            if (sections++) {
+                printf("\n");
+            }
+            const kernel_entry_t *best = run_autotune(&ws, opts->sparsity,
+                                                      opts->iterations);
+            if (!best || plan_save(opts->plan_path) != 0) {
+                weight_set_free(&ws);
+                return 1;
+            }
+            printf("\nPlan: %s for %d × %d at %.0f%% zeros, saved to %s\n",
+                   best->name, rows, cols, 100.0 * opts->sparsity, opts->plan_path);
+        }
+        weight_set_free(&ws);
+        return 0;
+    }
+
+    // Both sides come from the kernel registry: the baseline, and whatever
+    // the plan chose for this shape on this CPU. Without an autotuned entry
+    // a saved sparse break-even picks sparse or packed 2-bit.
+    const plan_entry_t *plan = plan_lookup(rows, cols, opts->sparsity);
+    const plan_break_even_t *even = plan ? NULL : plan_break_even(rows, cols);
+    const char *planned = plan ? plan->kernel : NULL;
+    if (even && ternary_prefer_sparse(opts->sparsity, even->break_even)) {
+        planned = "sparse";
+    }
+    const kernel_entry_t *baseline = ternary_find_kernel(KERNEL_BASELINE);
+    const kernel_entry_t *packed = ternary_find_kernel(KERNEL_DEFAULT);
+    const kernel_entry_t *ours = planned ? ternary_find_kernel(planned) : packed;
+    kernel_args_t args;
+    ternary_kernel_args_init(&args, &ws);
+    if (planned && (!ours || !ternary_kernel_available(ours) ||
+                    ternary_kernel_prepare(ours, &args) != 0)) {
+        fprintf(stderr, "Planned kernel '%s' cannot run here; using %s\n",
+                planned, KERNEL_DEFAULT);
+        ours = packed;
+    }
+
     // Warmup
     for (int i = 0; i < 10; i++) {
-        matvec_8bit(matrix_8bit, input, output, MATRIX_ROWS, MATRIX_COLS);
-        matvec_2bit(matrix_2bit, input, output, MATRIX_ROWS, MATRIX_COLS);
+        baseline->run(&args);
+        ours->run(&args);
     }
     
     // Benchmark 8-bit
     printf("Running Version A (8-bit)...\n");
     benchmark_result_t result_8bit;
-    benchmark_8bit(matrix_8bit, input, output, MATRIX_ROWS, MATRIX_COLS,
-                   ITERATIONS, &result_8bit);
+    benchmark_kernel(baseline, &args, opts->iterations, &result_8bit);
     
     // Benchmark 2-bit
     printf("Running Version B (2-bit packed)...\n");
     benchmark_result_t result_2bit;
-    benchmark_2bit(matrix_2bit, input, output, MATRIX_ROWS, MATRIX_COLS,
-                   ITERATIONS, &result_2bit);
+    benchmark_kernel(packed, &args, opts->iterations, &result_2bit);
+
+    benchmark_result_t result_ours = result_2bit;
+    if (ours != packed) {
+        printf("Running planned kernel (%s, %s)...\n", ours->name, *ours->impl);
+        benchmark_kernel(ours, &args, opts->iterations, &result_ours);
+    }
+    
+    // Alternative packed layouts, compared against the two results above
+    printf("Running Version C (2-bit bitplane)...\n");
+    benchmark_result_t format_results[WEIGHT_FORMAT_COUNT];
+    format_results[0] = result_8bit;
+    format_results[1] = result_2bit;
+    for (int i = 0; i < 10; i++) {
+        ternary_matvec_bitplane_impl(matrix_bitplane, input, output, rows, cols);
+    }
+    benchmark_format(FORMAT_BITPLANE, (const uint8_t*)matrix_bitplane, input, output,
+                     rows, cols, opts->iterations, &format_results[2]);
+
+    printf("Running Version D (1.6-bit base-3)...\n");
+    for (int i = 0; i < 10; i++) {
+        ternary_matvec_base3_impl(matrix_base3, input, output, rows, cols);
+    }
+    benchmark_format(FORMAT_BASE3, matrix_base3, input, output,
+                     rows, cols, opts->iterations, &format_results[3]);
     
     printf("\n");
     printf("========================================================================\n");
     printf("RESULTS\n");
     printf("========================================================================\n\n");
     
+    if (ours != packed && plan) {
+        printf("Ours is the planned kernel: %s (%s, %s), autotuned at %.3f ms/it.\n\n",
+               ours->name, ours->layout, *ours->impl, plan->ms);
+    } else if (ours != packed) {
+        printf("Ours is the planned kernel: %s (%s, %s), %.0f%% zeros being past\n"
+               "the %.1f%% sparse break-even.\n\n", ours->name, ours->layout, *ours->impl,
+               100.0 * opts->sparsity, 100.0 * even->break_even);
+    }
     printf("%-25s | %15s | %15s | %10s\n",
-           "Metric", "8-bit (Theirs)", "2-bit (Ours)", "Improvement");
+           "Metric", "8-bit (Theirs)", ours == packed ? "2-bit (Ours)" : "Plan (Ours)",
+           "Improvement");
     printf("------------------------------------------------------------------------\n");
     
-    printf("%-25s | %12.2f ms | %12.2f ms | %9.2fx\n",
-           "Total Time",
-           result_8bit.time_ms, result_2bit.time_ms,
-           result_8bit.time_ms / result_2bit.time_ms);
+    if (result_8bit.iterations == result_ours.iterations) {
+        printf("%-25s | %12.2f ms | %12.2f ms | %9.2fx\n",
+               "Total Time",
+               result_8bit.time_ms, result_ours.time_ms,
+               result_8bit.time_ms / result_ours.time_ms);
+    } else {
+        printf("%-25s | %12.3f ms | %12.3f ms | %9.2fx\n",
+               "Mean Time / Iteration",
+               result_8bit.stats.mean_ms, result_ours.stats.mean_ms,
+               result_8bit.stats.mean_ms / result_ours.stats.mean_ms);
+    }
+    printf("%-25s | %12.3f ms | %12.3f ms | %9.2fx\n",
+           "p99 Latency",
+           result_8bit.stats.p99_ms, result_ours.stats.p99_ms,
+           result_8bit.stats.p99_ms / result_ours.stats.p99_ms);
     
     printf("%-25s | %15zu | %15zu | %9.2fx\n",
            "Memory Footprint (KB)",
            result_8bit.memory_bytes / 1024,
-           result_2bit.memory_bytes / 1024,
-           (double)result_8bit.memory_bytes / result_2bit.memory_bytes);
+           result_ours.memory_bytes / 1024,
+           (double)result_8bit.memory_bytes / result_ours.memory_bytes);
     
 #ifdef USE_PERF
-    printf("%-25s | %15lld | %15lld | %9.2fx\n",
-           "Cache References",
-           result_8bit.cache_refs, result_2bit.cache_refs,
-           (double)result_8bit.cache_refs / result_2bit.cache_refs);
-    
-    printf("%-25s | %15lld | %15lld | %9.2fx\n",
-           "Cache Misses",
-           result_8bit.cache_misses, result_2bit.cache_misses,
-           (double)result_8bit.cache_misses / result_2bit.cache_misses);
-    
-    printf("%-25s | %13.2f%% | %13.2f%% | %9.2fx\n",
-           "Cache Miss Rate",
-           result_8bit.cache_miss_rate, result_2bit.cache_miss_rate,
-           result_8bit.cache_miss_rate / result_2bit.cache_miss_rate);
-    
-    printf("%-25s | %15lld | %15lld | %9.2fx\n",
-           "L1D Cache Misses",
-           result_8bit.l1d_misses, result_2bit.l1d_misses,
-           (double)result_8bit.l1d_misses / result_2bit.l1d_misses);
-    
-    printf("%-25s | %15lld | %15lld | %9.2fx\n",
-           "LLC (L3) Cache Misses",
-           result_8bit.llc_misses, result_2bit.llc_misses,
-           (double)result_8bit.llc_misses / result_2bit.llc_misses);
-    
-    printf("%-25s | %15.2f | %15.2f | %9.2fx\n",
-           "IPC (Instructions/Cycle)",
-           result_8bit.ipc, result_2bit.ipc,
-           result_2bit.ipc / result_8bit.ipc);
+    print_counter_row("Cache References", result_8bit.cache_refs, result_ours.cache_refs);
+    print_counter_row("Cache Misses", result_8bit.cache_misses, result_ours.cache_misses);
+    print_rate_row("Cache Miss Rate", result_8bit.cache_miss_rate,
+                   result_ours.cache_miss_rate, "%", 0);
+    print_counter_row("L1D Cache Misses", result_8bit.l1d_misses, result_ours.l1d_misses);
+    print_counter_row("LLC (L3) Cache Misses", result_8bit.llc_misses, result_ours.llc_misses);
+    print_counter_row("dTLB Load Misses", result_8bit.dtlb_misses, result_ours.dtlb_misses);
+    print_rate_row("IPC (Instructions/Cycle)", result_8bit.ipc, result_ours.ipc, "", 1);
+    print_counter_row("Stalled Cycles (Front)", result_8bit.stalled_frontend,
+                      result_ours.stalled_frontend);
+    print_counter_row("Stalled Cycles (Back)", result_8bit.stalled_backend,
+                      result_ours.stalled_backend);
+    print_counter_row("DRAM Reads (node-loads)", result_8bit.node_reads,
+                      result_ours.node_reads);
+    print_counter_row("DRAM Read MB (IMC)",
+                      result_8bit.dram_read_bytes < 0 ? -1 :
+                      result_8bit.dram_read_bytes >> 20,
+                      result_ours.dram_read_bytes < 0 ? -1 :
+                      result_ours.dram_read_bytes >> 20);
+
+    double coverage = result_8bit.counter_coverage < result_ours.counter_coverage ?
+                      result_8bit.counter_coverage : result_ours.counter_coverage;
+    if (coverage > 0.0 && coverage < 0.999) {
+        printf("\nCounters were multiplexed (on the PMU %.0f%% of the run); values are\n",
+               coverage * 100.0);
+        printf("scaled by time_enabled / time_running.\n");
+    }
+    if (result_8bit.dram_read_bytes >= 0) {
+        printf("IMC reads are system-wide and include other processes.\n");
+    }
 #endif
     
+    printf("\n========================================================================\n");
+    printf("PACKED FORMATS\n");
+    printf("========================================================================\n\n");
+    print_format_comparison(ternary_all_formats, format_results, WEIGHT_FORMAT_COUNT);
+
+    printf("\n========================================================================\n");
+    printf("LATENCY DISTRIBUTION\n");
+    printf("========================================================================\n\n");
+    print_latency_table(ternary_all_formats, format_results, WEIGHT_FORMAT_COUNT);
+
+    if (roof && roof->valid) {
+        printf("\n========================================================================\n");
+        printf("ROOFLINE (1 core)\n");
+        printf("========================================================================\n\n");
+        print_roofline_table(ternary_all_formats, format_results, WEIGHT_FORMAT_COUNT,
+                             rows, cols, roof);
+
+        const char *regime;
+        double bytes = roofline_bytes(result_ours.memory_bytes, rows, cols);
+        double fraction = roofline_fraction(roof, bytes, (double)rows * cols,
+                                            result_ours.stats.mean_ms, &regime);
+        const char *bound = roofline_bound(fraction, regime);
+        printf("\n%s (%s): %.0f%% of the %s roof, %s-bound.\n",
+               ours == packed ? "matvec_2bit" : ours->name, *ours->impl,
+               100.0 * fraction, regime, bound);
+        if (strcmp(bound, "decode") == 0) {
+            printf("Unpacking the weights, not memory traffic, limits this kernel.\n");
+        }
+    }
+
+    for (int i = 0; i < WEIGHT_FORMAT_COUNT; i++) {
+        result_sink_add(sink, rows, cols, ternary_format_name(ternary_all_formats[i]),
+                        ternary_format_kernel_name(ternary_all_formats[i]), &format_results[i]);
+    }
+    // The planned kernel gets its own "plan" row, so --compare also
+    // tracks whatever the plan picked for this shape
+    if (ours != packed) {
+        char kernel[48];
+        snprintf(kernel, sizeof(kernel), "%s %s", ours->name, *ours->impl);
+        result_sink_add(sink, rows, cols, "plan", kernel, &result_ours);
+    }
+    
     printf("\n========================================================================\n");
     printf("CONCLUSION\n");
     printf("========================================================================\n\n");
     
 #ifdef USE_PERF
-    double cache_miss_improvement = (double)result_8bit.cache_misses / result_2bit.cache_misses;
-    double bandwidth_improvement = (double)result_8bit.memory_bytes / result_2bit.memory_bytes;
+    double cache_miss_improvement = counter_ratio(result_8bit.cache_misses,
+                                                  result_ours.cache_misses);
+    double bandwidth_improvement = (double)result_8bit.memory_bytes / result_ours.memory_bytes;
     
-    printf("The 2-bit packed encoding reduces cache misses by %.1fx and memory\n",
-           cache_miss_improvement);
-    printf("footprint by %.1fx, directly addressing the memory bandwidth bottleneck\n",
-           bandwidth_improvement);
-    printf("in ternary neural network inference.\n\n");
+    if (cache_miss_improvement < 0.0) {
+        printf("Cache misses were not counted on this machine; memory footprint is\n");
+        printf("reduced by %.1fx.\n\n", bandwidth_improvement);
+    } else {
+        printf("The 2-bit packed encoding reduces cache misses by %.1fx and memory\n",
+               cache_miss_improvement);
+        printf("footprint by %.1fx, directly addressing the memory bandwidth bottleneck\n",
+               bandwidth_improvement);
+        printf("in ternary neural network inference.\n\n");
+    }
     
     if (cache_miss_improvement > 2.0) {
         printf("✓ SIGNIFICANT CACHE EFFICIENCY IMPROVEMENT CONFIRMED\n");
@@ -470,16 +5050,195 @@ int main() {
     }
 #else
     printf("Compile with -DUSE_PERF to measure hardware performance counters.\n");
-    printf("Time improvement: %.2fx\n", result_8bit.time_ms / result_2bit.time_ms);
+    printf("Time improvement: %.2fx\n",
+           result_8bit.stats.mean_ms / result_ours.stats.mean_ms);
     printf("Memory reduction: %.2fx\n",
-           (double)result_8bit.memory_bytes / result_2bit.memory_bytes);
+           (double)result_8bit.memory_bytes / result_ours.memory_bytes);
 #endif
     
-    // Cleanup
-    free(matrix_8bit);
-    free(matrix_2bit);
-    free(input);
-    free(output);
-    
+    ternary_kernel_args_free(&args);
+    weight_set_free(&ws);
+
     return 0;
 }
+
+// Every mode returns from main on its own path; the trace covers the run
+// up to whichever one does
+static const char *trace_output;
+
+static void write_trace_at_exit(void) {
+    ternary_trace_write(trace_output);
+}
+
+int main(int argc, char **argv) {
+    bench_options_t opts;
+    int status = parse_options(argc, argv, &opts);
+    if (status != 0) {
+        return status < 0 ? 2 : 0;
+    }
+    if (opts.compare_baseline) {
+        return run_compare(opts.compare_baseline, opts.compare_candidate,
+                           opts.compare_threshold);
+    }
+    if (opts.write_weights) {
+        ternary_init_kernel_dispatch();
+        return write_weight_file(opts.write_weights, opts.layout, opts.shape_rows[0],
+                                 opts.shape_cols[0], opts.sparsity);
+    }
+
+    printf("========================================================================\n");
+    printf("2-Bit Ternary Encoding Memory Bandwidth Micro-Benchmark\n");
+    printf("HyperFold Technologies UK Ltd.\n");
+    printf("========================================================================\n\n");
+    
+    ternary_init_kernel_dispatch();
+    if (opts.trace_path) {
+        trace_output = opts.trace_path;
+        ternary_trace_start();
+        atexit(write_trace_at_exit);
+    }
+    ternary_alloc_policy = opts.alloc;
+    ternary_alloc_numa_node = opts.numa_node;
+    timing_target_ci = opts.target_ci;
+    timing_max_iterations = opts.max_iterations;
+    int pinned = opts.pin_cpu >= 0 && ternary_pin_current_thread(opts.pin_cpu) == 0;
+    read_cpu_model(plan_cpu, sizeof(plan_cpu));
+    int planned = opts.plan_path ? plan_load(opts.plan_path) : -1;
+
+    printf("Configuration:\n");
+    if (opts.layers) {
+        printf("  Layer Profile: %s\n", opts.layers);
+    } else if (opts.decode) {
+        printf("  Token Decode: %s, %d tokens\n", opts.decode, opts.tokens);
+    } else if (opts.validate) {
+        printf("  Validation:   %d random shapes and %d edge / specialized ones\n",
+               VALIDATE_SHAPES, VALIDATE_EDGE_COUNT + FIXED_COL_COUNT);
+    } else if (opts.weights_path) {
+        printf("  Weight File:  %s\n", opts.weights_path);
+    } else if (opts.working_set) {
+        printf("  Working Set:  4 KB to %zu MB (8-bit footprint)\n",
+               opts.wss_max_bytes >> 20);
+    } else if (opts.nshapes == 1) {
+        printf("  Matrix Size:  %d × %d\n", opts.shape_rows[0], opts.shape_cols[0]);
+        printf("  Total Weights: %lld\n",
+               (long long)opts.shape_rows[0] * opts.shape_cols[0]);
+    } else {
+        printf("  Matrix Sizes:");
+        for (int i = 0; i < opts.nshapes; i++) {
+            printf("%s %d × %d", i ? "," : "", opts.shape_rows[i], opts.shape_cols[i]);
+        }
+        printf("\n");
+    }
+    printf("  Sparsity:     %.0f%%\n", opts.sparsity * 100.0f);
+    if (opts.target_ci > 0.0) {
+        printf("  Iterations:   %d, more until CI95 <= %.2f%% of mean (max %d)\n",
+               opts.iterations, opts.target_ci * 100.0, opts.max_iterations);
+    } else {
+        printf("  Iterations:   %d\n", opts.iterations);
+    }
+    if (opts.pin_cpu >= 0) {
+        printf("  Pinned CPU:   %d%s\n", opts.pin_cpu, pinned ? "" : " (pinning failed)");
+    }
+    print_cpu_frequency_policy(opts.pin_cpu >= 0 ? opts.pin_cpu : 0);
+    printf("  8-bit Kernel: %s\n", ternary_matvec_8bit_impl_name);
+    printf("  2-bit Kernel: %s\n", ternary_matvec_2bit_impl_name);
+    printf("  Bitplane Kernel: %s\n", ternary_matvec_bitplane_impl_name);
+    printf("  Base-3 Kernel: %s\n", ternary_matvec_base3_impl_name);
+    print_alloc_policy();
+    if (!opts.plan_path) {
+        printf("  Plan Cache:   off\n");
+    } else if (planned < 0) {
+        printf("  Plan Cache:   %s (none yet; --autotune writes it)\n", opts.plan_path);
+    } else {
+        printf("  Plan Cache:   %s (%d entr%s for this CPU)\n", opts.plan_path,
+               planned, planned == 1 ? "y" : "ies");
+    }
+#ifdef USE_PERF
+    printf("  Profiling:    Hardware Performance Counters (perf)\n");
+#else
+    printf("  Profiling:    Time only (compile with -DUSE_PERF for counters)\n");
+#endif
+    if (opts.trace_path) {
+        printf("  Tracing:      %s (Chrome trace JSON)\n", opts.trace_path);
+    }
+    printf("\n");
+
+    if (opts.layers) {
+        for (int i = 0; i < MODEL_SHAPE_COUNT; i++) {
+            const model_shape_t *model = &model_shapes[i];
+            if (strcmp(opts.layers, "all") != 0 && strcmp(opts.layers, model->name) != 0) {
+                continue;
+            }
+            if (model != &model_shapes[0] && strcmp(opts.layers, "all") == 0) {
+                printf("\n");
+            }
+            run_layer_profile(model, opts.sparsity, opts.iterations);
+        }
+        return 0;
+    }
+
+    if (opts.decode) {
+        const model_shape_t *model = find_model_shape(opts.decode);
+        int layers = opts.decode_layers > 0 ? opts.decode_layers : model->layers;
+        return run_decode(model, opts.layout, layers, opts.tokens, opts.lookahead,
+                          opts.pin_cpu, opts.sparsity) == 0 ? 0 : 1;
+    }
+
+    if (opts.validate) {
+        return run_validate(opts.validate_seed) == 0 ? 0 : 1;
+    }
+
+    if (opts.working_set) {
+        run_working_set_sweep(opts.sparsity, opts.wss_max_bytes, opts.csv_path);
+        return 0;
+    }
+
+    if (opts.weights_path) {
+        return run_weight_file(opts.weights_path, opts.map_flags, opts.sparsity,
+                               opts.iterations);
+    }
+
+    // Only the default comparison reports against the roofline
+    roofline_t roof;
+    int comparison = !(opts.threads > 0 || opts.batch > 0 || opts.int8 ||
+                       opts.tiles || opts.prefetch || opts.pack_bench ||
+                       opts.alloc_sweep || opts.epilogue || opts.multi_proj ||
+                       opts.sparse || opts.pool > 0 || opts.fixed || opts.gpu ||
+                       opts.autotune);
+    memset(&roof, 0, sizeof(roof));
+    if (comparison && opts.roofline) {
+        measure_roofline(&roof);
+        print_roofline(&roof);
+    }
+
+    result_sink_t sink;
+    if (result_sink_open(&sink, opts.json_path, opts.csv_path, opts.sparsity,
+                         opts.iterations, opts.target_ci, opts.pin_cpu, &roof) != 0) {
+        result_sink_close(&sink);
+        return 1;
+    }
+    for (int i = 0; i < opts.nshapes; i++) {
+        if (opts.nshapes > 1) {
+            printf("%s========================================================================\n",
+                   i ? "\n" : "");
+            printf("SHAPE %d × %d\n", opts.shape_rows[i], opts.shape_cols[i]);
+            printf("========================================================================\n\n");
+        }
+        status = run_shape(&opts, &sink, &roof, opts.shape_rows[i], opts.shape_cols[i]);
+        if (status != 0) {
+            break;
+        }
+    }
+    result_sink_close(&sink);
+    if (status == 0 && (opts.json_path || opts.csv_path)) {
+        printf("\nResults written to");
+        if (opts.json_path) {
+            printf(" %s", opts.json_path);
+        }
+        if (opts.csv_path) {
+            printf("%s %s", opts.json_path ? " and" : "", opts.csv_path);
+        }
+        printf("\n");
+    }
+    return status;
+}
@@ -132,9 +132,9 @@ echo "Running benchmark on ${os_info}..."
     echo "OS: ${os_info}"
     echo "Date (UTC): ${utc_date_display}"
     echo "------------------------"
-    ./benchmark
+    ./benchmark --json "${filename%.txt}.json"
 } | tee "$filename"
 
 echo ""
-echo "Results saved to: $filename"
+echo "Results saved to: $filename (and ${filename%.txt}.json)"
 echo "All benchmark results are stored in the '${OUTPUT_DIR}/' directory"
\ No newline at end of file
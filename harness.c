@@ -0,0 +1,850 @@
+/*
+ * The benchmark harness, linked into the benchmark but not the library:
+ * hardware performance counters (perf_event_open, built with -DUSE_PERF),
+ * timing statistics, the timing loop every benchmark mode goes through,
+ * random weight sets and the report printers.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+#ifdef USE_PERF
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "harness.h"
+
+// ============================================================================
+// PERFORMANCE COUNTER SETUP
+// ============================================================================
+// All core events live in one perf group so they are scheduled together and
+// read atomically with PERF_FORMAT_GROUP. If the kernel has to multiplex the
+// group, every value is scaled by time_enabled / time_running. Events the
+// CPU or kernel does not support (ENOENT, EOPNOTSUPP, or EINVAL because the
+// group no longer fits the PMU) are skipped and reported as n/a, never read.
+//
+// DRAM traffic comes from two optional sources: the generic "node-loads"
+// cache event (offcore response on Intel), and the Intel uncore IMC
+// cas_count_read counters. The IMC counters are system-wide, so they need
+// perf_event_paranoid <= 0 or CAP_PERFMON and include other processes.
+#ifdef USE_PERF
+static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+                           int cpu, int group_fd, unsigned long flags) {
+    return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
+}
+
+typedef enum {
+    PERF_EV_CYCLES,
+    PERF_EV_INSTRUCTIONS,
+    PERF_EV_LLC_READ_MISS,
+    PERF_EV_L1D_READ_MISS,
+    PERF_EV_DTLB_READ_MISS,
+    PERF_EV_CACHE_REFS,
+    PERF_EV_CACHE_MISSES,
+    PERF_EV_STALLED_FRONTEND,
+    PERF_EV_STALLED_BACKEND,
+    PERF_EV_NODE_READS,
+    PERF_EV_COUNT
+} perf_event_id_t;
+
+#define PERF_HW_CACHE_EVENT(cache, op, result) \
+    ((cache) | ((PERF_COUNT_HW_CACHE_OP_##op) << 8) | \
+     ((PERF_COUNT_HW_CACHE_RESULT_##result) << 16))
+
+// Opened in this order; the first one that opens leads the group
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_EV_COUNT] = {
+    { "cycles",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "LLC-read-misses", PERF_TYPE_HW_CACHE,
+      PERF_HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, READ, MISS) },
+    { "L1D-read-misses", PERF_TYPE_HW_CACHE,
+      PERF_HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, READ, MISS) },
+    { "dTLB-load-misses", PERF_TYPE_HW_CACHE,
+      PERF_HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, READ, MISS) },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "stalled-cycles-frontend", PERF_TYPE_HARDWARE,
+      PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+    { "stalled-cycles-backend", PERF_TYPE_HARDWARE,
+      PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+    { "node-loads",      PERF_TYPE_HW_CACHE,
+      PERF_HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_NODE, READ, ACCESS) },
+};
+
+#define PERF_MAX_UNCORE 32          // uncore_imc_N PMUs probed
+#define PERF_MAX_UNCORE_FDS 256     // one counter per PMU per listed CPU
+#define PERF_IMC_BYTES_PER_CAS 64
+
+typedef struct {
+    int leader;                       // group leader fd, -1 if nothing opened
+    int fd[PERF_EV_COUNT];            // -1: event unavailable
+    int slot[PERF_EV_COUNT];          // index in the group read, -1 if absent
+    int nr;                           // events in the group
+    int uncore_fd[PERF_MAX_UNCORE_FDS]; // IMC read-CAS counters, per channel and socket
+    int uncore_count;
+} perf_counters_t;
+
+typedef struct {
+    long long value[PERF_EV_COUNT];   // -1: not counted
+    long long dram_read_bytes;        // uncore IMC reads, -1 if unavailable
+    double coverage;                  // time_running / time_enabled
+} perf_sample_t;
+
+// Reads a one-line sysfs file; returns 0 on success
+static int read_sysfs_line(const char *path, char *buf, size_t size) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    int ok = fgets(buf, (int)size, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+// Builds an attr config from an event spec such as "event=0x04,umask=0x03",
+// placing each term at the bit offset from the PMU's format/<term> file
+static int parse_pmu_event(const char *pmu_dir, const char *spec, uint64_t *config) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    *config = 0;
+
+    for (char *term = strtok(buf, ",\n"); term; term = strtok(NULL, ",\n")) {
+        char *eq = strchr(term, '=');
+        if (!eq) {
+            return -1;
+        }
+        *eq = '\0';
+        char path[512], fmt[64];
+        int lo;
+        snprintf(path, sizeof(path), "%s/format/%s", pmu_dir, term);
+        if (read_sysfs_line(path, fmt, sizeof(fmt)) != 0 ||
+            sscanf(fmt, "config:%d", &lo) != 1) {
+            return -1;
+        }
+        *config |= strtoull(eq + 1, NULL, 0) << lo;
+    }
+    return 0;
+}
+
+// Parses a sysfs CPU list such as "0", "0,28" or "0-3,8" into cpus[];
+// returns the number stored, at most max
+static int parse_cpu_list(const char *list, int *cpus, int max) {
+    int n = 0;
+    const char *p = list;
+    while (*p && *p != '\n' && n < max) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0) {
+            break;
+        }
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo) {
+                break;
+            }
+            p = end;
+        }
+        for (long cpu = lo; cpu <= hi && n < max; cpu++) {
+            cpus[n++] = (int)cpu;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return n;
+}
+
+// Opens cas_count_read on every IMC channel. An uncore PMU's cpumask lists
+// one CPU per socket, and each counter only sees its own socket, so one is
+// opened per listed CPU and read_perf_counters() sums them all.
+static void setup_uncore_counters(perf_counters_t *counters) {
+    counters->uncore_count = 0;
+    for (int i = 0; i < PERF_MAX_UNCORE; i++) {
+        char dir[128], path[256], line[256];
+        snprintf(dir, sizeof(dir), "/sys/bus/event_source/devices/uncore_imc_%d", i);
+
+        snprintf(path, sizeof(path), "%s/type", dir);
+        if (read_sysfs_line(path, line, sizeof(line)) != 0) {
+            if (i == 0) {
+                // Some servers number from uncore_imc_1; keep looking
+                continue;
+            }
+            break;
+        }
+        uint32_t type = (uint32_t)strtoul(line, NULL, 10);
+
+        uint64_t config;
+        snprintf(path, sizeof(path), "%s/events/cas_count_read", dir);
+        if (read_sysfs_line(path, line, sizeof(line)) != 0 ||
+            parse_pmu_event(dir, line, &config) != 0) {
+            continue;
+        }
+
+        int cpus[PERF_MAX_UNCORE_FDS], ncpus = 0;
+        snprintf(path, sizeof(path), "%s/cpumask", dir);
+        if (read_sysfs_line(path, line, sizeof(line)) == 0) {
+            ncpus = parse_cpu_list(line, cpus, PERF_MAX_UNCORE_FDS);
+        }
+        if (ncpus == 0) {
+            cpus[ncpus++] = 0;
+        }
+
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type = type;
+        pe.size = sizeof(pe);
+        pe.config = config;
+        pe.disabled = 1;
+        for (int c = 0; c < ncpus && counters->uncore_count < PERF_MAX_UNCORE_FDS; c++) {
+            int fd = (int)perf_event_open(&pe, -1, cpus[c], -1, 0);
+            if (fd >= 0) {
+                counters->uncore_fd[counters->uncore_count++] = fd;
+            }
+        }
+    }
+}
+
+// Returns the number of core events opened; warns once per process about
+// the ones that were skipped
+static int setup_perf_counters(perf_counters_t *counters) {
+    static int warned = 0;
+    struct perf_event_attr pe;
+
+    counters->leader = -1;
+    counters->nr = 0;
+    for (int i = 0; i < PERF_EV_COUNT; i++) {
+        memset(&pe, 0, sizeof(pe));
+        pe.type = perf_events[i].type;
+        pe.size = sizeof(pe);
+        pe.config = perf_events[i].config;
+        pe.disabled = counters->leader < 0;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        int fd = (int)perf_event_open(&pe, 0, -1, counters->leader, 0);
+        counters->fd[i] = fd;
+        counters->slot[i] = -1;
+        if (fd < 0) {
+            if (!warned) {
+                fprintf(stderr, "perf: skipping %s: %s\n",
+                        perf_events[i].name, strerror(errno));
+            }
+            continue;
+        }
+        if (counters->leader < 0) {
+            counters->leader = fd;
+        }
+        counters->slot[i] = counters->nr++;
+    }
+
+    setup_uncore_counters(counters);
+    if (!warned && counters->uncore_count == 0) {
+        fprintf(stderr, "perf: no uncore IMC counters (needs Intel uncore and "
+                        "perf_event_paranoid <= 0)\n");
+    }
+    if (!warned && counters->nr == 0) {
+        fprintf(stderr, "perf: no core counters available; check "
+                        "/proc/sys/kernel/perf_event_paranoid\n");
+    }
+    warned = 1;
+    return counters->nr;
+}
+
+static void start_perf_counters(perf_counters_t *counters) {
+    if (counters->leader >= 0) {
+        ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    for (int i = 0; i < counters->uncore_count; i++) {
+        ioctl(counters->uncore_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->uncore_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void stop_perf_counters(perf_counters_t *counters, perf_sample_t *sample) {
+    for (int i = 0; i < PERF_EV_COUNT; i++) {
+        sample->value[i] = -1;
+    }
+    sample->dram_read_bytes = -1;
+    sample->coverage = 0.0;
+
+    if (counters->leader >= 0) {
+        ioctl(counters->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        // { nr, time_enabled, time_running, value[nr] }
+        uint64_t buf[3 + PERF_EV_COUNT];
+        ssize_t want = (ssize_t)((3 + counters->nr) * sizeof(uint64_t));
+        if (read(counters->leader, buf, sizeof(buf)) == want &&
+            buf[0] == (uint64_t)counters->nr && buf[2] > 0) {
+            double scale = (double)buf[1] / (double)buf[2];
+            sample->coverage = (double)buf[2] / (double)buf[1];
+            for (int i = 0; i < PERF_EV_COUNT; i++) {
+                if (counters->slot[i] >= 0) {
+                    sample->value[i] = (long long)(buf[3 + counters->slot[i]] * scale);
+                }
+            }
+        }
+    }
+
+    if (counters->uncore_count > 0) {
+        long long cas = 0;
+        int ok = 1;
+        for (int i = 0; i < counters->uncore_count; i++) {
+            uint64_t count;
+            ioctl(counters->uncore_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters->uncore_fd[i], &count, sizeof(count)) != sizeof(count)) {
+                ok = 0;
+                break;
+            }
+            cas += (long long)count;
+        }
+        if (ok) {
+            sample->dram_read_bytes = cas * PERF_IMC_BYTES_PER_CAS;
+        }
+    }
+}
+
+static void close_perf_counters(perf_counters_t *counters) {
+    for (int i = 0; i < PERF_EV_COUNT; i++) {
+        if (counters->fd[i] >= 0) {
+            close(counters->fd[i]);
+        }
+    }
+    for (int i = 0; i < counters->uncore_count; i++) {
+        close(counters->uncore_fd[i]);
+    }
+}
+#endif
+
+// ============================================================================
+// TIMING STATISTICS
+// ============================================================================
+// Every timed iteration is recorded into a buffer allocated before timing
+// starts, so the timed loop only calls the kernel and reads the clock.
+// With timing_target_ci > 0 (--target-ci), benchmark_format keeps adding
+// iterations until the 95% confidence interval of the mean is within that
+// fraction of the mean, or until timing_max_iterations / TIMING_MAX_MS.
+
+double timing_target_ci = 0.0;      // 0: fixed iteration count
+int timing_max_iterations = 10000;
+
+double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Newton's method: the build does not link libm
+double sqrt_nolibm(double x) {
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    double r = x > 1.0 ? x : 1.0;
+    for (int i = 0; i < 60; i++) {
+        double next = 0.5 * (r + x / r);
+        if (next == r) {
+            break;
+        }
+        r = next;
+    }
+    return r;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of an ascending array
+static double percentile_sorted(const double *sorted, int n, double p) {
+    int rank = (int)(p * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+static void mean_and_ci(const double *samples, int n, double *mean,
+                        double *stddev, double *ci95) {
+    double sum = 0.0, sum_sq = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    *mean = n > 0 ? sum / n : 0.0;
+    for (int i = 0; i < n; i++) {
+        double d = samples[i] - *mean;
+        sum_sq += d * d;
+    }
+    *stddev = n > 1 ? sqrt_nolibm(sum_sq / (n - 1)) : 0.0;
+    *ci95 = n > 1 ? 1.96 * *stddev / sqrt_nolibm((double)n) : 0.0;
+}
+
+void compute_timing_stats(const double *samples, int n, timing_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->count = n;
+    if (n == 0) {
+        return;
+    }
+    mean_and_ci(samples, n, &stats->mean_ms, &stats->stddev_ms, &stats->ci95_ms);
+
+    double *sorted = (double*)malloc((size_t)n * sizeof(double));
+    if (!sorted) {
+        return;
+    }
+    memcpy(sorted, samples, (size_t)n * sizeof(double));
+    qsort(sorted, (size_t)n, sizeof(double), compare_doubles);
+    stats->min_ms = sorted[0];
+    stats->median_ms = percentile_sorted(sorted, n, 0.5);
+    stats->p90_ms = percentile_sorted(sorted, n, 0.9);
+    stats->p99_ms = percentile_sorted(sorted, n, 0.99);
+    free(sorted);
+}
+
+// Reports the frequency governor and turbo state of `cpu`; both are the
+// usual sources of run-to-run variance
+void print_cpu_frequency_policy(int cpu) {
+#ifdef __linux__
+    char path[128], buf[64];
+    FILE *f;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+    if ((f = fopen(path, "r")) && fgets(buf, sizeof(buf), f)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        printf("  CPU Governor: %s\n", buf);
+        if (strcmp(buf, "performance") != 0) {
+            printf("  Warning:      governor is not 'performance'; frequency scaling\n");
+            printf("                adds variance (cpupower frequency-set -g performance)\n");
+        }
+    } else {
+        printf("  CPU Governor: unknown (no cpufreq)\n");
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    int turbo = -1, value;
+    if ((f = fopen("/sys/devices/system/cpu/intel_pstate/no_turbo", "r"))) {
+        if (fscanf(f, "%d", &value) == 1) turbo = !value;
+        fclose(f);
+    } else if ((f = fopen("/sys/devices/system/cpu/cpufreq/boost", "r"))) {
+        if (fscanf(f, "%d", &value) == 1) turbo = value;
+        fclose(f);
+    }
+    if (turbo >= 0) {
+        printf("  Turbo/Boost:  %s\n", turbo ? "on (clock varies with load and temperature)"
+                                             : "off");
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+// ============================================================================
+// BENCHMARK HARNESS
+// ============================================================================
+
+double counter_ratio(long long num, long long den) {
+    return num >= 0 && den > 0 ? (double)num / (double)den : -1.0;
+}
+
+typedef struct {
+    weight_format_t format;
+    const uint8_t *matrix;
+    const float *input;
+    float *output;
+    int rows;
+    int cols;
+} format_call_t;
+
+static void format_call(const void *ctx) {
+    const format_call_t *c = (const format_call_t*)ctx;
+    ternary_matvec_rows(c->format, c->matrix, c->input, c->output, 0, c->rows, c->cols);
+}
+
+// Times samples[begin..end) one call each
+static void time_samples(matvec_call_fn call, const void *ctx,
+                         double *samples, int begin, int end) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = begin; i < end; i++) {
+        call(ctx);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        samples[i] = elapsed_ms(&t0, &t1);
+        t0 = t1;
+    }
+}
+
+// Times `iterations` calls, or more when auto-calibrating toward
+// timing_target_ci. memory_bytes is left for the caller to fill in.
+void benchmark_call(matvec_call_fn call, const void *ctx, int iterations,
+                    benchmark_result_t *result) {
+    int capacity = iterations;
+    if (timing_target_ci > 0.0 && timing_max_iterations > capacity) {
+        capacity = timing_max_iterations;
+    }
+    double *samples = (double*)malloc((size_t)capacity * sizeof(double));
+    if (!samples) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    
+#ifdef USE_PERF
+    perf_counters_t counters;
+    setup_perf_counters(&counters);
+    start_perf_counters(&counters);
+#endif
+    
+    int count = iterations;
+    time_samples(call, ctx, samples, 0, count);
+
+    if (timing_target_ci > 0.0) {
+        double total_ms = 0.0;
+        for (int i = 0; i < count; i++) {
+            total_ms += samples[i];
+        }
+        for (;;) {
+            double mean, stddev, ci95;
+            mean_and_ci(samples, count, &mean, &stddev, &ci95);
+            if (ci95 <= timing_target_ci * mean || count >= capacity ||
+                total_ms >= TIMING_MAX_MS) {
+                break;
+            }
+            int more = count < capacity - count ? count : capacity - count;
+            time_samples(call, ctx, samples, count, count + more);
+            for (int i = count; i < count + more; i++) {
+                total_ms += samples[i];
+            }
+            count += more;
+        }
+    }
+    
+#ifdef USE_PERF
+    perf_sample_t sample;
+    stop_perf_counters(&counters, &sample);
+    close_perf_counters(&counters);
+
+    result->cycles = sample.value[PERF_EV_CYCLES];
+    result->instructions = sample.value[PERF_EV_INSTRUCTIONS];
+    result->cache_refs = sample.value[PERF_EV_CACHE_REFS];
+    result->cache_misses = sample.value[PERF_EV_CACHE_MISSES];
+    result->l1d_misses = sample.value[PERF_EV_L1D_READ_MISS];
+    result->llc_misses = sample.value[PERF_EV_LLC_READ_MISS];
+    result->dtlb_misses = sample.value[PERF_EV_DTLB_READ_MISS];
+    result->stalled_frontend = sample.value[PERF_EV_STALLED_FRONTEND];
+    result->stalled_backend = sample.value[PERF_EV_STALLED_BACKEND];
+    result->node_reads = sample.value[PERF_EV_NODE_READS];
+    result->dram_read_bytes = sample.dram_read_bytes;
+    result->counter_coverage = sample.coverage;
+#else
+    result->cycles = -1;
+    result->instructions = -1;
+    result->cache_refs = -1;
+    result->cache_misses = -1;
+    result->l1d_misses = -1;
+    result->llc_misses = -1;
+    result->dtlb_misses = -1;
+    result->stalled_frontend = -1;
+    result->stalled_backend = -1;
+    result->node_reads = -1;
+    result->dram_read_bytes = -1;
+    result->counter_coverage = 0.0;
+#endif
+    result->cache_miss_rate = counter_ratio(result->cache_misses, result->cache_refs);
+    if (result->cache_miss_rate >= 0.0) {
+        result->cache_miss_rate *= 100.0;
+    }
+    result->ipc = counter_ratio(result->instructions, result->cycles);
+    
+    compute_timing_stats(samples, count, &result->stats);
+    free(samples);
+    result->iterations = count;
+    result->time_ms = result->stats.mean_ms * count;
+}
+
+// Times `iterations` whole-matrix matvecs in any weight format, or more
+// when auto-calibrating toward timing_target_ci
+void benchmark_format(weight_format_t format, const uint8_t *matrix,
+                      const float *input, float *output, int rows, int cols,
+                      int iterations, benchmark_result_t *result) {
+    format_call_t ctx = { format, matrix, input, output, rows, cols };
+    benchmark_call(format_call, &ctx, iterations, result);
+    result->memory_bytes = (size_t)rows * ternary_format_row_bytes(format, cols);
+}
+
+void benchmark_8bit(const int8_t *matrix, const float *input, float *output,
+                   int rows, int cols, int iterations,
+                   benchmark_result_t *result) {
+    benchmark_format(FORMAT_8BIT, (const uint8_t*)matrix, input, output,
+                     rows, cols, iterations, result);
+}
+
+void benchmark_2bit(const uint8_t *matrix_packed, const float *input,
+                   float *output, int rows, int cols, int iterations,
+                   benchmark_result_t *result) {
+    benchmark_format(FORMAT_2BIT, matrix_packed, input, output,
+                     rows, cols, iterations, result);
+}
+
+// Up to max_iterations matvecs, stopping early (after min_iterations) once
+// budget_ms has elapsed, so slow formats on large shapes stay bounded.
+// Returns ms per iteration after one untimed warmup call. With stats
+// non-NULL, per-iteration samples (up to max_iterations) are kept too.
+double time_format_budget(weight_format_t format, const uint8_t *matrix,
+                          const float *input, float *output,
+                          int rows, int cols, int min_iterations,
+                          int max_iterations, double budget_ms,
+                          timing_stats_t *stats) {
+    struct timespec start, last, now;
+    double *samples = NULL;
+    if (stats) {
+        samples = (double*)malloc((size_t)max_iterations * sizeof(double));
+    }
+    ternary_matvec_rows(format, matrix, input, output, 0, rows, cols);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    int done = 0;
+    double elapsed = 0.0;
+    while (done < max_iterations) {
+        ternary_matvec_rows(format, matrix, input, output, 0, rows, cols);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (samples) {
+            samples[done] = elapsed_ms(&last, &now);
+        }
+        last = now;
+        done++;
+        elapsed = elapsed_ms(&start, &now);
+        if (done >= min_iterations && elapsed > budget_ms) {
+            break;
+        }
+    }
+
+    if (stats) {
+        compute_timing_stats(samples, samples ? done : 0, stats);
+        free(samples);
+    }
+    return elapsed / done;
+}
+
+// One row per format; speedups are relative to the first entry
+void print_format_comparison(const weight_format_t *formats,
+                             const benchmark_result_t *results, int count) {
+    printf("%-16s | %-7s | %12s | %12s | %10s | %9s\n",
+           "Format", "Kernel", "Footprint KB", "ms/iter", "GB/s", "vs 8-bit");
+    printf("--------------------------------------------------------------------------------\n");
+
+    for (int i = 0; i < count; i++) {
+        double ms = results[i].stats.mean_ms;
+        printf("%-16s | %-7s | %12zu | %12.3f | %10.2f | %8.2fx\n",
+               ternary_format_name(formats[i]), ternary_format_kernel_name(formats[i]),
+               results[i].memory_bytes / 1024, ms,
+               results[i].memory_bytes / (ms * 1e6),
+               results[0].stats.mean_ms / ms);
+    }
+    printf("\nGB/s counts weight bytes streamed per matvec.\n");
+}
+
+// Per-iteration latency distribution, one row per format
+void print_latency_table(const weight_format_t *formats,
+                         const benchmark_result_t *results, int count) {
+    printf("%-16s | %6s | %9s | %9s | %9s | %9s | %9s | %8s\n",
+           "Format", "Iters", "min ms", "median", "p90", "p99", "stddev", "CI95 %");
+    printf("---------------------------------------------------------------------------------------------\n");
+
+    for (int i = 0; i < count; i++) {
+        const timing_stats_t *t = &results[i].stats;
+        printf("%-16s | %6d | %9.3f | %9.3f | %9.3f | %9.3f | %9.4f | %7.2f%%\n",
+               ternary_format_name(formats[i]), t->count, t->min_ms, t->median_ms,
+               t->p90_ms, t->p99_ms, t->stddev_ms,
+               t->mean_ms > 0.0 ? 100.0 * t->ci95_ms / t->mean_ms : 0.0);
+    }
+    printf("\nCI95 is the half-width of the 95%% confidence interval of the mean.\n");
+}
+
+#ifdef USE_PERF
+// RESULTS table rows; a side that was not counted prints n/a
+static void format_counter(char *buf, size_t size, long long value) {
+    if (value < 0) {
+        snprintf(buf, size, "n/a");
+    } else {
+        snprintf(buf, size, "%lld", value);
+    }
+}
+
+void print_counter_row(const char *label, long long a, long long b) {
+    char sa[32], sb[32];
+    format_counter(sa, sizeof(sa), a);
+    format_counter(sb, sizeof(sb), b);
+    double ratio = counter_ratio(a, b);
+    if (ratio < 0.0) {
+        printf("%-25s | %15s | %15s | %10s\n", label, sa, sb, "n/a");
+    } else {
+        printf("%-25s | %15s | %15s | %9.2fx\n", label, sa, sb, ratio);
+    }
+}
+
+// invert: improvement is b / a (higher is better, e.g. IPC)
+void print_rate_row(const char *label, double a, double b,
+                    const char *unit, int invert) {
+    char sa[32], sb[32];
+    if (a < 0.0) snprintf(sa, sizeof(sa), "n/a");
+    else snprintf(sa, sizeof(sa), "%.2f%s", a, unit);
+    if (b < 0.0) snprintf(sb, sizeof(sb), "n/a");
+    else snprintf(sb, sizeof(sb), "%.2f%s", b, unit);
+    double num = invert ? b : a, den = invert ? a : b;
+    if (num < 0.0 || den <= 0.0) {
+        printf("%-25s | %15s | %15s | %10s\n", label, sa, sb, "n/a");
+    } else {
+        printf("%-25s | %15s | %15s | %9.2fx\n", label, sa, sb, num / den);
+    }
+}
+#endif
+
+// ============================================================================
+// ALLOCATION POLICY
+// ============================================================================
+int parse_alloc_policy(const char *name, alloc_policy_t *policy) {
+    for (int i = 0; i < ALLOC_POLICY_COUNT; i++) {
+        if (strcmp(name, ternary_alloc_policy_names[i]) == 0) {
+            *policy = (alloc_policy_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void print_alloc_policy(void) {
+    printf("  Allocator:    %s", ternary_alloc_policy_names[ternary_alloc_policy]);
+    if (ternary_alloc_policy == ALLOC_THP || ternary_alloc_policy == ALLOC_HUGETLB) {
+        printf(" (THP mode: %s)", ternary_thp_mode());
+    }
+    if (ternary_alloc_numa_node >= 0) {
+        printf(", bound to NUMA node %d", ternary_alloc_numa_node);
+    }
+    printf("\n");
+}
+
+// ============================================================================
+// DATA GENERATION
+// ============================================================================
+void generate_ternary_matrix_8bit(int8_t *matrix, int rows, int cols,
+                                  float sparsity) {
+    for (size_t i = 0; i < (size_t)rows * cols; i++) {
+        float r = (float)rand() / RAND_MAX;
+        if (r < sparsity) {
+            matrix[i] = 0;
+        } else if (r < sparsity + (1.0f - sparsity) / 2.0f) {
+            matrix[i] = 1;
+        } else {
+            matrix[i] = -1;
+        }
+    }
+}
+
+void generate_input_vector(float *vec, int size) {
+    for (int i = 0; i < size; i++) {
+        vec[i] = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
+    }
+}
+
+// ============================================================================
+// WEIGHT SETS
+// ============================================================================
+// One random ternary matrix of a given shape, packed into every format,
+// with an input and an output vector to match. Seeded per set, so the same
+// shape and sparsity always produce the same weights. Every buffer comes
+// from ternary_alloc(), so --alloc covers weights and activations alike.
+
+void weight_set_free(weight_set_t *ws) {
+    ternary_free(ws->matrix_8bit);
+    ternary_free(ws->matrix_2bit);
+    ternary_free(ws->matrix_bitplane);
+    ternary_free(ws->matrix_base3);
+    ternary_free(ws->input);
+    ternary_free(ws->output);
+    memset(ws, 0, sizeof(*ws));
+}
+
+// Returns 0 on success; on failure nothing is left allocated
+int weight_set_alloc(weight_set_t *ws, int rows, int cols, float sparsity) {
+    ws->rows = rows;
+    ws->cols = cols;
+    ws->matrix_8bit = (int8_t*)ternary_alloc((size_t)rows *
+                                             ternary_format_row_bytes(FORMAT_8BIT, cols));
+    ws->matrix_2bit = (uint8_t*)ternary_alloc((size_t)rows *
+                                              ternary_format_row_bytes(FORMAT_2BIT, cols));
+    ws->matrix_bitplane = (uint64_t*)ternary_alloc((size_t)rows *
+                                                   ternary_format_row_bytes(FORMAT_BITPLANE, cols));
+    ws->matrix_base3 = (uint8_t*)ternary_alloc((size_t)rows *
+                                               ternary_format_row_bytes(FORMAT_BASE3, cols));
+    ws->input = (float*)ternary_alloc((size_t)cols * sizeof(float));
+    ws->output = (float*)ternary_alloc((size_t)rows * sizeof(float));
+
+    if (!ws->matrix_8bit || !ws->matrix_2bit || !ws->matrix_bitplane ||
+        !ws->matrix_base3 || !ws->input || !ws->output) {
+        weight_set_free(ws);
+        return -1;
+    }
+
+    srand(42);
+    generate_ternary_matrix_8bit(ws->matrix_8bit, rows, cols, sparsity);
+    int threads = ternary_online_cpus();
+    ternary_pack_matrix(FORMAT_2BIT, ws->matrix_8bit, ws->matrix_2bit, rows, cols, threads);
+    ternary_pack_matrix(FORMAT_BITPLANE, ws->matrix_8bit, (uint8_t*)ws->matrix_bitplane,
+                        rows, cols, threads);
+    ternary_pack_matrix(FORMAT_BASE3, ws->matrix_8bit, ws->matrix_base3, rows, cols, threads);
+    generate_input_vector(ws->input, cols);
+    return 0;
+}
+
+const uint8_t *weight_set_matrix(const weight_set_t *ws, weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return (const uint8_t*)ws->matrix_8bit;
+    case FORMAT_2BIT:     return ws->matrix_2bit;
+    case FORMAT_BITPLANE: return (const uint8_t*)ws->matrix_bitplane;
+    case FORMAT_BASE3:    return ws->matrix_base3;
+    }
+    return NULL;
+}
+
+// ============================================================================
+// REGISTRY KERNELS
+// ============================================================================
+typedef struct {
+    const kernel_entry_t *kernel;
+    const kernel_args_t *args;
+} kernel_call_t;
+
+static void kernel_call(const void *ctx) {
+    const kernel_call_t *c = (const kernel_call_t*)ctx;
+    c->kernel->run(c->args);
+}
+
+// benchmark_format() for a registry kernel; ternary_kernel_prepare() must have run
+void benchmark_kernel(const kernel_entry_t *k, const kernel_args_t *a,
+                      int iterations, benchmark_result_t *result) {
+    kernel_call_t ctx = { k, a };
+    benchmark_call(kernel_call, &ctx, iterations, result);
+    result->memory_bytes = ternary_kernel_bytes(k, a);
+}
@@ -0,0 +1,111 @@
+/*
+ * Benchmark harness
+ *
+ * Timing, perf counters, random weight sets and the report printers the
+ * benchmark modes share, built from harness.c into the benchmark only.
+ * None of it is part of libternary.a or libternary.so, so nothing here
+ * carries the ternary_ prefix; ternary.h is the library's interface.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#ifndef TERNARY_HARNESS_H
+#define TERNARY_HARNESS_H
+
+#include "ternary.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ============================================================================
+// DATA GENERATION AND WEIGHT SETS
+// ============================================================================
+void generate_ternary_matrix_8bit(int8_t *matrix, int rows, int cols,
+                                  float sparsity);
+void generate_input_vector(float *vec, int size);
+
+// --alloc names
+int parse_alloc_policy(const char *name, alloc_policy_t *policy);
+void print_alloc_policy(void);
+
+// One seeded random matrix packed in every format, from ternary_alloc()
+void weight_set_free(weight_set_t *ws);
+int weight_set_alloc(weight_set_t *ws, int rows, int cols, float sparsity);
+const uint8_t *weight_set_matrix(const weight_set_t *ws, weight_format_t format);
+
+// ============================================================================
+// PERF COUNTERS, TIMING AND HARNESS
+// ============================================================================
+#define TIMING_MAX_MS 30000.0
+
+// Counter fields are -1 (ratios -1.0) when the event was not counted
+typedef struct {
+    double time_ms;
+    long long cycles;
+    long long instructions;
+    long long cache_refs;
+    long long cache_misses;
+    long long l1d_misses;
+    long long llc_misses;
+    long long dtlb_misses;
+    long long stalled_frontend;
+    long long stalled_backend;
+    long long node_reads;
+    long long dram_read_bytes;
+    double counter_coverage;    // fraction of the run the group was on the PMU
+    double cache_miss_rate;
+    double ipc;
+    size_t memory_bytes;
+    int iterations;             // timed iterations actually run
+    timing_stats_t stats;       // per-iteration latency distribution
+} benchmark_result_t;
+
+// One whole-matrix matvec of whatever is being timed; ctx is caller data
+typedef void (*matvec_call_fn)(const void *ctx);
+
+extern double timing_target_ci;      // 0: fixed iteration count
+extern int timing_max_iterations;
+
+// Timing statistics
+double elapsed_ms(const struct timespec *start, const struct timespec *end);
+double sqrt_nolibm(double x);
+void compute_timing_stats(const double *samples, int n, timing_stats_t *stats);
+void print_cpu_frequency_policy(int cpu);
+
+// Benchmark harness; results honour timing_target_ci
+double counter_ratio(long long num, long long den);
+void benchmark_call(matvec_call_fn call, const void *ctx, int iterations,
+                    benchmark_result_t *result);
+void benchmark_format(weight_format_t format, const uint8_t *matrix,
+                      const float *input, float *output, int rows, int cols,
+                      int iterations, benchmark_result_t *result);
+void benchmark_8bit(const int8_t *matrix, const float *input, float *output,
+                   int rows, int cols, int iterations,
+                   benchmark_result_t *result);
+void benchmark_2bit(const uint8_t *matrix_packed, const float *input,
+                   float *output, int rows, int cols, int iterations,
+                   benchmark_result_t *result);
+double time_format_budget(weight_format_t format, const uint8_t *matrix,
+                          const float *input, float *output,
+                          int rows, int cols, int min_iterations,
+                          int max_iterations, double budget_ms,
+                          timing_stats_t *stats);
+void print_format_comparison(const weight_format_t *formats,
+                             const benchmark_result_t *results, int count);
+void print_latency_table(const weight_format_t *formats,
+                         const benchmark_result_t *results, int count);
+void print_counter_row(const char *label, long long a, long long b);
+void print_rate_row(const char *label, double a, double b,
+                    const char *unit, int invert);
+
+// benchmark_call() on a registry kernel
+void benchmark_kernel(const kernel_entry_t *k, const kernel_args_t *a,
+                      int iterations, benchmark_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,461 @@
+/*
+ * Ternary matvec library
+ *
+ * The packing and kernels behind the benchmark, built as libternary.a and
+ * libternary.so (make lib). An inference server links the same objects the
+ * benchmark times:
+ *   ternary_kernels.c   weight layouts, packers and every matvec kernel,
+ *                       with runtime ISA dispatch
+ *   ternary_memory.c    ternary_alloc() policies
+ *   ternary_pool.c      the work-stealing thread pool and CPU pinning
+ *   ternary_trace.c     span tracing to Chrome trace JSON (-DTERNARY_TRACE)
+ *   ternary_registry.c  the named registry of whole-matrix kernels
+ *   ternary_cuda.cu     the CUDA / HIP backend (make cuda / make hip)
+ * Call ternary_init_kernel_dispatch() once before using any *_impl pointer.
+ *
+ * Every symbol the library defines is prefixed ternary_, and only the
+ * TERNARY_API declarations below are exported from libternary.so. The
+ * benchmark harness (timing, perf counters, printers, weight sets) lives
+ * in harness.c / harness.h and is linked into the benchmark alone.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#ifndef TERNARY_H
+#define TERNARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TERNARY_API __attribute__((visibility("default")))
+#else
+#define TERNARY_API
+#endif
+
+// ============================================================================
+// TRACING (ternary_trace.c)
+// ============================================================================
+// TRACE_BEGIN(t) ... TRACE_END(t, "name", n) records one span with an
+// integer argument (rows, a layer index) on the calling thread. Without
+// -DTERNARY_TRACE (make trace) both expand to nothing.
+#ifdef TERNARY_TRACE
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+#endif
+}
+
+TERNARY_API void ternary_trace_event(const char *name, uint64_t begin, uint64_t end, long long arg);
+
+#define TRACE_BEGIN(t) uint64_t t = trace_clock()
+#define TRACE_END(t, name, arg) ternary_trace_event((name), (t), trace_clock(), (arg))
+#else
+#define TRACE_BEGIN(t) ((void)0)
+#define TRACE_END(t, name, arg) ((void)0)
+#endif
+
+// ternary_trace_start() clears the rings and starts recording; ternary_trace_write()
+// stops and writes Chrome trace JSON. Both are no-ops when compiled out.
+TERNARY_API int ternary_trace_compiled_in(void);
+TERNARY_API void ternary_trace_start(void);
+TERNARY_API int ternary_trace_write(const char *path);
+
+// ============================================================================
+// KERNELS AND PACKING (ternary_kernels.c)
+// ============================================================================
+#define MAX_PACK_THREADS 256
+#define MAX_MATVEC_THREADS 64
+
+typedef void (*matvec_8bit_fn)(const int8_t *matrix, const float *input,
+                               float *output, int rows, int cols);
+
+typedef void (*matvec_2bit_fn)(const uint8_t *matrix_packed, const float *input,
+                               float *output, int rows, int cols);
+
+#define MATMUL_BLOCK 8
+
+typedef void (*matmul_8bit_fn)(const int8_t *matrix, const float *input,
+                               float *output, int rows, int cols, int batch);
+
+typedef void (*matmul_2bit_fn)(const uint8_t *matrix_packed, const float *input,
+                               float *output, int rows, int cols, int batch);
+
+typedef void (*matvec_bitplane_fn)(const uint64_t *planes, const float *input,
+                                   float *output, int rows, int cols);
+
+#define BASE3_TRITS 5
+
+typedef void (*matvec_base3_fn)(const uint8_t *matrix_base3, const float *input,
+                                float *output, int rows, int cols);
+
+typedef struct {
+    int8_t *q;          // quantized input, `cols` entries, kernel column order
+    float scale;        // dequantization scale
+    int32_t block_sum;  // sum of q over the full blocks (VNNI offset term)
+    int cols;
+} quant_input_t;
+
+typedef void (*matvec_2bit_q8_fn)(const uint8_t *matrix_packed,
+                                  const quant_input_t *input,
+                                  float *output, int rows, int cols);
+
+#define TILE_MAX_ROWS 8
+
+typedef void (*matvec_2bit_tiled_fn)(const uint8_t *matrix_packed,
+                                     const float *input, float *output,
+                                     int rows, int cols,
+                                     int row_tile, int col_tile);
+
+// Shape-specialized 2-bit kernels: one per column count and row tile
+#define FIXED_COL_COUNT 9
+#define FIXED_TILE_COUNT 3
+#define FIXED_MAX_TILE 4
+#define FIXED_DEFAULT_TILE 1     // used by ternary_matvec_2bit_shaped()
+
+typedef struct {
+    int prefetch_distance;  // bytes ahead in the weight stream, 0 = off
+    int nontemporal;        // NTA prefetch hint + streaming loads
+} load_hints_t;
+
+typedef void (*matvec_2bit_hinted_fn)(const uint8_t *matrix_packed,
+                                      const float *input, float *output,
+                                      int rows, int cols,
+                                      const load_hints_t *hints);
+
+typedef enum {
+    EPILOGUE_NONE,
+    EPILOGUE_RELU,
+    EPILOGUE_SILU,
+    EPILOGUE_RELU2      // squared ReLU
+} epilogue_act_t;
+
+#define EPILOGUE_ACT_COUNT 4
+
+TERNARY_API extern const char *const ternary_epilogue_act_names[EPILOGUE_ACT_COUNT];
+
+typedef struct {
+    const float *scales;    // rows, or rows * groups with group_size > 0
+    const float *bias;      // rows
+    int group_size;         // columns per scale, 0 = one scale per row
+    epilogue_act_t act;
+} epilogue_t;
+
+typedef void (*matvec_2bit_fused_fn)(const uint8_t *matrix_packed,
+                                     const float *input, float *output,
+                                     int rows, int cols, const epilogue_t *ep);
+
+#define MAX_PROJECTIONS 4
+
+typedef struct {
+    const uint8_t *matrix;  // 2-bit packed, rows x cols
+    float *output;          // rows
+    int rows;
+} projection_t;
+
+typedef void (*matvec_2bit_multi_fn)(const projection_t *proj, int count,
+                                     const float *input, int cols);
+
+typedef struct {
+    int rows;
+    int cols;
+    uint32_t *offsets;  // 2 * rows + 1 entries into deltas
+    uint8_t *deltas;
+    size_t bytes;       // deltas + offsets
+} sparse_matrix_t;
+
+typedef void (*matvec_sparse_fn)(const sparse_matrix_t *sm, const float *input,
+                                 float *output);
+
+typedef void (*pack_fn)(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols);
+
+typedef void (*unpack_fn)(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols);
+
+// Every weight layout is row-major with a fixed number of bytes per row, so
+// any row range can be handed to its kernel as a smaller matrix.
+typedef enum {
+    FORMAT_8BIT,
+    FORMAT_2BIT,
+    FORMAT_BITPLANE,
+    FORMAT_BASE3
+} weight_format_t;
+
+// Chosen by ternary_init_kernel_dispatch(); *_name is the ISA variant in use
+TERNARY_API extern matvec_8bit_fn ternary_matvec_8bit_impl;
+TERNARY_API extern const char *ternary_matvec_8bit_impl_name;
+TERNARY_API extern matvec_2bit_fn ternary_matvec_2bit_impl;
+TERNARY_API extern const char *ternary_matvec_2bit_impl_name;
+TERNARY_API extern matvec_bitplane_fn ternary_matvec_bitplane_impl;
+TERNARY_API extern const char *ternary_matvec_bitplane_impl_name;
+TERNARY_API extern matvec_base3_fn ternary_matvec_base3_impl;
+TERNARY_API extern const char *ternary_matvec_base3_impl_name;
+TERNARY_API extern matvec_2bit_q8_fn ternary_matvec_2bit_q8_impl;
+TERNARY_API extern const char *ternary_matvec_2bit_q8_impl_name;
+TERNARY_API extern int ternary_matvec_2bit_q8_block;    // column order the quantizer must use
+TERNARY_API extern matvec_2bit_tiled_fn ternary_matvec_2bit_tiled_impl;
+TERNARY_API extern const char *ternary_matvec_2bit_tiled_impl_name;
+TERNARY_API extern const char *ternary_matvec_2bit_fixed_impl_name;    // "none" without specializations
+TERNARY_API extern matvec_2bit_hinted_fn ternary_matvec_2bit_hinted_impl;
+TERNARY_API extern const char *ternary_matvec_2bit_hinted_impl_name;
+TERNARY_API extern int ternary_matvec_2bit_hinted_streams;   // kernel has streaming loads
+TERNARY_API extern matvec_2bit_fused_fn ternary_matvec_2bit_fused_impl;
+TERNARY_API extern const char *ternary_matvec_2bit_fused_impl_name;
+TERNARY_API extern matvec_2bit_multi_fn ternary_matvec_2bit_multi_impl;
+TERNARY_API extern const char *ternary_matvec_2bit_multi_impl_name;
+TERNARY_API extern matvec_sparse_fn ternary_matvec_sparse_impl;
+TERNARY_API extern const char *ternary_matvec_sparse_impl_name;
+TERNARY_API extern matmul_8bit_fn ternary_matmul_8bit_impl;
+TERNARY_API extern const char *ternary_matmul_8bit_impl_name;
+TERNARY_API extern matmul_2bit_fn ternary_matmul_2bit_impl;
+TERNARY_API extern const char *ternary_matmul_2bit_impl_name;
+
+// Reference packer
+TERNARY_API void ternary_pack_2bit(const int8_t *matrix_8bit, uint8_t *matrix_2bit,
+                                   int rows, int cols);
+
+// Scalar reference kernels, also the fallback of every *_impl
+TERNARY_API void ternary_matvec_8bit(const int8_t *matrix, const float *input, float *output,
+                                     int rows, int cols);
+TERNARY_API void ternary_matvec_2bit(const uint8_t *matrix_packed, const float *input,
+                                     float *output, int rows, int cols);
+
+// Batched (GEMM) kernels; the batch is walked MATMUL_BLOCK inputs at a time
+TERNARY_API void ternary_matmul_8bit(const int8_t *matrix, const float *input, float *output,
+                                     int rows, int cols, int batch);
+TERNARY_API void ternary_matmul_2bit(const uint8_t *matrix_packed, const float *input,
+                                     float *output, int rows, int cols, int batch);
+
+// Bitplane format
+TERNARY_API void ternary_pack_bitplane(const int8_t *matrix_8bit, uint64_t *planes,
+                                       int rows, int cols);
+TERNARY_API void ternary_matvec_bitplane(const uint64_t *planes, const float *input,
+                                         float *output, int rows, int cols);
+
+// Base-3 format, BASE3_TRITS per byte
+TERNARY_API void ternary_pack_base3(const int8_t *matrix_8bit, uint8_t *matrix_base3,
+                                    int rows, int cols);
+TERNARY_API void ternary_matvec_base3(const uint8_t *matrix_base3, const float *input,
+                                      float *output, int rows, int cols);
+
+// Int8 activations
+TERNARY_API void ternary_quantize_input_int8(const float *input, int cols, int block,
+                                             quant_input_t *out);
+TERNARY_API void ternary_matvec_2bit_q8(const uint8_t *matrix_packed, const quant_input_t *input,
+                                        float *output, int rows, int cols);
+
+// Cache-blocked (tiled) kernels. row_tile is clamped to [1, TILE_MAX_ROWS]
+// (SIMD variants use the largest power of two not above it); col_tile is
+// rounded up by ternary_tile_round_cols()
+TERNARY_API int ternary_tile_round_cols(int col_tile);
+TERNARY_API void ternary_matvec_2bit_tiled(const uint8_t *matrix_packed, const float *input,
+                                           float *output, int rows, int cols,
+                                           int row_tile, int col_tile);
+
+// Shape-specialized kernels; ternary_matvec_2bit_fixed() is NULL for shapes
+// without one, ternary_matvec_2bit_shaped() falls back to ternary_matvec_2bit_impl
+TERNARY_API extern const int ternary_matvec_2bit_fixed_cols[FIXED_COL_COUNT];
+TERNARY_API extern const int ternary_matvec_2bit_fixed_tiles[FIXED_TILE_COUNT];
+TERNARY_API matvec_2bit_fn ternary_matvec_2bit_fixed(int cols, int row_tile);
+TERNARY_API void ternary_matvec_2bit_shaped(const uint8_t *matrix_packed, const float *input,
+                                            float *output, int rows, int cols);
+
+// Prefetch / streaming-load variants
+TERNARY_API void ternary_matvec_2bit_hinted(const uint8_t *matrix_packed, const float *input,
+                                            float *output, int rows, int cols,
+                                            const load_hints_t *hints);
+
+// Fused epilogue kernels
+TERNARY_API void ternary_epilogue_pass(float *output, int rows, const epilogue_t *ep);
+TERNARY_API void ternary_matvec_2bit_fused(const uint8_t *matrix_packed, const float *input,
+                                           float *output, int rows, int cols, const epilogue_t *ep);
+
+// Multi-projection kernels; up to MAX_PROJECTIONS share one pass over the
+// input, larger counts run in groups of MAX_PROJECTIONS
+TERNARY_API void ternary_matvec_2bit_multi(const projection_t *proj, int count, const float *input,
+                                           int cols);
+
+// Sparse ternary kernels
+TERNARY_API void ternary_matvec_sparse(const sparse_matrix_t *sm, const float *input, float *output);
+TERNARY_API void ternary_sparse_matrix_free(sparse_matrix_t *sm);
+TERNARY_API int ternary_sparse_matrix_build(sparse_matrix_t *sm, const int8_t *matrix_8bit, int rows, int cols);
+TERNARY_API double ternary_sparsity(const int8_t *matrix_8bit, size_t count);
+TERNARY_API int ternary_prefer_sparse(double sparsity, double break_even);
+
+// Picks every *_impl for this CPU; TERNARY_ISA=scalar|avx2|avx512|neon|sve
+// forces one
+TERNARY_API void ternary_init_kernel_dispatch(void);
+
+// Weight formats; ternary_pack_matrix() and ternary_unpack_matrix() split rows across threads
+TERNARY_API const char *ternary_format_name(weight_format_t format);
+TERNARY_API const char *ternary_format_kernel_name(weight_format_t format);
+TERNARY_API size_t ternary_format_row_bytes(weight_format_t format, int cols);
+TERNARY_API void ternary_matvec_rows(weight_format_t format, const uint8_t *matrix,
+                                     const float *input, float *output,
+                                     int row_begin, int row_end, int cols);
+TERNARY_API void ternary_matvec_rows_parallel(weight_format_t format, const uint8_t *matrix,
+                                              const float *input, float *output,
+                                              int rows, int cols, int num_threads);
+TERNARY_API const char *ternary_format_packer_name(weight_format_t format);
+TERNARY_API int ternary_online_cpus(void);
+TERNARY_API void ternary_pack_matrix(weight_format_t format, const int8_t *matrix_8bit, uint8_t *packed,
+                                     int rows, int cols, int num_threads);
+TERNARY_API void ternary_unpack_matrix(weight_format_t format, const uint8_t *packed, int8_t *matrix_8bit,
+                                       int rows, int cols, int num_threads);
+
+// ============================================================================
+// MEMORY (ternary_memory.c)
+// ============================================================================
+typedef enum { ALLOC_MALLOC, ALLOC_ALIGNED, ALLOC_THP, ALLOC_HUGETLB } alloc_policy_t;
+
+#define ALLOC_POLICY_COUNT 4
+#define WEIGHT_FORMAT_COUNT 4
+
+typedef struct {
+    int rows;
+    int cols;
+    int8_t *matrix_8bit;
+    uint8_t *matrix_2bit;
+    uint64_t *matrix_bitplane;
+    uint8_t *matrix_base3;
+    float *input;
+    float *output;
+} weight_set_t;
+
+TERNARY_API extern const char *const ternary_alloc_policy_names[ALLOC_POLICY_COUNT];
+TERNARY_API extern const weight_format_t ternary_all_formats[WEIGHT_FORMAT_COUNT];
+TERNARY_API extern alloc_policy_t ternary_alloc_policy;
+TERNARY_API extern int ternary_alloc_numa_node;
+TERNARY_API extern int ternary_alloc_hugetlb_fallbacks;   // hugetlb requests served as thp
+
+// Memory allocation
+TERNARY_API void *ternary_alloc(size_t bytes);
+TERNARY_API void ternary_free(void *ptr);
+TERNARY_API long ternary_huge_page_bytes(const void *ptr, size_t bytes);
+TERNARY_API const char *ternary_thp_mode(void);
+
+// ============================================================================
+// THREAD POOL (ternary_pool.c)
+// ============================================================================
+#define POOL_DEFAULT_CHUNK 64   // rows per work item
+
+typedef struct thread_pool thread_pool_t;
+
+// Items [begin, end) of a ternary_pool_run()
+typedef void (*pool_task_fn)(void *ctx, int begin, int end);
+
+// Per thread, accumulated over runs until ternary_pool_reset_stats()
+typedef struct {
+    double busy_ms;     // inside runs: own chunks, steals and stolen chunks
+    long long chunks;   // chunks run
+    long long steals;   // ... of which taken from another thread's deque
+    long long parks;    // times it slept on the condition variable
+} thread_pool_stats_t;
+
+// Returns 0 on success; best-effort, Linux only
+TERNARY_API int ternary_pin_current_thread(int cpu);
+
+// The calling thread runs as thread 0, so `threads` includes it
+TERNARY_API thread_pool_t *ternary_pool_create(int threads, int pin);
+TERNARY_API void ternary_pool_destroy(thread_pool_t *pool);
+TERNARY_API int ternary_pool_threads(const thread_pool_t *pool);
+TERNARY_API void ternary_pool_run(thread_pool_t *pool, pool_task_fn task, void *ctx,
+                                  int items, int chunk, int steal);
+TERNARY_API void ternary_pool_stats(const thread_pool_t *pool, thread_pool_stats_t *stats);
+TERNARY_API void ternary_pool_reset_stats(thread_pool_t *pool);
+
+// Row-parallel matvecs on the pool, `chunk` rows per work item
+TERNARY_API void ternary_pool_matvec_rows(thread_pool_t *pool, weight_format_t format,
+                                          const uint8_t *matrix, const float *input, float *output,
+                                          int rows, int cols, int chunk, int steal);
+TERNARY_API void ternary_pool_matvec_sparse(thread_pool_t *pool, const sparse_matrix_t *sm,
+                                            const float *input, float *output, int chunk, int steal);
+
+// ============================================================================
+// KERNEL REGISTRY (ternary_registry.c)
+// ============================================================================
+#define KERNEL_COUNT 12
+typedef struct {
+    const weight_set_t *ws;
+    sparse_matrix_t sparse;     // index lists, built by ternary_kernel_prepare()
+    int have_sparse;
+    int threads;                // row slices for "2bit-mt" and the pool
+    thread_pool_t *pool;        // built by ternary_kernel_prepare() for "*-pool"
+} kernel_args_t;
+
+typedef struct {
+    const char *name;           // plan-file id
+    const char *layout;         // weight layout it streams
+    weight_format_t format;     // that layout, unless sparse
+    int sparse;
+    int threaded;               // only offered with more than one CPU
+    int pooled;                 // runs on the persistent thread pool
+    int shaped;                 // only for widths with a specialized kernel
+    const char *const *impl;    // dispatch name of the kernel underneath
+    void (*run)(const kernel_args_t *a);
+} kernel_entry_t;
+
+#define KERNEL_BASELINE "8bit"      // "Theirs" in the default comparison
+#define KERNEL_DEFAULT "2bit"       // "Ours" when no plan covers the shape
+
+TERNARY_API extern const kernel_entry_t ternary_kernel_registry[KERNEL_COUNT];
+
+// Lookup and per-weight-set state
+TERNARY_API const kernel_entry_t *ternary_find_kernel(const char *name);
+TERNARY_API int ternary_kernel_available(const kernel_entry_t *k);
+TERNARY_API void ternary_kernel_args_init(kernel_args_t *a, const weight_set_t *ws);
+TERNARY_API void ternary_kernel_args_free(kernel_args_t *a);
+TERNARY_API int ternary_kernel_prepare(const kernel_entry_t *k, kernel_args_t *a);
+TERNARY_API size_t ternary_kernel_bytes(const kernel_entry_t *k, const kernel_args_t *a);
+
+// ============================================================================
+// GPU BACKEND (ternary_cuda.cu, make cuda / make hip)
+// ============================================================================
+// 8-bit, 2-bit packed and bitplane matvecs on the exact bytes the CPU
+// packers write, one warp (one wavefront on AMD) per row. Only linked
+// into builds with -DTERNARY_GPU. Every call returns -1 with a message on
+// stderr when there is no usable device or a CUDA / HIP call fails.
+// Per-call latency distribution
+typedef struct {
+    int count;
+    double min_ms;
+    double median_ms;
+    double p90_ms;
+    double p99_ms;
+    double mean_ms;
+    double stddev_ms;
+    double ci95_ms;     // half-width of the 95% confidence interval of the mean
+} timing_stats_t;
+
+typedef struct {
+    double upload_ms;       // weights, host to device, pageable memory
+    double upload_gbps;
+    double io_us;           // input up and output back, per call
+    timing_stats_t kernel;  // per call, from device events
+    double hbm_gbps;        // weight + activation bytes / median kernel time
+} gpu_result_t;
+
+// peak_gbps is memory clock x bus width, 0 when the driver does not say
+TERNARY_API int ternary_gpu_device_info(char *name, size_t len, double *peak_gbps);
+TERNARY_API int ternary_gpu_matvec_bench(weight_format_t format, const uint8_t *matrix,
+                                         const float *input, float *output, int rows, int cols,
+                                         int iterations, gpu_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
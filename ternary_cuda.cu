@@ -0,0 +1,378 @@
+/*
+ * GPU backend: 8-bit, 2-bit packed and bitplane matvecs on the same bytes
+ * the CPU packers write, and a harness timing upload, per-call transfers
+ * and achieved device-memory bandwidth. Builds as CUDA (make cuda) or as
+ * HIP with hipcc (make hip); not part of the default build.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__HIPCC__)
+#include <hip/hip_runtime.h>
+#define GPU_API "HIP"
+#define cudaError_t hipError_t
+#define cudaSuccess hipSuccess
+#define cudaGetErrorString hipGetErrorString
+#define cudaGetLastError hipGetLastError
+#define cudaGetDeviceCount hipGetDeviceCount
+#define cudaGetDevice hipGetDevice
+#define cudaDeviceProp hipDeviceProp_t
+#define cudaGetDeviceProperties hipGetDeviceProperties
+#define cudaDeviceGetAttribute hipDeviceGetAttribute
+#define cudaDevAttrMemoryClockRate hipDeviceAttributeMemoryClockRate
+#define cudaDevAttrGlobalMemoryBusWidth hipDeviceAttributeMemoryBusWidth
+#define cudaDevAttrWarpSize hipDeviceAttributeWarpSize
+#define cudaMalloc hipMalloc
+#define cudaFree hipFree
+#define cudaMemcpy hipMemcpy
+#define cudaMemcpyHostToDevice hipMemcpyHostToDevice
+#define cudaMemcpyDeviceToHost hipMemcpyDeviceToHost
+#define cudaEvent_t hipEvent_t
+#define cudaEventCreate hipEventCreate
+#define cudaEventDestroy hipEventDestroy
+#define cudaEventRecord hipEventRecord
+#define cudaEventSynchronize hipEventSynchronize
+#define cudaEventElapsedTime hipEventElapsedTime
+#define WARP_SHFL(v, src) __shfl((v), (src))
+#define WARP_SHFL_DOWN(v, d) __shfl_down((v), (d))
+#else
+#include <cuda_runtime.h>
+#define GPU_API "CUDA"
+#define WARP_SHFL(v, src) __shfl_sync(0xffffffffu, (v), (src))
+#define WARP_SHFL_DOWN(v, d) __shfl_down_sync(0xffffffffu, (v), (d))
+#endif
+
+#include "harness.h"
+
+// ============================================================================
+// DECODE KERNELS
+// ============================================================================
+// One warp per row, GPU_THREADS / warp rows per block. Each step the warp
+// loads GPU_WARP consecutive packed words of its row in one coalesced
+// request, then walks them GPU_WARP columns at a time: lane j takes column
+// j of each step, shuffles in the word that holds its trit, and loads its
+// input element, so the input reads are coalesced too. Lanes past the row
+// end see a zero word and a zero input. Lane sums are reduced with
+// shuffles and lane 0 stores the row.
+//
+// Packed 2-bit rows are read as 32-bit words when the row length in bytes
+// is a multiple of 4 (every cols % 16 == 0 shape, i.e. all model widths)
+// and as bytes otherwise, so unaligned rows never see a misaligned load.
+// GPU_WARP is the device pass's wavefront size on AMD: 64 on CDNA, 32 on
+// RDNA in wave32 mode. The host reads it back from the device to size the
+// grid, so both passes agree.
+#define GPU_THREADS 256
+
+#if defined(__HIPCC__) && defined(__AMDGCN_WAVEFRONT_SIZE)
+#define GPU_WARP __AMDGCN_WAVEFRONT_SIZE
+#elif defined(__HIPCC__)
+#define GPU_WARP 64
+#else
+#define GPU_WARP 32
+#endif
+
+__device__ __forceinline__ float warp_sum(float v) {
+#pragma unroll
+    for (int off = GPU_WARP / 2; off > 0; off >>= 1) {
+        v += WARP_SHFL_DOWN(v, off);
+    }
+    return v;
+}
+
+__device__ __forceinline__ int warp_row(void) {
+    return blockIdx.x * (blockDim.x / GPU_WARP) + threadIdx.x / GPU_WARP;
+}
+
+// Word is uint32_t (16 trits) or uint8_t (4 trits)
+template <typename Word>
+__global__ void matvec_2bit_gpu(const uint8_t *__restrict__ matrix,
+                                const float *__restrict__ input,
+                                float *__restrict__ output, int rows, int cols) {
+    constexpr int trits = 4 * sizeof(Word);
+    const int row = warp_row();
+    const int lane = threadIdx.x % GPU_WARP;
+    if (row >= rows) {
+        return;
+    }
+    const size_t row_bytes = (size_t)(cols + 3) / 4;
+    const int words = (int)(row_bytes / sizeof(Word));
+    const Word *row_ptr = (const Word*)(matrix + (size_t)row * row_bytes);
+    float sum = 0.0f;
+
+    for (int base = 0; base < words; base += GPU_WARP) {
+        unsigned mine = base + lane < words ? (unsigned)row_ptr[base + lane] : 0u;
+        const int c0 = base * trits;
+#pragma unroll
+        for (int k = 0; k < trits; k++) {
+            const int idx = k * GPU_WARP + lane;
+            unsigned word = WARP_SHFL(mine, idx / trits);
+            unsigned code = (word >> (2 * (idx % trits))) & 3u;
+            const int c = c0 + idx;
+            float x = c < cols ? input[c] : 0.0f;
+            sum += code == 1u ? x : code == 2u ? -x : 0.0f;
+        }
+    }
+
+    sum = warp_sum(sum);
+    if (lane == 0) {
+        output[row] = sum;
+    }
+}
+
+// The bitplane rows are nz[words] then neg[words] of 64 columns each
+__global__ void matvec_bitplane_gpu(const unsigned long long *__restrict__ planes,
+                                    const float *__restrict__ input,
+                                    float *__restrict__ output, int rows, int cols) {
+    const int row = warp_row();
+    const int lane = threadIdx.x % GPU_WARP;
+    if (row >= rows) {
+        return;
+    }
+    const int words = (cols + 63) / 64;
+    const unsigned long long *nz = planes + (size_t)row * 2 * words;
+    const unsigned long long *neg = nz + words;
+    float sum = 0.0f;
+
+    for (int base = 0; base < words; base += GPU_WARP) {
+        unsigned long long my_nz = base + lane < words ? nz[base + lane] : 0ull;
+        unsigned long long my_neg = base + lane < words ? neg[base + lane] : 0ull;
+        const int c0 = base * 64;
+#pragma unroll 8
+        for (int k = 0; k < 64; k++) {
+            const int idx = k * GPU_WARP + lane;
+            unsigned long long n = WARP_SHFL(my_nz, idx / 64);
+            unsigned long long g = WARP_SHFL(my_neg, idx / 64);
+            const int bit = idx % 64;
+            const int c = c0 + idx;
+            float x = c < cols ? input[c] : 0.0f;
+            sum += (n >> bit) & 1 ? ((g >> bit) & 1 ? -x : x) : 0.0f;
+        }
+    }
+
+    sum = warp_sum(sum);
+    if (lane == 0) {
+        output[row] = sum;
+    }
+}
+
+// Lanes stride the row; with cols % 4 == 0 four weights and a float4 of
+// input per load
+__global__ void matvec_8bit_gpu(const int8_t *__restrict__ matrix,
+                                const float *__restrict__ input,
+                                float *__restrict__ output, int rows, int cols) {
+    const int row = warp_row();
+    const int lane = threadIdx.x % GPU_WARP;
+    if (row >= rows) {
+        return;
+    }
+    const int8_t *row_ptr = matrix + (size_t)row * cols;
+    float sum = 0.0f;
+
+    if (cols % 4 == 0) {
+        const char4 *w4 = (const char4*)row_ptr;
+        const float4 *x4 = (const float4*)input;
+        for (int i = lane; i < cols / 4; i += GPU_WARP) {
+            char4 w = w4[i];
+            float4 x = x4[i];
+            sum += w.x * x.x + w.y * x.y + w.z * x.z + w.w * x.w;
+        }
+    } else {
+        for (int c = lane; c < cols; c += GPU_WARP) {
+            sum += row_ptr[c] * input[c];
+        }
+    }
+
+    sum = warp_sum(sum);
+    if (lane == 0) {
+        output[row] = sum;
+    }
+}
+
+// ============================================================================
+// HARNESS
+// ============================================================================
+// The weights are uploaded once from the caller's (pageable) buffer, as a
+// server would load a layer. Each timed call is bracketed by its own pair
+// of device events and the calls are queued back to back, so launch
+// latency overlaps the previous kernel and the samples are device time.
+// io_us is the per-token cost the kernel time leaves out: the input up to
+// the device and the output back, synchronous, timed on the host.
+static int gpu_check(cudaError_t err, const char *what) {
+    if (err != cudaSuccess) {
+        fprintf(stderr, "GPU: %s failed: %s\n", what, cudaGetErrorString(err));
+        return -1;
+    }
+    return 0;
+}
+
+int ternary_gpu_device_info(char *name, size_t len, double *peak_gbps) {
+    int count = 0, dev = 0, clock_khz = 0, bus_bits = 0;
+    cudaDeviceProp prop;
+    if (cudaGetDeviceCount(&count) != cudaSuccess || count == 0) {
+        fprintf(stderr, "GPU: no " GPU_API " device\n");
+        return -1;
+    }
+    if (gpu_check(cudaGetDevice(&dev), "cudaGetDevice") != 0 ||
+        gpu_check(cudaGetDeviceProperties(&prop, dev), "cudaGetDeviceProperties") != 0) {
+        return -1;
+    }
+    snprintf(name, len, "%s, " GPU_API, prop.name);
+    // Double data rate, as the vendor samples compute it
+    if (cudaDeviceGetAttribute(&clock_khz, cudaDevAttrMemoryClockRate, dev) == cudaSuccess &&
+        cudaDeviceGetAttribute(&bus_bits, cudaDevAttrGlobalMemoryBusWidth, dev) == cudaSuccess) {
+        *peak_gbps = 2.0 * clock_khz * 1e3 * (bus_bits / 8.0) / 1e9;
+    } else {
+        *peak_gbps = 0.0;
+    }
+    return 0;
+}
+
+static void gpu_launch(weight_format_t format, const void *matrix,
+                       const float *input, float *output, int rows, int cols,
+                       int warp) {
+    const int rows_per_block = GPU_THREADS / warp;
+    const int blocks = (rows + rows_per_block - 1) / rows_per_block;
+    switch (format) {
+    case FORMAT_8BIT:
+        matvec_8bit_gpu<<<blocks, GPU_THREADS>>>((const int8_t*)matrix, input,
+                                                  output, rows, cols);
+        break;
+    case FORMAT_2BIT:
+        if ((cols + 3) / 4 % 4 == 0) {
+            matvec_2bit_gpu<uint32_t><<<blocks, GPU_THREADS>>>(
+                (const uint8_t*)matrix, input, output, rows, cols);
+        } else {
+            matvec_2bit_gpu<uint8_t><<<blocks, GPU_THREADS>>>(
+                (const uint8_t*)matrix, input, output, rows, cols);
+        }
+        break;
+    case FORMAT_BITPLANE:
+        matvec_bitplane_gpu<<<blocks, GPU_THREADS>>>(
+            (const unsigned long long*)matrix, input, output, rows, cols);
+        break;
+    case FORMAT_BASE3:
+        break;
+    }
+}
+
+// Device time per call, one event pair per iteration
+static int gpu_time_kernel(weight_format_t format, const void *d_matrix,
+                           const float *d_input, float *d_output, int rows,
+                           int cols, int warp, int iterations,
+                           timing_stats_t *stats) {
+    cudaEvent_t *events = (cudaEvent_t*)calloc((size_t)2 * iterations, sizeof(cudaEvent_t));
+    double *samples = (double*)malloc((size_t)iterations * sizeof(double));
+    int created = 0, ok = events && samples;
+
+    for (; ok && created < 2 * iterations; created++) {
+        ok = gpu_check(cudaEventCreate(&events[created]), "cudaEventCreate") == 0;
+    }
+    for (int i = 0; ok && i < 3; i++) {
+        gpu_launch(format, d_matrix, d_input, d_output, rows, cols, warp);
+    }
+    ok = ok && gpu_check(cudaGetLastError(), "kernel launch") == 0;
+    for (int i = 0; ok && i < iterations; i++) {
+        cudaEventRecord(events[2 * i]);
+        gpu_launch(format, d_matrix, d_input, d_output, rows, cols, warp);
+        cudaEventRecord(events[2 * i + 1]);
+    }
+    ok = ok && gpu_check(cudaEventSynchronize(events[2 * iterations - 1]),
+                         "kernel") == 0;
+    for (int i = 0; ok && i < iterations; i++) {
+        float ms = 0.0f;
+        ok = gpu_check(cudaEventElapsedTime(&ms, events[2 * i], events[2 * i + 1]),
+                       "cudaEventElapsedTime") == 0;
+        samples[i] = ms;
+    }
+    if (ok) {
+        compute_timing_stats(samples, iterations, stats);
+    } else if (!events || !samples) {
+        fprintf(stderr, "GPU: out of host memory\n");
+    }
+
+    for (int i = 0; i < created; i++) {
+        cudaEventDestroy(events[i]);
+    }
+    free(events);
+    free(samples);
+    return ok ? 0 : -1;
+}
+
+int ternary_gpu_matvec_bench(weight_format_t format, const uint8_t *matrix,
+                             const float *input, float *output, int rows, int cols,
+                             int iterations, gpu_result_t *result) {
+    if (format == FORMAT_BASE3) {
+        fprintf(stderr, "GPU: no base-3 kernel\n");
+        return -1;
+    }
+    const size_t matrix_bytes = (size_t)rows * ternary_format_row_bytes(format, cols);
+    const size_t input_bytes = (size_t)cols * sizeof(float);
+    const size_t output_bytes = (size_t)rows * sizeof(float);
+    void *d_matrix = NULL;
+    float *d_input = NULL, *d_output = NULL;
+    cudaEvent_t start = NULL, stop = NULL;
+    int dev = 0, warp = GPU_WARP;
+    float upload_ms = 0.0f;
+
+    memset(result, 0, sizeof(*result));
+    int ok = gpu_check(cudaGetDevice(&dev), "cudaGetDevice") == 0 &&
+             gpu_check(cudaDeviceGetAttribute(&warp, cudaDevAttrWarpSize, dev),
+                       "cudaDeviceGetAttribute") == 0 &&
+             gpu_check(cudaMalloc(&d_matrix, matrix_bytes), "cudaMalloc") == 0 &&
+             gpu_check(cudaMalloc((void**)&d_input, input_bytes), "cudaMalloc") == 0 &&
+             gpu_check(cudaMalloc((void**)&d_output, output_bytes), "cudaMalloc") == 0 &&
+             gpu_check(cudaEventCreate(&start), "cudaEventCreate") == 0 &&
+             gpu_check(cudaEventCreate(&stop), "cudaEventCreate") == 0;
+
+    if (ok) {
+        cudaEventRecord(start);
+        ok = gpu_check(cudaMemcpy(d_matrix, matrix, matrix_bytes, cudaMemcpyHostToDevice),
+                       "weight upload") == 0;
+        cudaEventRecord(stop);
+        ok = ok && gpu_check(cudaEventSynchronize(stop), "weight upload") == 0 &&
+             gpu_check(cudaEventElapsedTime(&upload_ms, start, stop),
+                       "cudaEventElapsedTime") == 0;
+        result->upload_ms = upload_ms;
+        result->upload_gbps = upload_ms > 0.0f ? matrix_bytes / (upload_ms * 1e6) : 0.0;
+    }
+
+    if (ok) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; ok && i < iterations; i++) {
+            ok = gpu_check(cudaMemcpy(d_input, input, input_bytes, cudaMemcpyHostToDevice),
+                           "input upload") == 0 &&
+                 gpu_check(cudaMemcpy(output, d_output, output_bytes, cudaMemcpyDeviceToHost),
+                           "output download") == 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        result->io_us = elapsed_ms(&t0, &t1) * 1e3 / iterations;
+    }
+
+    ok = ok && gpu_time_kernel(format, d_matrix, d_input, d_output, rows, cols,
+                               warp, iterations, &result->kernel) == 0 &&
+         gpu_check(cudaMemcpy(output, d_output, output_bytes, cudaMemcpyDeviceToHost),
+                   "output download") == 0;
+    if (ok && result->kernel.median_ms > 0.0) {
+        result->hbm_gbps = (matrix_bytes + input_bytes + output_bytes) /
+                           (result->kernel.median_ms * 1e6);
+    }
+
+    if (start) {
+        cudaEventDestroy(start);
+    }
+    if (stop) {
+        cudaEventDestroy(stop);
+    }
+    cudaFree(d_matrix);
+    cudaFree(d_input);
+    cudaFree(d_output);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,3430 @@
+/*
+ * Ternary kernels: the reference and fast packers, every matvec / matmul
+ * kernel with its AVX2, AVX-512, NEON and SVE variants, runtime dispatch
+ * (ternary_init_kernel_dispatch) and the weight-format helpers.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ternary.h"
+
+// ============================================================================
+// REFERENCE PACKER
+// ============================================================================
+void ternary_pack_2bit(const int8_t *matrix_8bit, uint8_t *matrix_2bit,
+                       int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    memset(matrix_2bit, 0, rows * packed_cols);
+    
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            int8_t val = matrix_8bit[r * cols + c];
+            int packed_idx = r * packed_cols + c / 4;
+            int trit_idx = c % 4;
+            
+            uint8_t bits;
+            if (val == 0) bits = 0;       // 00
+            else if (val == 1) bits = 1;  // 01
+            else bits = 2;                // 10 for -1
+            
+            matrix_2bit[packed_idx] |= (bits << (trit_idx * 2));
+        }
+    }
+}
+
+// ============================================================================
+// VERSION A: 8-BIT REPRESENTATION (THEIRS)
+// ============================================================================
+void ternary_matvec_8bit(const int8_t *matrix, const float *input, float *output,
+                         int rows, int cols) {
+    for (int r = 0; r < rows; r++) {
+        float sum = 0.0f;
+        const int8_t *row_ptr = matrix + r * cols;
+        
+        for (int c = 0; c < cols; c++) {
+            int8_t w = row_ptr[c];
+            if (w != 0) {
+                sum += (float)w * input[c];
+            }
+        }
+        
+        output[r] = sum;
+    }
+}
+
+// ============================================================================
+// VERSION B: 2-BIT PACKED REPRESENTATION (OURS)
+// ============================================================================
+static inline int8_t unpack_trit(uint8_t packed, int index) {
+    uint8_t bits = (packed >> (index * 2)) & 0x3;
+    return (bits == 2) ? -1 : (bits == 1) ? 1 : 0;
+}
+
+void ternary_matvec_2bit(const uint8_t *matrix_packed, const float *input,
+                         float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    
+    for (int r = 0; r < rows; r++) {
+        float sum = 0.0f;
+        const uint8_t *row_ptr = matrix_packed + r * packed_cols;
+        
+        for (int packed_idx = 0; packed_idx < packed_cols; packed_idx++) {
+            uint8_t packed = row_ptr[packed_idx];
+            
+            for (int trit_idx = 0; trit_idx < 4; trit_idx++) {
+                int c = packed_idx * 4 + trit_idx;
+                if (c < cols) {
+                    int8_t w = unpack_trit(packed, trit_idx);
+                    if (w != 0) {
+                        sum += (float)w * input[c];
+                    }
+                }
+            }
+        }
+        
+        output[r] = sum;
+    }
+}
+
+// ============================================================================
+// VERSION B: SIMD KERNELS + RUNTIME DISPATCH
+// ============================================================================
+// The scalar kernel above pays a shift, two compares and a branch per trit.
+// The SIMD kernels below decode a whole 32-bit word (16 trits) at once:
+// broadcast it, shift each lane by 2*lane, and turn the 01 / 10 codes into
+// +1 / -1 lane masks. The input is then added under the +1 mask and
+// subtracted under the -1 mask, so there is no multiply and no branch.
+//
+// x86 kernels carry their own target attributes, so the binary runs on any
+// x86 CPU and picks the widest supported kernel at startup via cpuid.
+// On AArch64 NEON is baseline; SVE kernels are built when the compiler
+// targets SVE (the Makefile passes -mcpu=native). The 8-bit kernel gets
+// NEON/SVE variants too so ARM runs compare SIMD against SIMD.
+// Set TERNARY_ISA=scalar|avx2|avx512|neon|sve to force a specific kernel.
+
+// Scalar tail for the columns a SIMD kernel did not cover
+static inline float matvec_2bit_tail(const uint8_t *row_ptr, const float *input,
+                                     int c, int cols) {
+    float sum = 0.0f;
+    for (; c < cols; c++) {
+        int8_t w = unpack_trit(row_ptr[c / 4], c % 4);
+        if (w != 0) {
+            sum += (float)w * input[c];
+        }
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+
+__attribute__((target("avx2")))
+static inline float hsum_avx2(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+    return _mm_cvtss_f32(lo);
+}
+
+// 16 columns (one 32-bit packed word) per step, as two 8-lane halves
+__attribute__((target("avx2")))
+static void matvec_2bit_avx2(const uint8_t *matrix_packed, const float *input,
+                             float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    const __m256i shift_lo = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m256i shift_hi = _mm256_setr_epi32(16, 18, 20, 22, 24, 26, 28, 30);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m256 pos_lo = _mm256_setzero_ps(), neg_lo = _mm256_setzero_ps();
+        __m256 pos_hi = _mm256_setzero_ps(), neg_hi = _mm256_setzero_ps();
+        int c = 0;
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            __m256i w = _mm256_set1_epi32((int)word);
+
+            __m256i codes_lo = _mm256_and_si256(_mm256_srlv_epi32(w, shift_lo), three);
+            __m256i codes_hi = _mm256_and_si256(_mm256_srlv_epi32(w, shift_hi), three);
+            __m256 x_lo = _mm256_loadu_ps(input + c);
+            __m256 x_hi = _mm256_loadu_ps(input + c + 8);
+
+            pos_lo = _mm256_add_ps(pos_lo, _mm256_and_ps(x_lo,
+                         _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_lo, one))));
+            neg_lo = _mm256_add_ps(neg_lo, _mm256_and_ps(x_lo,
+                         _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_lo, two))));
+            pos_hi = _mm256_add_ps(pos_hi, _mm256_and_ps(x_hi,
+                         _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_hi, one))));
+            neg_hi = _mm256_add_ps(neg_hi, _mm256_and_ps(x_hi,
+                         _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_hi, two))));
+        }
+
+        __m256 acc = _mm256_sub_ps(_mm256_add_ps(pos_lo, pos_hi),
+                                   _mm256_add_ps(neg_lo, neg_hi));
+        output[r] = hsum_avx2(acc) + matvec_2bit_tail(row_ptr, input, c, cols);
+    }
+}
+
+// 32 columns (two 32-bit packed words) per step. Mask registers make the
+// decode two vptestmd per 16 trits: bit 0 set means +1, bit 1 set means -1.
+__attribute__((target("avx512f")))
+static void matvec_2bit_avx512(const uint8_t *matrix_packed, const float *input,
+                               float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    const __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                             16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i two = _mm512_set1_epi32(2);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m512 pos0 = _mm512_setzero_ps(), neg0 = _mm512_setzero_ps();
+        __m512 pos1 = _mm512_setzero_ps(), neg1 = _mm512_setzero_ps();
+        int c = 0;
+
+        for (; c + 32 <= cols; c += 32) {
+            uint32_t words[2];
+            memcpy(words, row_ptr + c / 4, sizeof(words));
+            __m512i t0 = _mm512_srlv_epi32(_mm512_set1_epi32((int)words[0]), shifts);
+            __m512i t1 = _mm512_srlv_epi32(_mm512_set1_epi32((int)words[1]), shifts);
+            __m512 x0 = _mm512_loadu_ps(input + c);
+            __m512 x1 = _mm512_loadu_ps(input + c + 16);
+
+            pos0 = _mm512_mask_add_ps(pos0, _mm512_test_epi32_mask(t0, one), pos0, x0);
+            neg0 = _mm512_mask_add_ps(neg0, _mm512_test_epi32_mask(t0, two), neg0, x0);
+            pos1 = _mm512_mask_add_ps(pos1, _mm512_test_epi32_mask(t1, one), pos1, x1);
+            neg1 = _mm512_mask_add_ps(neg1, _mm512_test_epi32_mask(t1, two), neg1, x1);
+        }
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            __m512i t = _mm512_srlv_epi32(_mm512_set1_epi32((int)word), shifts);
+            __m512 x = _mm512_loadu_ps(input + c);
+            pos0 = _mm512_mask_add_ps(pos0, _mm512_test_epi32_mask(t, one), pos0, x);
+            neg0 = _mm512_mask_add_ps(neg0, _mm512_test_epi32_mask(t, two), neg0, x);
+        }
+
+        __m512 acc = _mm512_sub_ps(_mm512_add_ps(pos0, pos1),
+                                   _mm512_add_ps(neg0, neg1));
+        output[r] = _mm512_reduce_add_ps(acc) +
+                    matvec_2bit_tail(row_ptr, input, c, cols);
+    }
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_ARM_KERNELS 1
+
+// Widen 16 int8 weights to float and accumulate them against 16 inputs
+// already loaded into x
+static inline void neon_fma_s8x16_x(float32x4_t acc[4], int8x16_t w,
+                                    const float32x4_t x[4]) {
+    int16x8_t w_lo = vmovl_s8(vget_low_s8(w));
+    int16x8_t w_hi = vmovl_high_s8(w);
+    acc[0] = vfmaq_f32(acc[0], vcvtq_f32_s32(vmovl_s16(vget_low_s16(w_lo))), x[0]);
+    acc[1] = vfmaq_f32(acc[1], vcvtq_f32_s32(vmovl_high_s16(w_lo)), x[1]);
+    acc[2] = vfmaq_f32(acc[2], vcvtq_f32_s32(vmovl_s16(vget_low_s16(w_hi))), x[2]);
+    acc[3] = vfmaq_f32(acc[3], vcvtq_f32_s32(vmovl_high_s16(w_hi)), x[3]);
+}
+
+static inline void neon_fma_s8x16(float32x4_t acc[4], int8x16_t w,
+                                  const float *x) {
+    const float32x4_t xv[4] = { vld1q_f32(x), vld1q_f32(x + 4),
+                                vld1q_f32(x + 8), vld1q_f32(x + 12) };
+    neon_fma_s8x16_x(acc, w, xv);
+}
+
+static inline float neon_hsum4(const float32x4_t acc[4]) {
+    return vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]),
+                                vaddq_f32(acc[2], acc[3])));
+}
+
+static void matvec_8bit_neon(const int8_t *matrix, const float *input,
+                             float *output, int rows, int cols) {
+    for (int r = 0; r < rows; r++) {
+        const int8_t *row_ptr = matrix + (size_t)r * cols;
+        float32x4_t acc[4] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f),
+                               vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+        int c = 0;
+
+        for (; c + 16 <= cols; c += 16) {
+            neon_fma_s8x16(acc, vld1q_s8(row_ptr + c), input + c);
+        }
+
+        float sum = neon_hsum4(acc);
+        for (; c < cols; c++) {
+            sum += (float)row_ptr[c] * input[c];
+        }
+        output[r] = sum;
+    }
+}
+
+// TBL decode: the first TBL copies each packed byte into the 4 lanes that
+// hold its trits, a per-lane shift and mask leaves the 2-bit code, and a
+// second TBL maps the code to its int8 weight (00 -> 0, 01 -> +1, 10 -> -1).
+static const uint8_t neon_byte_idx[16] = { 0, 0, 0, 0, 1, 1, 1, 1,
+                                           2, 2, 2, 2, 3, 3, 3, 3 };
+static const int8_t neon_lane_shift[16] = { 0, -2, -4, -6, 0, -2, -4, -6,
+                                            0, -2, -4, -6, 0, -2, -4, -6 };
+static const int8_t neon_code_to_weight[16] = { 0, 1, -1, 0 };
+
+// Decodes the 16 trits held in packed bytes idx[0], idx[4], idx[8], idx[12]
+static inline int8x16_t neon_decode_2bit_16(uint8x16_t packed, uint8x16_t idx) {
+    uint8x16_t codes = vandq_u8(vshlq_u8(vqtbl1q_u8(packed, idx),
+                                         vld1q_s8(neon_lane_shift)),
+                                vdupq_n_u8(3));
+    return vqtbl1q_s8(vld1q_s8(neon_code_to_weight), codes);
+}
+
+static void matvec_2bit_neon(const uint8_t *matrix_packed, const float *input,
+                             float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+    const uint8x16_t idx1 = vaddq_u8(idx0, vdupq_n_u8(4));
+    const uint8x16_t idx2 = vaddq_u8(idx0, vdupq_n_u8(8));
+    const uint8x16_t idx3 = vaddq_u8(idx0, vdupq_n_u8(12));
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        float32x4_t acc[4] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f),
+                               vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+        int c = 0;
+
+        // 64 columns from one 16-byte load
+        for (; c + 64 <= cols; c += 64) {
+            uint8x16_t packed = vld1q_u8(row_ptr + c / 4);
+            neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx0), input + c);
+            neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx1), input + c + 16);
+            neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx2), input + c + 32);
+            neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx3), input + c + 48);
+        }
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            uint8x16_t packed = vreinterpretq_u8_u32(vdupq_n_u32(word));
+            neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx0), input + c);
+        }
+
+        output[r] = neon_hsum4(acc) + matvec_2bit_tail(row_ptr, input, c, cols);
+    }
+}
+
+#if defined(__ARM_FEATURE_SVE)
+#include <arm_sve.h>
+#define HAVE_SVE_KERNELS 1
+
+// Vector-length agnostic: svcntw() columns per step, predicated tail
+static void matvec_8bit_sve(const int8_t *matrix, const float *input,
+                            float *output, int rows, int cols) {
+    const int vl = (int)svcntw();
+
+    for (int r = 0; r < rows; r++) {
+        const int8_t *row_ptr = matrix + (size_t)r * cols;
+        svfloat32_t acc = svdup_n_f32(0.0f);
+
+        for (int c = 0; c < cols; c += vl) {
+            svbool_t pg = svwhilelt_b32_s32(c, cols);
+            svfloat32_t w = svcvt_f32_s32_x(pg, svld1sb_s32(pg, row_ptr + c));
+            acc = svmla_f32_m(pg, acc, w, svld1_f32(pg, input + c));
+        }
+
+        output[r] = svaddv_f32(svptrue_b32(), acc);
+    }
+}
+
+// Each step loads the svcntw()/4 packed bytes it needs one per lane, then
+// svtbl spreads byte i/4 to lane i. The decoded codes become predicates, so
+// the accumulate is a predicated add (+1) and predicated subtract (-1).
+static void matvec_2bit_sve(const uint8_t *matrix_packed, const float *input,
+                            float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    const int vl = (int)svcntw();
+    const svbool_t all = svptrue_b32();
+    const svuint32_t lane = svindex_u32(0, 1);
+    const svuint32_t byte_of_lane = svlsr_n_u32_x(all, lane, 2);
+    const svuint32_t shift_of_lane = svlsl_n_u32_x(all, svand_n_u32_x(all, lane, 3), 1);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        svfloat32_t acc = svdup_n_f32(0.0f);
+
+        for (int c = 0; c < cols; c += vl) {
+            int byte_start = c / 4;
+            int byte_end = byte_start + vl / 4;
+            if (byte_end > packed_cols) {
+                byte_end = packed_cols;
+            }
+            svbool_t pg = svwhilelt_b32_s32(c, cols);
+            svbool_t pb = svwhilelt_b32_s32(byte_start, byte_end);
+
+            svuint32_t bytes = svld1ub_u32(pb, row_ptr + byte_start);
+            svuint32_t codes = svand_n_u32_x(pg,
+                svlsr_u32_x(pg, svtbl_u32(bytes, byte_of_lane), shift_of_lane), 3);
+            svfloat32_t x = svld1_f32(pg, input + c);
+
+            acc = svadd_f32_m(svcmpeq_n_u32(pg, codes, 1), acc, x);
+            acc = svsub_f32_m(svcmpeq_n_u32(pg, codes, 2), acc, x);
+        }
+
+        output[r] = svaddv_f32(all, acc);
+    }
+}
+#endif
+#endif
+
+// ============================================================================
+// BATCHED (GEMM) KERNELS
+// ============================================================================
+// B input vectors against one weight matrix. Inputs are B contiguous
+// vectors of `cols` floats, outputs are B contiguous vectors of `rows`.
+// Each row is decoded once per block of up to MATMUL_BLOCK vectors and the
+// decoded weights (or lane masks) are applied to every vector in the block
+// straight from registers; the row itself stays in L1 between blocks.
+
+void ternary_matmul_8bit(const int8_t *matrix, const float *input, float *output,
+                         int rows, int cols, int batch) {
+    for (int r = 0; r < rows; r++) {
+        const int8_t *row_ptr = matrix + (size_t)r * cols;
+
+        for (int b0 = 0; b0 < batch; b0 += MATMUL_BLOCK) {
+            int nb = batch - b0 < MATMUL_BLOCK ? batch - b0 : MATMUL_BLOCK;
+            const float *x = input + (size_t)b0 * cols;
+            float sum[MATMUL_BLOCK] = { 0.0f };
+
+            for (int c = 0; c < cols; c++) {
+                int8_t w = row_ptr[c];
+                if (w != 0) {
+                    for (int b = 0; b < nb; b++) {
+                        sum[b] += (float)w * x[(size_t)b * cols + c];
+                    }
+                }
+            }
+
+            for (int b = 0; b < nb; b++) {
+                output[(size_t)(b0 + b) * rows + r] = sum[b];
+            }
+        }
+    }
+}
+
+void ternary_matmul_2bit(const uint8_t *matrix_packed, const float *input,
+                         float *output, int rows, int cols, int batch) {
+    int packed_cols = (cols + 3) / 4;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+
+        for (int b0 = 0; b0 < batch; b0 += MATMUL_BLOCK) {
+            int nb = batch - b0 < MATMUL_BLOCK ? batch - b0 : MATMUL_BLOCK;
+            const float *x = input + (size_t)b0 * cols;
+            float sum[MATMUL_BLOCK] = { 0.0f };
+
+            for (int packed_idx = 0; packed_idx < packed_cols; packed_idx++) {
+                uint8_t packed = row_ptr[packed_idx];
+
+                for (int trit_idx = 0; trit_idx < 4; trit_idx++) {
+                    int c = packed_idx * 4 + trit_idx;
+                    if (c < cols) {
+                        int8_t w = unpack_trit(packed, trit_idx);
+                        if (w != 0) {
+                            for (int b = 0; b < nb; b++) {
+                                sum[b] += (float)w * x[(size_t)b * cols + c];
+                            }
+                        }
+                    }
+                }
+            }
+
+            for (int b = 0; b < nb; b++) {
+                output[(size_t)(b0 + b) * rows + r] = sum[b];
+            }
+        }
+    }
+}
+
+// Splits the batch into blocks of 8/4/2/1 so every block call below sees a
+// compile-time nb and keeps its accumulators in registers.
+#define MATMUL_FOR_EACH_BLOCK(batch, BLOCK_CALL)                   \
+    for (int b0 = 0; b0 < (batch); ) {                             \
+        int left = (batch) - b0;                                   \
+        if (left >= 8)      { BLOCK_CALL(8); b0 += 8; }            \
+        else if (left >= 4) { BLOCK_CALL(4); b0 += 4; }            \
+        else if (left >= 2) { BLOCK_CALL(2); b0 += 2; }            \
+        else                { BLOCK_CALL(1); b0 += 1; }            \
+    }
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx512f"), always_inline))
+static inline void matmul_2bit_avx512_block(const uint8_t *row_ptr,
+                                            const float *x, float *out,
+                                            int rows, int cols, const int nb) {
+    const __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                             16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i two = _mm512_set1_epi32(2);
+    __m512 acc[MATMUL_BLOCK];
+    for (int b = 0; b < nb; b++) {
+        acc[b] = _mm512_setzero_ps();
+    }
+
+    int c = 0;
+    for (; c + 16 <= cols; c += 16) {
+        uint32_t word;
+        memcpy(&word, row_ptr + c / 4, sizeof(word));
+        __m512i t = _mm512_srlv_epi32(_mm512_set1_epi32((int)word), shifts);
+        __mmask16 plus = _mm512_test_epi32_mask(t, one);
+        __mmask16 minus = _mm512_test_epi32_mask(t, two);
+
+        for (int b = 0; b < nb; b++) {
+            __m512 v = _mm512_loadu_ps(x + (size_t)b * cols + c);
+            acc[b] = _mm512_mask_add_ps(acc[b], plus, acc[b], v);
+            acc[b] = _mm512_mask_sub_ps(acc[b], minus, acc[b], v);
+        }
+    }
+
+    for (int b = 0; b < nb; b++) {
+        out[(size_t)b * rows] = _mm512_reduce_add_ps(acc[b]) +
+            matvec_2bit_tail(row_ptr, x + (size_t)b * cols, c, cols);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matmul_2bit_avx512(const uint8_t *matrix_packed, const float *input,
+                               float *output, int rows, int cols, int batch) {
+    int packed_cols = (cols + 3) / 4;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+#define AVX512_BLOCK(nb) \
+        matmul_2bit_avx512_block(row_ptr, input + (size_t)b0 * cols, \
+                                 output + (size_t)b0 * rows + r, rows, cols, nb)
+        MATMUL_FOR_EACH_BLOCK(batch, AVX512_BLOCK)
+#undef AVX512_BLOCK
+    }
+}
+
+// AVX2 has no mask registers, so each 8-lane group is decoded into a
+// nonzero mask and a sign bit: contribution = (x & nonzero) ^ sign. That
+// needs one accumulator per vector instead of a +1 and a -1 pair.
+__attribute__((target("avx2"), always_inline))
+static inline void matmul_2bit_avx2_block(const uint8_t *row_ptr,
+                                          const float *x, float *out,
+                                          int rows, int cols, const int nb) {
+    const __m256i shift_lo = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m256i shift_hi = _mm256_setr_epi32(16, 18, 20, 22, 24, 26, 28, 30);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i sign_bit = _mm256_set1_epi32((int)0x80000000u);
+    __m256 acc[MATMUL_BLOCK];
+    for (int b = 0; b < nb; b++) {
+        acc[b] = _mm256_setzero_ps();
+    }
+
+    int c = 0;
+    for (; c + 16 <= cols; c += 16) {
+        uint32_t word;
+        memcpy(&word, row_ptr + c / 4, sizeof(word));
+        __m256i w = _mm256_set1_epi32((int)word);
+        __m256i t_lo = _mm256_srlv_epi32(w, shift_lo);
+        __m256i t_hi = _mm256_srlv_epi32(w, shift_hi);
+        __m256 zero_lo = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+            _mm256_and_si256(t_lo, three), _mm256_setzero_si256()));
+        __m256 zero_hi = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+            _mm256_and_si256(t_hi, three), _mm256_setzero_si256()));
+        __m256 sign_lo = _mm256_castsi256_ps(_mm256_and_si256(
+            _mm256_slli_epi32(t_lo, 30), sign_bit));
+        __m256 sign_hi = _mm256_castsi256_ps(_mm256_and_si256(
+            _mm256_slli_epi32(t_hi, 30), sign_bit));
+
+        for (int b = 0; b < nb; b++) {
+            const float *xb = x + (size_t)b * cols + c;
+            __m256 v_lo = _mm256_xor_ps(_mm256_andnot_ps(zero_lo, _mm256_loadu_ps(xb)),
+                                        sign_lo);
+            __m256 v_hi = _mm256_xor_ps(_mm256_andnot_ps(zero_hi, _mm256_loadu_ps(xb + 8)),
+                                        sign_hi);
+            acc[b] = _mm256_add_ps(acc[b], _mm256_add_ps(v_lo, v_hi));
+        }
+    }
+
+    for (int b = 0; b < nb; b++) {
+        out[(size_t)b * rows] = hsum_avx2(acc[b]) +
+            matvec_2bit_tail(row_ptr, x + (size_t)b * cols, c, cols);
+    }
+}
+
+__attribute__((target("avx2")))
+static void matmul_2bit_avx2(const uint8_t *matrix_packed, const float *input,
+                             float *output, int rows, int cols, int batch) {
+    int packed_cols = (cols + 3) / 4;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+#define AVX2_BLOCK(nb) \
+        matmul_2bit_avx2_block(row_ptr, input + (size_t)b0 * cols, \
+                               output + (size_t)b0 * rows + r, rows, cols, nb)
+        MATMUL_FOR_EACH_BLOCK(batch, AVX2_BLOCK)
+#undef AVX2_BLOCK
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+// Widen 16 int8 weights to 4 float vectors once; every vector in the block
+// then costs 4 FMAs per 16 columns.
+static inline void neon_s8x16_to_f32(int8x16_t w, float32x4_t wf[4]) {
+    int16x8_t w_lo = vmovl_s8(vget_low_s8(w));
+    int16x8_t w_hi = vmovl_high_s8(w);
+    wf[0] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(w_lo)));
+    wf[1] = vcvtq_f32_s32(vmovl_high_s16(w_lo));
+    wf[2] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(w_hi)));
+    wf[3] = vcvtq_f32_s32(vmovl_high_s16(w_hi));
+}
+
+// packed != 0: row_ptr holds 2-bit packed trits, otherwise int8 weights
+__attribute__((always_inline))
+static inline void matmul_neon_block(const void *row, const float *x, float *out,
+                                     int rows, int cols, const int nb,
+                                     const int packed) {
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+    float32x4_t acc[MATMUL_BLOCK];
+    for (int b = 0; b < nb; b++) {
+        acc[b] = vdupq_n_f32(0.0f);
+    }
+
+    int c = 0;
+    for (; c + 16 <= cols; c += 16) {
+        int8x16_t w;
+        if (packed) {
+            uint32_t word;
+            memcpy(&word, (const uint8_t*)row + c / 4, sizeof(word));
+            w = neon_decode_2bit_16(vreinterpretq_u8_u32(vdupq_n_u32(word)), idx0);
+        } else {
+            w = vld1q_s8((const int8_t*)row + c);
+        }
+        float32x4_t wf[4];
+        neon_s8x16_to_f32(w, wf);
+
+        for (int b = 0; b < nb; b++) {
+            const float *xb = x + (size_t)b * cols + c;
+            acc[b] = vfmaq_f32(acc[b], wf[0], vld1q_f32(xb));
+            acc[b] = vfmaq_f32(acc[b], wf[1], vld1q_f32(xb + 4));
+            acc[b] = vfmaq_f32(acc[b], wf[2], vld1q_f32(xb + 8));
+            acc[b] = vfmaq_f32(acc[b], wf[3], vld1q_f32(xb + 12));
+        }
+    }
+
+    for (int b = 0; b < nb; b++) {
+        const float *xb = x + (size_t)b * cols;
+        float sum = vaddvq_f32(acc[b]);
+        if (packed) {
+            sum += matvec_2bit_tail((const uint8_t*)row, xb, c, cols);
+        } else {
+            for (int k = c; k < cols; k++) {
+                sum += (float)((const int8_t*)row)[k] * xb[k];
+            }
+        }
+        out[(size_t)b * rows] = sum;
+    }
+}
+
+static void matmul_8bit_neon(const int8_t *matrix, const float *input,
+                             float *output, int rows, int cols, int batch) {
+    for (int r = 0; r < rows; r++) {
+        const int8_t *row_ptr = matrix + (size_t)r * cols;
+#define NEON_BLOCK(nb) \
+        matmul_neon_block(row_ptr, input + (size_t)b0 * cols, \
+                          output + (size_t)b0 * rows + r, rows, cols, nb, 0)
+        MATMUL_FOR_EACH_BLOCK(batch, NEON_BLOCK)
+#undef NEON_BLOCK
+    }
+}
+
+static void matmul_2bit_neon(const uint8_t *matrix_packed, const float *input,
+                             float *output, int rows, int cols, int batch) {
+    int packed_cols = (cols + 3) / 4;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+#define NEON_BLOCK(nb) \
+        matmul_neon_block(row_ptr, input + (size_t)b0 * cols, \
+                          output + (size_t)b0 * rows + r, rows, cols, nb, 1)
+        MATMUL_FOR_EACH_BLOCK(batch, NEON_BLOCK)
+#undef NEON_BLOCK
+    }
+}
+#endif
+
+// ============================================================================
+// VERSION C: BITPLANE FORMAT
+// ============================================================================
+// Same 2 bits per weight as the packed format, split into two planes per
+// row: a "nonzero" word and a "negative" word per 64 columns.
+//
+//   row r: nz[0..words)  neg[0..words)      words = ceil(cols / 64)
+//
+// A -1 sets both bits, a +1 only the nonzero bit, so the +1 mask is
+// nz ^ neg and the -1 mask is neg. The planes are already lane masks:
+// AVX-512 uses 16 bits at a time as mask registers with no decode at all.
+void ternary_pack_bitplane(const int8_t *matrix_8bit, uint64_t *planes,
+                           int rows, int cols) {
+    int words = (cols + 63) / 64;
+    memset(planes, 0, (size_t)rows * 2 * words * sizeof(uint64_t));
+
+    for (int r = 0; r < rows; r++) {
+        uint64_t *nz = planes + (size_t)r * 2 * words;
+        uint64_t *neg = nz + words;
+
+        for (int c = 0; c < cols; c++) {
+            int8_t val = matrix_8bit[(size_t)r * cols + c];
+            uint64_t bit = 1ULL << (c % 64);
+            if (val != 0) nz[c / 64] |= bit;
+            if (val < 0) neg[c / 64] |= bit;
+        }
+    }
+}
+
+// Branch-free: the weight is (+1 bit) - (-1 bit)
+static inline float bitplane_word_sum(uint64_t plus, uint64_t minus,
+                                      const float *x, int n) {
+    float sum = 0.0f;
+    for (int b = 0; b < n; b++) {
+        float w = (float)(int)((plus >> b) & 1) - (float)(int)((minus >> b) & 1);
+        sum += w * x[b];
+    }
+    return sum;
+}
+
+void ternary_matvec_bitplane(const uint64_t *planes, const float *input,
+                             float *output, int rows, int cols) {
+    int words = (cols + 63) / 64;
+
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        const uint64_t *neg = nz + words;
+        float sum = 0.0f;
+
+        for (int w = 0; w < words; w++) {
+            int n = cols - w * 64 < 64 ? cols - w * 64 : 64;
+            sum += bitplane_word_sum(nz[w] ^ neg[w], neg[w], input + w * 64, n);
+        }
+
+        output[r] = sum;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx512f")))
+static void matvec_bitplane_avx512(const uint64_t *planes, const float *input,
+                                   float *output, int rows, int cols) {
+    int words = (cols + 63) / 64;
+
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        const uint64_t *neg = nz + words;
+        __m512 pos[4], sub[4];
+        for (int k = 0; k < 4; k++) {
+            pos[k] = _mm512_setzero_ps();
+            sub[k] = _mm512_setzero_ps();
+        }
+
+        for (int w = 0; w < words; w++) {
+            uint64_t minus = neg[w];
+            uint64_t plus = nz[w] ^ minus;
+            uint64_t any = nz[w];
+            const float *x = input + w * 64;
+            int full = (w + 1) * 64 <= cols;
+
+            for (int k = 0; k < 4; k++) {
+                // Past the last column every bit is 0, so the masked load
+                // never touches memory beyond the input vector
+                __m512 v = full ? _mm512_loadu_ps(x + 16 * k)
+                                : _mm512_maskz_loadu_ps((__mmask16)(any >> (16 * k)),
+                                                        x + 16 * k);
+                pos[k] = _mm512_mask_add_ps(pos[k], (__mmask16)(plus >> (16 * k)),
+                                            pos[k], v);
+                sub[k] = _mm512_mask_add_ps(sub[k], (__mmask16)(minus >> (16 * k)),
+                                            sub[k], v);
+            }
+        }
+
+        __m512 acc = _mm512_sub_ps(
+            _mm512_add_ps(_mm512_add_ps(pos[0], pos[1]), _mm512_add_ps(pos[2], pos[3])),
+            _mm512_add_ps(_mm512_add_ps(sub[0], sub[1]), _mm512_add_ps(sub[2], sub[3])));
+        output[r] = _mm512_reduce_add_ps(acc);
+    }
+}
+
+// Variable left shift moves column bit k into the sign bit of lane k, and
+// blendv selects the input on the sign bit, so each mask bit becomes a lane
+// select with one shift and one blend.
+__attribute__((target("avx2")))
+static void matvec_bitplane_avx2(const uint64_t *planes, const float *input,
+                                 float *output, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    int full_words = cols / 64;
+    const __m256i sel_lo = _mm256_setr_epi32(31, 30, 29, 28, 27, 26, 25, 24);
+    const __m256i sel_hi = _mm256_setr_epi32(23, 22, 21, 20, 19, 18, 17, 16);
+    const __m256i step = _mm256_set1_epi32(16);
+    const __m256 zero = _mm256_setzero_ps();
+
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        const uint64_t *neg = nz + words;
+        __m256 pos_a = zero, pos_b = zero, sub_a = zero, sub_b = zero;
+
+        for (int w = 0; w < full_words; w++) {
+            uint64_t minus = neg[w];
+            uint64_t plus = nz[w] ^ minus;
+            const float *x = input + w * 64;
+
+            for (int half = 0; half < 2; half++) {
+                __m256i p = _mm256_set1_epi32((int)(uint32_t)(plus >> (32 * half)));
+                __m256i m = _mm256_set1_epi32((int)(uint32_t)(minus >> (32 * half)));
+                const float *xh = x + 32 * half;
+
+                // Bits 0-15 with shifts 31..16, bits 16-31 after shifting left by 16
+                for (int q = 0; q < 2; q++) {
+                    __m256 x_lo = _mm256_loadu_ps(xh + 16 * q);
+                    __m256 x_hi = _mm256_loadu_ps(xh + 16 * q + 8);
+                    pos_a = _mm256_add_ps(pos_a, _mm256_blendv_ps(zero, x_lo,
+                                _mm256_castsi256_ps(_mm256_sllv_epi32(p, sel_lo))));
+                    pos_b = _mm256_add_ps(pos_b, _mm256_blendv_ps(zero, x_hi,
+                                _mm256_castsi256_ps(_mm256_sllv_epi32(p, sel_hi))));
+                    sub_a = _mm256_add_ps(sub_a, _mm256_blendv_ps(zero, x_lo,
+                                _mm256_castsi256_ps(_mm256_sllv_epi32(m, sel_lo))));
+                    sub_b = _mm256_add_ps(sub_b, _mm256_blendv_ps(zero, x_hi,
+                                _mm256_castsi256_ps(_mm256_sllv_epi32(m, sel_hi))));
+                    p = _mm256_srlv_epi32(p, step);
+                    m = _mm256_srlv_epi32(m, step);
+                }
+            }
+        }
+
+        float sum = hsum_avx2(_mm256_sub_ps(_mm256_add_ps(pos_a, pos_b),
+                                            _mm256_add_ps(sub_a, sub_b)));
+        if (full_words < words) {
+            uint64_t minus = neg[full_words];
+            sum += bitplane_word_sum(nz[full_words] ^ minus, minus,
+                                     input + full_words * 64, cols - full_words * 64);
+        }
+        output[r] = sum;
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+// vtst turns 4 mask bits into 4 all-ones/all-zeros lanes
+static void matvec_bitplane_neon(const uint64_t *planes, const float *input,
+                                 float *output, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    int full_words = cols / 64;
+    static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+    const uint32x4_t sel = vld1q_u32(lane_bits);
+
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        const uint64_t *neg = nz + words;
+        float32x4_t pos[2] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+        float32x4_t sub[2] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+
+        for (int w = 0; w < full_words; w++) {
+            uint64_t minus = neg[w];
+            uint64_t plus = nz[w] ^ minus;
+            const float *x = input + w * 64;
+
+            for (int g = 0; g < 16; g++) {
+                uint32x4_t p = vtstq_u32(vdupq_n_u32((uint32_t)(plus >> (4 * g))), sel);
+                uint32x4_t m = vtstq_u32(vdupq_n_u32((uint32_t)(minus >> (4 * g))), sel);
+                uint32x4_t v = vreinterpretq_u32_f32(vld1q_f32(x + 4 * g));
+                pos[g & 1] = vaddq_f32(pos[g & 1], vreinterpretq_f32_u32(vandq_u32(v, p)));
+                sub[g & 1] = vaddq_f32(sub[g & 1], vreinterpretq_f32_u32(vandq_u32(v, m)));
+            }
+        }
+
+        float sum = vaddvq_f32(vsubq_f32(vaddq_f32(pos[0], pos[1]),
+                                         vaddq_f32(sub[0], sub[1])));
+        if (full_words < words) {
+            uint64_t minus = neg[full_words];
+            sum += bitplane_word_sum(nz[full_words] ^ minus, minus,
+                                     input + full_words * 64, cols - full_words * 64);
+        }
+        output[r] = sum;
+    }
+}
+#endif
+
+// ============================================================================
+// VERSION D: BASE-3 FORMAT (5 TRITS PER BYTE)
+// ============================================================================
+// 3^5 = 243 <= 256, so five trits fit in one byte as a base-3 number:
+//   byte = d0 + 3*d1 + 9*d2 + 27*d3 + 81*d4,   d = 0 (0), 1 (+1), 2 (-1)
+// That is 1.6 bits per weight, 20% fewer bytes than the 2-bit packing.
+// Decode is one 256-entry LUT lookup per byte; each entry holds the five
+// weights as floats padded to 8 lanes (3 trailing zeros), so an entry is
+// one aligned 8-float load that multiplies straight against the input.
+
+static float base3_lut[256][8] __attribute__((aligned(32)));
+
+// Codes 243..255 never occur and decode to zero weights
+static void init_base3_lut(void) {
+    for (int code = 0; code < 256; code++) {
+        int v = code;
+        for (int k = 0; k < 8; k++) {
+            float w = 0.0f;
+            if (k < BASE3_TRITS && code < 243) {
+                int d = v % 3;
+                v /= 3;
+                w = d == 1 ? 1.0f : d == 2 ? -1.0f : 0.0f;
+            }
+            base3_lut[code][k] = w;
+        }
+    }
+}
+
+void ternary_pack_base3(const int8_t *matrix_8bit, uint8_t *matrix_base3,
+                        int rows, int cols) {
+    int packed_cols = (cols + BASE3_TRITS - 1) / BASE3_TRITS;
+
+    for (int r = 0; r < rows; r++) {
+        for (int i = 0; i < packed_cols; i++) {
+            int code = 0;
+            for (int k = BASE3_TRITS - 1; k >= 0; k--) {
+                int c = i * BASE3_TRITS + k;
+                int8_t val = c < cols ? matrix_8bit[(size_t)r * cols + c] : 0;
+                code = code * 3 + (val == 1 ? 1 : val == -1 ? 2 : 0);
+            }
+            matrix_base3[(size_t)r * packed_cols + i] = (uint8_t)code;
+        }
+    }
+}
+
+// Scalar remainder from byte i (column c = 5 * i) to the end of the row
+static inline float matvec_base3_tail(const uint8_t *row_ptr, const float *input,
+                                      int i, int cols) {
+    float sum = 0.0f;
+    for (int c = i * BASE3_TRITS; c < cols; i++, c += BASE3_TRITS) {
+        const float *w = base3_lut[row_ptr[i]];
+        int n = cols - c < BASE3_TRITS ? cols - c : BASE3_TRITS;
+        for (int k = 0; k < n; k++) {
+            sum += w[k] * input[c + k];
+        }
+    }
+    return sum;
+}
+
+void ternary_matvec_base3(const uint8_t *matrix_base3, const float *input,
+                          float *output, int rows, int cols) {
+    int packed_cols = (cols + BASE3_TRITS - 1) / BASE3_TRITS;
+
+    for (int r = 0; r < rows; r++) {
+        output[r] = matvec_base3_tail(matrix_base3 + (size_t)r * packed_cols,
+                                      input, 0, cols);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// Four bytes (20 columns) per step into four accumulators. The 8-lane input
+// load reads 3 columns past each byte, hence the c + 23 <= cols bound.
+// AVX-512 CPUs use this kernel too: widening to 16 lanes would need a
+// cross-lane permute to place the next 5 weights, which costs more than it
+// saves.
+__attribute__((target("avx2,fma")))
+static void matvec_base3_avx2(const uint8_t *matrix_base3, const float *input,
+                              float *output, int rows, int cols) {
+    int packed_cols = (cols + BASE3_TRITS - 1) / BASE3_TRITS;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_base3 + (size_t)r * packed_cols;
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+        int i = 0, c = 0;
+
+        for (; c + 23 <= cols; i += 4, c += 20) {
+            acc0 = _mm256_fmadd_ps(_mm256_load_ps(base3_lut[row_ptr[i]]),
+                                   _mm256_loadu_ps(input + c), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_load_ps(base3_lut[row_ptr[i + 1]]),
+                                   _mm256_loadu_ps(input + c + 5), acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_load_ps(base3_lut[row_ptr[i + 2]]),
+                                   _mm256_loadu_ps(input + c + 10), acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_load_ps(base3_lut[row_ptr[i + 3]]),
+                                   _mm256_loadu_ps(input + c + 15), acc3);
+        }
+
+        __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1),
+                                   _mm256_add_ps(acc2, acc3));
+        output[r] = hsum_avx2(acc) + matvec_base3_tail(row_ptr, input, i, cols);
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+// Each LUT entry is two float32x4: lanes 0-3 and lane 4 (5-7 are zero)
+static void matvec_base3_neon(const uint8_t *matrix_base3, const float *input,
+                              float *output, int rows, int cols) {
+    int packed_cols = (cols + BASE3_TRITS - 1) / BASE3_TRITS;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_base3 + (size_t)r * packed_cols;
+        float32x4_t acc[4] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f),
+                               vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+        int i = 0, c = 0;
+
+        for (; c + 23 <= cols; i += 4, c += 20) {
+            for (int j = 0; j < 4; j++) {
+                const float *w = base3_lut[row_ptr[i + j]];
+                const float *x = input + c + 5 * j;
+                acc[j] = vfmaq_f32(acc[j], vld1q_f32(w), vld1q_f32(x));
+                acc[j] = vfmaq_f32(acc[j], vld1q_f32(w + 4), vld1q_f32(x + 4));
+            }
+        }
+
+        output[r] = neon_hsum4(acc) + matvec_base3_tail(row_ptr, input, i, cols);
+    }
+}
+#endif
+
+// ============================================================================
+// INT8 ACTIVATIONS
+// ============================================================================
+// The input vector is quantized once per call to int8 with one scale per
+// vector (x ~= q * scale, |q| <= 127). Against ternary weights every
+// product is +q, -q or 0, so the dot product is pure integer add/sub into
+// int32 and a single float multiply per output. Activations shrink from
+// 4 bytes to 1 per column.
+//
+// SIMD kernels decode packed bytes in bit-plane order (all trit-0 codes of
+// a group of bytes, then all trit-1 codes, ...), so the quantizer stores q
+// permuted to match: within each `block` columns, column 4*i + k goes to
+// position k * (block / 4) + i. block = 4 keeps natural order.
+
+void ternary_quantize_input_int8(const float *input, int cols, int block,
+                                 quant_input_t *out) {
+    TRACE_BEGIN(trace_t0);
+    float amax = 0.0f;
+    for (int c = 0; c < cols; c++) {
+        float a = input[c] < 0.0f ? -input[c] : input[c];
+        if (a > amax) amax = a;
+    }
+    float scale = amax > 0.0f ? amax / 127.0f : 1.0f;
+    float inv = 1.0f / scale;
+    int group = block / 4;
+    int full = cols / block * block;
+    int32_t sum = 0;
+
+    for (int c = 0; c < cols; c++) {
+        float v = input[c] * inv;
+        int qv = (int)(v + (v >= 0.0f ? 0.5f : -0.5f));
+        if (qv > 127) qv = 127;
+        if (qv < -127) qv = -127;
+
+        int dst = c;
+        if (c < full) {
+            int col = c % block;
+            dst = c - col + (col % 4) * group + col / 4;
+            sum += qv;
+        }
+        out->q[dst] = (int8_t)qv;
+    }
+
+    out->scale = scale;
+    out->block_sum = sum;
+    out->cols = cols;
+    TRACE_END(trace_t0, "quantize", cols);
+}
+
+// Columns from c to the end of the row, natural order, add/sub only
+static inline int32_t matvec_2bit_q8_tail(const uint8_t *row_ptr,
+                                          const int8_t *q, int c, int cols) {
+    int32_t sum = 0;
+    for (; c < cols; c++) {
+        int8_t w = unpack_trit(row_ptr[c / 4], c % 4);
+        if (w > 0) sum += q[c];
+        else if (w < 0) sum -= q[c];
+    }
+    return sum;
+}
+
+void ternary_matvec_2bit_q8(const uint8_t *matrix_packed, const quant_input_t *input,
+                            float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        output[r] = (float)matvec_2bit_q8_tail(row_ptr, input->q, 0, cols) *
+                    input->scale;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// 32 columns per step (block 32): 8 packed bytes are broadcast, each dword
+// pair shifted by 0/2/4/6 and masked to codes, vpshufb maps codes to
+// 0/+1/-1, and vpsignb applies the weight to q. maddubs/madd widen the
+// byte sums into int32.
+__attribute__((target("avx2")))
+static void matvec_2bit_q8_avx2(const uint8_t *matrix_packed,
+                                const quant_input_t *input,
+                                float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    int full = cols / 32 * 32;
+    const __m256i shifts = _mm256_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6);
+    const __m256i three = _mm256_set1_epi8(3);
+    const __m256i code_to_weight = _mm256_setr_epi8(
+        0, 1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i ones8 = _mm256_set1_epi8(1);
+    const __m256i ones16 = _mm256_set1_epi16(1);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+        int c = 0;
+
+        for (; c < full; c += 32) {
+            uint64_t bytes;
+            memcpy(&bytes, row_ptr + c / 4, sizeof(bytes));
+            __m256i p = _mm256_set1_epi64x((long long)bytes);
+            __m256i codes = _mm256_and_si256(_mm256_srlv_epi32(p, shifts), three);
+            __m256i w = _mm256_shuffle_epi8(code_to_weight, codes);
+            __m256i prod = _mm256_sign_epi8(
+                _mm256_loadu_si256((const __m256i*)(input->q + c)), w);
+            __m256i sum16 = _mm256_maddubs_epi16(ones8, prod);
+            if ((c / 32) & 1) {
+                acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(sum16, ones16));
+            } else {
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(sum16, ones16));
+            }
+        }
+
+        __m256i acc = _mm256_add_epi32(acc0, acc1);
+        __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                  _mm256_extracti128_si256(acc, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+        int32_t total = _mm_cvtsi128_si32(s) +
+                        matvec_2bit_q8_tail(row_ptr, input->q, c, cols);
+        output[r] = (float)total * input->scale;
+    }
+}
+
+// 64 columns per step (block 64): 16 packed bytes are broadcast to all four
+// 128-bit lanes, lane k is shifted by 2k (vpsrlvw) and masked, and vpshufb
+// maps the codes to w + 1 in {0, 1, 2}. vpdpbusd needs an unsigned operand,
+// so it accumulates (w + 1) * q and the per-vector sum of q is subtracted
+// once at the end.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void matvec_2bit_q8_vnni(const uint8_t *matrix_packed,
+                                const quant_input_t *input,
+                                float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    int full = cols / 64 * 64;
+    const __m512i shifts = _mm512_setr_epi32(
+        0, 0, 0, 0,
+        0x00020002, 0x00020002, 0x00020002, 0x00020002,
+        0x00040004, 0x00040004, 0x00040004, 0x00040004,
+        0x00060006, 0x00060006, 0x00060006, 0x00060006);
+    const __m512i three = _mm512_set1_epi8(3);
+    const __m512i code_to_weight_plus1 = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(1, 2, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+        int c = 0;
+
+        for (; c + 128 <= full; c += 128) {
+            __m512i p0 = _mm512_broadcast_i32x4(
+                _mm_loadu_si128((const __m128i*)(row_ptr + c / 4)));
+            __m512i p1 = _mm512_broadcast_i32x4(
+                _mm_loadu_si128((const __m128i*)(row_ptr + c / 4 + 16)));
+            __m512i w0 = _mm512_shuffle_epi8(code_to_weight_plus1,
+                _mm512_and_si512(_mm512_srlv_epi16(p0, shifts), three));
+            __m512i w1 = _mm512_shuffle_epi8(code_to_weight_plus1,
+                _mm512_and_si512(_mm512_srlv_epi16(p1, shifts), three));
+            acc0 = _mm512_dpbusd_epi32(acc0, w0, _mm512_loadu_si512(input->q + c));
+            acc1 = _mm512_dpbusd_epi32(acc1, w1, _mm512_loadu_si512(input->q + c + 64));
+        }
+
+        for (; c < full; c += 64) {
+            __m512i p = _mm512_broadcast_i32x4(
+                _mm_loadu_si128((const __m128i*)(row_ptr + c / 4)));
+            __m512i w = _mm512_shuffle_epi8(code_to_weight_plus1,
+                _mm512_and_si512(_mm512_srlv_epi16(p, shifts), three));
+            acc0 = _mm512_dpbusd_epi32(acc0, w, _mm512_loadu_si512(input->q + c));
+        }
+
+        int32_t total = _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1)) -
+                        input->block_sum +
+                        matvec_2bit_q8_tail(row_ptr, input->q, c, cols);
+        output[r] = (float)total * input->scale;
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+// The TBL decode already yields weights in natural column order (block 4).
+// With the dot-product extension (M1, Graviton2+) sdot does 16 signed
+// multiply-adds per instruction; otherwise widen with smull/smlal.
+static void matvec_2bit_q8_neon(const uint8_t *matrix_packed,
+                                const quant_input_t *input,
+                                float *output, int rows, int cols) {
+    int packed_cols = (cols + 3) / 4;
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        int32x4_t acc = vdupq_n_s32(0);
+        int c = 0;
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            int8x16_t w = neon_decode_2bit_16(vreinterpretq_u8_u32(vdupq_n_u32(word)),
+                                              idx0);
+            int8x16_t x = vld1q_s8(input->q + c);
+#ifdef __ARM_FEATURE_DOTPROD
+            acc = vdotq_s32(acc, w, x);
+#else
+            int16x8_t p = vmull_s8(vget_low_s8(w), vget_low_s8(x));
+            p = vmlal_high_s8(p, w, x);
+            acc = vpadalq_s16(acc, p);
+#endif
+        }
+
+        int32_t total = vaddvq_s32(acc) +
+                        matvec_2bit_q8_tail(row_ptr, input->q, c, cols);
+        output[r] = (float)total * input->scale;
+    }
+}
+#endif
+
+// ============================================================================
+// CACHE-BLOCKED (TILED) KERNELS
+// ============================================================================
+// The untiled kernel walks each row end to end, so the whole 16 KB input
+// competes with the streamed weights in L1. The tiled kernel walks one
+// column block of `col_tile` inputs at a time against panels of `row_tile`
+// rows: each 16-float input chunk is loaded once and applied to every row
+// of the panel, with one accumulator per row held in registers. Partial
+// sums are added into output after each column block.
+//
+// row_tile is clamped to [1, TILE_MAX_ROWS]; the SIMD kernels round it
+// down to 1, 2, 4 or 8 (a compile-time constant inside each panel call).
+// col_tile is rounded up to a multiple of 64 columns.
+
+int ternary_tile_round_cols(int col_tile) {
+    return col_tile < 64 ? 64 : (col_tile + 63) / 64 * 64;
+}
+
+// Largest power of two <= min(row_tile, left), at most TILE_MAX_ROWS
+static inline int tile_panel_rows(int row_tile, int left) {
+    int n = row_tile < left ? row_tile : left;
+    return n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+}
+
+// Runs PANEL_CALL(nr) over every row panel with a compile-time nr
+#define TILE_FOR_EACH_PANEL(rows, row_tile, PANEL_CALL)                  \
+    for (int r0 = 0; r0 < (rows); ) {                                    \
+        int nr = tile_panel_rows((row_tile), (rows) - r0);               \
+        switch (nr) {                                                    \
+        case 8:  PANEL_CALL(8); break;                                   \
+        case 4:  PANEL_CALL(4); break;                                   \
+        case 2:  PANEL_CALL(2); break;                                   \
+        default: PANEL_CALL(1); break;                                   \
+        }                                                                \
+        r0 += nr;                                                        \
+    }
+
+void ternary_matvec_2bit_tiled(const uint8_t *matrix_packed, const float *input,
+                               float *output, int rows, int cols,
+                               int row_tile, int col_tile) {
+    int packed_cols = (cols + 3) / 4;
+    col_tile = ternary_tile_round_cols(col_tile);
+    row_tile = row_tile < 1 ? 1 : row_tile > TILE_MAX_ROWS ? TILE_MAX_ROWS : row_tile;
+    memset(output, 0, (size_t)rows * sizeof(float));
+
+    for (int c0 = 0; c0 < cols; c0 += col_tile) {
+        int c1 = c0 + col_tile < cols ? c0 + col_tile : cols;
+
+        for (int r0 = 0; r0 < rows; r0 += row_tile) {
+            int nr = rows - r0 < row_tile ? rows - r0 : row_tile;
+            float sum[TILE_MAX_ROWS] = { 0.0f };
+
+            for (int c = c0; c < c1; c++) {
+                float x = input[c];
+                for (int j = 0; j < nr; j++) {
+                    const uint8_t *row_ptr = matrix_packed + (size_t)(r0 + j) * packed_cols;
+                    int8_t w = unpack_trit(row_ptr[c / 4], c % 4);
+                    if (w != 0) {
+                        sum[j] += (float)w * x;
+                    }
+                }
+            }
+
+            for (int j = 0; j < nr; j++) {
+                output[r0 + j] += sum[j];
+            }
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx512f"), always_inline))
+static inline void tiled_2bit_avx512_panel(const uint8_t *matrix_packed,
+                                           int packed_cols, const float *input,
+                                           float *output, int r0,
+                                           int c0, int c1, const int nr) {
+    const __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                             16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i two = _mm512_set1_epi32(2);
+    const uint8_t *row_ptr[TILE_MAX_ROWS];
+    __m512 acc[TILE_MAX_ROWS];
+    for (int j = 0; j < nr; j++) {
+        row_ptr[j] = matrix_packed + (size_t)(r0 + j) * packed_cols;
+        acc[j] = _mm512_setzero_ps();
+    }
+
+    int c = c0;
+    for (; c + 16 <= c1; c += 16) {
+        __m512 x = _mm512_loadu_ps(input + c);
+        for (int j = 0; j < nr; j++) {
+            uint32_t word;
+            memcpy(&word, row_ptr[j] + c / 4, sizeof(word));
+            __m512i t = _mm512_srlv_epi32(_mm512_set1_epi32((int)word), shifts);
+            acc[j] = _mm512_mask_add_ps(acc[j], _mm512_test_epi32_mask(t, one), acc[j], x);
+            acc[j] = _mm512_mask_sub_ps(acc[j], _mm512_test_epi32_mask(t, two), acc[j], x);
+        }
+    }
+
+    for (int j = 0; j < nr; j++) {
+        output[r0 + j] += _mm512_reduce_add_ps(acc[j]) +
+                          matvec_2bit_tail(row_ptr[j], input, c, c1);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matvec_2bit_tiled_avx512(const uint8_t *matrix_packed,
+                                     const float *input, float *output,
+                                     int rows, int cols,
+                                     int row_tile, int col_tile) {
+    int packed_cols = (cols + 3) / 4;
+    col_tile = ternary_tile_round_cols(col_tile);
+    memset(output, 0, (size_t)rows * sizeof(float));
+
+    for (int c0 = 0; c0 < cols; c0 += col_tile) {
+        int c1 = c0 + col_tile < cols ? c0 + col_tile : cols;
+#define AVX512_PANEL(n) \
+        tiled_2bit_avx512_panel(matrix_packed, packed_cols, input, output, \
+                                r0, c0, c1, n)
+        TILE_FOR_EACH_PANEL(rows, row_tile, AVX512_PANEL)
+#undef AVX512_PANEL
+    }
+}
+
+// Same sign-xor decode as the batched AVX2 kernel: one accumulator per row
+__attribute__((target("avx2"), always_inline))
+static inline void tiled_2bit_avx2_panel(const uint8_t *matrix_packed,
+                                         int packed_cols, const float *input,
+                                         float *output, int r0,
+                                         int c0, int c1, const int nr) {
+    const __m256i shift_lo = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m256i shift_hi = _mm256_setr_epi32(16, 18, 20, 22, 24, 26, 28, 30);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i sign_bit = _mm256_set1_epi32((int)0x80000000u);
+    const uint8_t *row_ptr[TILE_MAX_ROWS];
+    __m256 acc[TILE_MAX_ROWS];
+    for (int j = 0; j < nr; j++) {
+        row_ptr[j] = matrix_packed + (size_t)(r0 + j) * packed_cols;
+        acc[j] = _mm256_setzero_ps();
+    }
+
+    int c = c0;
+    for (; c + 16 <= c1; c += 16) {
+        __m256 x_lo = _mm256_loadu_ps(input + c);
+        __m256 x_hi = _mm256_loadu_ps(input + c + 8);
+        for (int j = 0; j < nr; j++) {
+            uint32_t word;
+            memcpy(&word, row_ptr[j] + c / 4, sizeof(word));
+            __m256i w = _mm256_set1_epi32((int)word);
+            __m256i t_lo = _mm256_srlv_epi32(w, shift_lo);
+            __m256i t_hi = _mm256_srlv_epi32(w, shift_hi);
+            __m256 zero_lo = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+                _mm256_and_si256(t_lo, three), _mm256_setzero_si256()));
+            __m256 zero_hi = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+                _mm256_and_si256(t_hi, three), _mm256_setzero_si256()));
+            __m256 v_lo = _mm256_xor_ps(_mm256_andnot_ps(zero_lo, x_lo),
+                _mm256_castsi256_ps(_mm256_and_si256(_mm256_slli_epi32(t_lo, 30), sign_bit)));
+            __m256 v_hi = _mm256_xor_ps(_mm256_andnot_ps(zero_hi, x_hi),
+                _mm256_castsi256_ps(_mm256_and_si256(_mm256_slli_epi32(t_hi, 30), sign_bit)));
+            acc[j] = _mm256_add_ps(acc[j], _mm256_add_ps(v_lo, v_hi));
+        }
+    }
+
+    for (int j = 0; j < nr; j++) {
+        output[r0 + j] += hsum_avx2(acc[j]) +
+                          matvec_2bit_tail(row_ptr[j], input, c, c1);
+    }
+}
+
+__attribute__((target("avx2")))
+static void matvec_2bit_tiled_avx2(const uint8_t *matrix_packed,
+                                   const float *input, float *output,
+                                   int rows, int cols,
+                                   int row_tile, int col_tile) {
+    int packed_cols = (cols + 3) / 4;
+    col_tile = ternary_tile_round_cols(col_tile);
+    memset(output, 0, (size_t)rows * sizeof(float));
+
+    for (int c0 = 0; c0 < cols; c0 += col_tile) {
+        int c1 = c0 + col_tile < cols ? c0 + col_tile : cols;
+#define AVX2_PANEL(n) \
+        tiled_2bit_avx2_panel(matrix_packed, packed_cols, input, output, \
+                              r0, c0, c1, n)
+        TILE_FOR_EACH_PANEL(rows, row_tile, AVX2_PANEL)
+#undef AVX2_PANEL
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+__attribute__((always_inline))
+static inline void tiled_2bit_neon_panel(const uint8_t *matrix_packed,
+                                         int packed_cols, const float *input,
+                                         float *output, int r0,
+                                         int c0, int c1, const int nr) {
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+    const uint8_t *row_ptr[TILE_MAX_ROWS];
+    float32x4_t acc[TILE_MAX_ROWS];
+    for (int j = 0; j < nr; j++) {
+        row_ptr[j] = matrix_packed + (size_t)(r0 + j) * packed_cols;
+        acc[j] = vdupq_n_f32(0.0f);
+    }
+
+    int c = c0;
+    for (; c + 16 <= c1; c += 16) {
+        float32x4_t x0 = vld1q_f32(input + c), x1 = vld1q_f32(input + c + 4);
+        float32x4_t x2 = vld1q_f32(input + c + 8), x3 = vld1q_f32(input + c + 12);
+        for (int j = 0; j < nr; j++) {
+            uint32_t word;
+            memcpy(&word, row_ptr[j] + c / 4, sizeof(word));
+            float32x4_t wf[4];
+            neon_s8x16_to_f32(neon_decode_2bit_16(
+                vreinterpretq_u8_u32(vdupq_n_u32(word)), idx0), wf);
+            acc[j] = vfmaq_f32(acc[j], wf[0], x0);
+            acc[j] = vfmaq_f32(acc[j], wf[1], x1);
+            acc[j] = vfmaq_f32(acc[j], wf[2], x2);
+            acc[j] = vfmaq_f32(acc[j], wf[3], x3);
+        }
+    }
+
+    for (int j = 0; j < nr; j++) {
+        output[r0 + j] += vaddvq_f32(acc[j]) +
+                          matvec_2bit_tail(row_ptr[j], input, c, c1);
+    }
+}
+
+static void matvec_2bit_tiled_neon(const uint8_t *matrix_packed,
+                                   const float *input, float *output,
+                                   int rows, int cols,
+                                   int row_tile, int col_tile) {
+    int packed_cols = (cols + 3) / 4;
+    col_tile = ternary_tile_round_cols(col_tile);
+    memset(output, 0, (size_t)rows * sizeof(float));
+
+    for (int c0 = 0; c0 < cols; c0 += col_tile) {
+        int c1 = c0 + col_tile < cols ? c0 + col_tile : cols;
+#define NEON_PANEL(n) \
+        tiled_2bit_neon_panel(matrix_packed, packed_cols, input, output, \
+                              r0, c0, c1, n)
+        TILE_FOR_EACH_PANEL(rows, row_tile, NEON_PANEL)
+#undef NEON_PANEL
+    }
+}
+#endif
+
+// ============================================================================
+// SHAPE-SPECIALIZED KERNELS
+// ============================================================================
+// The generic kernels take cols at run time, so every row pays for the
+// loop bounds, a 16-column step and a scalar tail it almost never needs.
+// Model layers only come in a handful of widths, so each width in
+// FIXED_2BIT_COLS gets its own kernel per row tile, stamped out by the
+// macros below: the body is an always_inline function and every wrapper
+// passes cols and the tile as literals, so the compiler sees a constant
+// trip count, drops the tail code and unrolls the column loop. Every
+// width is a multiple of 32, one full AVX-512 step.
+//
+// A tile of N rows loads each input chunk once and applies it to N rows.
+// The column loop is unrolled 4 steps rather than fully: an 11008-column
+// row fully unrolled is tens of KB of code per kernel, far past the L1i.
+// The scalar bodies keep the generic decode, so they measure only what the
+// constant shape buys; there are no NEON bodies, and AArch64 builds fall
+// back to ternary_matvec_2bit_impl unless TERNARY_ISA=scalar.
+#define FIXED_2BIT_COLS(X, isa, target)                                    \
+    X(isa, target, 2560) X(isa, target, 4096) X(isa, target, 5120)         \
+    X(isa, target, 6912) X(isa, target, 8192) X(isa, target, 11008)        \
+    X(isa, target, 13824) X(isa, target, 14336) X(isa, target, 28672)
+
+const int ternary_matvec_2bit_fixed_tiles[FIXED_TILE_COUNT] = { 1, 2, 4 };
+
+typedef struct {
+    int cols;
+    int row_tile;
+    matvec_2bit_fn fn;
+} fixed_2bit_kernel_t;
+
+// One wrapper per tile, matvec_2bit_<isa>_<cols>x<tile>
+#define FIXED_2BIT_KERNEL(isa, target, COLS, TILE)                         \
+    target static void matvec_2bit_##isa##_##COLS##x##TILE(                \
+        const uint8_t *matrix_packed, const float *input, float *output,   \
+        int rows, int cols) {                                              \
+        (void)cols;                                                        \
+        fixed_2bit_##isa(matrix_packed, input, output, rows, COLS, TILE);  \
+    }
+#define FIXED_2BIT_KERNELS(isa, target, COLS)                              \
+    FIXED_2BIT_KERNEL(isa, target, COLS, 1)                                \
+    FIXED_2BIT_KERNEL(isa, target, COLS, 2)                                \
+    FIXED_2BIT_KERNEL(isa, target, COLS, 4)
+#define FIXED_2BIT_ENTRIES(isa, target, COLS)                              \
+    { COLS, 1, matvec_2bit_##isa##_##COLS##x1 },                           \
+    { COLS, 2, matvec_2bit_##isa##_##COLS##x2 },                           \
+    { COLS, 4, matvec_2bit_##isa##_##COLS##x4 },
+#define FIXED_2BIT_COL_VALUE(isa, target, COLS) COLS,
+
+const int ternary_matvec_2bit_fixed_cols[FIXED_COL_COUNT] = {
+    FIXED_2BIT_COLS(FIXED_2BIT_COL_VALUE, , )
+};
+
+// Rows [0, rows) in panels of `tile`, leftover rows one at a time
+#define FIXED_2BIT_FOR_EACH_PANEL(rows, tile, PANEL)                       \
+    int r = 0;                                                             \
+    for (; r + (tile) <= (rows); r += (tile)) {                            \
+        PANEL(r, tile);                                                    \
+    }                                                                      \
+    for (; r < (rows); r++) {                                              \
+        PANEL(r, 1);                                                       \
+    }
+
+__attribute__((always_inline))
+static inline void fixed_2bit_scalar_panel(const uint8_t *matrix_packed,
+                                           const float *input, float *output,
+                                           int r0, const int cols, const int nr) {
+    const int packed_cols = cols / 4;
+    float sum[FIXED_MAX_TILE] = { 0.0f };
+
+#pragma GCC unroll 4
+    for (int p = 0; p < packed_cols; p++) {
+        for (int j = 0; j < nr; j++) {
+            uint8_t packed = matrix_packed[(size_t)(r0 + j) * packed_cols + p];
+            for (int k = 0; k < 4; k++) {
+                int8_t w = unpack_trit(packed, k);
+                if (w != 0) {
+                    sum[j] += (float)w * input[p * 4 + k];
+                }
+            }
+        }
+    }
+
+    for (int j = 0; j < nr; j++) {
+        output[r0 + j] = sum[j];
+    }
+}
+
+__attribute__((always_inline))
+static inline void fixed_2bit_scalar(const uint8_t *matrix_packed,
+                                     const float *input, float *output,
+                                     int rows, const int cols, const int tile) {
+#define SCALAR_PANEL(r0, n) \
+    fixed_2bit_scalar_panel(matrix_packed, input, output, r0, cols, n)
+    FIXED_2BIT_FOR_EACH_PANEL(rows, tile, SCALAR_PANEL)
+#undef SCALAR_PANEL
+}
+
+FIXED_2BIT_COLS(FIXED_2BIT_KERNELS, scalar, )
+
+static const fixed_2bit_kernel_t fixed_2bit_scalar_kernels[] = {
+    FIXED_2BIT_COLS(FIXED_2BIT_ENTRIES, scalar, )
+};
+
+#ifdef HAVE_X86_KERNELS
+// The generic AVX-512 step, 32 columns with four accumulators per row
+__attribute__((target("avx512f"), always_inline))
+static inline void fixed_2bit_avx512_panel(const uint8_t *matrix_packed,
+                                           const float *input, float *output,
+                                           int r0, const int cols, const int nr) {
+    const int packed_cols = cols / 4;
+    const __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                             16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i two = _mm512_set1_epi32(2);
+    const uint8_t *row_ptr[FIXED_MAX_TILE];
+    __m512 pos0[FIXED_MAX_TILE], neg0[FIXED_MAX_TILE];
+    __m512 pos1[FIXED_MAX_TILE], neg1[FIXED_MAX_TILE];
+    for (int j = 0; j < nr; j++) {
+        row_ptr[j] = matrix_packed + (size_t)(r0 + j) * packed_cols;
+        pos0[j] = neg0[j] = pos1[j] = neg1[j] = _mm512_setzero_ps();
+    }
+
+#pragma GCC unroll 4
+    for (int c = 0; c < cols; c += 32) {
+        __m512 x0 = _mm512_loadu_ps(input + c);
+        __m512 x1 = _mm512_loadu_ps(input + c + 16);
+        for (int j = 0; j < nr; j++) {
+            uint32_t words[2];
+            memcpy(words, row_ptr[j] + c / 4, sizeof(words));
+            __m512i t0 = _mm512_srlv_epi32(_mm512_set1_epi32((int)words[0]), shifts);
+            __m512i t1 = _mm512_srlv_epi32(_mm512_set1_epi32((int)words[1]), shifts);
+            pos0[j] = _mm512_mask_add_ps(pos0[j], _mm512_test_epi32_mask(t0, one), pos0[j], x0);
+            neg0[j] = _mm512_mask_add_ps(neg0[j], _mm512_test_epi32_mask(t0, two), neg0[j], x0);
+            pos1[j] = _mm512_mask_add_ps(pos1[j], _mm512_test_epi32_mask(t1, one), pos1[j], x1);
+            neg1[j] = _mm512_mask_add_ps(neg1[j], _mm512_test_epi32_mask(t1, two), neg1[j], x1);
+        }
+    }
+
+    for (int j = 0; j < nr; j++) {
+        output[r0 + j] = _mm512_reduce_add_ps(_mm512_sub_ps(
+            _mm512_add_ps(pos0[j], pos1[j]), _mm512_add_ps(neg0[j], neg1[j])));
+    }
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void fixed_2bit_avx512(const uint8_t *matrix_packed,
+                                     const float *input, float *output,
+                                     int rows, const int cols, const int tile) {
+#define AVX512_PANEL(r0, n) \
+    fixed_2bit_avx512_panel(matrix_packed, input, output, r0, cols, n)
+    FIXED_2BIT_FOR_EACH_PANEL(rows, tile, AVX512_PANEL)
+#undef AVX512_PANEL
+}
+
+// The generic AVX2 decode, with one add-then-subtract accumulator per half
+// so a 4-row tile stays within the 16 ymm registers
+__attribute__((target("avx2"), always_inline))
+static inline void fixed_2bit_avx2_panel(const uint8_t *matrix_packed,
+                                         const float *input, float *output,
+                                         int r0, const int cols, const int nr) {
+    const int packed_cols = cols / 4;
+    const __m256i shift_lo = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m256i shift_hi = _mm256_setr_epi32(16, 18, 20, 22, 24, 26, 28, 30);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    const uint8_t *row_ptr[FIXED_MAX_TILE];
+    __m256 acc_lo[FIXED_MAX_TILE], acc_hi[FIXED_MAX_TILE];
+    for (int j = 0; j < nr; j++) {
+        row_ptr[j] = matrix_packed + (size_t)(r0 + j) * packed_cols;
+        acc_lo[j] = acc_hi[j] = _mm256_setzero_ps();
+    }
+
+#pragma GCC unroll 4
+    for (int c = 0; c < cols; c += 16) {
+        __m256 x_lo = _mm256_loadu_ps(input + c);
+        __m256 x_hi = _mm256_loadu_ps(input + c + 8);
+        for (int j = 0; j < nr; j++) {
+            uint32_t word;
+            memcpy(&word, row_ptr[j] + c / 4, sizeof(word));
+            __m256i w = _mm256_set1_epi32((int)word);
+            __m256i codes_lo = _mm256_and_si256(_mm256_srlv_epi32(w, shift_lo), three);
+            __m256i codes_hi = _mm256_and_si256(_mm256_srlv_epi32(w, shift_hi), three);
+            acc_lo[j] = _mm256_add_ps(acc_lo[j], _mm256_and_ps(x_lo,
+                            _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_lo, one))));
+            acc_lo[j] = _mm256_sub_ps(acc_lo[j], _mm256_and_ps(x_lo,
+                            _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_lo, two))));
+            acc_hi[j] = _mm256_add_ps(acc_hi[j], _mm256_and_ps(x_hi,
+                            _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_hi, one))));
+            acc_hi[j] = _mm256_sub_ps(acc_hi[j], _mm256_and_ps(x_hi,
+                            _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_hi, two))));
+        }
+    }
+
+    for (int j = 0; j < nr; j++) {
+        output[r0 + j] = hsum_avx2(_mm256_add_ps(acc_lo[j], acc_hi[j]));
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void fixed_2bit_avx2(const uint8_t *matrix_packed,
+                                   const float *input, float *output,
+                                   int rows, const int cols, const int tile) {
+#define AVX2_PANEL(r0, n) \
+    fixed_2bit_avx2_panel(matrix_packed, input, output, r0, cols, n)
+    FIXED_2BIT_FOR_EACH_PANEL(rows, tile, AVX2_PANEL)
+#undef AVX2_PANEL
+}
+
+FIXED_2BIT_COLS(FIXED_2BIT_KERNELS, avx512, __attribute__((target("avx512f"))))
+FIXED_2BIT_COLS(FIXED_2BIT_KERNELS, avx2, __attribute__((target("avx2"))))
+
+static const fixed_2bit_kernel_t fixed_2bit_avx512_kernels[] = {
+    FIXED_2BIT_COLS(FIXED_2BIT_ENTRIES, avx512, )
+};
+static const fixed_2bit_kernel_t fixed_2bit_avx2_kernels[] = {
+    FIXED_2BIT_COLS(FIXED_2BIT_ENTRIES, avx2, )
+};
+#endif
+
+_Static_assert(sizeof(fixed_2bit_scalar_kernels) / sizeof(fixed_2bit_kernel_t) ==
+               FIXED_COL_COUNT * FIXED_TILE_COUNT,
+               "FIXED_COL_COUNT does not match FIXED_2BIT_COLS");
+
+// Set by ternary_init_kernel_dispatch(); NULL where there are no specializations
+static const fixed_2bit_kernel_t *fixed_2bit_kernels = fixed_2bit_scalar_kernels;
+
+matvec_2bit_fn ternary_matvec_2bit_fixed(int cols, int row_tile) {
+    if (!fixed_2bit_kernels) {
+        return NULL;
+    }
+    for (int i = 0; i < FIXED_COL_COUNT * FIXED_TILE_COUNT; i++) {
+        if (fixed_2bit_kernels[i].cols == cols &&
+            fixed_2bit_kernels[i].row_tile == row_tile) {
+            return fixed_2bit_kernels[i].fn;
+        }
+    }
+    return NULL;
+}
+
+void ternary_matvec_2bit_shaped(const uint8_t *matrix_packed, const float *input,
+                                float *output, int rows, int cols) {
+    matvec_2bit_fn fn = ternary_matvec_2bit_fixed(cols, FIXED_DEFAULT_TILE);
+    (fn ? fn : ternary_matvec_2bit_impl)(matrix_packed, input, output, rows, cols);
+}
+
+// ============================================================================
+// PREFETCH / STREAMING-LOAD VARIANTS
+// ============================================================================
+// The weights are streamed once per call and never reused, yet the kernels
+// above leave them to the hardware prefetcher and let them displace the
+// input vector from cache. These variants walk the weights a cache line
+// (256 columns) at a time and add two hints:
+//   prefetch_distance  __builtin_prefetch this many bytes ahead in the flat
+//                      weight stream (crossing into the following rows)
+//   nontemporal        prefetch with the NTA hint, and on x86 read the line
+//                      with streaming loads (movntdqa)
+// On ordinary write-back memory most x86 cores execute movntdqa as a plain
+// load; prefetchnta is what keeps the weights out of the outer cache levels.
+// ARM has no streaming-load intrinsic, so nontemporal only changes the
+// prefetch to PLDL1STRM there.
+
+static inline void prefetch_weights(const uint8_t *matrix_packed, size_t total,
+                                    const uint8_t *p, const load_hints_t *hints) {
+    size_t ahead = (size_t)(p - matrix_packed) + (size_t)hints->prefetch_distance;
+    if (hints->prefetch_distance > 0 && ahead < total) {
+        if (hints->nontemporal) {
+            __builtin_prefetch(matrix_packed + ahead, 0, 0);
+        } else {
+            __builtin_prefetch(matrix_packed + ahead, 0, 3);
+        }
+    }
+}
+
+void ternary_matvec_2bit_hinted(const uint8_t *matrix_packed, const float *input,
+                                float *output, int rows, int cols,
+                                const load_hints_t *hints) {
+    int packed_cols = (cols + 3) / 4;
+    size_t total = (size_t)rows * packed_cols;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        float sum = 0.0f;
+
+        for (int c = 0; c < cols; c += 256) {
+            prefetch_weights(matrix_packed, total, row_ptr + c / 4, hints);
+            sum += matvec_2bit_tail(row_ptr, input, c,
+                                    c + 256 < cols ? c + 256 : cols);
+        }
+        output[r] = sum;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// Accumulates the 16 trits of one packed word against inputs already in xv
+__attribute__((target("avx512f"), always_inline))
+static inline void avx512_2bit_acc(uint32_t word, __m512 xv, __m512 *pos, __m512 *neg) {
+    const __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                             16, 18, 20, 22, 24, 26, 28, 30);
+    __m512i t = _mm512_srlv_epi32(_mm512_set1_epi32((int)word), shifts);
+    *pos = _mm512_mask_add_ps(*pos, _mm512_test_epi32_mask(t, _mm512_set1_epi32(1)), *pos, xv);
+    *neg = _mm512_mask_add_ps(*neg, _mm512_test_epi32_mask(t, _mm512_set1_epi32(2)), *neg, xv);
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void avx512_2bit_word(uint32_t word, const float *x,
+                                    __m512 *pos, __m512 *neg) {
+    avx512_2bit_acc(word, _mm512_loadu_ps(x), pos, neg);
+}
+
+__attribute__((target("avx512f")))
+static void matvec_2bit_hinted_avx512(const uint8_t *matrix_packed,
+                                      const float *input, float *output,
+                                      int rows, int cols,
+                                      const load_hints_t *hints) {
+    int packed_cols = (cols + 3) / 4;
+    size_t total = (size_t)rows * packed_cols;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m512 pos0 = _mm512_setzero_ps(), neg0 = _mm512_setzero_ps();
+        __m512 pos1 = _mm512_setzero_ps(), neg1 = _mm512_setzero_ps();
+        int stream = hints->nontemporal && ((uintptr_t)row_ptr & 3) == 0;
+        int c = 0;
+
+        // Streaming loads need 64-byte alignment: single words until there
+        if (stream) {
+            for (; c + 16 <= cols && ((uintptr_t)(row_ptr + c / 4) & 63); c += 16) {
+                uint32_t word;
+                memcpy(&word, row_ptr + c / 4, sizeof(word));
+                avx512_2bit_word(word, input + c, &pos0, &neg0);
+            }
+        }
+
+        for (; c + 256 <= cols; c += 256) {
+            const uint8_t *p = row_ptr + c / 4;
+            uint32_t words[16] __attribute__((aligned(64)));
+            prefetch_weights(matrix_packed, total, p, hints);
+            if (stream) {
+                _mm512_store_si512((void*)words, _mm512_stream_load_si512((void*)p));
+            } else {
+                memcpy(words, p, sizeof(words));
+            }
+            for (int k = 0; k < 16; k += 2) {
+                avx512_2bit_word(words[k], input + c + 16 * k, &pos0, &neg0);
+                avx512_2bit_word(words[k + 1], input + c + 16 * k + 16, &pos1, &neg1);
+            }
+        }
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            avx512_2bit_word(word, input + c, &pos0, &neg0);
+        }
+
+        __m512 acc = _mm512_sub_ps(_mm512_add_ps(pos0, pos1),
+                                   _mm512_add_ps(neg0, neg1));
+        output[r] = _mm512_reduce_add_ps(acc) +
+                    matvec_2bit_tail(row_ptr, input, c, cols);
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void avx2_2bit_acc(uint32_t word, __m256 x_lo, __m256 x_hi,
+                                 __m256 *pos, __m256 *neg) {
+    const __m256i shift_lo = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m256i shift_hi = _mm256_setr_epi32(16, 18, 20, 22, 24, 26, 28, 30);
+    const __m256i three = _mm256_set1_epi32(3);
+    __m256i w = _mm256_set1_epi32((int)word);
+    __m256i codes_lo = _mm256_and_si256(_mm256_srlv_epi32(w, shift_lo), three);
+    __m256i codes_hi = _mm256_and_si256(_mm256_srlv_epi32(w, shift_hi), three);
+    __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+
+    pos[0] = _mm256_add_ps(pos[0], _mm256_and_ps(x_lo,
+                 _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_lo, one))));
+    neg[0] = _mm256_add_ps(neg[0], _mm256_and_ps(x_lo,
+                 _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_lo, two))));
+    pos[1] = _mm256_add_ps(pos[1], _mm256_and_ps(x_hi,
+                 _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_hi, one))));
+    neg[1] = _mm256_add_ps(neg[1], _mm256_and_ps(x_hi,
+                 _mm256_castsi256_ps(_mm256_cmpeq_epi32(codes_hi, two))));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void avx2_2bit_word(uint32_t word, const float *x,
+                                  __m256 *pos, __m256 *neg) {
+    avx2_2bit_acc(word, _mm256_loadu_ps(x), _mm256_loadu_ps(x + 8), pos, neg);
+}
+
+__attribute__((target("avx2")))
+static void matvec_2bit_hinted_avx2(const uint8_t *matrix_packed,
+                                    const float *input, float *output,
+                                    int rows, int cols,
+                                    const load_hints_t *hints) {
+    int packed_cols = (cols + 3) / 4;
+    size_t total = (size_t)rows * packed_cols;
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m256 pos[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+        __m256 neg[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+        int stream = hints->nontemporal && ((uintptr_t)row_ptr & 3) == 0;
+        int c = 0;
+
+        // Streaming loads need 32-byte alignment: single words until there
+        if (stream) {
+            for (; c + 16 <= cols && ((uintptr_t)(row_ptr + c / 4) & 31); c += 16) {
+                uint32_t word;
+                memcpy(&word, row_ptr + c / 4, sizeof(word));
+                avx2_2bit_word(word, input + c, pos, neg);
+            }
+        }
+
+        for (; c + 256 <= cols; c += 256) {
+            const uint8_t *p = row_ptr + c / 4;
+            uint32_t words[16] __attribute__((aligned(32)));
+            prefetch_weights(matrix_packed, total, p, hints);
+            if (stream) {
+                _mm256_store_si256((__m256i*)words,
+                                   _mm256_stream_load_si256((const __m256i*)p));
+                _mm256_store_si256((__m256i*)words + 1,
+                                   _mm256_stream_load_si256((const __m256i*)p + 1));
+            } else {
+                memcpy(words, p, sizeof(words));
+            }
+            for (int k = 0; k < 16; k++) {
+                avx2_2bit_word(words[k], input + c + 16 * k, pos, neg);
+            }
+        }
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            avx2_2bit_word(word, input + c, pos, neg);
+        }
+
+        __m256 acc = _mm256_sub_ps(_mm256_add_ps(pos[0], pos[1]),
+                                   _mm256_add_ps(neg[0], neg[1]));
+        output[r] = hsum_avx2(acc) + matvec_2bit_tail(row_ptr, input, c, cols);
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+static void matvec_2bit_hinted_neon(const uint8_t *matrix_packed,
+                                    const float *input, float *output,
+                                    int rows, int cols,
+                                    const load_hints_t *hints) {
+    int packed_cols = (cols + 3) / 4;
+    size_t total = (size_t)rows * packed_cols;
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+    const uint8x16_t idx1 = vaddq_u8(idx0, vdupq_n_u8(4));
+    const uint8x16_t idx2 = vaddq_u8(idx0, vdupq_n_u8(8));
+    const uint8x16_t idx3 = vaddq_u8(idx0, vdupq_n_u8(12));
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        float32x4_t acc[4] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f),
+                               vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+        int c = 0;
+
+        for (; c + 256 <= cols; c += 256) {
+            prefetch_weights(matrix_packed, total, row_ptr + c / 4, hints);
+            for (int k = 0; k < 256; k += 64) {
+                uint8x16_t packed = vld1q_u8(row_ptr + (c + k) / 4);
+                const float *x = input + c + k;
+                neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx0), x);
+                neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx1), x + 16);
+                neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx2), x + 32);
+                neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx3), x + 48);
+            }
+        }
+
+        for (; c + 16 <= cols; c += 16) {
+            uint32_t word;
+            memcpy(&word, row_ptr + c / 4, sizeof(word));
+            uint8x16_t packed = vreinterpretq_u8_u32(vdupq_n_u32(word));
+            neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx0), input + c);
+        }
+
+        output[r] = neon_hsum4(acc) + matvec_2bit_tail(row_ptr, input, c, cols);
+    }
+}
+#endif
+
+// ============================================================================
+// FUSED EPILOGUE KERNELS
+// ============================================================================
+// A BitNet-style layer does not stop at the ternary sum: each row is
+// multiplied by its scale (one per row, or one per group of columns), then
+// bias and an activation are applied. As a second pass that is a store and
+// a reload of every output; these kernels apply it to the row sum while it
+// is still in a register:
+//   output[r] = act(sum_g scale[r][g] * dot_g(w[r], x) + bias[r])
+// With group_size 0 there is one scale per row, applied once to the whole
+// dot product. Group sizes are a multiple of 16 columns, so every group
+// starts on a packed 32-bit word. NULL scales or bias stand for 1 and 0.
+
+const char *const ternary_epilogue_act_names[EPILOGUE_ACT_COUNT] = {
+    "none", "relu", "silu", "relu2"
+};
+
+static inline int epilogue_groups(const epilogue_t *ep, int cols) {
+    return ep->group_size > 0 ? (cols + ep->group_size - 1) / ep->group_size : 1;
+}
+
+static inline float epilogue_group_scale(const epilogue_t *ep, int r, int g, int groups) {
+    return ep->group_size > 0 && ep->scales ? ep->scales[(size_t)r * groups + g] : 1.0f;
+}
+
+// e^x as 2^n * p(x - n ln2) with a degree-6 polynomial; the build does
+// not link libm. Clamped to the normal float range.
+static inline float exp_nolibm(float x) {
+    x = x < -87.0f ? -87.0f : x > 88.0f ? 88.0f : x;
+    int n = (int)(x * 1.44269504f + (x >= 0.0f ? 0.5f : -0.5f));
+    float r = x - (float)n * 0.693145751953125f - (float)n * 1.428606765330187e-06f;
+    float p = 1.0f + r * (1.0f + r * (0.5f + r * (1.0f / 6.0f + r * (1.0f / 24.0f +
+              r * (1.0f / 120.0f + r * (1.0f / 720.0f))))));
+    union { uint32_t u; float f; } pow2 = { (uint32_t)(n + 127) << 23 };
+    return p * pow2.f;
+}
+
+// Per-row scale, bias and activation; group scales are already in `sum`
+static inline float epilogue_apply(float sum, int r, const epilogue_t *ep) {
+    if (ep->group_size == 0 && ep->scales) {
+        sum *= ep->scales[r];
+    }
+    if (ep->bias) {
+        sum += ep->bias[r];
+    }
+    switch (ep->act) {
+    case EPILOGUE_NONE:  return sum;
+    case EPILOGUE_RELU:  return sum > 0.0f ? sum : 0.0f;
+    case EPILOGUE_SILU:  return sum / (1.0f + exp_nolibm(-sum));
+    case EPILOGUE_RELU2: return sum > 0.0f ? sum * sum : 0.0f;
+    }
+    return sum;
+}
+
+// The unfused alternative: a second pass over the stored raw sums
+void ternary_epilogue_pass(float *output, int rows, const epilogue_t *ep) {
+    TRACE_BEGIN(trace_t0);
+    for (int r = 0; r < rows; r++) {
+        output[r] = epilogue_apply(output[r], r, ep);
+    }
+    TRACE_END(trace_t0, "epilogue", rows);
+}
+
+void ternary_matvec_2bit_fused(const uint8_t *matrix_packed, const float *input,
+                               float *output, int rows, int cols, const epilogue_t *ep) {
+    int packed_cols = (cols + 3) / 4;
+    int span = ep->group_size > 0 ? ep->group_size : cols;
+    int groups = epilogue_groups(ep, cols);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        float sum = 0.0f;
+        for (int g = 0, c = 0; c < cols; g++, c += span) {
+            int end = c + span < cols ? c + span : cols;
+            sum += epilogue_group_scale(ep, r, g, groups) *
+                   matvec_2bit_tail(row_ptr, input, c, end);
+        }
+        output[r] = epilogue_apply(sum, r, ep);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx512f")))
+static void matvec_2bit_fused_avx512(const uint8_t *matrix_packed,
+                                     const float *input, float *output,
+                                     int rows, int cols, const epilogue_t *ep) {
+    int packed_cols = (cols + 3) / 4;
+    int span = ep->group_size > 0 ? ep->group_size : cols;
+    int groups = epilogue_groups(ep, cols);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m512 acc = _mm512_setzero_ps();
+        float tail = 0.0f;
+
+        for (int g = 0, c0 = 0; c0 < cols; g++, c0 += span) {
+            int end = c0 + span < cols ? c0 + span : cols;
+            __m512 pos0 = _mm512_setzero_ps(), neg0 = _mm512_setzero_ps();
+            __m512 pos1 = _mm512_setzero_ps(), neg1 = _mm512_setzero_ps();
+            int c = c0;
+
+            for (; c + 32 <= end; c += 32) {
+                uint32_t words[2];
+                memcpy(words, row_ptr + c / 4, sizeof(words));
+                avx512_2bit_word(words[0], input + c, &pos0, &neg0);
+                avx512_2bit_word(words[1], input + c + 16, &pos1, &neg1);
+            }
+            for (; c + 16 <= end; c += 16) {
+                uint32_t word;
+                memcpy(&word, row_ptr + c / 4, sizeof(word));
+                avx512_2bit_word(word, input + c, &pos0, &neg0);
+            }
+
+            float s = epilogue_group_scale(ep, r, g, groups);
+            __m512 dot = _mm512_sub_ps(_mm512_add_ps(pos0, pos1),
+                                       _mm512_add_ps(neg0, neg1));
+            acc = _mm512_fmadd_ps(dot, _mm512_set1_ps(s), acc);
+            if (c < end) {
+                tail += s * matvec_2bit_tail(row_ptr, input, c, end);
+            }
+        }
+        output[r] = epilogue_apply(_mm512_reduce_add_ps(acc) + tail, r, ep);
+    }
+}
+
+__attribute__((target("avx2")))
+static void matvec_2bit_fused_avx2(const uint8_t *matrix_packed,
+                                   const float *input, float *output,
+                                   int rows, int cols, const epilogue_t *ep) {
+    int packed_cols = (cols + 3) / 4;
+    int span = ep->group_size > 0 ? ep->group_size : cols;
+    int groups = epilogue_groups(ep, cols);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        __m256 acc = _mm256_setzero_ps();
+        float tail = 0.0f;
+
+        for (int g = 0, c0 = 0; c0 < cols; g++, c0 += span) {
+            int end = c0 + span < cols ? c0 + span : cols;
+            __m256 pos[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+            __m256 neg[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+            int c = c0;
+
+            for (; c + 16 <= end; c += 16) {
+                uint32_t word;
+                memcpy(&word, row_ptr + c / 4, sizeof(word));
+                avx2_2bit_word(word, input + c, pos, neg);
+            }
+
+            float s = epilogue_group_scale(ep, r, g, groups);
+            __m256 dot = _mm256_sub_ps(_mm256_add_ps(pos[0], pos[1]),
+                                       _mm256_add_ps(neg[0], neg[1]));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(dot, _mm256_set1_ps(s)));
+            if (c < end) {
+                tail += s * matvec_2bit_tail(row_ptr, input, c, end);
+            }
+        }
+        output[r] = epilogue_apply(hsum_avx2(acc) + tail, r, ep);
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+static void matvec_2bit_fused_neon(const uint8_t *matrix_packed,
+                                   const float *input, float *output,
+                                   int rows, int cols, const epilogue_t *ep) {
+    int packed_cols = (cols + 3) / 4;
+    int span = ep->group_size > 0 ? ep->group_size : cols;
+    int groups = epilogue_groups(ep, cols);
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *row_ptr = matrix_packed + (size_t)r * packed_cols;
+        float32x4_t total = vdupq_n_f32(0.0f);
+        float tail = 0.0f;
+
+        for (int g = 0, c0 = 0; c0 < cols; g++, c0 += span) {
+            int end = c0 + span < cols ? c0 + span : cols;
+            float32x4_t acc[4] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f),
+                                   vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+            int c = c0;
+
+            for (; c + 16 <= end; c += 16) {
+                uint32_t word;
+                memcpy(&word, row_ptr + c / 4, sizeof(word));
+                uint8x16_t packed = vreinterpretq_u8_u32(vdupq_n_u32(word));
+                neon_fma_s8x16(acc, neon_decode_2bit_16(packed, idx0), input + c);
+            }
+
+            float s = epilogue_group_scale(ep, r, g, groups);
+            float32x4_t dot = vaddq_f32(vaddq_f32(acc[0], acc[1]),
+                                        vaddq_f32(acc[2], acc[3]));
+            total = vfmaq_n_f32(total, dot, s);
+            if (c < end) {
+                tail += s * matvec_2bit_tail(row_ptr, input, c, end);
+            }
+        }
+        output[r] = epilogue_apply(vaddvq_f32(total) + tail, r, ep);
+    }
+}
+#endif
+
+// ============================================================================
+// MULTI-PROJECTION KERNELS
+// ============================================================================
+// Attention runs Q, K and V, and the FFN runs gate and up, against the same
+// input vector. As separate calls, every input load and every loop step is
+// paid once per matrix. These kernels walk row r of all projections
+// together. Each input vector is loaded once, then decoded against one
+// packed word from each matrix. Projections may have different row counts
+// (grouped-query K/V); past its last row a projection drops out. The
+// per-row work is inlined for a fixed projection count, so the
+// accumulators of every projection stay in registers. Longer lists are
+// split into groups of MAX_PROJECTIONS.
+
+// Gathers the rows r of the projections that have one; returns how many
+static inline int projection_rows(const projection_t *proj, int count, int r,
+                                  int packed_cols, const uint8_t **row, float **out) {
+    int n = 0;
+    for (int p = 0; p < count; p++) {
+        if (r < proj[p].rows) {
+            row[n] = proj[p].matrix + (size_t)r * packed_cols;
+            out[n] = proj[p].output + r;
+            n++;
+        }
+    }
+    return n;
+}
+
+static inline int projection_max_rows(const projection_t *proj, int count) {
+    int rows = 0;
+    for (int p = 0; p < count; p++) {
+        rows = proj[p].rows > rows ? proj[p].rows : rows;
+    }
+    return rows;
+}
+
+// Past MAX_PROJECTIONS the projections run as consecutive groups of at most
+// that many, each its own pass over the input
+static void projection_groups(matvec_2bit_multi_fn fn, const projection_t *proj,
+                              int count, const float *input, int cols) {
+    for (int p = 0; p < count; p += MAX_PROJECTIONS) {
+        fn(proj + p, count - p < MAX_PROJECTIONS ? count - p : MAX_PROJECTIONS, input, cols);
+    }
+}
+
+void ternary_matvec_2bit_multi(const projection_t *proj, int count, const float *input,
+                               int cols) {
+    if (count > MAX_PROJECTIONS) {
+        projection_groups(ternary_matvec_2bit_multi, proj, count, input, cols);
+        return;
+    }
+    int packed_cols = (cols + 3) / 4;
+    int max_rows = projection_max_rows(proj, count);
+
+    for (int r = 0; r < max_rows; r++) {
+        const uint8_t *row[MAX_PROJECTIONS];
+        float *out[MAX_PROJECTIONS];
+        float sum[MAX_PROJECTIONS] = { 0.0f };
+        int n = projection_rows(proj, count, r, packed_cols, row, out);
+
+        for (int c = 0; c < cols; c++) {
+            float x = input[c];
+            for (int k = 0; k < n; k++) {
+                int8_t w = unpack_trit(row[k][c / 4], c % 4);
+                if (w != 0) {
+                    sum[k] += (float)w * x;
+                }
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            *out[k] = sum[k];
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx512f"), always_inline))
+static inline void multi_row_avx512(const uint8_t *const *row, float *const *out,
+                                    int n, const float *input, int cols) {
+    __m512 pos[MAX_PROJECTIONS][2], neg[MAX_PROJECTIONS][2];
+    for (int k = 0; k < n; k++) {
+        pos[k][0] = pos[k][1] = neg[k][0] = neg[k][1] = _mm512_setzero_ps();
+    }
+    int c = 0;
+
+    for (; c + 32 <= cols; c += 32) {
+        __m512 x0 = _mm512_loadu_ps(input + c);
+        __m512 x1 = _mm512_loadu_ps(input + c + 16);
+        for (int k = 0; k < n; k++) {
+            uint32_t words[2];
+            memcpy(words, row[k] + c / 4, sizeof(words));
+            avx512_2bit_acc(words[0], x0, &pos[k][0], &neg[k][0]);
+            avx512_2bit_acc(words[1], x1, &pos[k][1], &neg[k][1]);
+        }
+    }
+    for (; c + 16 <= cols; c += 16) {
+        __m512 x = _mm512_loadu_ps(input + c);
+        for (int k = 0; k < n; k++) {
+            uint32_t word;
+            memcpy(&word, row[k] + c / 4, sizeof(word));
+            avx512_2bit_acc(word, x, &pos[k][0], &neg[k][0]);
+        }
+    }
+
+    for (int k = 0; k < n; k++) {
+        __m512 acc = _mm512_sub_ps(_mm512_add_ps(pos[k][0], pos[k][1]),
+                                   _mm512_add_ps(neg[k][0], neg[k][1]));
+        *out[k] = _mm512_reduce_add_ps(acc) + matvec_2bit_tail(row[k], input, c, cols);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matvec_2bit_multi_avx512(const projection_t *proj, int count,
+                                     const float *input, int cols) {
+    if (count > MAX_PROJECTIONS) {
+        projection_groups(matvec_2bit_multi_avx512, proj, count, input, cols);
+        return;
+    }
+    int packed_cols = (cols + 3) / 4;
+    int max_rows = projection_max_rows(proj, count);
+
+    for (int r = 0; r < max_rows; r++) {
+        const uint8_t *row[MAX_PROJECTIONS];
+        float *out[MAX_PROJECTIONS];
+        switch (projection_rows(proj, count, r, packed_cols, row, out)) {
+        case 1: multi_row_avx512(row, out, 1, input, cols); break;
+        case 2: multi_row_avx512(row, out, 2, input, cols); break;
+        case 3: multi_row_avx512(row, out, 3, input, cols); break;
+        case 4: multi_row_avx512(row, out, 4, input, cols); break;
+        }
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void multi_row_avx2(const uint8_t *const *row, float *const *out,
+                                  int n, const float *input, int cols) {
+    __m256 pos[MAX_PROJECTIONS][2], neg[MAX_PROJECTIONS][2];
+    for (int k = 0; k < n; k++) {
+        pos[k][0] = pos[k][1] = neg[k][0] = neg[k][1] = _mm256_setzero_ps();
+    }
+    int c = 0;
+
+    for (; c + 16 <= cols; c += 16) {
+        __m256 x_lo = _mm256_loadu_ps(input + c);
+        __m256 x_hi = _mm256_loadu_ps(input + c + 8);
+        for (int k = 0; k < n; k++) {
+            uint32_t word;
+            memcpy(&word, row[k] + c / 4, sizeof(word));
+            avx2_2bit_acc(word, x_lo, x_hi, pos[k], neg[k]);
+        }
+    }
+
+    for (int k = 0; k < n; k++) {
+        __m256 acc = _mm256_sub_ps(_mm256_add_ps(pos[k][0], pos[k][1]),
+                                   _mm256_add_ps(neg[k][0], neg[k][1]));
+        *out[k] = hsum_avx2(acc) + matvec_2bit_tail(row[k], input, c, cols);
+    }
+}
+
+__attribute__((target("avx2")))
+static void matvec_2bit_multi_avx2(const projection_t *proj, int count,
+                                   const float *input, int cols) {
+    if (count > MAX_PROJECTIONS) {
+        projection_groups(matvec_2bit_multi_avx2, proj, count, input, cols);
+        return;
+    }
+    int packed_cols = (cols + 3) / 4;
+    int max_rows = projection_max_rows(proj, count);
+
+    for (int r = 0; r < max_rows; r++) {
+        const uint8_t *row[MAX_PROJECTIONS];
+        float *out[MAX_PROJECTIONS];
+        switch (projection_rows(proj, count, r, packed_cols, row, out)) {
+        case 1: multi_row_avx2(row, out, 1, input, cols); break;
+        case 2: multi_row_avx2(row, out, 2, input, cols); break;
+        case 3: multi_row_avx2(row, out, 3, input, cols); break;
+        case 4: multi_row_avx2(row, out, 4, input, cols); break;
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+static inline __attribute__((always_inline))
+void multi_row_neon(const uint8_t *const *row, float *const *out, int n,
+                    const float *input, int cols) {
+    const uint8x16_t idx0 = vld1q_u8(neon_byte_idx);
+    float32x4_t acc[MAX_PROJECTIONS][4];
+    for (int k = 0; k < n; k++) {
+        for (int i = 0; i < 4; i++) {
+            acc[k][i] = vdupq_n_f32(0.0f);
+        }
+    }
+    int c = 0;
+
+    for (; c + 16 <= cols; c += 16) {
+        const float32x4_t x[4] = { vld1q_f32(input + c), vld1q_f32(input + c + 4),
+                                   vld1q_f32(input + c + 8), vld1q_f32(input + c + 12) };
+        for (int k = 0; k < n; k++) {
+            uint32_t word;
+            memcpy(&word, row[k] + c / 4, sizeof(word));
+            uint8x16_t packed = vreinterpretq_u8_u32(vdupq_n_u32(word));
+            neon_fma_s8x16_x(acc[k], neon_decode_2bit_16(packed, idx0), x);
+        }
+    }
+
+    for (int k = 0; k < n; k++) {
+        *out[k] = neon_hsum4(acc[k]) + matvec_2bit_tail(row[k], input, c, cols);
+    }
+}
+
+static void matvec_2bit_multi_neon(const projection_t *proj, int count,
+                                   const float *input, int cols) {
+    if (count > MAX_PROJECTIONS) {
+        projection_groups(matvec_2bit_multi_neon, proj, count, input, cols);
+        return;
+    }
+    int packed_cols = (cols + 3) / 4;
+    int max_rows = projection_max_rows(proj, count);
+
+    for (int r = 0; r < max_rows; r++) {
+        const uint8_t *row[MAX_PROJECTIONS];
+        float *out[MAX_PROJECTIONS];
+        switch (projection_rows(proj, count, r, packed_cols, row, out)) {
+        case 1: multi_row_neon(row, out, 1, input, cols); break;
+        case 2: multi_row_neon(row, out, 2, input, cols); break;
+        case 3: multi_row_neon(row, out, 3, input, cols); break;
+        case 4: multi_row_neon(row, out, 4, input, cols); break;
+        }
+    }
+}
+#endif
+
+// ============================================================================
+// SPARSE TERNARY KERNELS
+// ============================================================================
+// Pruned layers run at 80-95% zeros, yet the dense kernels scan every
+// column. The sparse layout keeps, per row, the column indices of the +1
+// entries and then of the -1 entries, delta-encoded in a byte each:
+//   column = previous column + delta, starting from column -1
+//   delta 0 is an escape that advances 255 columns without an entry
+// so a gap of g columns costs (g - 1) / 255 escapes plus one byte. The
+// kernel gathers and sums only the listed inputs: sum(+1) - sum(-1).
+// offsets[2r] .. offsets[2r + 1] is row r's +1 list and
+// offsets[2r + 1] .. offsets[2r + 2] its -1 list.
+//
+// AVX-512 decodes 16 deltas at a time: a lane prefix sum turns them into
+// columns and a masked gather (escapes masked off) loads the inputs.
+// Other ISAs have no gather worth using, so they run the scalar kernel.
+
+static inline float sparse_list_sum(const uint8_t *d, const uint8_t *end,
+                                    const float *input) {
+    float sum = 0.0f;
+    int c = -1;
+    for (; d < end; d++) {
+        if (*d == 0) {
+            c += 255;
+        } else {
+            c += *d;
+            sum += input[c];
+        }
+    }
+    return sum;
+}
+
+void ternary_matvec_sparse(const sparse_matrix_t *sm, const float *input, float *output) {
+    for (int r = 0; r < sm->rows; r++) {
+        const uint8_t *plus = sm->deltas + sm->offsets[2 * r];
+        const uint8_t *minus = sm->deltas + sm->offsets[2 * r + 1];
+        const uint8_t *end = sm->deltas + sm->offsets[2 * r + 2];
+        output[r] = sparse_list_sum(plus, minus, input) -
+                    sparse_list_sum(minus, end, input);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// Adds the inputs of one delta list into acc, 16 deltas per step
+__attribute__((target("avx512f,avx512bw,avx512vl"), always_inline))
+static inline __m512 sparse_list_avx512(const uint8_t *d, int n, const float *input,
+                                        __m512 acc) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i escape = _mm512_set1_epi32(255);
+    const __m512i last = _mm512_set1_epi32(15);
+    __m512i base = _mm512_set1_epi32(-1);
+
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 valid = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512i step = _mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(valid, d + i));
+        __mmask16 entry = _mm512_test_epi32_mask(step, step);
+        step = _mm512_mask_mov_epi32(escape, entry, step);
+        step = _mm512_maskz_mov_epi32(valid, step);
+
+        // Inclusive prefix sum across the 16 lanes
+        step = _mm512_add_epi32(step, _mm512_alignr_epi32(step, zero, 15));
+        step = _mm512_add_epi32(step, _mm512_alignr_epi32(step, zero, 14));
+        step = _mm512_add_epi32(step, _mm512_alignr_epi32(step, zero, 12));
+        step = _mm512_add_epi32(step, _mm512_alignr_epi32(step, zero, 8));
+        __m512i cols = _mm512_add_epi32(base, step);
+
+        acc = _mm512_add_ps(acc, _mm512_mask_i32gather_ps(_mm512_setzero_ps(),
+                                                          entry & valid, cols,
+                                                          input, 4));
+        base = _mm512_permutexvar_epi32(last, cols);
+    }
+    return acc;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static void matvec_sparse_avx512(const sparse_matrix_t *sm, const float *input,
+                                 float *output) {
+    for (int r = 0; r < sm->rows; r++) {
+        uint32_t plus = sm->offsets[2 * r];
+        uint32_t minus = sm->offsets[2 * r + 1];
+        uint32_t end = sm->offsets[2 * r + 2];
+        __m512 pos = sparse_list_avx512(sm->deltas + plus, (int)(minus - plus), input,
+                                        _mm512_setzero_ps());
+        __m512 neg = sparse_list_avx512(sm->deltas + minus, (int)(end - minus), input,
+                                        _mm512_setzero_ps());
+        output[r] = _mm512_reduce_add_ps(_mm512_sub_ps(pos, neg));
+    }
+}
+#endif
+
+// Bytes one sign list of a row takes, escapes included
+static size_t sparse_list_bytes(const int8_t *row, int cols, int8_t sign) {
+    size_t bytes = 0;
+    int prev = -1;
+    for (int c = 0; c < cols; c++) {
+        if (row[c] == sign) {
+            bytes += (size_t)(c - prev - 1) / 255 + 1;
+            prev = c;
+        }
+    }
+    return bytes;
+}
+
+static uint8_t *sparse_list_encode(const int8_t *row, int cols, int8_t sign, uint8_t *d) {
+    int prev = -1;
+    for (int c = 0; c < cols; c++) {
+        if (row[c] == sign) {
+            int gap = c - prev;
+            for (; gap > 255; gap -= 255) {
+                *d++ = 0;
+            }
+            *d++ = (uint8_t)gap;
+            prev = c;
+        }
+    }
+    return d;
+}
+
+void ternary_sparse_matrix_free(sparse_matrix_t *sm) {
+    ternary_free(sm->offsets);
+    ternary_free(sm->deltas);
+    memset(sm, 0, sizeof(*sm));
+}
+
+// Returns 0 on success; on failure nothing is left allocated
+int ternary_sparse_matrix_build(sparse_matrix_t *sm, const int8_t *matrix_8bit, int rows, int cols) {
+    memset(sm, 0, sizeof(*sm));
+    sm->rows = rows;
+    sm->cols = cols;
+    sm->offsets = (uint32_t*)ternary_alloc((2 * (size_t)rows + 1) * sizeof(uint32_t));
+    if (!sm->offsets) {
+        return -1;
+    }
+    size_t total = 0;
+    for (int r = 0; r < rows; r++) {
+        const int8_t *row = matrix_8bit + (size_t)r * cols;
+        sm->offsets[2 * r] = (uint32_t)total;
+        total += sparse_list_bytes(row, cols, 1);
+        sm->offsets[2 * r + 1] = (uint32_t)total;
+        total += sparse_list_bytes(row, cols, -1);
+        if (total > UINT32_MAX) {
+            ternary_sparse_matrix_free(sm);
+            return -1;
+        }
+    }
+    sm->offsets[2 * rows] = (uint32_t)total;
+
+    sm->deltas = (uint8_t*)ternary_alloc(total);
+    if (!sm->deltas) {
+        ternary_sparse_matrix_free(sm);
+        return -1;
+    }
+    for (int r = 0; r < rows; r++) {
+        const int8_t *row = matrix_8bit + (size_t)r * cols;
+        sparse_list_encode(row, cols, 1, sm->deltas + sm->offsets[2 * r]);
+        sparse_list_encode(row, cols, -1, sm->deltas + sm->offsets[2 * r + 1]);
+    }
+    sm->bytes = total + (2 * (size_t)rows + 1) * sizeof(uint32_t);
+    return 0;
+}
+
+// Fraction of zero weights
+double ternary_sparsity(const int8_t *matrix_8bit, size_t count) {
+    size_t zeros = 0;
+    for (size_t i = 0; i < count; i++) {
+        zeros += matrix_8bit[i] == 0;
+    }
+    return count ? (double)zeros / count : 0.0;
+}
+
+// Whether a layer at `sparsity` should use the sparse layout, given a
+// break-even point from run_sparse_sweep()
+int ternary_prefer_sparse(double sparsity, double break_even) {
+    return break_even > 0.0 && sparsity >= break_even;
+}
+
+// ============================================================================
+// FAST PACKERS
+// ============================================================================
+// The pack_ternary_* functions above are the reference encoders: one trit
+// at a time with a read-modify-write per trit. Weights are repacked on
+// every model update, so each layout also has a fast packer and unpacker.
+// The packers produce byte-identical output to the reference:
+//   2-bit     SWAR multiply folds four codes into a byte; AVX2 / AVX-512BW
+//             maddubs + madd; NEON vld4 de-interleave and shift-or
+//   bitplane  SWAR multiply gathers eight bits; AVX2 movemask, AVX-512BW
+//             mask registers
+//   base-3    SWAR multiply folds the five digits of a byte on every ISA;
+//             a 5-byte stride does not map onto SIMD lanes without
+//             shuffles that cost more than they save
+// A ternary byte maps to its code with min_u8(v, 2): 0 -> 0, 1 -> 1,
+// 0xff (-1) -> 2, which is both the 2-bit code and the base-3 digit.
+// Unpackers return int8 {-1, 0, +1} through a LUT per packed byte, or SIMD
+// for 2-bit and bitplane. Inputs must be ternary. ternary_pack_matrix() in WEIGHT
+// FORMATS threads them across rows. The SWAR and LUT paths assume a
+// little-endian host, like the weight file format.
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_GATHER_BITS 0x0102040810204080ULL  // bit 0 of byte k -> bit 56 + k
+#define SWAR_FOLD_2BIT 0x01041040u              // code k (byte k) -> bits 24 + 2k
+#define SWAR_FOLD_BASE3 0x0103091B51ULL         // sum of digit k * 3^k -> byte 4
+
+static uint32_t unpack_2bit_table[256];  // packed byte -> four int8 weights
+static uint64_t unpack_bits_table[256];  // 8 bits -> eight 0x00 / 0x01 bytes
+static uint64_t unpack_base3_table[256]; // base-3 byte -> five int8 weights
+
+static void init_pack_luts(void) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t w2 = 0;
+        uint64_t bits = 0, w3 = 0;
+        for (int k = 0; k < 4; k++) {
+            w2 |= (uint32_t)(uint8_t)unpack_trit((uint8_t)b, k) << (8 * k);
+        }
+        for (int k = 0; k < 8; k++) {
+            bits |= (uint64_t)((b >> k) & 1) << (8 * k);
+        }
+        for (int k = 0; k < BASE3_TRITS; k++) {
+            w3 |= (uint64_t)(uint8_t)(int8_t)base3_lut[b][k] << (8 * k);
+        }
+        unpack_2bit_table[b] = w2;
+        unpack_bits_table[b] = bits;
+        unpack_base3_table[b] = w3;
+    }
+}
+
+// Up to 8 bytes from src, zero-padded; a full word is one load
+static inline uint64_t swar_load(const int8_t *src, int n) {
+    uint64_t x = 0;
+    if (n >= 8) {
+        memcpy(&x, src, 8);
+    } else {
+        memcpy(&x, src, (size_t)n);
+    }
+    return x;
+}
+
+// min_u8(v, 2) in every byte: bit 7 marks -1, bit 0 any nonzero
+static inline uint64_t swar_codes(uint64_t x) {
+    uint64_t neg = (x >> 7) & SWAR_ONES;
+    return ((x & SWAR_ONES) & ~neg) | (neg << 1);
+}
+
+static inline uint8_t swar_fold_2bit(uint32_t codes) {
+    return (uint8_t)((codes * SWAR_FOLD_2BIT) >> 24);
+}
+
+static inline uint8_t swar_gather_bits(uint64_t bit0s) {
+    return (uint8_t)((bit0s * SWAR_GATHER_BITS) >> 56);
+}
+
+// Packs columns [c, cols) of one row; c is a multiple of 4
+static void pack_2bit_row_swar(const int8_t *src, uint8_t *dst, int c, int cols) {
+    for (; c < cols; c += 8) {
+        uint64_t codes = swar_codes(swar_load(src + c, cols - c));
+        dst[c / 4] = swar_fold_2bit((uint32_t)codes);
+        if (c + 4 < cols) {
+            dst[c / 4 + 1] = swar_fold_2bit((uint32_t)(codes >> 32));
+        }
+    }
+}
+
+static void unpack_2bit_row_lut(const uint8_t *src, int8_t *dst, int c, int cols) {
+    for (; c + 4 <= cols; c += 4) {
+        memcpy(dst + c, &unpack_2bit_table[src[c / 4]], 4);
+    }
+    if (c < cols) {
+        memcpy(dst + c, &unpack_2bit_table[src[c / 4]], (size_t)(cols - c));
+    }
+}
+
+// Packs words [w, words) of one row into its two planes
+static void pack_bitplane_row_swar(const int8_t *src, uint64_t *nz, uint64_t *neg,
+                                   int w, int cols) {
+    for (int c = w * 64; c < cols; w++) {
+        uint64_t nz_word = 0, neg_word = 0;
+        for (int k = 0; k < 64 && c < cols; k += 8, c += 8) {
+            uint64_t x = swar_load(src + c, cols - c);
+            nz_word |= (uint64_t)swar_gather_bits(x & SWAR_ONES) << k;
+            neg_word |= (uint64_t)swar_gather_bits((x >> 7) & SWAR_ONES) << k;
+        }
+        nz[w] = nz_word;
+        neg[w] = neg_word;
+    }
+}
+
+static void unpack_bitplane_row_lut(const uint64_t *nz, const uint64_t *neg,
+                                    int8_t *dst, int w, int cols) {
+    for (int c = w * 64; c < cols; w++) {
+        uint64_t plus = nz[w] ^ neg[w], minus = neg[w];
+        for (int k = 0; k < 64 && c < cols; k += 8, c += 8) {
+            uint64_t out = unpack_bits_table[(plus >> k) & 0xff] |
+                           unpack_bits_table[(minus >> k) & 0xff] * 0xff;
+            memcpy(dst + c, &out, cols - c < 8 ? (size_t)(cols - c) : 8);
+        }
+    }
+}
+
+static void pack_2bit_swar(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    for (int r = 0; r < rows; r++) {
+        pack_2bit_row_swar(matrix_8bit + (size_t)r * cols, packed + r * row_bytes, 0, cols);
+    }
+}
+
+static void unpack_2bit_lut(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    for (int r = 0; r < rows; r++) {
+        unpack_2bit_row_lut(packed + r * row_bytes, matrix_8bit + (size_t)r * cols, 0, cols);
+    }
+}
+
+static void pack_bitplane_swar(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    uint64_t *planes = (uint64_t*)packed;
+    for (int r = 0; r < rows; r++) {
+        uint64_t *nz = planes + (size_t)r * 2 * words;
+        pack_bitplane_row_swar(matrix_8bit + (size_t)r * cols, nz, nz + words, 0, cols);
+    }
+}
+
+static void unpack_bitplane_lut(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    const uint64_t *planes = (const uint64_t*)packed;
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        unpack_bitplane_row_lut(nz, nz + words, matrix_8bit + (size_t)r * cols, 0, cols);
+    }
+}
+
+static void pack_base3_swar(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    int packed_cols = (cols + BASE3_TRITS - 1) / BASE3_TRITS;
+    for (int r = 0; r < rows; r++) {
+        const int8_t *src = matrix_8bit + (size_t)r * cols;
+        uint8_t *dst = packed + (size_t)r * packed_cols;
+        int i = 0, c = 0;
+        // Whole 8-byte loads while they stay inside the row
+        for (; c + 8 <= cols; i++, c += BASE3_TRITS) {
+            uint64_t digits = swar_codes(swar_load(src + c, 8) & 0xffffffffffULL);
+            dst[i] = (uint8_t)((digits * SWAR_FOLD_BASE3) >> 32);
+        }
+        for (; i < packed_cols; i++, c += BASE3_TRITS) {
+            int n = cols - c < BASE3_TRITS ? cols - c : BASE3_TRITS;
+            uint64_t digits = swar_codes(swar_load(src + c, n));
+            dst[i] = (uint8_t)((digits * SWAR_FOLD_BASE3) >> 32);
+        }
+    }
+}
+
+static void unpack_base3_lut(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    int packed_cols = (cols + BASE3_TRITS - 1) / BASE3_TRITS;
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *src = packed + (size_t)r * packed_cols;
+        int8_t *dst = matrix_8bit + (size_t)r * cols;
+        int i = 0, c = 0;
+        // 8-byte stores overlap the next group, which is written next
+        for (; c + 8 <= cols; i++, c += BASE3_TRITS) {
+            memcpy(dst + c, &unpack_base3_table[src[i]], 8);
+        }
+        for (; i < packed_cols; i++, c += BASE3_TRITS) {
+            int n = cols - c < BASE3_TRITS ? cols - c : BASE3_TRITS;
+            memcpy(dst + c, &unpack_base3_table[src[i]], (size_t)n);
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// codes (c0, c1, c2, c3) per dword -> c0 + 4 c1 + 16 c2 + 64 c3
+__attribute__((target("avx512f,avx512bw")))
+static void pack_2bit_avx512(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    const __m512i two = _mm512_set1_epi8(2);
+    const __m512i pair = _mm512_set1_epi16(0x0401);
+    const __m512i quad = _mm512_set1_epi32(0x00100001);
+
+    for (int r = 0; r < rows; r++) {
+        const int8_t *src = matrix_8bit + (size_t)r * cols;
+        uint8_t *dst = packed + r * row_bytes;
+        int c = 0;
+        for (; c + 64 <= cols; c += 64) {
+            __m512i codes = _mm512_min_epu8(_mm512_loadu_si512(src + c), two);
+            __m512i sums = _mm512_madd_epi16(_mm512_maddubs_epi16(codes, pair), quad);
+            _mm_storeu_si128((__m128i*)(dst + c / 4), _mm512_cvtepi32_epi8(sums));
+        }
+        pack_2bit_row_swar(src, dst, c, cols);
+    }
+}
+
+// Each packed byte is spread so field k lands at bit 8k, then masked
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_2bit_avx512(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    const __m512i three = _mm512_set1_epi8(3);
+    const __m512i one = _mm512_set1_epi8(1);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *src = packed + r * row_bytes;
+        int8_t *dst = matrix_8bit + (size_t)r * cols;
+        int c = 0;
+        for (; c + 64 <= cols; c += 64) {
+            __m512i p = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(src + c / 4)));
+            p = _mm512_or_si512(_mm512_or_si512(p, _mm512_slli_epi32(p, 6)),
+                                _mm512_or_si512(_mm512_slli_epi32(p, 12),
+                                                _mm512_slli_epi32(p, 18)));
+            __m512i codes = _mm512_and_si512(p, three);
+            __m512i w = _mm512_sub_epi8(_mm512_and_si512(codes, one),
+                                        _mm512_and_si512(_mm512_srli_epi32(codes, 1), one));
+            _mm512_storeu_si512(dst + c, w);
+        }
+        unpack_2bit_row_lut(src, dst, c, cols);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void pack_bitplane_avx512(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    uint64_t *planes = (uint64_t*)packed;
+    for (int r = 0; r < rows; r++) {
+        const int8_t *src = matrix_8bit + (size_t)r * cols;
+        uint64_t *nz = planes + (size_t)r * 2 * words;
+        uint64_t *neg = nz + words;
+        int w = 0;
+        for (; (w + 1) * 64 <= cols; w++) {
+            __m512i v = _mm512_loadu_si512(src + w * 64);
+            nz[w] = _mm512_test_epi8_mask(v, v);
+            neg[w] = _mm512_movepi8_mask(v);
+        }
+        pack_bitplane_row_swar(src, nz, neg, w, cols);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_bitplane_avx512(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    const uint64_t *planes = (const uint64_t*)packed;
+    const __m512i one = _mm512_set1_epi8(1);
+    const __m512i minus_one = _mm512_set1_epi8(-1);
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        const uint64_t *neg = nz + words;
+        int8_t *dst = matrix_8bit + (size_t)r * cols;
+        int w = 0;
+        for (; (w + 1) * 64 <= cols; w++) {
+            __m512i v = _mm512_maskz_mov_epi8(nz[w] ^ neg[w], one);
+            _mm512_storeu_si512(dst + w * 64, _mm512_mask_mov_epi8(v, neg[w], minus_one));
+        }
+        unpack_bitplane_row_lut(nz, neg, dst, w, cols);
+    }
+}
+
+__attribute__((target("avx2")))
+static void pack_2bit_avx2(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    const __m256i two = _mm256_set1_epi8(2);
+    const __m256i pair = _mm256_set1_epi16(0x0401);
+    const __m256i quad = _mm256_set1_epi32(0x00100001);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (int r = 0; r < rows; r++) {
+        const int8_t *src = matrix_8bit + (size_t)r * cols;
+        uint8_t *dst = packed + r * row_bytes;
+        int c = 0;
+        for (; c + 32 <= cols; c += 32) {
+            __m256i codes = _mm256_min_epu8(_mm256_loadu_si256((const __m256i*)(src + c)),
+                                            two);
+            __m256i sums = _mm256_madd_epi16(_mm256_maddubs_epi16(codes, pair), quad);
+            // Dwords 0-3 land in bytes 0-3 of the low lane, 4-7 of the high lane
+            __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(sums, zero), zero);
+            uint32_t lo = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(bytes));
+            uint32_t hi = (uint32_t)_mm_cvtsi128_si32(_mm256_extracti128_si256(bytes, 1));
+            memcpy(dst + c / 4, &lo, 4);
+            memcpy(dst + c / 4 + 4, &hi, 4);
+        }
+        pack_2bit_row_swar(src, dst, c, cols);
+    }
+}
+
+__attribute__((target("avx2")))
+static void unpack_2bit_avx2(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    const __m256i three = _mm256_set1_epi8(3);
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *src = packed + r * row_bytes;
+        int8_t *dst = matrix_8bit + (size_t)r * cols;
+        int c = 0;
+        for (; c + 32 <= cols; c += 32) {
+            __m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + c / 4)));
+            p = _mm256_or_si256(_mm256_or_si256(p, _mm256_slli_epi32(p, 6)),
+                                _mm256_or_si256(_mm256_slli_epi32(p, 12),
+                                                _mm256_slli_epi32(p, 18)));
+            __m256i codes = _mm256_and_si256(p, three);
+            __m256i w = _mm256_sub_epi8(_mm256_and_si256(codes, one),
+                                        _mm256_and_si256(_mm256_srli_epi32(codes, 1), one));
+            _mm256_storeu_si256((__m256i*)(dst + c), w);
+        }
+        unpack_2bit_row_lut(src, dst, c, cols);
+    }
+}
+
+__attribute__((target("avx2")))
+static void pack_bitplane_avx2(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    uint64_t *planes = (uint64_t*)packed;
+    const __m256i zero = _mm256_setzero_si256();
+    for (int r = 0; r < rows; r++) {
+        const int8_t *src = matrix_8bit + (size_t)r * cols;
+        uint64_t *nz = planes + (size_t)r * 2 * words;
+        uint64_t *neg = nz + words;
+        int w = 0;
+        for (; (w + 1) * 64 <= cols; w++) {
+            __m256i lo = _mm256_loadu_si256((const __m256i*)(src + w * 64));
+            __m256i hi = _mm256_loadu_si256((const __m256i*)(src + w * 64 + 32));
+            uint32_t zero_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero));
+            uint32_t zero_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero));
+            nz[w] = ~((uint64_t)zero_hi << 32 | zero_lo);
+            neg[w] = (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32 |
+                     (uint32_t)_mm256_movemask_epi8(lo);
+        }
+        pack_bitplane_row_swar(src, nz, neg, w, cols);
+    }
+}
+
+// 32 mask bits -> 32 bytes of 0x00 / 0xff
+__attribute__((target("avx2")))
+static inline __m256i avx2_expand_bits(uint32_t bits) {
+    const __m256i select = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bit = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int)bits), select);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(v, bit), bit);
+}
+
+__attribute__((target("avx2")))
+static void unpack_bitplane_avx2(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    int words = (cols + 63) / 64;
+    const uint64_t *planes = (const uint64_t*)packed;
+    const __m256i one = _mm256_set1_epi8(1);
+    for (int r = 0; r < rows; r++) {
+        const uint64_t *nz = planes + (size_t)r * 2 * words;
+        const uint64_t *neg = nz + words;
+        int8_t *dst = matrix_8bit + (size_t)r * cols;
+        int w = 0;
+        for (; (w + 1) * 64 <= cols; w++) {
+            for (int half = 0; half < 2; half++) {
+                uint32_t n = (uint32_t)(nz[w] >> (32 * half));
+                uint32_t m = (uint32_t)(neg[w] >> (32 * half));
+                // nonzero -> 1, then negative -> 0xff
+                __m256i v = _mm256_or_si256(_mm256_and_si256(avx2_expand_bits(n), one),
+                                            avx2_expand_bits(m));
+                _mm256_storeu_si256((__m256i*)(dst + w * 64 + 32 * half), v);
+            }
+        }
+        unpack_bitplane_row_lut(nz, neg, dst, w, cols);
+    }
+}
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+// vld4 de-interleaves columns 4i + k into lane i of vector k
+static void pack_2bit_neon(const int8_t *matrix_8bit, uint8_t *packed, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    const uint8x16_t two = vdupq_n_u8(2);
+    for (int r = 0; r < rows; r++) {
+        const int8_t *src = matrix_8bit + (size_t)r * cols;
+        uint8_t *dst = packed + r * row_bytes;
+        int c = 0;
+        for (; c + 64 <= cols; c += 64) {
+            uint8x16x4_t v = vld4q_u8((const uint8_t*)src + c);
+            uint8x16_t out = vminq_u8(v.val[0], two);
+            out = vorrq_u8(out, vshlq_n_u8(vminq_u8(v.val[1], two), 2));
+            out = vorrq_u8(out, vshlq_n_u8(vminq_u8(v.val[2], two), 4));
+            out = vorrq_u8(out, vshlq_n_u8(vminq_u8(v.val[3], two), 6));
+            vst1q_u8(dst + c / 4, out);
+        }
+        pack_2bit_row_swar(src, dst, c, cols);
+    }
+}
+
+static void unpack_2bit_neon(const uint8_t *packed, int8_t *matrix_8bit, int rows, int cols) {
+    size_t row_bytes = (size_t)(cols + 3) / 4;
+    const uint8x16_t one = vdupq_n_u8(1);
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *src = packed + r * row_bytes;
+        int8_t *dst = matrix_8bit + (size_t)r * cols;
+        int c = 0;
+        for (; c + 64 <= cols; c += 64) {
+            uint8x16_t p = vld1q_u8(src + c / 4);
+            uint8x16x4_t w;
+            w.val[0] = vsubq_u8(vandq_u8(p, one), vandq_u8(vshrq_n_u8(p, 1), one));
+            w.val[1] = vsubq_u8(vandq_u8(vshrq_n_u8(p, 2), one),
+                                vandq_u8(vshrq_n_u8(p, 3), one));
+            w.val[2] = vsubq_u8(vandq_u8(vshrq_n_u8(p, 4), one),
+                                vandq_u8(vshrq_n_u8(p, 5), one));
+            w.val[3] = vsubq_u8(vandq_u8(vshrq_n_u8(p, 6), one), vshrq_n_u8(p, 7));
+            vst4q_u8((uint8_t*)dst + c, w);
+        }
+        unpack_2bit_row_lut(src, dst, c, cols);
+    }
+}
+#endif
+
+static pack_fn pack_2bit_impl = pack_2bit_swar;
+static const char *pack_2bit_impl_name = "swar";
+static unpack_fn unpack_2bit_impl = unpack_2bit_lut;
+static pack_fn pack_bitplane_impl = pack_bitplane_swar;
+static const char *pack_bitplane_impl_name = "swar";
+static unpack_fn unpack_bitplane_impl = unpack_bitplane_lut;
+
+matvec_8bit_fn ternary_matvec_8bit_impl = ternary_matvec_8bit;
+const char *ternary_matvec_8bit_impl_name = "scalar";
+matvec_2bit_fn ternary_matvec_2bit_impl = ternary_matvec_2bit;
+const char *ternary_matvec_2bit_impl_name = "scalar";
+matvec_bitplane_fn ternary_matvec_bitplane_impl = ternary_matvec_bitplane;
+const char *ternary_matvec_bitplane_impl_name = "scalar";
+matvec_base3_fn ternary_matvec_base3_impl = ternary_matvec_base3;
+const char *ternary_matvec_base3_impl_name = "scalar";
+matvec_2bit_q8_fn ternary_matvec_2bit_q8_impl = ternary_matvec_2bit_q8;
+const char *ternary_matvec_2bit_q8_impl_name = "scalar";
+int ternary_matvec_2bit_q8_block = 4;    // column order the quantizer must use
+matvec_2bit_tiled_fn ternary_matvec_2bit_tiled_impl = ternary_matvec_2bit_tiled;
+const char *ternary_matvec_2bit_tiled_impl_name = "scalar";
+const char *ternary_matvec_2bit_fixed_impl_name = "scalar";
+matvec_2bit_hinted_fn ternary_matvec_2bit_hinted_impl = ternary_matvec_2bit_hinted;
+const char *ternary_matvec_2bit_hinted_impl_name = "scalar";
+int ternary_matvec_2bit_hinted_streams = 0;   // kernel has streaming loads
+matvec_2bit_fused_fn ternary_matvec_2bit_fused_impl = ternary_matvec_2bit_fused;
+const char *ternary_matvec_2bit_fused_impl_name = "scalar";
+matvec_2bit_multi_fn ternary_matvec_2bit_multi_impl = ternary_matvec_2bit_multi;
+const char *ternary_matvec_2bit_multi_impl_name = "scalar";
+matvec_sparse_fn ternary_matvec_sparse_impl = ternary_matvec_sparse;
+const char *ternary_matvec_sparse_impl_name = "scalar";
+matmul_8bit_fn ternary_matmul_8bit_impl = ternary_matmul_8bit;
+const char *ternary_matmul_8bit_impl_name = "scalar";
+matmul_2bit_fn ternary_matmul_2bit_impl = ternary_matmul_2bit;
+const char *ternary_matmul_2bit_impl_name = "scalar";
+
+// Pick the widest kernel the CPU supports, honouring TERNARY_ISA if set
+void ternary_init_kernel_dispatch(void) {
+    const char *want = getenv("TERNARY_ISA");
+
+    init_base3_lut();
+    init_pack_luts();
+
+    ternary_matvec_8bit_impl = ternary_matvec_8bit;
+    ternary_matvec_8bit_impl_name = "scalar";
+    ternary_matvec_2bit_impl = ternary_matvec_2bit;
+    ternary_matvec_2bit_impl_name = "scalar";
+    ternary_matmul_8bit_impl = ternary_matmul_8bit;
+    ternary_matmul_8bit_impl_name = "scalar";
+    ternary_matmul_2bit_impl = ternary_matmul_2bit;
+    ternary_matmul_2bit_impl_name = "scalar";
+    ternary_matvec_bitplane_impl = ternary_matvec_bitplane;
+    ternary_matvec_bitplane_impl_name = "scalar";
+    ternary_matvec_base3_impl = ternary_matvec_base3;
+    ternary_matvec_base3_impl_name = "scalar";
+    ternary_matvec_2bit_q8_impl = ternary_matvec_2bit_q8;
+    ternary_matvec_2bit_q8_impl_name = "scalar";
+    ternary_matvec_2bit_q8_block = 4;
+    ternary_matvec_2bit_tiled_impl = ternary_matvec_2bit_tiled;
+    ternary_matvec_2bit_tiled_impl_name = "scalar";
+    fixed_2bit_kernels = fixed_2bit_scalar_kernels;
+    ternary_matvec_2bit_fixed_impl_name = "scalar";
+    ternary_matvec_2bit_hinted_impl = ternary_matvec_2bit_hinted;
+    ternary_matvec_2bit_hinted_impl_name = "scalar";
+    ternary_matvec_2bit_hinted_streams = 0;
+    ternary_matvec_2bit_fused_impl = ternary_matvec_2bit_fused;
+    ternary_matvec_2bit_fused_impl_name = "scalar";
+    ternary_matvec_2bit_multi_impl = ternary_matvec_2bit_multi;
+    ternary_matvec_2bit_multi_impl_name = "scalar";
+    ternary_matvec_sparse_impl = ternary_matvec_sparse;
+    ternary_matvec_sparse_impl_name = "scalar";
+    pack_2bit_impl = pack_2bit_swar;
+    pack_2bit_impl_name = "swar";
+    unpack_2bit_impl = unpack_2bit_lut;
+    pack_bitplane_impl = pack_bitplane_swar;
+    pack_bitplane_impl_name = "swar";
+    unpack_bitplane_impl = unpack_bitplane_lut;
+    if (want && strcmp(want, "scalar") == 0) {
+        return;
+    }
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int has_avx512 = __builtin_cpu_supports("avx512f");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_fma = __builtin_cpu_supports("fma");
+    int has_vnni = __builtin_cpu_supports("avx512vnni") &&
+                   __builtin_cpu_supports("avx512bw");
+
+    if (want && strcmp(want, "avx2") == 0) {
+        has_avx512 = 0;
+        has_vnni = 0;
+    }
+    if (has_avx512) {
+        ternary_matvec_2bit_impl = matvec_2bit_avx512;
+        ternary_matvec_2bit_impl_name = "avx512";
+        ternary_matmul_2bit_impl = matmul_2bit_avx512;
+        ternary_matmul_2bit_impl_name = "avx512";
+        ternary_matvec_bitplane_impl = matvec_bitplane_avx512;
+        ternary_matvec_bitplane_impl_name = "avx512";
+        ternary_matvec_2bit_tiled_impl = matvec_2bit_tiled_avx512;
+        ternary_matvec_2bit_tiled_impl_name = "avx512";
+        fixed_2bit_kernels = fixed_2bit_avx512_kernels;
+        ternary_matvec_2bit_fixed_impl_name = "avx512";
+        ternary_matvec_2bit_hinted_impl = matvec_2bit_hinted_avx512;
+        ternary_matvec_2bit_hinted_impl_name = "avx512";
+        ternary_matvec_2bit_hinted_streams = 1;
+        ternary_matvec_2bit_fused_impl = matvec_2bit_fused_avx512;
+        ternary_matvec_2bit_fused_impl_name = "avx512";
+        ternary_matvec_2bit_multi_impl = matvec_2bit_multi_avx512;
+        ternary_matvec_2bit_multi_impl_name = "avx512";
+    } else if (has_avx2) {
+        ternary_matvec_2bit_impl = matvec_2bit_avx2;
+        ternary_matvec_2bit_impl_name = "avx2";
+        ternary_matmul_2bit_impl = matmul_2bit_avx2;
+        ternary_matmul_2bit_impl_name = "avx2";
+        ternary_matvec_bitplane_impl = matvec_bitplane_avx2;
+        ternary_matvec_bitplane_impl_name = "avx2";
+        ternary_matvec_2bit_tiled_impl = matvec_2bit_tiled_avx2;
+        ternary_matvec_2bit_tiled_impl_name = "avx2";
+        fixed_2bit_kernels = fixed_2bit_avx2_kernels;
+        ternary_matvec_2bit_fixed_impl_name = "avx2";
+        ternary_matvec_2bit_hinted_impl = matvec_2bit_hinted_avx2;
+        ternary_matvec_2bit_hinted_impl_name = "avx2";
+        ternary_matvec_2bit_hinted_streams = 1;
+        ternary_matvec_2bit_fused_impl = matvec_2bit_fused_avx2;
+        ternary_matvec_2bit_fused_impl_name = "avx2";
+        ternary_matvec_2bit_multi_impl = matvec_2bit_multi_avx2;
+        ternary_matvec_2bit_multi_impl_name = "avx2";
+    }
+    if (has_avx512 && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl")) {
+        ternary_matvec_sparse_impl = matvec_sparse_avx512;
+        ternary_matvec_sparse_impl_name = "avx512";
+    }
+    if (has_avx512 && __builtin_cpu_supports("avx512bw")) {
+        pack_2bit_impl = pack_2bit_avx512;
+        pack_2bit_impl_name = "avx512";
+        unpack_2bit_impl = unpack_2bit_avx512;
+        pack_bitplane_impl = pack_bitplane_avx512;
+        pack_bitplane_impl_name = "avx512";
+        unpack_bitplane_impl = unpack_bitplane_avx512;
+    } else if (has_avx2) {
+        pack_2bit_impl = pack_2bit_avx2;
+        pack_2bit_impl_name = "avx2";
+        unpack_2bit_impl = unpack_2bit_avx2;
+        pack_bitplane_impl = pack_bitplane_avx2;
+        pack_bitplane_impl_name = "avx2";
+        unpack_bitplane_impl = unpack_bitplane_avx2;
+    }
+    if (has_avx2 && has_fma) {
+        ternary_matvec_base3_impl = matvec_base3_avx2;
+        ternary_matvec_base3_impl_name = "avx2";
+    }
+    if (has_avx512 && has_vnni) {
+        ternary_matvec_2bit_q8_impl = matvec_2bit_q8_vnni;
+        ternary_matvec_2bit_q8_impl_name = "avx512vnni";
+        ternary_matvec_2bit_q8_block = 64;
+    } else if (has_avx2) {
+        ternary_matvec_2bit_q8_impl = matvec_2bit_q8_avx2;
+        ternary_matvec_2bit_q8_impl_name = "avx2";
+        ternary_matvec_2bit_q8_block = 32;
+    }
+#endif
+
+#ifdef HAVE_ARM_KERNELS
+    ternary_matvec_8bit_impl = matvec_8bit_neon;
+    ternary_matvec_8bit_impl_name = "neon";
+    ternary_matvec_2bit_impl = matvec_2bit_neon;
+    ternary_matvec_2bit_impl_name = "neon";
+    // Batched kernels are NEON-only; SVE builds use them as well
+    ternary_matmul_8bit_impl = matmul_8bit_neon;
+    ternary_matmul_8bit_impl_name = "neon";
+    ternary_matmul_2bit_impl = matmul_2bit_neon;
+    ternary_matmul_2bit_impl_name = "neon";
+    ternary_matvec_bitplane_impl = matvec_bitplane_neon;
+    ternary_matvec_bitplane_impl_name = "neon";
+    ternary_matvec_base3_impl = matvec_base3_neon;
+    ternary_matvec_base3_impl_name = "neon";
+    ternary_matvec_2bit_tiled_impl = matvec_2bit_tiled_neon;
+    ternary_matvec_2bit_tiled_impl_name = "neon";
+    fixed_2bit_kernels = NULL;
+    ternary_matvec_2bit_fixed_impl_name = "none";
+    ternary_matvec_2bit_hinted_impl = matvec_2bit_hinted_neon;
+    ternary_matvec_2bit_hinted_impl_name = "neon";
+    ternary_matvec_2bit_fused_impl = matvec_2bit_fused_neon;
+    ternary_matvec_2bit_fused_impl_name = "neon";
+    ternary_matvec_2bit_multi_impl = matvec_2bit_multi_neon;
+    ternary_matvec_2bit_multi_impl_name = "neon";
+    pack_2bit_impl = pack_2bit_neon;
+    pack_2bit_impl_name = "neon";
+    unpack_2bit_impl = unpack_2bit_neon;
+    ternary_matvec_2bit_q8_impl = matvec_2bit_q8_neon;
+#ifdef __ARM_FEATURE_DOTPROD
+    ternary_matvec_2bit_q8_impl_name = "neon-sdot";
+#else
+    ternary_matvec_2bit_q8_impl_name = "neon";
+#endif
+#ifdef HAVE_SVE_KERNELS
+    if (!(want && strcmp(want, "neon") == 0)) {
+        ternary_matvec_8bit_impl = matvec_8bit_sve;
+        ternary_matvec_8bit_impl_name = "sve";
+        ternary_matvec_2bit_impl = matvec_2bit_sve;
+        ternary_matvec_2bit_impl_name = "sve";
+    }
+#endif
+#endif
+
+    if (want && strcmp(want, ternary_matvec_2bit_impl_name) != 0) {
+        fprintf(stderr, "Warning: TERNARY_ISA=%s not available, using %s\n",
+                want, ternary_matvec_2bit_impl_name);
+    }
+}
+
+// ============================================================================
+// WEIGHT FORMATS
+// ============================================================================
+
+const char *ternary_format_name(weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return "8-bit";
+    case FORMAT_2BIT:     return "2-bit packed";
+    case FORMAT_BITPLANE: return "2-bit bitplane";
+    case FORMAT_BASE3:    return "1.6-bit base-3";
+    }
+    return "?";
+}
+
+const char *ternary_format_kernel_name(weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return ternary_matvec_8bit_impl_name;
+    case FORMAT_2BIT:     return ternary_matvec_2bit_impl_name;
+    case FORMAT_BITPLANE: return ternary_matvec_bitplane_impl_name;
+    case FORMAT_BASE3:    return ternary_matvec_base3_impl_name;
+    }
+    return "?";
+}
+
+size_t ternary_format_row_bytes(weight_format_t format, int cols) {
+    switch (format) {
+    case FORMAT_8BIT:     return (size_t)cols;
+    case FORMAT_2BIT:     return (size_t)(cols + 3) / 4;
+    case FORMAT_BITPLANE: return (size_t)(cols + 63) / 64 * 2 * sizeof(uint64_t);
+    case FORMAT_BASE3:    return (size_t)(cols + BASE3_TRITS - 1) / BASE3_TRITS;
+    }
+    return 0;
+}
+
+void ternary_matvec_rows(weight_format_t format, const uint8_t *matrix,
+                         const float *input, float *output,
+                         int row_begin, int row_end, int cols) {
+    size_t row_bytes = ternary_format_row_bytes(format, cols);
+    const uint8_t *slice = matrix + (size_t)row_begin * row_bytes;
+    int rows = row_end - row_begin;
+    TRACE_BEGIN(trace_t0);
+
+    switch (format) {
+    case FORMAT_8BIT:
+        ternary_matvec_8bit_impl((const int8_t*)slice, input, output + row_begin, rows, cols);
+        break;
+    case FORMAT_2BIT:
+        ternary_matvec_2bit_impl(slice, input, output + row_begin, rows, cols);
+        break;
+    case FORMAT_BITPLANE:
+        ternary_matvec_bitplane_impl((const uint64_t*)slice, input, output + row_begin,
+                                     rows, cols);
+        break;
+    case FORMAT_BASE3:
+        ternary_matvec_base3_impl(slice, input, output + row_begin, rows, cols);
+        break;
+    }
+    TRACE_END(trace_t0, ternary_format_name(format), rows);
+}
+
+typedef struct {
+    weight_format_t format;
+    const uint8_t *matrix;
+    const float *input;
+    float *output;
+    int row_begin;
+    int row_end;
+    int cols;
+} matvec_job_t;
+
+static void *matvec_worker(void *arg) {
+    const matvec_job_t *job = (const matvec_job_t*)arg;
+    ternary_matvec_rows(job->format, job->matrix, job->input, job->output,
+                        job->row_begin, job->row_end, job->cols);
+    return NULL;
+}
+
+// Splits rows into num_threads slices on threads spawned and joined within
+// the call; the calling thread runs slice 0 itself
+void ternary_matvec_rows_parallel(weight_format_t format, const uint8_t *matrix,
+                                  const float *input, float *output,
+                                  int rows, int cols, int num_threads) {
+    pthread_t threads[MAX_MATVEC_THREADS];
+    matvec_job_t jobs[MAX_MATVEC_THREADS];
+    int started[MAX_MATVEC_THREADS] = { 0 };
+
+    if (num_threads > rows) {
+        num_threads = rows;
+    }
+    if (num_threads > MAX_MATVEC_THREADS) {
+        num_threads = MAX_MATVEC_THREADS;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        matvec_job_t job = { format, matrix, input, output,
+                             (int)((long long)rows * t / num_threads),
+                             (int)((long long)rows * (t + 1) / num_threads), cols };
+        jobs[t] = job;
+    }
+    for (int t = 1; t < num_threads; t++) {
+        started[t] = pthread_create(&threads[t], NULL, matvec_worker, &jobs[t]) == 0;
+        if (!started[t]) {
+            matvec_worker(&jobs[t]);
+        }
+    }
+    matvec_worker(&jobs[0]);
+    for (int t = 1; t < num_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+}
+
+static pack_fn format_packer(weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return NULL;
+    case FORMAT_2BIT:     return pack_2bit_impl;
+    case FORMAT_BITPLANE: return pack_bitplane_impl;
+    case FORMAT_BASE3:    return pack_base3_swar;
+    }
+    return NULL;
+}
+
+static unpack_fn format_unpacker(weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return NULL;
+    case FORMAT_2BIT:     return unpack_2bit_impl;
+    case FORMAT_BITPLANE: return unpack_bitplane_impl;
+    case FORMAT_BASE3:    return unpack_base3_lut;
+    }
+    return NULL;
+}
+
+const char *ternary_format_packer_name(weight_format_t format) {
+    switch (format) {
+    case FORMAT_8BIT:     return "copy";
+    case FORMAT_2BIT:     return pack_2bit_impl_name;
+    case FORMAT_BITPLANE: return pack_bitplane_impl_name;
+    case FORMAT_BASE3:    return "swar";
+    }
+    return "?";
+}
+
+int ternary_online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Conversion between int8 and a packed format, split into row slices
+typedef struct {
+    weight_format_t format;
+    int unpack;
+    const int8_t *matrix_8bit;
+    int8_t *out_8bit;
+    const uint8_t *packed;
+    uint8_t *out_packed;
+    int row_begin;
+    int row_end;
+    int cols;
+} pack_job_t;
+
+static void *pack_worker(void *arg) {
+    pack_job_t *job = (pack_job_t*)arg;
+    size_t row_bytes = ternary_format_row_bytes(job->format, job->cols);
+    size_t begin = (size_t)job->row_begin;
+    int rows = job->row_end - job->row_begin;
+
+    if (job->format == FORMAT_8BIT) {
+        size_t bytes = (size_t)rows * job->cols;
+        if (job->unpack) {
+            memcpy(job->out_8bit + begin * job->cols, job->packed + begin * row_bytes, bytes);
+        } else {
+            memcpy(job->out_packed + begin * row_bytes, job->matrix_8bit + begin * job->cols,
+                   bytes);
+        }
+    } else if (job->unpack) {
+        format_unpacker(job->format)(job->packed + begin * row_bytes,
+                                     job->out_8bit + begin * job->cols, rows, job->cols);
+    } else {
+        format_packer(job->format)(job->matrix_8bit + begin * job->cols,
+                                   job->out_packed + begin * row_bytes, rows, job->cols);
+    }
+    return NULL;
+}
+
+// Runs the fast packer (or unpacker) on up to num_threads row slices;
+// the calling thread takes the first slice
+static void run_pack_jobs(pack_job_t *base, int rows, int num_threads) {
+    pthread_t threads[MAX_PACK_THREADS];
+    pack_job_t jobs[MAX_PACK_THREADS];
+    int started[MAX_PACK_THREADS] = { 0 };
+
+    if (num_threads > rows) {
+        num_threads = rows;
+    }
+    if (num_threads > MAX_PACK_THREADS) {
+        num_threads = MAX_PACK_THREADS;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        jobs[t] = *base;
+        jobs[t].row_begin = (int)((long long)rows * t / num_threads);
+        jobs[t].row_end = (int)((long long)rows * (t + 1) / num_threads);
+    }
+    for (int t = 1; t < num_threads; t++) {
+        started[t] = pthread_create(&threads[t], NULL, pack_worker, &jobs[t]) == 0;
+        if (!started[t]) {
+            pack_worker(&jobs[t]);
+        }
+    }
+    pack_worker(&jobs[0]);
+    for (int t = 1; t < num_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+}
+
+void ternary_pack_matrix(weight_format_t format, const int8_t *matrix_8bit, uint8_t *packed,
+                         int rows, int cols, int num_threads) {
+    pack_job_t job = { format, 0, matrix_8bit, NULL, NULL, packed, 0, 0, cols };
+    run_pack_jobs(&job, rows, num_threads);
+}
+
+void ternary_unpack_matrix(weight_format_t format, const uint8_t *packed, int8_t *matrix_8bit,
+                           int rows, int cols, int num_threads) {
+    pack_job_t job = { format, 1, NULL, matrix_8bit, packed, NULL, 0, 0, cols };
+    run_pack_jobs(&job, rows, num_threads);
+}
@@ -0,0 +1,274 @@
+/*
+ * Buffer allocation under the --alloc policies: aligned, transparent and
+ * hugetlb huge pages, NUMA binding.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>  // mbind
+#endif
+
+#ifdef __APPLE__
+#include <mach/vm_statistics.h>  // VM_FLAGS_SUPERPAGE_SIZE_2MB
+#endif
+
+#include "ternary.h"
+
+// ============================================================================
+// MEMORY ALLOCATION
+// ============================================================================
+// Weight and activation buffers come from ternary_alloc() under one policy
+// (--alloc):
+//   malloc    plain malloc: 16-byte alignment, 4 KB pages
+//   aligned   64-byte aligned, so no vector load splits a cache line
+//   thp       2 MB aligned anonymous mapping advised MADV_HUGEPAGE
+//             (a VM_FLAGS_SUPERPAGE_SIZE_2MB mapping on macOS/x86)
+//   hugetlb   MAP_HUGETLB from the reserved pool (vm.nr_hugepages); falls
+//             back to thp when the pool cannot serve the request
+// --numa-node N binds every buffer to one node with mbind (Linux). Bound
+// buffers are always mapped, since a malloc'ed range shares pages with its
+// neighbours. Mappings are recorded so ternary_free() can release them.
+
+#define ALLOC_ALIGN 64
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+#define ALLOC_MIN_MAPPINGS 64      // first table size; doubled when full
+#define ALLOC_MPOL_BIND 2           // MPOL_BIND from <linux/mempolicy.h>
+
+const char *const ternary_alloc_policy_names[ALLOC_POLICY_COUNT] = {
+    "malloc", "aligned", "thp", "hugetlb"
+};
+
+alloc_policy_t ternary_alloc_policy = ALLOC_ALIGNED;
+int ternary_alloc_numa_node = -1;
+int ternary_alloc_hugetlb_fallbacks;   // hugetlb requests served as thp
+
+typedef struct {
+    void *base;
+    size_t bytes;
+} alloc_mapping_t;
+
+// Grows with the number of live mappings (--decode maps every layer's
+// projections); guarded by alloc_lock
+static alloc_mapping_t *alloc_mappings;
+static size_t alloc_mapping_count;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void alloc_bind_node(void *ptr, size_t bytes) {
+#if defined(__linux__) && defined(SYS_mbind)
+    static int warned;
+    unsigned long mask[16] = { 0 };
+    if (ternary_alloc_numa_node < 0 || ternary_alloc_numa_node >= (int)(sizeof(mask) * 8)) {
+        return;
+    }
+    mask[ternary_alloc_numa_node / 64] |= 1UL << (ternary_alloc_numa_node % 64);
+    if (syscall(SYS_mbind, ptr, bytes, ALLOC_MPOL_BIND, mask, sizeof(mask) * 8, 0) != 0 &&
+        !warned) {
+        fprintf(stderr, "Warning: could not bind buffers to NUMA node %d\n",
+                ternary_alloc_numa_node);
+        warned = 1;
+    }
+#else
+    (void)ptr;
+    (void)bytes;
+#endif
+}
+
+// Anonymous mapping of at least `bytes` for the mapped policies, or NULL
+static void *alloc_map(size_t bytes, alloc_policy_t policy, size_t *mapped) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t huge_len = (bytes + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+    void *ptr = MAP_FAILED;
+
+    if (policy == ALLOC_HUGETLB) {
+#ifdef MAP_HUGETLB
+        ptr = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (ptr != MAP_FAILED) {
+            *mapped = huge_len;
+            return ptr;
+        }
+        ternary_alloc_hugetlb_fallbacks++;
+        policy = ALLOC_THP;
+    }
+
+    if (policy != ALLOC_THP) {
+        *mapped = (bytes + page - 1) & ~(page - 1);
+        ptr = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+#if defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+    ptr = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+    if (ptr != MAP_FAILED) {
+        *mapped = huge_len;
+        return ptr;
+    }
+#endif
+    // Over-map by one huge page and trim both ends to a 2 MB boundary
+    uint8_t *raw = (uint8_t*)mmap(NULL, huge_len + HUGE_PAGE_BYTES,
+                                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                  -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t *aligned = (uint8_t*)(((uintptr_t)raw + HUGE_PAGE_BYTES - 1) &
+                                  ~(uintptr_t)(HUGE_PAGE_BYTES - 1));
+    size_t head = (size_t)(aligned - raw);
+    if (head) {
+        munmap(raw, head);
+    }
+    if (HUGE_PAGE_BYTES - head) {
+        munmap(aligned + huge_len, HUGE_PAGE_BYTES - head);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, huge_len, MADV_HUGEPAGE);
+#endif
+    *mapped = huge_len;
+    return aligned;
+}
+
+// Allocates `bytes` under ternary_alloc_policy; release with ternary_free()
+void *ternary_alloc(size_t bytes) {
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    if (ternary_alloc_numa_node < 0) {
+        if (ternary_alloc_policy == ALLOC_MALLOC) {
+            return malloc(bytes);
+        }
+        if (ternary_alloc_policy == ALLOC_ALIGNED) {
+            void *ptr = NULL;
+            return posix_memalign(&ptr, ALLOC_ALIGN, bytes) == 0 ? ptr : NULL;
+        }
+    }
+
+    size_t mapped = 0;
+    void *ptr = alloc_map(bytes, ternary_alloc_policy, &mapped);
+    if (!ptr) {
+        return NULL;
+    }
+    alloc_bind_node(ptr, mapped);
+
+    pthread_mutex_lock(&alloc_lock);
+    size_t slot = alloc_mapping_count;
+    for (size_t i = 0; i < alloc_mapping_count && slot == alloc_mapping_count; i++) {
+        if (!alloc_mappings[i].base) {
+            slot = i;
+        }
+    }
+    if (slot == alloc_mapping_count) {
+        size_t count = slot ? 2 * slot : ALLOC_MIN_MAPPINGS;
+        alloc_mapping_t *grown = (alloc_mapping_t*)realloc(alloc_mappings,
+                                                           count * sizeof(*grown));
+        if (grown) {
+            memset(grown + slot, 0, (count - slot) * sizeof(*grown));
+            alloc_mappings = grown;
+            alloc_mapping_count = count;
+        }
+    }
+    int recorded = slot < alloc_mapping_count;
+    if (recorded) {
+        alloc_mappings[slot].base = ptr;
+        alloc_mappings[slot].bytes = mapped;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (!recorded) {
+        fprintf(stderr, "Cannot record mapping %zu: out of memory for the mapping table\n",
+                slot + 1);
+        munmap(ptr, mapped);
+        return NULL;
+    }
+    return ptr;
+}
+
+void ternary_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    pthread_mutex_lock(&alloc_lock);
+    for (size_t i = 0; i < alloc_mapping_count; i++) {
+        if (alloc_mappings[i].base == ptr) {
+            munmap(ptr, alloc_mappings[i].bytes);
+            alloc_mappings[i].base = NULL;
+            pthread_mutex_unlock(&alloc_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    free(ptr);
+}
+
+// Bytes of [ptr, ptr + bytes) backed by huge pages, from the smaps entry
+// of its VMA (neighbouring mappings may be merged into it, so the result is
+// clamped to `bytes`); -1 where smaps is unavailable
+long ternary_huge_page_bytes(const void *ptr, size_t bytes) {
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    int inside = 0;
+    long huge = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        long kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (inside) {
+                break;
+            }
+            inside = (uintptr_t)ptr >= start && (uintptr_t)ptr < end;
+        } else if (inside && (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+                              sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1 ||
+                              sscanf(line, "Shared_Hugetlb: %ld kB", &kb) == 1)) {
+            huge += kb * 1024;
+        }
+    }
+    fclose(f);
+    return huge < (long)bytes ? huge : (long)bytes;
+#else
+    (void)ptr;
+    (void)bytes;
+    return -1;
+#endif
+}
+
+// "[madvise]" style mode of transparent huge pages, or "n/a"
+const char *ternary_thp_mode(void) {
+    static char mode[32] = "n/a";
+#ifdef __linux__
+    char line[128] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f) {
+        if (fgets(line, sizeof(line), f)) {
+            char *open = strchr(line, '['), *close = open ? strchr(open, ']') : NULL;
+            if (open && close && close - open - 1 < (long)sizeof(mode)) {
+                memcpy(mode, open + 1, (size_t)(close - open - 1));
+                mode[close - open - 1] = '\0';
+            }
+        }
+        fclose(f);
+    }
+#endif
+    return mode;
+}
+
+// ============================================================================
+// WEIGHT FORMATS
+// ============================================================================
+const weight_format_t ternary_all_formats[WEIGHT_FORMAT_COUNT] = {
+    FORMAT_8BIT, FORMAT_2BIT, FORMAT_BITPLANE, FORMAT_BASE3
+};
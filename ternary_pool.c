@@ -0,0 +1,361 @@
+/*
+ * A persistent work-stealing thread pool for row-parallel matvecs, and
+ * CPU pinning for the threads of both the pool and the benchmark.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE  // pthread_setaffinity_np
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ternary.h"
+
+// ============================================================================
+// THREAD POOL
+// ============================================================================
+// Workers are created once and reused by every ternary_pool_run(). A run
+// cuts [0, items) into chunks and deals each thread one contiguous range
+// of chunk indices, so with stealing off it is the usual static partition.
+// Each range is a deque packed into one 64-bit word, (head << 32) | tail:
+// the owner takes chunks from the head, in row order, and an idle thread
+// with stealing on takes them from the tail of another thread's deque.
+// Both sides claim a chunk with one compare-and-swap, so no locks are taken
+// while rows run. Between runs workers spin for a while, then park on a
+// condition variable; the calling thread works as thread 0. With more
+// threads than CPUs a spinning thread only delays the one it waits for, so
+// such pools park (and the caller yields) straight away.
+#define POOL_SPIN_LIMIT 20000   // pause iterations before parking / yielding
+#define POOL_LINE_BYTES 64
+
+typedef struct {
+    uint64_t range;     // (head << 32) | tail, chunk indices
+    char pad[POOL_LINE_BYTES - sizeof(uint64_t)];
+} pool_deque_t;
+
+typedef struct {
+    thread_pool_t *pool;
+    pthread_t thread;
+    int index;
+    int started;
+    thread_pool_stats_t stats;
+} pool_worker_t;
+
+struct thread_pool {
+    int threads;
+    int spin_limit;         // POOL_SPIN_LIMIT, or 0 when oversubscribed
+    pool_deque_t *deques;
+    pool_worker_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned generation;    // bumped by every run, read by waiting workers
+    int stop;
+    int active;             // workers still inside the current run
+
+    // The current run, published before generation is bumped
+    pool_task_fn task;
+    void *ctx;
+    int items;
+    int chunk;
+    int steal;
+};
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+int ternary_pin_current_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+// Claims a chunk from the head (own deque) or tail (a victim's); -1 if empty
+static int deque_take(pool_deque_t *q, int from_tail) {
+    uint64_t range = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t head = (uint32_t)(range >> 32);
+        uint32_t tail = (uint32_t)range;
+        if (head >= tail) {
+            return -1;
+        }
+        uint64_t next = from_tail ? ((uint64_t)head << 32) | (tail - 1)
+                                  : ((uint64_t)(head + 1) << 32) | tail;
+        if (__atomic_compare_exchange_n(&q->range, &range, next, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (int)(from_tail ? tail - 1 : head);
+        }
+    }
+}
+
+static double pool_now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+// One thread's share of a run: its own chunks, then (with stealing) other
+// threads' from the tail, visiting victims round-robin from its neighbour
+static void pool_work(thread_pool_t *pool, pool_worker_t *self) {
+    double start = pool_now_ms();
+    int victim = self->index;
+
+    for (;;) {
+        int chunk = deque_take(&pool->deques[self->index], 0);
+        int stolen = 0;
+        if (chunk < 0 && pool->steal) {
+            for (int i = 1; i < pool->threads && chunk < 0; i++) {
+                victim = (victim + 1) % pool->threads;
+                if (victim != self->index) {
+                    chunk = deque_take(&pool->deques[victim], 1);
+                }
+            }
+            stolen = chunk >= 0;
+            self->stats.steals += stolen;
+        }
+        if (chunk < 0) {
+            break;
+        }
+        int begin = chunk * pool->chunk;
+        int end = begin + pool->chunk < pool->items ? begin + pool->chunk : pool->items;
+        TRACE_BEGIN(trace_t0);
+        pool->task(pool->ctx, begin, end);
+        TRACE_END(trace_t0, stolen ? "stolen chunk" : "chunk", begin);
+        self->stats.chunks++;
+    }
+    self->stats.busy_ms += pool_now_ms() - start;
+}
+
+static void *pool_worker_main(void *arg) {
+    pool_worker_t *self = (pool_worker_t*)arg;
+    thread_pool_t *pool = self->pool;
+    unsigned seen = 0;
+
+    for (;;) {
+        int spins = 0;
+        while (__atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) == seen &&
+               !__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+            if (++spins < pool->spin_limit) {
+                cpu_relax();
+                continue;
+            }
+            TRACE_BEGIN(trace_t0);
+            pthread_mutex_lock(&pool->lock);
+            while (pool->generation == seen && !pool->stop) {
+                __atomic_fetch_add(&self->stats.parks, 1, __ATOMIC_RELAXED);
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            TRACE_END(trace_t0, "park", 0);
+        }
+        if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        seen = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE);
+        pool_work(pool, self);
+        __atomic_fetch_sub(&pool->active, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+thread_pool_t *ternary_pool_create(int threads, int pin) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_MATVEC_THREADS) {
+        threads = MAX_MATVEC_THREADS;
+    }
+
+    thread_pool_t *pool = (thread_pool_t*)calloc(1, sizeof(thread_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = threads;
+    pool->spin_limit = threads <= ternary_online_cpus() ? POOL_SPIN_LIMIT : 0;
+    pool->deques = (pool_deque_t*)ternary_alloc((size_t)threads * sizeof(pool_deque_t));
+    pool->workers = (pool_worker_t*)calloc((size_t)threads, sizeof(pool_worker_t));
+    if (!pool->deques || !pool->workers) {
+        ternary_free(pool->deques);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->deques, 0, (size_t)threads * sizeof(pool_deque_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (int t = 0; t < threads; t++) {
+        pool_worker_t *w = &pool->workers[t];
+        w->pool = pool;
+        w->index = t;
+        if (t == 0) {
+            continue;
+        }
+        w->started = pthread_create(&w->thread, NULL, pool_worker_main, w) == 0;
+        if (!w->started) {
+            ternary_pool_destroy(pool);
+            return NULL;
+        }
+#ifdef __linux__
+        // Best-effort, as for the engine threads
+        if (pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(t % ternary_online_cpus(), &set);
+            pthread_setaffinity_np(w->thread, sizeof(set), &set);
+        }
+#else
+        (void)pin;
+#endif
+    }
+    return pool;
+}
+
+void ternary_pool_destroy(thread_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 1; t < pool->threads; t++) {
+        if (pool->workers[t].started) {
+            pthread_join(pool->workers[t].thread, NULL);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    ternary_free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+int ternary_pool_threads(const thread_pool_t *pool) {
+    return pool->threads;
+}
+
+void ternary_pool_run(thread_pool_t *pool, pool_task_fn task, void *ctx,
+                      int items, int chunk, int steal) {
+    if (items <= 0) {
+        return;
+    }
+    if (chunk < 1) {
+        chunk = 1;
+    }
+    int chunks = (items + chunk - 1) / chunk;
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->items = items;
+    pool->chunk = chunk;
+    pool->steal = steal;
+    for (int t = 0; t < pool->threads; t++) {
+        uint64_t head = (uint64_t)((long long)chunks * t / pool->threads);
+        uint64_t tail = (uint64_t)((long long)chunks * (t + 1) / pool->threads);
+        __atomic_store_n(&pool->deques[t].range, (head << 32) | tail, __ATOMIC_RELAXED);
+    }
+    if (pool->threads == 1) {
+        pool_work(pool, &pool->workers[0]);
+        return;
+    }
+
+    __atomic_store_n(&pool->active, pool->threads - 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->lock);
+    __atomic_fetch_add(&pool->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, &pool->workers[0]);
+
+    // Yield once spinning has gone on long enough to suggest the workers
+    // are sharing CPUs with this thread
+    int spins = 0;
+    while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE) > 0) {
+        if (++spins < pool->spin_limit) {
+            cpu_relax();
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// Workers only touch busy_ms, chunks and steals inside a run; parks can
+// change while the caller reads, after a worker finishes its share
+void ternary_pool_stats(const thread_pool_t *pool, thread_pool_stats_t *stats) {
+    for (int t = 0; t < pool->threads; t++) {
+        const thread_pool_stats_t *s = &pool->workers[t].stats;
+        stats[t].busy_ms = s->busy_ms;
+        stats[t].chunks = s->chunks;
+        stats[t].steals = s->steals;
+        stats[t].parks = __atomic_load_n(&s->parks, __ATOMIC_RELAXED);
+    }
+}
+
+void ternary_pool_reset_stats(thread_pool_t *pool) {
+    for (int t = 0; t < pool->threads; t++) {
+        thread_pool_stats_t *s = &pool->workers[t].stats;
+        s->busy_ms = 0.0;
+        s->chunks = 0;
+        s->steals = 0;
+        __atomic_store_n(&s->parks, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// ============================================================================
+// POOLED MATVECS
+// ============================================================================
+typedef struct {
+    weight_format_t format;
+    const uint8_t *matrix;
+    const sparse_matrix_t *sparse;
+    const float *input;
+    float *output;
+    int cols;
+} pool_matvec_t;
+
+static void pool_rows_task(void *ctx, int begin, int end) {
+    const pool_matvec_t *m = (const pool_matvec_t*)ctx;
+    ternary_matvec_rows(m->format, m->matrix, m->input, m->output, begin, end, m->cols);
+}
+
+// Offsets index deltas from the start, so a row range is the same lists
+// behind a shifted offsets pointer
+static void pool_sparse_task(void *ctx, int begin, int end) {
+    const pool_matvec_t *m = (const pool_matvec_t*)ctx;
+    sparse_matrix_t view = *m->sparse;
+    view.rows = end - begin;
+    view.offsets = m->sparse->offsets + 2 * (size_t)begin;
+    ternary_matvec_sparse_impl(&view, m->input, m->output + begin);
+}
+
+void ternary_pool_matvec_rows(thread_pool_t *pool, weight_format_t format,
+                              const uint8_t *matrix, const float *input, float *output,
+                              int rows, int cols, int chunk, int steal) {
+    pool_matvec_t m = { format, matrix, NULL, input, output, cols };
+    ternary_pool_run(pool, pool_rows_task, &m, rows, chunk, steal);
+}
+
+void ternary_pool_matvec_sparse(thread_pool_t *pool, const sparse_matrix_t *sm,
+                                const float *input, float *output, int chunk, int steal) {
+    pool_matvec_t m = { FORMAT_2BIT, NULL, sm, input, output, sm->cols };
+    ternary_pool_run(pool, pool_sparse_task, &m, sm->rows, chunk, steal);
+}
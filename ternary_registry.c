@@ -0,0 +1,173 @@
+/*
+ * The kernel registry: every whole-matrix matvec under a stable name, as
+ * used by --autotune, the plan cache and the default comparison.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ternary.h"
+
+// ============================================================================
+// KERNEL REGISTRY
+// ============================================================================
+// Every whole-matrix matvec the benchmark can run on one weight set, under
+// a stable name. --autotune times all of them, the plan cache stores one of
+// these names per shape, and the default comparison looks both of its
+// sides up here instead of calling fixed kernels.
+#define KERNEL_ROW_TILE 4           // tile for "2bit-tiled"
+#define KERNEL_COL_TILE 1024
+#define KERNEL_PREFETCH_DISTANCE 1024   // bytes ahead for "2bit-prefetch"
+
+static const char *const kernel_scalar_name = "scalar";
+
+static void kernel_run_8bit(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_8bit_impl(ws->matrix_8bit, ws->input, ws->output, ws->rows, ws->cols);
+}
+
+static void kernel_run_2bit(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_2bit_impl(ws->matrix_2bit, ws->input, ws->output, ws->rows, ws->cols);
+}
+
+static void kernel_run_2bit_scalar(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_2bit(ws->matrix_2bit, ws->input, ws->output, ws->rows, ws->cols);
+}
+
+static void kernel_run_2bit_tiled(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_2bit_tiled_impl(ws->matrix_2bit, ws->input, ws->output, ws->rows, ws->cols,
+                                   KERNEL_ROW_TILE, KERNEL_COL_TILE);
+}
+
+// Widths without a specialized kernel are refused by ternary_kernel_prepare()
+static void kernel_run_2bit_fixed(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_2bit_shaped(ws->matrix_2bit, ws->input, ws->output, ws->rows, ws->cols);
+}
+
+static void kernel_run_2bit_prefetch(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    load_hints_t hints = { KERNEL_PREFETCH_DISTANCE, 0 };
+    ternary_matvec_2bit_hinted_impl(ws->matrix_2bit, ws->input, ws->output, ws->rows, ws->cols,
+                                    &hints);
+}
+
+// One slice per thread, spawned and joined within the call, so every call
+// pays thread start-up
+static void kernel_run_2bit_mt(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_rows_parallel(FORMAT_2BIT, ws->matrix_2bit, ws->input, ws->output,
+                                 ws->rows, ws->cols, a->threads);
+}
+
+static void kernel_run_2bit_pool(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_pool_matvec_rows(a->pool, FORMAT_2BIT, ws->matrix_2bit, ws->input, ws->output,
+                             ws->rows, ws->cols, POOL_DEFAULT_CHUNK, 1);
+}
+
+static void kernel_run_bitplane(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_bitplane_impl(ws->matrix_bitplane, ws->input, ws->output, ws->rows, ws->cols);
+}
+
+static void kernel_run_base3(const kernel_args_t *a) {
+    const weight_set_t *ws = a->ws;
+    ternary_matvec_base3_impl(ws->matrix_base3, ws->input, ws->output, ws->rows, ws->cols);
+}
+
+static void kernel_run_sparse(const kernel_args_t *a) {
+    ternary_matvec_sparse_impl(&a->sparse, a->ws->input, a->ws->output);
+}
+
+static void kernel_run_sparse_pool(const kernel_args_t *a) {
+    ternary_pool_matvec_sparse(a->pool, &a->sparse, a->ws->input, a->ws->output,
+                               POOL_DEFAULT_CHUNK, 1);
+}
+
+const kernel_entry_t ternary_kernel_registry[] = {
+    { "8bit",          "8-bit",          FORMAT_8BIT,     0, 0, 0, 0,
+      &ternary_matvec_8bit_impl_name,        kernel_run_8bit },
+    { "2bit",          "2-bit packed",   FORMAT_2BIT,     0, 0, 0, 0,
+      &ternary_matvec_2bit_impl_name,        kernel_run_2bit },
+    { "2bit-scalar",   "2-bit packed",   FORMAT_2BIT,     0, 0, 0, 0,
+      &kernel_scalar_name,           kernel_run_2bit_scalar },
+    { "2bit-tiled",    "2-bit packed",   FORMAT_2BIT,     0, 0, 0, 0,
+      &ternary_matvec_2bit_tiled_impl_name,  kernel_run_2bit_tiled },
+    { "2bit-fixed",    "2-bit packed",   FORMAT_2BIT,     0, 0, 0, 1,
+      &ternary_matvec_2bit_fixed_impl_name,  kernel_run_2bit_fixed },
+    { "2bit-prefetch", "2-bit packed",   FORMAT_2BIT,     0, 0, 0, 0,
+      &ternary_matvec_2bit_hinted_impl_name, kernel_run_2bit_prefetch },
+    { "2bit-mt",       "2-bit packed",   FORMAT_2BIT,     0, 1, 0, 0,
+      &ternary_matvec_2bit_impl_name,        kernel_run_2bit_mt },
+    { "2bit-pool",     "2-bit packed",   FORMAT_2BIT,     0, 1, 1, 0,
+      &ternary_matvec_2bit_impl_name,        kernel_run_2bit_pool },
+    { "bitplane",      "2-bit bitplane", FORMAT_BITPLANE, 0, 0, 0, 0,
+      &ternary_matvec_bitplane_impl_name,    kernel_run_bitplane },
+    { "base3",         "1.6-bit base-3", FORMAT_BASE3,    0, 0, 0, 0,
+      &ternary_matvec_base3_impl_name,       kernel_run_base3 },
+    { "sparse",        "sparse lists",   FORMAT_2BIT,     1, 0, 0, 0,
+      &ternary_matvec_sparse_impl_name,      kernel_run_sparse },
+    { "sparse-pool",   "sparse lists",   FORMAT_2BIT,     1, 1, 1, 0,
+      &ternary_matvec_sparse_impl_name,      kernel_run_sparse_pool },
+};
+
+const kernel_entry_t *ternary_find_kernel(const char *name) {
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        if (strcmp(ternary_kernel_registry[i].name, name) == 0) {
+            return &ternary_kernel_registry[i];
+        }
+    }
+    return NULL;
+}
+
+int ternary_kernel_available(const kernel_entry_t *k) {
+    return !k->threaded || ternary_online_cpus() > 1;
+}
+
+void ternary_kernel_args_init(kernel_args_t *a, const weight_set_t *ws) {
+    memset(a, 0, sizeof(*a));
+    a->ws = ws;
+    a->threads = ternary_online_cpus();
+}
+
+void ternary_kernel_args_free(kernel_args_t *a) {
+    ternary_pool_destroy(a->pool);
+    a->pool = NULL;
+    if (a->have_sparse) {
+        ternary_sparse_matrix_free(&a->sparse);
+        a->have_sparse = 0;
+    }
+}
+
+// Builds whatever extra layout the kernel needs; returns 0 on success, and
+// -1 for a shaped kernel on a width it has no specialization for
+int ternary_kernel_prepare(const kernel_entry_t *k, kernel_args_t *a) {
+    if (k->shaped && !ternary_matvec_2bit_fixed(a->ws->cols, FIXED_DEFAULT_TILE)) {
+        return -1;
+    }
+    if (k->sparse && !a->have_sparse) {
+        if (ternary_sparse_matrix_build(&a->sparse, a->ws->matrix_8bit, a->ws->rows,
+                                        a->ws->cols) != 0) {
+            return -1;
+        }
+        a->have_sparse = 1;
+    }
+    if (k->pooled && !a->pool && !(a->pool = ternary_pool_create(a->threads, 1))) {
+        return -1;
+    }
+    return 0;
+}
+
+size_t ternary_kernel_bytes(const kernel_entry_t *k, const kernel_args_t *a) {
+    if (k->sparse) {
+        return a->sparse.bytes;
+    }
+    return (size_t)a->ws->rows * ternary_format_row_bytes(k->format, a->ws->cols);
+}
@@ -0,0 +1,194 @@
+/*
+ * Hot-path tracing: timestamped spans in per-thread ring buffers, written
+ * out as Chrome trace JSON. Compiled in only with -DTERNARY_TRACE.
+ *
+ * Copyright (C) 2024 HyperFold Technologies UK Ltd.
+ * Licensed under GNU AGPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ternary.h"
+
+// ============================================================================
+// TRACING
+// ============================================================================
+// TRACE_BEGIN / TRACE_END (ternary.h) put two cycle-counter reads and one
+// 32-byte store around a span: rdtsc on x86, cntvct_el0 on AArch64. Each
+// thread writes its own ring of TRACE_RING_EVENTS spans without locking
+// and overwrites the oldest once it wraps, so a long run keeps its tail.
+// Rings are handed back when a thread exits and reused by the next one,
+// which keeps threads spawned per call from piling up buffers; one trace
+// lane is one ring, not one OS thread. Ticks are converted to wall time
+// against CLOCK_MONOTONIC between ternary_trace_start() and ternary_trace_write().
+#define TRACE_RING_EVENTS 32768     // per ring, a power of two
+#define TRACE_MAX_RINGS 256
+
+#ifdef TERNARY_TRACE
+typedef struct {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+    long long arg;
+} trace_span_t;
+
+typedef struct {
+    trace_span_t *spans;
+    uint64_t count;     // spans written, including overwritten ones
+    int in_use;
+} trace_ring_t;
+
+static trace_ring_t trace_rings[TRACE_MAX_RINGS];
+static int trace_ring_count;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *trace_ring;
+static int trace_on;
+static uint64_t trace_start_ticks;
+static struct timespec trace_start_time;
+static long long trace_dropped;     // spans with no ring left to go to
+
+static void trace_release_ring(void *ring) {
+    pthread_mutex_lock(&trace_lock);
+    ((trace_ring_t*)ring)->in_use = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_make_key(void) {
+    pthread_key_create(&trace_key, trace_release_ring);
+}
+
+// A free ring, or a new one; NULL once TRACE_MAX_RINGS are all in use
+static trace_ring_t *trace_acquire_ring(void) {
+    trace_ring_t *ring = NULL;
+    pthread_once(&trace_key_once, trace_make_key);
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < trace_ring_count && !ring; i++) {
+        if (!trace_rings[i].in_use) {
+            ring = &trace_rings[i];
+        }
+    }
+    if (!ring && trace_ring_count < TRACE_MAX_RINGS) {
+        trace_span_t *spans = (trace_span_t*)calloc(TRACE_RING_EVENTS, sizeof(trace_span_t));
+        if (spans) {
+            ring = &trace_rings[trace_ring_count++];
+            ring->spans = spans;
+            ring->count = 0;
+        }
+    }
+    if (ring) {
+        ring->in_use = 1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (ring) {
+        pthread_setspecific(trace_key, ring);
+    }
+    return ring;
+}
+
+void ternary_trace_event(const char *name, uint64_t begin, uint64_t end, long long arg) {
+    if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) {
+        return;
+    }
+    trace_ring_t *ring = trace_ring;
+    if (!ring && !(ring = trace_ring = trace_acquire_ring())) {
+        __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    trace_span_t *s = &ring->spans[ring->count & (TRACE_RING_EVENTS - 1)];
+    s->name = name;
+    s->begin = begin;
+    s->end = end;
+    s->arg = arg;
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+int ternary_trace_compiled_in(void) {
+    return 1;
+}
+
+void ternary_trace_start(void) {
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < trace_ring_count; i++) {
+        trace_rings[i].count = 0;
+    }
+    trace_dropped = 0;
+    pthread_mutex_unlock(&trace_lock);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start_time);
+    trace_start_ticks = trace_clock();
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+}
+
+// Writes every ring as complete ("X") events, one tid per ring, with ts
+// and dur in microseconds from ternary_trace_start(). Tracing stops first; spans
+// still being written by other threads at that moment may be missing.
+int ternary_trace_write(const char *path) {
+    struct timespec now;
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ticks = trace_clock() - trace_start_ticks;
+    double ns = (now.tv_sec - trace_start_time.tv_sec) * 1e9 +
+                (double)(now.tv_nsec - trace_start_time.tv_nsec);
+    double us_per_tick = ticks > 0 && ns > 0.0 ? ns / 1000.0 / (double)ticks : 1e-3;
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write trace '%s'\n", path);
+        return -1;
+    }
+
+    long long written = 0, lost = trace_dropped;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+               "\"args\":{\"name\":\"ternary\"}}");
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < trace_ring_count; i++) {
+        const trace_ring_t *ring = &trace_rings[i];
+        uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        uint64_t first = count > TRACE_RING_EVENTS ? count - TRACE_RING_EVENTS : 0;
+        lost += (long long)first;
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                   "\"args\":{\"name\":\"%s %d\"}}", i, i ? "ring" : "main ring", i);
+        for (uint64_t e = first; e < count; e++) {
+            const trace_span_t *s = &ring->spans[e & (TRACE_RING_EVENTS - 1)];
+            if (s->begin < trace_start_ticks) {
+                continue;
+            }
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                       "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%lld}}",
+                    s->name, i, (s->begin - trace_start_ticks) * us_per_tick,
+                    (s->end - s->begin) * us_per_tick, s->arg);
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(f, "\n]}\n");
+    int failed = ferror(f);
+    failed |= fclose(f) != 0;
+    if (failed) {
+        fprintf(stderr, "Error writing trace '%s'\n", path);
+        return -1;
+    }
+    printf("Trace: %lld spans in %d rings to %s (%lld overwritten or dropped)\n",
+           written, trace_ring_count, path, lost);
+    return 0;
+}
+#else
+int ternary_trace_compiled_in(void) {
+    return 0;
+}
+
+void ternary_trace_start(void) {
+}
+
+int ternary_trace_write(const char *path) {
+    (void)path;
+    return 0;
+}
+#endif